@@ -6,12 +6,58 @@ using namespace std;
 vector<FD_entry> fd_Table;
 
 
-#if 1
 int proc;
-#endif
 
 int currentFdNum;
 
+/**
+ * Default backend, forwards the command to the kernel module
+ */
+static int moduleBackend(unsigned int cmd, void *arg)
+{
+    return ioctl (proc, cmd, arg);
+}
+
+// All commands go through here, defaults to the module for existing callers
+static rd_backend_t rd_backend = moduleBackend;
+
+int rd_use_module(void)
+{
+    proc = open ("/proc/ramdisk", O_RDONLY);
+    if (proc < 0)
+        return -1;
+
+    rd_backend = moduleBackend;
+    return 0;
+}
+
+int rd_use_engine(void)
+{
+    if (ramdisk_engine_init() < 0)
+        return -1;
+
+    rd_backend = ramdisk_engine_ioctl;
+    return 0;
+}
+
+int rd_use_shared_engine(const char *name)
+{
+    if (ramdisk_engine_init_shared(name) < 0)
+        return -1;
+
+    rd_backend = ramdisk_engine_ioctl;
+    return 0;
+}
+
+int rd_use_snapshot_engine(const char *path)
+{
+    if (ramdisk_engine_init_snapshot(path) < 0)
+        return -1;
+
+    rd_backend = ramdisk_engine_ioctl;
+    return 0;
+}
+
 
 void printfdTable ()
 {
@@ -19,15 +65,21 @@ void printfdTable ()
     printf("---------FD Table---------\n");
     for (it = fd_Table.begin() ; it != fd_Table.end() ; it++)
     {
-        printf("fd: %d  indexNode: %d  offset: %d  fileSize: %d path: %s\n", it->fd, it->indexNode, it->offset, it->fileSize, it->pathname);
+        printf("fd: %d  indexNode: %d  offset: %lld  fileSize: %lld path: %s\n", it->fd, it->indexNode, it->offset, it->fileSize, it->pathname);
     }
     printf("---------End of FD Table---------\n");
 }
 
 int rd_creat(char *pathname)
+{
+    return rd_creat_sized(pathname, 0);
+}
+
+int rd_creat_sized(char *pathname, int expectedSize)
 {
     struct RAM_path rampath;
     rampath.name = pathname;
+    rampath.sizeHint = expectedSize;
 
     char *filename;
     filename = getFileNameFromPath(pathname);
@@ -36,9 +88,7 @@ int rd_creat(char *pathname)
         return -1;
     }
 
-#if 1
-    ioctl (proc, RAM_CREATE, &rampath);
-#endif
+    rd_backend (RAM_CREATE, &rampath);
 
     return rampath.ret;
 }
@@ -56,13 +106,13 @@ int rd_mkdir(char *pathname)
     printf("Filename out of mkdir is %s\n", filename);
     if (strlen(filename)>12) {
         printf("Error: filename too long, dir must be less than 14 chars\n");
+        free(pathname);
         return -1;
     }
 
 
-#if 1
-    ioctl (proc, RAM_MKDIR, &rampath);
-#endif
+    rd_backend (RAM_MKDIR, &rampath);
+    free(pathname);
     return rampath.ret;
 }
 
@@ -71,9 +121,7 @@ int rd_open(char *pathname)
     struct RAM_file file;
     file.name = pathname;
 printf("PATH: %s\n", pathname);
-#if 1
-    ioctl (proc, RAM_OPEN, &file);
-#endif
+    rd_backend (RAM_OPEN, &file);
 
     // If the file open failed, return an error
     printf("Index node - %d\n", file.indexNode);
@@ -94,6 +142,13 @@ printf("PATH: %s\n", pathname);
         entry.fileSize = file.fileSize;
         entry.pathname = pathname;
         entry.dirIndex = 0; // Initially the file pointer is 0 (first file in dir)
+        entry.dirCursor = 0;
+        entry.readBuffer = NULL;
+        entry.bufferOffset = 0;
+        entry.bufferLength = 0;
+        entry.lastReadEnd = -1;
+        entry.sequentialReads = 0;
+        entry.generation = 0;
         fd_Table.push_back(entry);
 
         printf("Inserting fd entry with fd=%d inode=%d\n", entry.fd, entry.indexNode);
@@ -111,12 +166,111 @@ printf("PATH: %s\n", pathname);
 
 int rd_close(int fd)
 {
+    FD_entry *entry;
+
+    if (checkIfFileExists(fd) == -1)
+        return -1;
+
+    // Release the read-ahead buffer before dropping the entry
+    entry = getEntryFromFd(fd);
+    free(entry->readBuffer);
+    entry->readBuffer = NULL;
 
     // Closing a file simply means removing a file from the FD table
     return deleteFileFromFDTable(fd);
 
 }
 
+/**
+ * Serves a read from the read-ahead buffer of an fd entry
+ *
+ * @return  int  number of bytes copied, or -1 if the request is not fully buffered
+ * @param[in]  entry  the fd entry holding the buffer
+ * @param[out]  address  destination of the data
+ * @param[in]  num_bytes  number of bytes requested
+ */
+int readFromBuffer(FD_entry *entry, char *address, int num_bytes)
+{
+    long long start;
+    int available;
+
+    if (entry->readBuffer == NULL || entry->bufferLength == 0)
+        return -1;
+
+    // The engine's generations can be checked on every hit, another process may have
+    // written the file since the fill.  The module's are only seen when a call returns
+    if (rd_backend != moduleBackend && ramdisk_engine_generation(entry->indexNode) != entry->generation)
+    {
+        entry->bufferLength = 0;
+        return -1;
+    }
+
+    start = entry->offset - entry->bufferOffset;
+    if (start < 0 || start > entry->bufferLength)
+        return -1;
+
+    available = entry->bufferLength - (int)start;
+    if (available < num_bytes)
+    {
+        // A short buffer that stops at the old end of file may be hiding data
+        // appended since, so only trust it when the file size agrees
+        if (entry->bufferOffset + entry->bufferLength != entry->fileSize)
+            return -1;
+        if (entry->bufferLength == RD_READ_BUFFER_SIZE)
+            return -1;
+        num_bytes = available;
+    }
+
+    memcpy(address, entry->readBuffer + start, num_bytes);
+    address[num_bytes] = '\0'; // Same null placement as the module read
+    return num_bytes;
+}
+
+/**
+ * Refills the read-ahead buffer of an fd entry with one block aligned read
+ *
+ * @return  int  0 on success, -1 if the module read failed
+ * @param[in]  entry  the fd entry to refill
+ */
+int fillReadBuffer(FD_entry *entry)
+{
+    struct RAM_accessFile file;
+
+    if (entry->readBuffer == NULL)
+    {
+        // One extra byte for the null the module places after the data
+        entry->readBuffer = (char *)malloc(RD_READ_BUFFER_SIZE + 1);
+        if (entry->readBuffer == NULL)
+            return -1;
+    }
+
+    file.fd = entry->fd;
+    file.address = entry->readBuffer;
+    file.numBytes = RD_READ_BUFFER_SIZE;
+    file.indexNode = entry->indexNode;
+    file.offset = entry->offset - (entry->offset % RD_READ_BUFFER_ALIGN);
+
+    entry->bufferOffset = file.offset;
+    entry->bufferLength = 0;
+
+    rd_backend (RAM_READ, &file);
+
+    if (file.ret < 0)
+        return -1;
+
+    // A generation we did not see means another process wrote the file,
+    // drop the sequential streak so the next reads go back to the module
+    if (file.generation != entry->generation)
+    {
+        entry->generation = file.generation;
+        entry->sequentialReads = 0;
+    }
+    entry->fileSize = file.fileSize;
+
+    entry->bufferLength = (int)file.ret;
+    return 0;
+}
+
 int rd_read(int file_fd, char *address, int num_bytes)
 {
 
@@ -131,21 +285,59 @@ int rd_read(int file_fd, char *address, int num_bytes)
     FD_entry *entry;
     entry = getEntryFromFd(file_fd);
 
+    // Track whether this read picks up where the last one stopped
+    if (entry->offset == entry->lastReadEnd)
+        entry->sequentialReads++;
+    else
+        entry->sequentialReads = 0;
+
+    int ret;
+    ret = readFromBuffer(entry, address, num_bytes);
+    if (ret == -1 && entry->sequentialReads >= RD_SEQUENTIAL_THRESHOLD
+        && num_bytes <= RD_READ_BUFFER_SIZE - RD_READ_BUFFER_ALIGN)
+    {
+        // Small sequential read that missed, pull in the next aligned buffer
+        if (fillReadBuffer(entry) == 0)
+            ret = readFromBuffer(entry, address, num_bytes);
+    }
+
+    if (ret >= 0)
+    {
+        entry->offset += ret;
+        entry->lastReadEnd = entry->offset;
+        return ret;
+    }
+
     struct RAM_accessFile file;
+    int total = 0;
     file.fd = file_fd;
-    file.address = address;
-    file.numBytes = num_bytes;
     file.indexNode = indexNodeFromfd(file_fd);
-    file.offset = entry->offset;
-
-#if 1
-    ioctl (proc, RAM_READ, &file);
-#endif
 
-    // Update the offset after reading the file
-    entry->offset = file.offset;
+    // A large read comes back in pieces, one per lock budget
+    do
+    {
+        file.address = address + total;
+        file.numBytes = num_bytes - total;
+        file.offset = entry->offset;
+
+        rd_backend (RAM_READ, &file);
+        if (file.ret < 0)
+            return total ? total : (int)file.ret;
+
+        // Update the offset after reading the file
+        entry->offset = file.offset;
+        entry->lastReadEnd = entry->offset;
+        total += (int)file.ret;
+        if (file.generation != entry->generation)
+        {
+            // Someone else changed the file, whatever we buffered is stale
+            entry->generation = file.generation;
+            entry->bufferLength = 0;
+        }
+        entry->fileSize = file.fileSize;
+    } while (file.ret > 0 && total < num_bytes && entry->offset < file.fileSize);
 
-    return file.ret;
+    return total;
 }
 
 int rd_write(int file_fd, char *address, int num_bytes)
@@ -163,24 +355,35 @@ int rd_write(int file_fd, char *address, int num_bytes)
     FD_entry *entry;
     entry = getEntryFromFd(file_fd);
 
+    int total = 0;
     file.fd = file_fd;
-    file.address = address;
-    file.numBytes = num_bytes;
     file.indexNode = indexNodeFromfd(file_fd);
-    file.offset = entry->offset;
 
-#if 1
-    ioctl (proc, RAM_WRITE, &file);
-#endif
+    // A large write goes down in pieces, one per lock budget
+    do
+    {
+        file.address = address + total;
+        file.numBytes = num_bytes - total;
+        file.offset = entry->offset;
 
-    // Update the offset after reading the file
-    entry->offset = file.offset + file.ret;
-    entry->fileSize = file.fileSize;
+        rd_backend (RAM_WRITE, &file);
+        if (file.ret < 0)
+            return total ? total : (int)file.ret;
+
+        // Update the offset after writing the file
+        entry->offset = file.offset + file.ret;
+        entry->fileSize = file.fileSize;
+        entry->generation = file.generation;
+        total += (int)file.ret;
+    } while (file.ret > 0 && total < num_bytes);
 
-    return file.ret;
+    // Our own write may have landed in the buffered range
+    entry->bufferLength = 0;
+
+    return total;
 }
 
-int rd_lseek(int file_fd, int offset)
+int rd_lseek(int file_fd, long long offset)
 {
 
     // Make sure the file exists
@@ -190,25 +393,251 @@ int rd_lseek(int file_fd, int offset)
         return -1;
     }
 
-    // If the offset the user specifies is greater than the file size
-    // move the pointer to end of file
+    // Seeking past the end of the file is allowed, a write there leaves a hole
+    if (offset < 0)
+        return -1;
+
     struct FD_entry *entry;
     entry = getEntryFromFd(file_fd);
     entry->offset = offset;
+    return 1;
+
+}
 
-    if (offset > entry->fileSize)
+int rd_punch_hole(int file_fd, long long offset, long long len)
+{
+
+    // Make sure the file exists
+    if (checkIfFileExists(file_fd) == -1)
     {
-        entry->offset = entry->fileSize;
+        printf("fd does not exist in the file descriptor table.\n");
+        return -1;
     }
 
-    if (offset<0)
-    offset = 0;
+    struct RAM_accessFile file;
+
+    FD_entry *entry;
+    entry = getEntryFromFd(file_fd);
+
+    file.fd = file_fd;
+    file.indexNode = entry->indexNode;
+
+    // The hole is punched from its end, one lock budget per call
+    do
+    {
+        file.offset = offset;
+        file.numBytes = len;
+
+        rd_backend (RAM_PUNCH_HOLE, &file);
+        len = file.offset - offset;
+    } while (file.ret == 1);
+
+    entry->fileSize = file.fileSize;
+    entry->generation = file.generation;
+    // The hole may cover buffered data
+    entry->bufferLength = 0;
 
-    if (entry->offset < 0)
+    return (int)file.ret;
+}
+
+int rd_ftruncate(int file_fd, long long len)
+{
+
+    // Make sure the file exists
+    if (checkIfFileExists(file_fd) == -1)
+    {
+        printf("fd does not exist in the file descriptor table.\n");
         return -1;
-    else
-        return 1;
+    }
+
+    struct RAM_accessFile file;
+
+    FD_entry *entry;
+    entry = getEntryFromFd(file_fd);
+
+    file.fd = file_fd;
+    file.indexNode = entry->indexNode;
+
+    // A file shrinks by one lock budget per call
+    do
+    {
+        file.offset = len;
+
+        rd_backend (RAM_TRUNCATE, &file);
+    } while (file.ret == 1);
+
+    entry->fileSize = file.fileSize;
+    entry->generation = file.generation;
+    // Buffered data may lie past the new end
+    entry->bufferLength = 0;
+
+    return (int)file.ret;
+}
+
+int rd_fallocate(int file_fd, long long offset, long long len)
+{
+
+    // Make sure the file exists
+    if (checkIfFileExists(file_fd) == -1)
+    {
+        printf("fd does not exist in the file descriptor table.\n");
+        return -1;
+    }
+
+    struct RAM_accessFile file;
+
+    FD_entry *entry;
+    entry = getEntryFromFd(file_fd);
+
+    file.fd = file_fd;
+    file.indexNode = entry->indexNode;
+    file.offset = offset;
+    file.numBytes = len;
+
+    rd_backend (RAM_FALLOCATE, &file);
+
+    entry->fileSize = file.fileSize;
+    entry->generation = file.generation;
+    entry->bufferLength = 0;
 
+    return (int)file.ret;
+}
+
+int rd_lock_budget(int blocks, long long us)
+{
+    struct RAM_lockBudget budget;
+
+    budget.blocks = blocks;
+    budget.us = us;
+    if (rd_backend (RAM_LOCK_BUDGET, &budget) < 0)
+        return -1;
+
+    return 0;
+}
+
+int rd_sched_weight(int pid, int weight)
+{
+    struct RAM_schedWeight request;
+
+    request.pid = pid;
+    request.weight = weight;
+    if (rd_backend (RAM_SCHED_WEIGHT, &request) < 0)
+        return -1;
+
+    return request.weight;
+}
+
+int rd_sched_stats(int index, struct RAM_schedStats *stats)
+{
+    stats->index = index;
+    if (rd_backend (RAM_SCHED_STATS, stats) < 0)
+        return -1;
+
+    return stats->index;
+}
+
+int rd_latency(unsigned int cmd, struct RAM_latency *latency)
+{
+    latency->command = cmd;
+    latency->reset = 0;
+    if (rd_backend (RAM_LATENCY, latency) < 0)
+        return -1;
+
+    return 0;
+}
+
+int rd_latency_reset(void)
+{
+    struct RAM_latency latency;
+
+    latency.command = 0;
+    latency.reset = 1;
+    if (rd_backend (RAM_LATENCY, &latency) < 0)
+        return -1;
+
+    return 0;
+}
+
+int rd_latency_report(char *buffer, int size)
+{
+    int stats, length, got;
+
+    if (rd_backend != moduleBackend)
+        return ramdisk_engine_stats(buffer, size);
+
+    stats = open ("/proc/ramdisk_stats", O_RDONLY);
+    if (stats < 0 || size <= 0)
+    {
+        if (stats >= 0)
+            close (stats);
+        return -1;
+    }
+    length = 0;
+    while (length < size - 1 && (got = read (stats, buffer + length, size - 1 - length)) > 0)
+        length += got;
+    buffer[length] = '\0';
+    close (stats);
+    return length;
+}
+
+long long rd_reclaim(long long watermark)
+{
+    struct RAM_reclaim reclaim;
+
+    reclaim.watermark = watermark;
+    reclaim.released = 0;
+    if (rd_backend (RAM_RECLAIM, &reclaim) < 0)
+        return -1;
+
+    return reclaim.released;
+}
+
+int rd_fsck(struct RAM_fsck *report)
+{
+    if (rd_backend (RAM_FSCK, report) < 0 || report->errors < 0)
+        return -1;
+
+    return 0;
+}
+
+int rd_frag_score(int fd)
+{
+    struct RAM_fragScore score;
+
+    score.indexNode = -1;
+    if (fd != -1)
+    {
+        if (checkIfFileExists(fd) == -1)
+        {
+            printf("fd does not exist in the file descriptor table.\n");
+            return -1;
+        }
+        score.indexNode = indexNodeFromfd(fd);
+    }
+    if (rd_backend (RAM_FRAG_SCORE, &score) < 0)
+        return -1;
+
+    return score.score;
+}
+
+long long rd_defrag(int threshold, int budget)
+{
+    struct RAM_defrag defrag;
+    long long moved;
+
+    memset(&defrag, 0, sizeof(defrag));
+    defrag.threshold = threshold;
+    defrag.budget = budget;
+    moved = 0;
+    // One step per call, so the lock is given up between them
+    while (!defrag.done)
+    {
+        if (rd_backend (RAM_DEFRAG, &defrag) < 0 || defrag.done < 0)
+            return -1;
+        moved += defrag.moved;
+    }
+
+    return moved;
 }
 
 int rd_unlink(char *pathname)
@@ -229,9 +658,7 @@ int rd_unlink(char *pathname)
     }
     
 
-#if 1
-    ioctl (proc, RAM_UNLINK, &rampath);
-#endif
+    rd_backend (RAM_UNLINK, &rampath);
     return rampath.ret;
 }
 
@@ -246,6 +673,7 @@ int rd_readdir(int file_fd, char *address)
 
     file.indexNode = entry->indexNode;
     file.dirIndex = entry->dirIndex;
+    file.offset = entry->dirCursor;
 
     // Make sure the file exists
     if (checkIfFileExists(file_fd) == -1)
@@ -254,19 +682,23 @@ int rd_readdir(int file_fd, char *address)
         return -1;
     }
 
-#if 1
-    ioctl (proc, RAM_READDIR, &file);
-#endif
+    // The scan picks up at the cursor, a long run of deleted entries may take a few calls
+    do
+    {
+        rd_backend (RAM_READDIR, &file);
+    } while (file.ret == 2);
 
     // If the number of files pointer have exceeded total num of files, reset it
     entry->numOfFiles = file.numOfFiles;
     entry->dirIndex = entry->dirIndex + 1;
-    if (entry->dirIndex == (entry->numOfFiles +1)) {
+    entry->dirCursor = file.offset;
+    if (file.ret == 0 || entry->dirIndex == (entry->numOfFiles +1)) {
         entry->dirIndex = 0;
+        entry->dirCursor = 0;
         return 0;
     }
 
-    return file.ret;
+    return (int)file.ret;
 }
 
 /******************* HELPER FUNCTION ********************/
@@ -336,8 +768,10 @@ int deleteFileFromFDTable(int fd)
     for (it = fd_Table.begin() ; it != fd_Table.end() ; it++)
     {
         if (it->fd==fd)
+        {
             fd_Table.erase(it);
-        return 1;
+            return 1;
+        }
     }
     return -1;
 }
@@ -349,6 +783,7 @@ char *getFileNameFromPath(char *pathname)
     int delimPosition, index;
     delim =  '/';
     index = 0;
+    delimPosition = 0; /* Root has no delimiter followed by a name */
     temp = pathname[index];
     while (temp != '\0')
     {
@@ -369,7 +804,7 @@ char *getFileNameFromPath(char *pathname)
 char* concatDirToPath(char *path) {
     int length;
     length = strlen(path);
-    char *newpath = (char*)malloc(sizeof(char)*(length+1));
+    char *newpath = (char*)malloc(sizeof(char)*(length+2)); /* Room for the / and the null */
     strcpy(newpath, path);
     newpath[length] = '/';
     newpath[length+1] = '\0';
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <string.h>
 #include "structs.h"
+#include "ramdisk_engine.h"
 #include <vector>
 
 /**
@@ -17,6 +18,57 @@
 */
 
 
+/**
+ * Client side read buffering.  Once RD_SEQUENTIAL_THRESHOLD back to back reads
+ * on a descriptor continue where the previous one stopped, small reads are
+ * served from a RD_READ_BUFFER_SIZE buffer filled with one aligned read.
+ * Every read, write and resize hands back the file's write generation.  On
+ * the engines a hit checks it first, so another process's write is never
+ * missed.  On the module a hit cannot check without an ioctl, so a write by
+ * another process shows up at the next fill, at most one buffer later.
+ */
+#define RD_READ_BUFFER_SIZE 4096
+#define RD_READ_BUFFER_ALIGN 256    /* Ramdisk block size */
+#define RD_SEQUENTIAL_THRESHOLD 2
+
+/**
+ * Backend that carries out the RAM_* commands, either the kernel module
+ * through ioctl on /proc/ramdisk or the in-process engine
+ */
+typedef int (*rd_backend_t)(unsigned int cmd, void *arg);
+
+/**
+ * Routes all rd_* calls to the kernel module
+ *
+ * @return	int	0 on success, -1 if /proc/ramdisk could not be opened
+ */
+int rd_use_module(void);
+
+/**
+ * Routes all rd_* calls to an in-process ramdisk, no module or root needed
+ *
+ * @return	int	0 on success, -1 if the engine could not be started
+ */
+int rd_use_engine(void);
+
+/**
+ * Routes all rd_* calls to a ramdisk in shared memory, run directly by every process using it
+ *
+ * @return	int	0 on success, -1 if the segment could not be created or attached
+ * @param[in]	name	shm_open name shared by cooperating processes, or NULL for an
+ *			anonymous segment inherited by children forked afterwards
+ */
+int rd_use_shared_engine(const char *name);
+
+/**
+ * Routes all rd_* calls to an in-process ramdisk restored from a snapshot
+ *
+ * @return	int	0 on success, -1 if the file is not a snapshot
+ * @param[in]	path	a file written by ramdisk_engine_snapshot
+ * @remark	usable at once, blocks are read from the file as they are first touched
+ */
+int rd_use_snapshot_engine(const char *path);
+
 /**
 * Creates a new full file at pathname
 *
@@ -26,6 +78,16 @@
 */
 int rd_creat(char *pathname);
 
+/**
+* Creates a new file that is expected to grow to about expectedSize bytes
+*
+* @return	int	0 on success, -1 on error
+* @param[in]	pathname	the absolute path of the file to create
+* @param[in]	expectedSize	the expected size in bytes, large files start in large block clusters
+* @remark	Only a hint, the file still starts empty and can grow past it
+*/
+int rd_creat_sized(char *pathname, int expectedSize);
+
 /**
  * Creates a new directory at pathname
  *
@@ -72,9 +134,9 @@ int rd_write(int fd, char *address, int num_bytes);
  * @return	int	0 on success, -1 on failure
  * @param[in]	fd	file descriptor of the file to seek into
  * @param[in]	offset	offset into file desired
- * @remark	sets file position to EOF if offset larger than remaining size
+ * @remark	the position may be past EOF, a write there leaves a hole that reads as zeros
  */
-int rd_lseek(int fd, int offset);
+int rd_lseek(int fd, long long offset);
 
 /**
  * Unlinks the file from ramdisk memory
@@ -85,12 +147,139 @@ int rd_lseek(int fd, int offset);
  */
 int rd_unlink(char *pathname); 
 
+/**
+ * Frees the blocks of a range inside a file, the range then reads as zeros
+ *
+ * @return	int	0 on success, -1 on failure
+ * @param[in]	fd	file descriptor of the file
+ * @param[in]	offset	first byte of the hole
+ * @param[in]	len	bytes in the hole
+ * @remark	the file keeps its size
+ */
+int rd_punch_hole(int fd, long long offset, long long len);
+
+/**
+ * Sets the size of a file, freeing the blocks past a shorter size
+ *
+ * @return	int	0 on success, -1 on failure
+ * @param[in]	fd	file descriptor of the file
+ * @param[in]	len	the new size in bytes
+ * @remark	growing the file leaves a hole
+ */
+int rd_ftruncate(int fd, long long len);
+
+/**
+ * Reserves the blocks of a range of a file up front, as one contiguous run when possible
+ *
+ * @return	int	0 on success, -1 on failure
+ * @param[in]	fd	file descriptor of the file
+ * @param[in]	offset	first byte of the range
+ * @param[in]	len	bytes in the range
+ * @remark	the file grows to cover the range, which reads as zeros
+ */
+int rd_fallocate(int fd, long long offset, long long len);
+
+/**
+ * Gives the memory of the ramdisk's free chunks back to the system
+ *
+ * @return	long long	bytes given back, -1 on failure
+ * @param[in]	watermark	bytes freed after which this happens by itself from now on, -1 to keep it
+ * @remark	memory is otherwise kept for reuse until the watermark is reached
+ */
+long long rd_reclaim(long long watermark);
+
+/**
+ * Sets how long one call of a long command (a big read or write, a directory scan, a
+ * truncate or hole punch) keeps the ramdisk locked before the rest is left to the next
+ *
+ * @return	int	0 on success, -1 on failure
+ * @param[in]	blocks	blocks worked through per call, 0 for no limit, -1 to keep it
+ * @param[in]	us	microseconds per call, 0 for no limit, -1 to keep it
+ * @remark	the library makes the further calls itself, callers see whole operations
+ */
+int rd_lock_budget(int blocks, long long us);
+
+/**
+ * Sets a process's share of the ramdisk when several are waiting for it
+ *
+ * @return	int	the weight in force, -1 on failure
+ * @param[in]	pid	the process, 0 for the caller, a thread id in the engine
+ * @param[in]	weight	1 to SCHED_MAX_WEIGHT, -1 to only read it.  A process with
+ *			weight 2 gets twice the bytes and requests of one with weight 1
+ * @remark	On a shared engine each process schedules only its own threads, so
+ *		weights do not apply between processes sharing the segment
+ */
+int rd_sched_weight(int pid, int weight);
+
+/**
+ * Reads how long the requests of a process using the ramdisk waited for their turn
+ *
+ * @return	int	slot of the process reported, -1 once there are no more
+ * @param[in]	index	slot to look from, 0 first and then one past the last slot returned
+ * @param[out]	stats	the process, its weight, requests, bytes and queueing delay
+ */
+int rd_sched_stats(int index, struct RAM_schedStats *stats);
+
+/**
+ * Reads the latency percentiles of a command since the histograms were last emptied
+ *
+ * @return	int	0 on success, -1 on failure
+ * @param[in]	cmd	the command, RAM_READ and so on
+ * @param[out]	latency	calls timed, and p50, p99, p99.9 and longest of the time each
+ *			waited for the ramdisk and the time it then took, in nanoseconds
+ */
+int rd_latency(unsigned int cmd, struct RAM_latency *latency);
+
+/**
+ * Empties the latency histograms of every command
+ *
+ * @return	int	0 on success, -1 on failure
+ */
+int rd_latency_reset(void);
+
+/**
+ * Reads the latency percentiles of every command as a table, from /proc/ramdisk_stats
+ * for the module and from the engine in-process
+ *
+ * @return	int	bytes read, -1 on failure
+ * @param[out]	buffer	the table, NUL terminated
+ * @param[in]	size	bytes buffer holds
+ */
+int rd_latency_report(char *buffer, int size);
+
+/**
+ * Checks the ramdisk's metadata for consistency, and optionally repairs it
+ *
+ * @return	int	0 if the check ran, -1 on failure
+ * @param[in-out]	report	set repair and threads, the problems found are filled in
+ * @remark	every other command waits while the check runs
+ */
+int rd_fsck(struct RAM_fsck *report);
+
+/**
+ * Scores how scattered the blocks of a file, or of the whole filesystem, are
+ *
+ * @return	int	per mille of clusters that do not follow the one before them, -1 on failure
+ * @param[in]	fd	file descriptor of the file, -1 for the whole filesystem
+ * @remark	0 is one contiguous run, 1000 every cluster somewhere else
+ */
+int rd_frag_score(int fd);
+
+/**
+ * Moves the blocks of scattered files into contiguous free runs
+ *
+ * @return	long long	blocks moved, -1 on failure
+ * @param[in]	threshold	files scoring above this, per mille, are moved
+ * @param[in]	budget	blocks moved or scored per step, other commands run between steps
+ */
+long long rd_defrag(int threshold, int budget);
+
 /**
  * Read one entry from the directory file
  *
  * @return	int	1 on success, -1 on failure
  * @param[in]	fd	file descriptor of directory to read
- * @param[out]	address	16 byte output, 14 bytes filename, 2 bytesindex_node num
+ * @param[out]	address	18 byte output, 14 bytes filename, 4 bytes index_node num
  * @remark	Fails if fd is a regular file.  On each call, file position of fd incremented by 1
  */
 int rd_readdir(int fd, char *address);
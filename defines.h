@@ -1,10 +1,30 @@
 #define DEBUG  /* For now, while developing on mac */
 #ifdef DEBUG
 
+	#ifndef _GNU_SOURCE
+		#define _GNU_SOURCE /* memfd_create */
+	#endif
 	#include <stdio.h>
 	#include <stdlib.h>
+	#include <stddef.h>
 	#include <string.h>
-	#define PRINT printf
+	#include <errno.h>
+	#include <pthread.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sched.h>
+	#include <time.h>
+	#include <sys/ioctl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/syscall.h>
+
+	#if defined(RAMDISK_ENGINE) && !defined(RAMDISK_VERBOSE)
+		/* The in-process engine is used as a library, keep it quiet */
+		#define PRINT(...) do { } while (0)
+	#else
+		#define PRINT printf
+	#endif
 
 #else
 
@@ -12,6 +32,8 @@
 	#include <linux/kernel.h>
 	#include <linux/init.h>
 	#include <linux/vmalloc.h>
+	#include <linux/mm.h>
+	#include <asm/cacheflush.h>
 	#include <linux/errno.h> /* error codes */
 	#include <linux/proc_fs.h>
 	#include <asm/uaccess.h>
@@ -20,6 +42,9 @@
 	#include <linux/string.h>
 	#include <linux/interrupt.h>
 	#include <linux/semaphore.h>
+	#include <linux/ktime.h>
+	#include <linux/spinlock.h>
+	#include <linux/completion.h>
 
 	#define PRINT printk
 #endif
@@ -29,74 +54,392 @@
 
 
 /*********************FILE SYSTEM STRUCTURE************************/
-#define FS_SIZE 2097152 // Exactly 2 MB
-#define MAX_FILE_SIZE 1067008
+// The geometry is chosen when the ramdisk is formatted (module parameters, or
+// ramdisk_engine_configure in the DEBUG build) and recorded in the superblock.
+// These are the defaults, which give the original 2 MB layout
+#define DEFAULT_FS_SIZE 2097152 // Exactly 2 MB
+#ifdef RAM_FIXED_BLOCK_SIZE
+	#define DEFAULT_BLOCK_SIZE RAM_FIXED_BLOCK_SIZE
+#else
+	#define DEFAULT_BLOCK_SIZE 256
+#endif
+#define DEFAULT_INODE_COUNT 1024
 
-#define RAM_BLOCK_SIZE 256  // Size in bytes
+#define MIN_BLOCK_SIZE 256
+#define MAX_BLOCK_SIZE 65536
+
+/**
+ * In-memory copy of the layout recorded in the superblock.  Everything below
+ * is derived from it, so the hot paths never have to read the superblock
+ */
+struct RAM_geometry
+{
+    unsigned long fsSize;   /* Bytes of RAM_memory */
+    int blockSize;          /* Bytes per block, a power of 2 */
+    int inodeTableBlocks;   /* Blocks holding the index node array */
+    int inodeCount;         /* Index nodes in the fixed array, the table grows past it into data blocks */
+    int bitmapBlocks;       /* Blocks holding the block bitmap */
+    int dataBlockCount;     /* Data blocks tracked by the bitmap */
+    int maxBlocksPerFile;   /* Data blocks one file can hold */
+    long maxLogicalBlocks;  /* Logical blocks the pointers of one index node reach, holes included */
+    int maxIndexNodes;      /* Index nodes the table can grow to */
+};
+
+#define FS_SIZE (geometry.fsSize)
+// A deployment profile fixes the block size at compile time (make engine
+// PROFILE=tiny or PROFILE=huge).  Everything derived from it, pointers per
+// block, the indirect limits, index nodes per block and the fragment sizes,
+// is then a constant and the block mapping code is specialized for it
+#ifdef RAM_FIXED_BLOCK_SIZE
+	#define RAM_BLOCK_SIZE RAM_FIXED_BLOCK_SIZE  // Size in bytes
+#else
+	#define RAM_BLOCK_SIZE (geometry.blockSize)  // Size in bytes
+#endif
 
 #define INDEX_NODE_SIZE 64  // Size in bytes
-#define INDEX_NODE_ARRAY_LENGTH 256  // Number of blocks
-#define INDEX_NODE_COUNT INDEX_NODE_ARRAY_LENGTH*(RAM_BLOCK_SIZE/INDEX_NODE_SIZE)
-#define BLOCK_BITMAP_SIZE 4*RAM_BLOCK_SIZE
-#define BLOCK_BITMAP_BLOCK_COUNT 4
+#define INDEX_NODE_ARRAY_LENGTH (geometry.inodeTableBlocks)  // Number of blocks
+#define INDEX_NODE_COUNT (geometry.inodeCount)
+#define INODES_PER_BLOCK (RAM_BLOCK_SIZE/INDEX_NODE_SIZE)
+#define MAX_INDEX_NODES (geometry.maxIndexNodes)
+#define BLOCK_BITMAP_BLOCK_COUNT (geometry.bitmapBlocks)
+#define BLOCK_BITMAP_SIZE (BLOCK_BITMAP_BLOCK_COUNT*RAM_BLOCK_SIZE)
 
 #define SUPERBLOCK_OFFSET 0
 #define INODE_COUNT_OFFSET 4
 #define INDEX_NODE_ARRAY_OFFSET RAM_BLOCK_SIZE
 
 // I'm indexing the fs via block size
-#define BLOCK_BITMAP_OFFSET RAM_BLOCK_SIZE*(INDEX_NODE_ARRAY_LENGTH+1)
+#define BLOCK_BITMAP_OFFSET (RAM_BLOCK_SIZE*(INDEX_NODE_ARRAY_LENGTH+1))
 
 // This is the index into the root dir in bytes, or the first data block in the ramdisk
-#define DATA_BLOCKS_OFFSET BLOCK_BITMAP_OFFSET+BLOCK_BITMAP_SIZE
+#define DATA_BLOCKS_OFFSET (BLOCK_BITMAP_OFFSET+BLOCK_BITMAP_SIZE)
 #define ROOT_INDEX_NODE 0 // Simply to make this access clearer
 
-// The total number of available blocks in the filesystem, excluding the Root Dir since that is always occupied
-#define TOT_AVAILABLE_BLOCKS FS_SIZE/RAM_BLOCK_SIZE-1-INDEX_NODE_ARRAY_LENGTH-BLOCK_BITMAP_BLOCK_COUNT
+// The total number of available blocks in the filesystem
+#define TOT_AVAILABLE_BLOCKS (geometry.dataBlockCount)
 
-#define MAX_BLOCKS_ALLOCATABLE 4168
+// Block pointers are 4 bytes, so an indirect block holds this many
+#define PTRS_PER_BLOCK (RAM_BLOCK_SIZE/4)
+// Logical blocks below this are reached through the single indirect block
+#define SINGLE_INDIR_LIMIT (NUM_DIRECT+PTRS_PER_BLOCK)
+// and below this through the double indirect block, the rest through the triple
+#define DOUBLE_INDIR_LIMIT (SINGLE_INDIR_LIMIT+(long)PTRS_PER_BLOCK*PTRS_PER_BLOCK)
+#define TRIPLE_INDIR_LIMIT (DOUBLE_INDIR_LIMIT+(long)PTRS_PER_BLOCK*PTRS_PER_BLOCK*PTRS_PER_BLOCK)
 
-/*********************INDEX NODE STRUCTURE************************/
-// Indexes into an inode are in bytes, must be cast into an int or pointer
-// before used, but I don't take that into account here.  To access these
-// elements, get the inode offset, and then add in these values
-#define INODE_TYPE 0
-#define INODE_SIZE 4
-#define DIRECT_1 8
-#define SINGLE_INDIR 40
-#define DOUBLE_INDIR 44
+#define MAX_BLOCKS_ALLOCATABLE (geometry.maxBlocksPerFile)
+#ifdef RAM_FIXED_BLOCK_SIZE
+	#define MAX_LOGICAL_BLOCKS TRIPLE_INDIR_LIMIT
+#else
+	#define MAX_LOGICAL_BLOCKS (geometry.maxLogicalBlocks)
+#endif
+#define MAX_FILE_SIZE ((long long)MAX_BLOCKS_ALLOCATABLE*RAM_BLOCK_SIZE)
+
+// Files that outgrow their direct blocks move to clusters of at least this
+// many bytes, so large files are not mapped a few hundred bytes at a time
+#define LARGE_CLUSTER_SIZE 4096
+
+/*********************SUPERBLOCK STRUCTURE************************/
+// The free block and free index node counts stay at offsets 0 and 4, the
+// layout follows them
+#define SB_MAGIC_OFFSET 8
+#define SB_VERSION_OFFSET 12
+#define SB_FS_SIZE_OFFSET 16   // 8 bytes
+#define SB_BLOCK_SIZE_OFFSET 24
+#define SB_INODE_BLOCKS_OFFSET 28
+#define SB_BITMAP_BLOCKS_OFFSET 32
+#define SB_DATA_BLOCKS_OFFSET 36
+#define SB_FREE_HINT_OFFSET 40  // No block below this is free
+#define SB_FRAG_LIST_OFFSET 44  // First fragment block with free units, -1 if none
+#define SB_INODE_TOTAL_OFFSET 48  // Index nodes in the table, the blocks it grew into included
+#define SB_INODE_HINT_OFFSET 52  // No index node below this is free
+#define SB_DEAD_LIST_OFFSET 56  // First unlinked index node whose blocks are still to be freed, 0 if none
+
+// Index nodes past the fixed array live in data blocks taken on demand.  Those
+// blocks are mapped by a pointer area laid out like an index node's (DIRECT_1
+// through TRIPLE_INDIR), kept in the superblock at this offset
+#define SB_INODE_MAP_OFFSET 64
+
+#define RAMDISK_MAGIC 0x52414D46 /* "RAMF" */
+#define RAMDISK_VERSION 4  /* 2: 64 bit sizes and a triple indirect pointer
+                              3: growable index node table, 32 bit directory entries
+                              4: typed, cache line aligned index nodes */
+#define RAMDISK_OLDEST_VERSION 3  /* Older images are upgraded to this version when loaded */
+
+// Index nodes are one 64 byte cache line each, and the image is allocated
+// cache line aligned so every index node starts one
+#define RAM_CACHE_LINE 64
+
+// The data region is backed a chunk at a time: a chunk gets memory when the
+// allocator first hands out a block in it, and reclaimChunks gives it back once
+// all of its blocks are free again.  A chunk holds at least 32 blocks, so its
+// part of the bitmap is whole 32 bit words
+#define RAM_CHUNK_SIZE (2UL*1024*1024)
+#define CHUNK_BLOCKS ((int)(RAM_CHUNK_SIZE/RAM_BLOCK_SIZE))
+#define DATA_CHUNK_COUNT ((TOT_AVAILABLE_BLOCKS+CHUNK_BLOCKS-1)/CHUNK_BLOCKS)
+// Chunks left empty by frees are given back once this many bytes have been
+// freed, so a file deleted and written again does not refault its memory
+#define DEFAULT_RECLAIM_WATERMARK (64UL*1024*1024)
+
+// Long commands (big reads and writes, directory scans, truncates, and the worker
+// freeing the blocks of unlinked files) stop once they have worked through this many
+// blocks or held the lock this many microseconds, and the next call carries on from
+// there.  0 is no limit
+#define DEFAULT_LOCK_BUDGET_BLOCKS 1024
+#define DEFAULT_LOCK_BUDGET_US 1000
+// Blocks a command works through between looks at the clock
+#define BUDGET_CHECK_BLOCKS 64
+
+// Requests wait for the core in one queue per process, served by deficit round robin.
+// Each round a process gets SCHED_QUANTUM bytes of credit times its weight, and a
+// request costs SCHED_OP_COST plus the bytes it reads or writes, up to SCHED_MAX_COST
+#define SCHED_CLIENTS 64
+#define SCHED_QUANTUM (64LL*1024)
+#define SCHED_OP_COST 4096LL
+#define SCHED_MAX_COST (16*SCHED_QUANTUM)
+#define SCHED_DEFAULT_WEIGHT 1
+#define SCHED_MAX_WEIGHT 64
+
+// Every command's time waiting for the core and time in it go in latency histograms
+// kept per CPU.  Buckets are log linear like an HDR histogram, LAT_SUB_BUCKETS to
+// each power of 2 nanoseconds up to 2^LAT_MAX_SHIFT, so a percentile read back is at
+// most an eighth above the real one
+#define LAT_COMMANDS 32     // Above the _IOC_NR of every RAM_* command
+#define LAT_SUB_BITS 3
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_MAX_SHIFT 36    // About 69 seconds, longer ones land in the last bucket
+#define LAT_BUCKETS ((LAT_MAX_SHIFT - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+#ifdef DEBUG
+	#define LAT_CPUS 64     // CPUs past it share histograms
+#else
+	#define LAT_CPUS NR_CPUS
+#endif
 
-#define NUM_DIRECT 8
+/*********************MEMORY ALLOCATION************************/
+#ifdef DEBUG
+	#define RAM_ALLOC(size) malloc(size)
+	#define RAM_FREE(ptr) free(ptr)
+#else
+	#define RAM_ALLOC(size) vmalloc(size)
+	#define RAM_FREE(ptr) vfree(ptr)
+#endif
 
-// I add this custom value to keep track of directory file count
-// I use 2 bytes ( a short ) for this
-#define INODE_FILE_COUNT 48
+/*********************INDEX NODE STRUCTURE************************/
+// An index node is a struct RAM_indexNode, these are the byte offsets of its
+// fields for the code that walks the pointer area as raw memory
+#define INODE_TYPE 0     // 1 byte, one of the RAM_TYPE_ values
+#define DIRECT_1 4
+#define SINGLE_INDIR 28
+#define DOUBLE_INDIR 32
+#define TRIPLE_INDIR 36
+#define INODE_SIZE 40    // 8 bytes, sizes and offsets are 64 bit
+
+#define NUM_DIRECT 6
+
+#define RAM_TYPE_FREE 0
+#define RAM_TYPE_REG 1
+#define RAM_TYPE_DIR 2
+// Unlinked, with blocks still to be freed.  It keeps its size class and pointers,
+// and its size holds the next index node on the superblock's dead list
+#define RAM_TYPE_DEAD 3
+
+// A regular file's size class: every block pointer of the file names the first
+// of 2^class contiguous blocks (a cluster).  A directory's file count is its
+// size over FILE_INFO_SIZE, so it needs no field of its own
+#define INODE_SIZE_CLASS 1
+
+// Flags of a regular file
+#define INODE_FLAGS 2
+#define INODE_FLAG_INLINE 0x01  // The pointer area holds the file's data itself
+#define INODE_FLAG_FRAGMENT 0x02  // The data is a fragment of a shared block
+#define INODE_FLAG_SMALL (INODE_FLAG_INLINE | INODE_FLAG_FRAGMENT)
+
+// Tiny files keep their data where the block pointers would be
+#define INLINE_DATA_OFFSET DIRECT_1
+#define INLINE_DATA_SIZE (TRIPLE_INDIR + 4 - DIRECT_1)
+
+// A fragment file keeps (block, offset, length) of its fragment in the pointer area
+#define FRAG_BLOCK DIRECT_1
+#define FRAG_OFFSET (DIRECT_1 + 4)  // Byte offset of the fragment in its block
+#define FRAG_LENGTH (DIRECT_1 + 8)  // Bytes reserved, the file size may be less
+
+/*********************FRAGMENT BLOCKS************************/
+// Files too big to be inline but at most half a block share fragment blocks.
+// A fragment block is split into 64 units, and its first unit(s) hold a header
+// with a bitmap of the units in use.  Fragment blocks with free units are
+// chained from the superblock
+#define FRAG_UNITS_PER_BLOCK 64
+#define FRAG_UNIT_SIZE (RAM_BLOCK_SIZE / FRAG_UNITS_PER_BLOCK)
+#define FRAGMENT_MAX_SIZE (RAM_BLOCK_SIZE / 2)
+#define FRAG_HEADER_MAP 0       // 8 bytes, bit n set when unit n is in use
+#define FRAG_HEADER_NEXT 8      // Next fragment block with free units, -1 ends the chain
+#define FRAG_HEADER_FREE 12     // short, free units left
+#define FRAG_HEADER_LISTED 14   // short, 1 while the block is on the chain
+#define FRAG_HEADER_SIZE 16
 
 // I also keep within here the filename for convenience, so that it
 // isn't necessary to view memory to access current files name
-#define INODE_FILE_NAME 50
+#define INODE_FILE_NAME 48
+#define INODE_FILE_NAME_SIZE 16
 
 /*********************FILE SYSTEM DIRECTORY STRUCTURE************************/
 // Files are just raw data pointed to from the index node, directories on the
-// othere hand are groups of 16 byte "structs", where 14 bytes is filename and
-// 2 bytes index node number
-
-#define FILE_INFO_SIZE 16
-#define INODE_NUM_OFFSET 14 // Offset in file_info to get the inode
-
-
+// othere hand are groups of 20 byte "structs", where 14 bytes is filename, 2
+// bytes padding and 4 bytes index node number
+
+#define FILE_INFO_SIZE 20
+#define INODE_NUM_OFFSET 16 // Offset in file_info to get the inode
+
+/*********************ON-MEDIA STRUCTURES************************/
+// Compile time check, for compilers without static_assert
+#define RAM_STATIC_ASSERT(cond, name) typedef char ram_static_assert_##name[(cond) ? 1 : -1]
+
+struct RAM_indexNode
+{
+    unsigned char type;       /* RAM_TYPE_FREE while unused */
+    unsigned char sizeClass;  /* Regular files only */
+    unsigned char flags;      /* Regular files only, INODE_FLAG_ bits */
+    unsigned char reserved;
+    int direct[NUM_DIRECT];   /* Or the inline data, or a fragment's (block, offset, length) */
+    int singleIndirect;
+    int doubleIndirect;
+    int tripleIndirect;
+    long long size;
+    char name[INODE_FILE_NAME_SIZE];
+} __attribute__((packed, aligned(RAM_CACHE_LINE)));
+
+struct RAM_dirent
+{
+    char name[16];                /* 14 bytes used, NUL terminated */
+    int indexNode;                /* 0 if never used, -2 once its file is deleted */
+} __attribute__((packed, aligned(4)));
+
+struct RAM_superblock
+{
+    int freeBlocks;
+    int freeIndexNodes;
+    int magic;
+    int version;
+    long long fsSize;
+    int blockSize;
+    int inodeTableBlocks;
+    int bitmapBlocks;
+    int dataBlocks;
+    int freeHint;          /* No block below this is free */
+    int fragList;          /* First fragment block with free units, -1 if none */
+    int inodeTotal;        /* Index nodes in the table, the blocks it grew into included */
+    int inodeHint;         /* No index node below this is free */
+    int deadList;          /* First unlinked index node whose blocks are still to be freed, 0 if none */
+    int reserved;
+    struct RAM_indexNode inodeMap;  /* Only the pointers are used */
+} __attribute__((packed, aligned(RAM_CACHE_LINE)));
+
+RAM_STATIC_ASSERT(sizeof(struct RAM_indexNode) == INDEX_NODE_SIZE, index_node_size);
+RAM_STATIC_ASSERT(sizeof(struct RAM_indexNode) == RAM_CACHE_LINE, index_node_is_a_cache_line);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, sizeClass) == INODE_SIZE_CLASS, size_class_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, flags) == INODE_FLAGS, flags_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, direct) == DIRECT_1, direct_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, singleIndirect) == SINGLE_INDIR, single_indirect_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, doubleIndirect) == DOUBLE_INDIR, double_indirect_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, tripleIndirect) == TRIPLE_INDIR, triple_indirect_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, size) == INODE_SIZE, size_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_indexNode, name) == INODE_FILE_NAME, name_offset);
+RAM_STATIC_ASSERT(sizeof(struct RAM_dirent) == FILE_INFO_SIZE, dirent_size);
+RAM_STATIC_ASSERT(offsetof(struct RAM_dirent, indexNode) == INODE_NUM_OFFSET, dirent_index_node_offset);
+RAM_STATIC_ASSERT(sizeof(struct RAM_superblock) == 128, superblock_size);
+RAM_STATIC_ASSERT(offsetof(struct RAM_superblock, fsSize) == SB_FS_SIZE_OFFSET, sb_fs_size_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_superblock, fragList) == SB_FRAG_LIST_OFFSET, sb_frag_list_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_superblock, inodeHint) == SB_INODE_HINT_OFFSET, sb_inode_hint_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_superblock, deadList) == SB_DEAD_LIST_OFFSET, sb_dead_list_offset);
+RAM_STATIC_ASSERT(offsetof(struct RAM_superblock, inodeMap) == SB_INODE_MAP_OFFSET, sb_inode_map_offset);
+
+/*********************VERSION 3 INDEX NODES************************/
+// Read only by the upgrade done when a version 3 image is loaded.  The type was
+// a string, and the pointers came after the size
+#define V3_INODE_SIZE 4
+#define V3_DIRECT_1 12
+#define V3_POINTERS_SIZE 36
+#define V3_INODE_SIZE_CLASS 48
+#define V3_INODE_FLAGS 49
+#define V3_INODE_FILE_NAME 50
+
+
+
+int setGeometry(unsigned long fsSize, int blockSize, int inodeCount);
+
+int loadGeometry(void);
+
+void upgradeFromVersion3(void);
+
+int getAllocatedBlockNumbers(int *blockArray, int inodeNum);
+
+long long getFileSize(int indexNode);
+
+void setFileSize(int indexNode, long long fileSize);
+
+long long writeToFile(int indexNode, char *data, long long size, long long offset);
+
+long long readFromFile(int indexNode, char *data, long long size, long long offset);
+
+int punchHole(int indexNode, long long offset, long long length);
+
+int truncateFile(int indexNode, long long length);
+
+int fallocateFile(int indexNode, long long offset, long long length);
 
 /**
  * Get free block from memory region
  *
  * @return  blocknumber
  */
-int allocBlockForNode(int indexNode, int currentSize);
+int allocBlockForNode(int indexNode, long logicalBlock);
+
+int newPointerBlock(void);
 
 int getFreeBlock(void);
 
+int getFreeRun(int blockCount, int align);
+long long reclaimChunks(void);
+
+int getFreeCluster(int blockCount);
+
+void freeCluster(int firstBlock, int blockCount);
+
+int fileSizeClass(int indexNode);
+
+int largeSizeClass(void);
+
+int fileFlags(int indexNode);
+
+int fileIsInline(int indexNode);
+
+char *smallFileData(int indexNode);
+
+int smallFileCapacity(int indexNode);
+
+void releaseSmallData(int indexNode);
+
+int moveSmallDataToBlocks(int indexNode);
+
+int moveToFragment(int indexNode, int length);
+
+int allocFragment(int length, int *fragBlock);
+
+void freeFragment(int fragBlock, int fragOffset, int length);
+
+int setFileSizeClass(int indexNode, int sizeClass);
+
+int fragScore(struct RAM_fragScore *fragScore);
+
+int defragStep(struct RAM_defrag *defrag);
+
+int fsckRun(struct RAM_fsck *report);
+
 void freeBlock(int blockindex);
 
+void freeRun(int firstBlock, int blockCount);
+
+long long reapDeadIndexNodes(long long budget);
+
 void allocMemoryForIndexNode(int indexNodeNumber, int numberOfBlocks);
 
 void negateIndexNodePointers(int indexNodeNumber);
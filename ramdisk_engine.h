@@ -0,0 +1,117 @@
+#ifndef RAMDISK_ENGINE_H
+#define RAMDISK_ENGINE_H
+
+/**
+*  In-process ramdisk engine
+*
+*  The filesystem core from ramdisk_ioctl.c built as a userspace library
+*  (make engine).  It takes the same RAM_* commands and structs as the
+*  /proc/ramdisk ioctl, so RAMFileLib can run on top of it with no syscalls.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Allocates and formats the in-process ramdisk
+ *
+ * @return	int	0 on success, -1 if the memory could not be allocated
+ * @remark	Calling this more than once keeps the existing filesystem
+ */
+int ramdisk_engine_init(void);
+
+/**
+ * Sets the geometry used when the engine formats its ramdisk
+ *
+ * @return	int	0 on success, -1 if the geometry is invalid or the engine is already running
+ * @param[in]	fsSize	capacity in bytes
+ * @param[in]	blockSize	bytes per block, a power of 2 from 256 to 65536
+ * @param[in]	inodeCount	number of index nodes
+ * @remark	Must be called before ramdisk_engine_init or ramdisk_engine_init_shared,
+ *		processes attaching to an existing shared segment use its geometry instead
+ */
+int ramdisk_engine_configure(unsigned long fsSize, int blockSize, int inodeCount);
+
+/**
+ * Maps a ramdisk in shared memory so several processes can run the core on it
+ *
+ * @return	int	0 on success, -1 on failure
+ * @param[in]	name	shm_open name to create or attach to, or NULL for an anonymous
+ *			memfd segment shared with children forked afterwards
+ * @remark	Metadata is guarded by a robust, process shared mutex in the segment
+ */
+int ramdisk_engine_init_shared(const char *name);
+
+/**
+ * Dumps the ramdisk to a sparse image file, only the metadata and blocks in use are written
+ *
+ * @return	long long	bytes written, -1 on failure
+ * @param[in]	path	the image file
+ * @param[in]	incremental	when set and path holds the previous snapshot, only what
+ *			changed since then is written
+ * @remark	A full dump replaces path atomically, an incremental one updates it in place
+ */
+long long ramdisk_engine_snapshot(const char *path, int incremental);
+
+/**
+ * Brings up the in-process ramdisk from a snapshot, usable at once
+ *
+ * @return	int	0 on success, -1 if path is not a snapshot or the engine is running
+ * @param[in]	path	a file written by ramdisk_engine_snapshot
+ * @remark	The file is mapped copy on write, blocks are read in when first touched
+ */
+int ramdisk_engine_init_snapshot(const char *path);
+
+/**
+ * Replays a metadata journal over the running ramdisk, then journals to it
+ *
+ * @return	long	records replayed, -1 on failure
+ * @param[in]	path	the journal file, created if missing
+ * @remark	Start the engine from the snapshot the journal follows first.  From then
+ *		on creates, mkdirs, unlinks and size changes return once their record is
+ *		on disk, concurrent ones share one fsync.  A snapshot empties the journal
+ */
+long ramdisk_engine_journal(const char *path);
+
+/**
+ * Reports how well the journal's group commit is batching
+ *
+ * @param[out]	records	records journaled
+ * @param[out]	commits	write and fsync rounds that made them durable
+ */
+void ramdisk_engine_journal_stats(unsigned long long *records, unsigned long long *commits);
+
+/**
+ * Reports the latency percentiles of every command this process has run
+ *
+ * @return	int	bytes written, not counting the NUL
+ * @param[out]	buffer	a line per command, as /proc/ramdisk_stats shows for the module
+ * @param[in]	size	bytes buffer holds
+ */
+int ramdisk_engine_stats(char *buffer, int size);
+
+/**
+ * Reads the write generation of a file, which changes with its data or size
+ *
+ * @return	unsigned int	the generation a RAM_READ would return now
+ * @param[in]	indexNode	the file
+ * @remark	Takes no lock and makes no call, so a buffered read can check it every time
+ */
+unsigned int ramdisk_engine_generation(int indexNode);
+
+/**
+ * Runs one ramdisk command in-process
+ *
+ * @return	int	0 on success, -EINVAL on an unknown command, -EIO if the operation
+ *		was applied but its journal record could not be written, ret is then -1
+ * @param[in]	cmd	one of the RAM_* ioctl commands
+ * @param[in-out]	arg	the struct matching cmd, results are written back into it
+ */
+int ramdisk_engine_ioctl(unsigned int cmd, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RAMDISK_ENGINE_H */
@@ -16,13 +16,302 @@ MODULE_LICENSE("GPL");
 static int ramdisk_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg);
 static struct file_operations pseudo_dev_proc_operations;
 static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *stats_entry;
 static DECLARE_MUTEX(FS_mutex);
 static int rootCreated;
+
+/* Geometry, fixed when the module loads */
+static unsigned long fs_size = DEFAULT_FS_SIZE;
+module_param(fs_size, ulong, 0444);
+MODULE_PARM_DESC(fs_size, "Ramdisk capacity in bytes");
+
+static int block_size = DEFAULT_BLOCK_SIZE;
+module_param(block_size, int, 0444);
+MODULE_PARM_DESC(block_size, "Block size in bytes, a power of 2 from 256 to 65536");
+
+static int inode_count = DEFAULT_INODE_COUNT;
+module_param(inode_count, int, 0444);
+MODULE_PARM_DESC(inode_count, "Number of index nodes");
+
+static unsigned long reclaim_watermark = DEFAULT_RECLAIM_WATERMARK;
+module_param(reclaim_watermark, ulong, 0444);
+MODULE_PARM_DESC(reclaim_watermark, "Bytes freed between returns of free memory to the kernel");
+
+static int lock_budget_blocks = DEFAULT_LOCK_BUDGET_BLOCKS;
+module_param(lock_budget_blocks, int, 0444);
+MODULE_PARM_DESC(lock_budget_blocks, "Blocks a long command works through per hold of the lock, 0 for no limit");
+
+static long lock_budget_us = DEFAULT_LOCK_BUDGET_US;
+module_param(lock_budget_us, long, 0444);
+MODULE_PARM_DESC(lock_budget_us, "Microseconds a long command holds the lock for, 0 for no limit");
 #endif
 
 // @var The ramdisk memory in the kernel */
 static char *RAM_memory;
-static int allocatedBlocks[MAX_BLOCKS_ALLOCATABLE];
+// @var Layout of RAM_memory, loaded from the superblock */
+static struct RAM_geometry geometry;
+// @var Scratch block list, sized for the largest file the geometry allows */
+static int *allocatedBlocks;
+// @var Set while RAM_memory is known to be all zeros, so formatting it need not clear anything */
+static int imageZeroed;
+// @var Set when RAM_memory is a shared segment, whose pages are given back with MADV_REMOVE */
+static int imageShared;
+// @var One flag per data chunk, set once this instance has handed out a block in it */
+static unsigned char *chunkCommitted;
+// @var Bytes of blocks freed after which reclaimChunks runs by itself */
+static unsigned long reclaimWatermark = DEFAULT_RECLAIM_WATERMARK;
+// @var Bytes of blocks freed since reclaimChunks last ran */
+static unsigned long freedSinceReclaim;
+// @var Blocks a long command works through per hold of the lock, 0 for no limit */
+static int lockBudgetBlocks = DEFAULT_LOCK_BUDGET_BLOCKS;
+// @var Microseconds a long command holds the lock for, 0 for no limit */
+static long lockBudgetUs = DEFAULT_LOCK_BUDGET_US;
+// @var One bit per dirty unit written since the last snapshot, NULL before the first one */
+static unsigned char *dirtyMap;
+// @var dirtyMap while a command that can write blocks runs, NULL otherwise */
+static unsigned char *dirtyMarking;
+// @var A dirty unit is 1 << dirtyUnitShift blocks, the size of the largest cluster */
+static int dirtyUnitShift;
+// @var The file the last snapshot went to, only it can take an incremental one */
+static char *snapshotPath;
+// @var Set once a worker frees the blocks of unlinked files, unlink then only detaches them */
+static int deferredFreeing;
+
+/* Files hash into this many write generations, a collision only drops a read buffer early */
+#define WRITE_GENERATIONS 256
+// @var Write generations of a ramdisk nothing else shares */
+static unsigned int localGenerations[WRITE_GENERATIONS];
+// @var The write generations in use, a shared engine keeps them in its segment */
+static volatile unsigned int *writeGenerations = localGenerations;
+
+static void wakeReaper(void);
+
+#ifdef DEBUG
+#define RAM_PAGE_SIZE 4096UL
+#define RAM_HUGE_PAGE_SIZE (2UL*1024*1024)
+/* Kept just in front of an image from allocImage, which sits somewhere inside its mapping */
+struct RAM_imageHeader
+{
+    char *mapping;
+    unsigned long length;
+};
+// @var Whether allocImage asks for transparent huge pages */
+static int imageHugePages = 1;
+#else
+// @var Address space reserved for the image, pages are mapped into it as chunks are used */
+static struct vm_struct *imageArea;
+// @var The page backing each page of the image, NULL where nothing is mapped */
+static struct page **imagePages;
+#endif
+
+/**
+ * Reserves memory for a filesystem image, block aligned so its index nodes are cache line aligned
+ *
+ * @return  char*  the memory, NULL if out of memory
+ * @param[in]  size  bytes of the image
+ * @require  setGeometry has been called, the layout decides where the image is placed
+ * @remark  Only address space is taken here.  Memory comes as the image is used: on
+ *          first touch in the DEBUG build, a chunk at a time through commitBlocks in
+ *          the module, where the caller maps the metadata with mapImagePages first.
+ *          In the DEBUG build the data region starts on a huge page, so every chunk
+ *          is exactly one transparent huge page and random block access misses the
+ *          TLB far less often
+ */
+static char *allocImage(unsigned long size)
+{
+#ifdef DEBUG
+    char *mapping, *image;
+    unsigned long length, dataStart;
+    struct RAM_imageHeader *header;
+
+    length = size + 2 * RAM_HUGE_PAGE_SIZE;
+    mapping = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+    madvise(mapping, length, imageHugePages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+
+    dataStart = ((unsigned long)mapping + sizeof(*header) + DATA_BLOCKS_OFFSET + RAM_HUGE_PAGE_SIZE - 1)
+                & ~(RAM_HUGE_PAGE_SIZE - 1);
+    image = (char *)(dataStart - DATA_BLOCKS_OFFSET);
+    header = (struct RAM_imageHeader *)image - 1;
+    header->mapping = mapping;
+    header->length = length;
+    imageShared = 0;
+    imageZeroed = 1;
+    return image;
+#else
+    unsigned long pageCount;
+    pageCount = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    imagePages = (struct page **)vmalloc(pageCount * sizeof(struct page *));
+    imageArea = get_vm_area(pageCount << PAGE_SHIFT, VM_ALLOC);
+    if (!imagePages || !imageArea)
+    {
+        if (imageArea)
+            free_vm_area(imageArea);
+        vfree(imagePages);
+        return NULL;
+    }
+    memset(imagePages, 0, pageCount * sizeof(struct page *));
+    imageZeroed = 1; /* Every page is mapped zeroed */
+    return (char *)imageArea->addr;
+#endif
+}
+
+#ifndef DEBUG
+/**
+ * Backs every page of part of the image that is not backed yet with a fresh zeroed page
+ *
+ * @return  int  0 on success, -1 if out of memory
+ * @param[in]  start  byte offset into the image
+ * @param[in]  end  byte offset just past the part
+ */
+static int mapImagePages(unsigned long start, unsigned long end)
+{
+    unsigned long page, address;
+    struct page *newPage;
+
+    for (page = start >> PAGE_SHIFT; page < PAGE_ALIGN(end) >> PAGE_SHIFT; page++)
+    {
+        if (imagePages[page])
+            continue;
+        newPage = alloc_page(GFP_KERNEL | __GFP_HIGHMEM | __GFP_ZERO);
+        if (!newPage)
+            return -1;
+        address = (unsigned long)imageArea->addr + (page << PAGE_SHIFT);
+        if (map_kernel_range_noflush(address, PAGE_SIZE, PAGE_KERNEL, &newPage) < 0)
+        {
+            __free_page(newPage);
+            return -1;
+        }
+        flush_cache_vmap(address, address + PAGE_SIZE);
+        imagePages[page] = newPage;
+    }
+    return 0;
+}
+
+/**
+ * Unmaps and frees the pages that lie wholly inside part of the image
+ *
+ * @param[in]  start  byte offset into the image
+ * @param[in]  end  byte offset just past the part
+ * @remark  A page shared with a neighbouring chunk stays, it is freed with the image
+ */
+static void unmapImagePages(unsigned long start, unsigned long end)
+{
+    unsigned long page, first, last;
+
+    first = PAGE_ALIGN(start) >> PAGE_SHIFT;
+    last = end >> PAGE_SHIFT;
+    if (first >= last)
+        return;
+    unmap_kernel_range((unsigned long)imageArea->addr + (first << PAGE_SHIFT), (last - first) << PAGE_SHIFT);
+    for (page = first; page < last; page++)
+    {
+        if (imagePages[page])
+            __free_page(imagePages[page]);
+        imagePages[page] = NULL;
+    }
+}
+#endif
+
+/**
+ * Gives back an image from allocImage and all the memory behind it
+ *
+ * @param[in]  image  the image
+ */
+static void freeImage(char *image)
+{
+#ifdef DEBUG
+    struct RAM_imageHeader *header;
+    header = (struct RAM_imageHeader *)image - 1;
+    munmap(header->mapping, header->length);
+#else
+    unmapImagePages(0, PAGE_ALIGN(FS_SIZE));
+    free_vm_area(imageArea);
+    vfree(imagePages);
+    imageArea = NULL;
+    imagePages = NULL;
+#endif
+}
+
+/**
+ * Returns the address of a data block
+ *
+ * @param[in]  blockNum  the data block number
+ * @remark  Done in long arithmetic so regions past 2 GB are addressable
+ */
+static inline char *blockAddress(int blockNum)
+{
+    /* Blocks are only written through addresses from here, and no write crosses a
+     * cluster, so marking the unit holding the block covers it */
+    if (dirtyMarking)
+        dirtyMarking[(blockNum >> dirtyUnitShift) >> 3] |= 1 << ((blockNum >> dirtyUnitShift) & 7);
+    return RAM_memory + DATA_BLOCKS_OFFSET + (long)blockNum * RAM_BLOCK_SIZE;
+}
+
+static int *pointerAreaSlot(char *pointerArea, long logicalBlock, int allocate);
+
+/**
+ * Returns the superblock at the start of RAM_memory
+ */
+static inline struct RAM_superblock *superblock(void)
+{
+    return (struct RAM_superblock *)RAM_memory;
+}
+
+/**
+ * Returns the address of an index node, in the fixed array or in a block the table grew into
+ *
+ * @param[in]  indexNode  the index node number, below the table's total
+ */
+static inline char *indexNodeAddress(int indexNode)
+{
+    int *slot;
+
+    if (indexNode < INDEX_NODE_COUNT)
+        return RAM_memory + INDEX_NODE_ARRAY_OFFSET + (long)indexNode * INDEX_NODE_SIZE;
+
+    indexNode -= INDEX_NODE_COUNT;
+    slot = pointerAreaSlot(RAM_memory + SB_INODE_MAP_OFFSET, indexNode / INODES_PER_BLOCK, 0);
+    return blockAddress(*slot) + (long)(indexNode % INODES_PER_BLOCK) * INDEX_NODE_SIZE;
+}
+
+/**
+ * Returns an index node as its on-media struct
+ *
+ * @param[in]  indexNode  the index node number, below the table's total
+ */
+static inline struct RAM_indexNode *indexNodeAt(int indexNode)
+{
+    return (struct RAM_indexNode *)indexNodeAddress(indexNode);
+}
+
+/**
+ * Returns the index node number stored in a directory entry
+ *
+ * @param[in]  entry  start of the FILE_INFO_SIZE byte entry
+ * @remark  0 marks an entry never used and -2 one whose file was deleted
+ */
+static inline int dirEntryIndexNode(char *entry)
+{
+    return ((struct RAM_dirent *)entry)->indexNode;
+}
+
+static inline void setDirEntryIndexNode(char *entry, int indexNode)
+{
+    ((struct RAM_dirent *)entry)->indexNode = indexNode;
+}
+
+/**
+ * Returns the number of files in a directory
+ *
+ * @param[in]  indexNode  index node of the directory
+ */
+static inline int directoryFileCount(int indexNode)
+{
+    return (int)(getFileSize(indexNode) / FILE_INFO_SIZE);
+}
 
 /**
  * Utility function to set a specified bit within a byte
@@ -79,10 +368,7 @@ int checkBit(int index, int bit)
  */
 void changeBlockCount(int delta)
 {
-    int blockCount;
-    memcpy(&blockCount, RAM_memory, sizeof(int));
-    blockCount += delta;
-    memcpy(RAM_memory, &blockCount, sizeof(int));
+    superblock()->freeBlocks += delta;
 }
 
 /**
@@ -93,170 +379,988 @@ void changeBlockCount(int delta)
  */
 void changeIndexNodeCount(int delta)
 {
-    int blockCount;
-    memcpy(&blockCount, RAM_memory + 4, sizeof(int));
-    blockCount += delta;
-    memcpy(RAM_memory + 4, &blockCount, sizeof(int));
+    superblock()->freeIndexNodes += delta;
+}
+
+/**
+ * Derives the whole layout from the format parameters, filling in the geometry
+ *
+ * @return  int  0 on success, -1 if the parameters can not make a usable filesystem
+ * @param[in]  fsSize  total bytes of ramdisk memory
+ * @param[in]  blockSize  bytes per block, a power of 2 between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+ * @param[in]  inodeCount  number of index nodes, rounded up to fill whole blocks
+ */
+int setGeometry(unsigned long fsSize, int blockSize, int inodeCount)
+{
+    struct RAM_geometry g;
+    unsigned long totalBlocks, remaining;
+    long maxBlocks, maxInodes;
+
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)))
+    {
+        PRINT("Block size must be a power of 2 between %d and %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+#ifdef RAM_FIXED_BLOCK_SIZE
+    if (blockSize != RAM_FIXED_BLOCK_SIZE)
+    {
+        PRINT("This build only handles %d byte blocks\n", RAM_FIXED_BLOCK_SIZE);
+        return -1;
+    }
+#endif
+    if (inodeCount < 2)
+    {
+        PRINT("Need at least two index nodes\n");
+        return -1;
+    }
+
+    g.fsSize = fsSize;
+    g.blockSize = blockSize;
+    g.inodeTableBlocks = (int)(((long)inodeCount * INDEX_NODE_SIZE + blockSize - 1) / blockSize);
+    g.inodeCount = g.inodeTableBlocks * (blockSize / INDEX_NODE_SIZE);
+
+    /* Superblock, then the index node array, then the bitmap, then the data.
+     * Each bitmap block covers blockSize * 8 data blocks and takes one itself */
+    totalBlocks = fsSize / blockSize;
+    if (totalBlocks < 3 + (unsigned long)g.inodeTableBlocks || totalBlocks > 0x7FFFFFFFUL)
+    {
+        PRINT("Filesystem size %lu does not fit the layout\n", fsSize);
+        return -1;
+    }
+    remaining = totalBlocks - 1 - g.inodeTableBlocks;
+    g.bitmapBlocks = (int)((remaining + (unsigned long)blockSize * 8) / ((unsigned long)blockSize * 8 + 1));
+    g.dataBlockCount = (int)(remaining - g.bitmapBlocks);
+
+    /* A file can not hold more blocks than the filesystem has */
+    maxBlocks = NUM_DIRECT + (long)(blockSize / 4) + (long)(blockSize / 4) * (blockSize / 4)
+                + (long)(blockSize / 4) * (blockSize / 4) * (blockSize / 4);
+    g.maxLogicalBlocks = maxBlocks;
+    if (maxBlocks > g.dataBlockCount)
+        maxBlocks = g.dataBlockCount;
+    g.maxBlocksPerFile = (int)maxBlocks;
+
+    /* The table grows a block at a time through its own pointer area in the superblock */
+    maxInodes = g.inodeCount + g.maxLogicalBlocks * (blockSize / INDEX_NODE_SIZE);
+    g.maxIndexNodes = maxInodes > 0x7FFFFFFFL ? 0x7FFFFFFF : (int)maxInodes;
+
+    geometry = g;
+    return 0;
+}
+
+/**
+ * Rebuilds the geometry from the superblock of an already formatted RAM_memory
+ *
+ * @return  int  0 on success, -1 if the superblock is not a ramdisk superblock
+ * @remark  A version 3 image is upgraded in place to the current layout
+ */
+int loadGeometry(void)
+{
+    struct RAM_superblock *sb;
+    int blockSize;
+
+    sb = superblock();
+    if (sb->magic != RAMDISK_MAGIC || sb->version < RAMDISK_OLDEST_VERSION || sb->version > RAMDISK_VERSION)
+    {
+        PRINT("Not a ramdisk superblock (magic %x version %d)\n", sb->magic, sb->version);
+        return -1;
+    }
+
+    blockSize = sb->blockSize;
+    if (setGeometry((unsigned long)sb->fsSize, blockSize, sb->inodeTableBlocks * (blockSize / INDEX_NODE_SIZE)) < 0)
+        return -1;
+    if (sb->version == 3)
+        upgradeFromVersion3();
+    return 0;
+}
+
+/**
+ * Rewrites one index node from the version 3 layout to the current one
+ *
+ * @param[in-out]  record  the 64 bytes of the index node
+ */
+static void upgradeIndexNodeRecord(char *record)
+{
+    char old[INDEX_NODE_SIZE];
+    struct RAM_indexNode *node;
+
+    memcpy(old, record, INDEX_NODE_SIZE);
+    memset(record, 0, INDEX_NODE_SIZE);
+    node = (struct RAM_indexNode *)record;
+
+    if (strcmp(old, "reg") == 0)
+    {
+        node->type = RAM_TYPE_REG;
+        node->sizeClass = old[V3_INODE_SIZE_CLASS];
+        node->flags = old[V3_INODE_FLAGS];
+    }
+    else if (strcmp(old, "dir") == 0)
+    {
+        node->type = RAM_TYPE_DIR; /* The old file count is the size over FILE_INFO_SIZE */
+    }
+    memcpy(record + DIRECT_1, old + V3_DIRECT_1, V3_POINTERS_SIZE);
+    memcpy(&node->size, old + V3_INODE_SIZE, sizeof(long long));
+    memcpy(node->name, old + V3_INODE_FILE_NAME, INDEX_NODE_SIZE - V3_INODE_FILE_NAME);
+}
+
+/**
+ * Upgrades a version 3 image in place.  Only the index nodes changed: directory
+ * entries, the bitmap, fragment blocks and the rest of the superblock are the same
+ */
+void upgradeFromVersion3(void)
+{
+    int ii, total;
+    char *record;
+
+    /* The pointer area mapping the grown table is laid out like an index node */
+    upgradeIndexNodeRecord(RAM_memory + SB_INODE_MAP_OFFSET);
+
+    total = superblock()->inodeTotal;
+    for (ii = 0; ii < total; ii++)
+    {
+        record = indexNodeAddress(ii);
+        /* A free index node is all zeros in both layouts */
+        if (record[0] != '\0')
+            upgradeIndexNodeRecord(record);
+    }
+    superblock()->version = RAMDISK_VERSION;
+    PRINT("Upgraded the ramdisk image from version 3 to %d\n", RAMDISK_VERSION);
+}
+
+/**
+ * Allocates the per instance scratch space that depends on the geometry
+ *
+ * @return  int  0 on success, -1 if out of memory
+ */
+int allocScratch(void)
+{
+    if (allocatedBlocks)
+        RAM_FREE(allocatedBlocks);
+    /* One extra slot so a full file still gets its -1 terminator */
+    allocatedBlocks = (int *)RAM_ALLOC(((long)MAX_BLOCKS_ALLOCATABLE + 1) * sizeof(int));
+
+    if (chunkCommitted)
+        RAM_FREE(chunkCommitted);
+    chunkCommitted = (unsigned char *)RAM_ALLOC(DATA_CHUNK_COUNT);
+    if (!allocatedBlocks || !chunkCommitted)
+        return -1;
+    memset(chunkCommitted, 0, DATA_CHUNK_COUNT);
+    freedSinceReclaim = 0;
+    return 0;
 }
 
 /**
  * RAMDISK initialization
  * Initializes the ramdisk superblock, indexnodes, and bitmap to include the root directory and nothing else
  *
+ * @require  setGeometry has been called and RAM_memory holds FS_SIZE bytes
  */
 void init_ramdisk(void)
 {
-    // First, we must clear all of the bits of RAM_memory to ensure they are all 0
-    int ii, data;
-    for (ii = 0 ; ii < FS_SIZE ; ii++)
-        RAM_memory[ii] = '\0';  // Null terminator is 0
+    // The superblock, index nodes and bitmap must start out all 0.  A fresh image
+    // already is, and is left untouched so formatting costs the same at any
+    // capacity.  Data blocks are zeroed when they are handed out, so they are
+    // never cleared here and their chunks stay without memory until used
+    unsigned long ii;
+    struct RAM_superblock *sb;
+    if (!imageZeroed)
+        memset(RAM_memory, 0, DATA_BLOCKS_OFFSET);
+    imageZeroed = 0;
 
     /****** Set up the superblock *******/
-    // Consists of two values, a 4 byte value containing the free block count
-    // and a 4 byte value containing the number of free index nodes.  Initialized with
-    // everything free
-    data = TOT_AVAILABLE_BLOCKS;
-    memcpy(RAM_memory, &data, sizeof(int));
-    data = INDEX_NODE_COUNT;
-    memcpy(RAM_memory + INODE_COUNT_OFFSET, &data, sizeof(int));
-    // For now, thats all that our superblock contains, may expand more in the future
-    printSuperblock();
+    // Starts with two values, the free block count and the number of free index
+    // nodes.  Initialized with everything free
+    sb = superblock();
+    sb->freeBlocks = TOT_AVAILABLE_BLOCKS;
+    sb->freeIndexNodes = INDEX_NODE_COUNT;
+
+    // Followed by the layout, so the geometry can be recovered from the memory alone
+    sb->magic = RAMDISK_MAGIC;
+    sb->version = RAMDISK_VERSION;
+    sb->fsSize = FS_SIZE;
+    sb->blockSize = RAM_BLOCK_SIZE;
+    sb->inodeTableBlocks = INDEX_NODE_ARRAY_LENGTH;
+    sb->bitmapBlocks = BLOCK_BITMAP_BLOCK_COUNT;
+    sb->dataBlocks = TOT_AVAILABLE_BLOCKS;
+    sb->fragList = -1;
+    sb->inodeTotal = INDEX_NODE_COUNT;
+    for (ii = 0; ii < NUM_DIRECT; ii++)
+        sb->inodeMap.direct[ii] = -1;
+    sb->inodeMap.singleIndirect = -1;
+    sb->inodeMap.doubleIndirect = -1;
+    sb->inodeMap.tripleIndirect = -1;
 
     /****************Create the root directory******************/
     createIndexNode("dir\0", "/\0",  0);
 #ifndef DEBUG
     rootCreated = 1;
 #endif
-    printIndexNode(0);
-    printSuperblock();
 
     /****** At start, root directory has no files, so its block is empty (but claimed) at the moment ******/
     PRINT("RAMDISK has been initialized with memory\n");
 }
 
-/************************ INTERNAL HELPER FUNCTIONS **************************/
+/************************ LOCK BUDGETS *****************************/
 
 /**
- * Fills the input array with the block numbers of all the allocated blocks for a given index node, valid for both dir and fil
+ * Where a long command is against the lock budget
+ */
+struct RAM_budget
+{
+    unsigned long long start;  /* When the command started, in nanoseconds */
+    long blocks;               /* Blocks it has worked through */
+};
+
+static unsigned long long budgetClock(void)
+{
+#ifdef DEBUG
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#else
+    return ktime_to_ns(ktime_get());
+#endif
+}
+
+static void budgetStart(struct RAM_budget *budget)
+{
+    budget->blocks = 0;
+    budget->start = lockBudgetUs ? budgetClock() : 0;
+}
+
+/**
+ * Charges work to a command
  *
- * @param[in-out]  blockArray  An int array which will hold the values of allocated blocks.
- * @param[in]  inodeNum  the inode number to search through
- * @require blockArray MUST be allocated with size 4168 before being passed into this functino
+ * @return  int  1 once the command has used up its budget and should stop where it is
+ * @param[in-out]  budget  the command's budget
+ * @param[in]  blocks  blocks worked through since the last charge
  */
-void getAllocatedBlockNumbers(int *blockArray, int inodeNum)
+static int budgetCharge(struct RAM_budget *budget, long blocks)
 {
-    int ii, jj, counter, offset, value;
-    char *inodePointer;
-    char *singleIndirPointer;
-    char *doubleIndirPointer;
-    char *blockPointer;
+    budget->blocks += blocks;
+    if (lockBudgetBlocks && budget->blocks >= lockBudgetBlocks)
+        return 1;
+    return lockBudgetUs && budgetClock() - budget->start >= (unsigned long long)lockBudgetUs * 1000;
+}
 
-    /* First, fill everything with -1 */
-    for (ii = 0 ; ii < MAX_BLOCKS_ALLOCATABLE ; ii++)
-        blockArray[ii] = -1;
+/**
+ * Picks the tail of a range in a file that one call can free within the block budget
+ *
+ * @return  long long  first byte of the tail, a cluster boundary, or offset if the whole range fits
+ * @param[in]  indexNode  the file
+ * @param[in]  offset  first byte of the range
+ * @param[in]  end  byte just past the range
+ * @remark  The range is freed from its end, so what is left for the next call is a
+ *          range again and the file never has holes the caller did not ask for
+ */
+static long long budgetRangeStart(int indexNode, long long offset, long long end)
+{
+    long long clusterSize, dataEnd, span, start;
+
+    if (!lockBudgetBlocks || end <= offset || indexNodeAt(indexNode)->type != RAM_TYPE_REG
+            || (fileFlags(indexNode) & INODE_FLAG_SMALL))
+        return offset;
+    clusterSize = (long long)RAM_BLOCK_SIZE << fileSizeClass(indexNode);
+
+    /* Past the clusters the size reaches there is at most what a failed write left */
+    dataEnd = (getFileSize(indexNode) + clusterSize - 1) / clusterSize * clusterSize;
+    if (end > dataEnd && dataEnd > offset)
+        return dataEnd;
+
+    span = (long long)lockBudgetBlocks * RAM_BLOCK_SIZE;
+    if (span < clusterSize)
+        span = clusterSize;
+    start = (end - span) / clusterSize * clusterSize;
+    return start > offset ? start : offset;
+}
 
-    /* Now, travel through the directory to get all of the block numbers */
-    counter = 0;
+/************************ REQUEST SCHEDULER *****************************/
 
-    /* Direct */
-    inodePointer = RAM_memory + INDEX_NODE_ARRAY_OFFSET + inodeNum * INDEX_NODE_SIZE;
-    for (ii = 0 ; ii < NUM_DIRECT ; ii++)
-    {
-        value = (int) * ( (int *)(inodePointer + DIRECT_1 + ii * 4) );
-        blockArray[counter] = value;
-        /* Now after value is set, check for -1 ( we need to have at least one -1 as an end condition for the external check) */
-        if (value == -1)
-        {
-            return;
-        }
+/* A request waiting for its turn at the core */
+struct RAM_schedRequest
+{
+    struct RAM_schedRequest *next;
+    int client;                /* Index into schedClients */
+    long long cost;
+    long long bytes;
+    unsigned long long queued; /* When it was queued, in nanoseconds */
+    volatile int granted;
+#ifndef DEBUG
+    struct completion grant;
+#endif
+};
 
-        counter++;
-    }
+/* A process and its queue, kept after its queue empties for the statistics */
+struct RAM_schedClient
+{
+    int id;                    /* Process id, a thread id in the engine.  0 if the slot is free */
+    int weight;
+    long long deficit;         /* Credit left this round, in bytes */
+    struct RAM_schedRequest *head, *tail;
+    int queued;
+    unsigned long long requests, bytes, waitNs, maxWaitNs;
+    unsigned long long lastUsed;
+};
+
+// @var Every process that has used the ramdisk lately */
+static struct RAM_schedClient schedClients[SCHED_CLIENTS];
+// @var The client whose round it is */
+static int schedCursor;
+// @var Set while a request is in the core */
+static int schedBusy;
+#ifdef DEBUG
+static pthread_mutex_t schedMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t schedGranted = PTHREAD_COND_INITIALIZER;
+#define SCHED_LOCK() pthread_mutex_lock(&schedMutex)
+#define SCHED_UNLOCK() pthread_mutex_unlock(&schedMutex)
+#else
+static DEFINE_SPINLOCK(schedLock);
+#define SCHED_LOCK() spin_lock(&schedLock)
+#define SCHED_UNLOCK() spin_unlock(&schedLock)
+#endif
 
-    /* Singly Indirect */
-    singleIndirPointer = inodePointer + SINGLE_INDIR;
-    offset = (int) * ( (int *)(singleIndirPointer) );
-    if (offset == -1)
-    {
-        /* This means there are no single indirect pointers, so set the next to -1 and return */
-        blockArray[counter] = -1;
-        return;
-    }
+/**
+ * Returns the id requests from the caller are queued under
+ */
+static int schedCaller(void)
+{
+#ifdef DEBUG
+    /* Threads are the callers.  The queues live in each process, so on a shared engine
+     * the threads of one process are fair to each other but not to other processes */
+    return (int)syscall(SYS_gettid);
+#else
+    return current->tgid;
+#endif
+}
 
-    blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + offset * RAM_BLOCK_SIZE;
-    for (ii = 0 ; ii < 64 ; ii++)
-    {
-        value = (int) * ( (int *)(blockPointer + ii * 4) );
-        blockArray[counter] = value;
-        /* Once again, check for termination */
-        if (value == -1)
-        {
-            return;
-        }
+/**
+ * Returns the cost of a command for the scheduler
+ *
+ * @return  long long  SCHED_OP_COST plus the bytes it may move, at most SCHED_MAX_COST
+ * @param[in]  cmd  the command
+ * @param[in]  bytes  bytes it reads or writes, 0 for the rest
+ */
+static long long schedCost(unsigned int cmd, long long bytes)
+{
+    if (cmd != RAM_READ && cmd != RAM_WRITE)
+        bytes = 0;
+    /* No call moves more than the lock budget */
+    if (lockBudgetBlocks && bytes > (long long)lockBudgetBlocks * RAM_BLOCK_SIZE)
+        bytes = (long long)lockBudgetBlocks * RAM_BLOCK_SIZE;
+    return bytes + SCHED_OP_COST < SCHED_MAX_COST ? bytes + SCHED_OP_COST : SCHED_MAX_COST;
+}
 
-        counter++;
-    }
+/**
+ * Finds the slot of a client, taking a free one or the longest idle one if it has none
+ *
+ * @return  int  the slot, -1 if every slot has requests queued
+ * @param[in]  id  the client's process id
+ * @remark  Called with the scheduler lock held
+ */
+static int schedClient(int id)
+{
+    int ii, slot;
 
-    /* Double Indirect */
-    singleIndirPointer = inodePointer + DOUBLE_INDIR; /* The top level doubly indirect pointer */
-    offset = (int) * ( (int *)(singleIndirPointer) );
-    if (offset == -1)
+    slot = -1;
+    for (ii = 0; ii < SCHED_CLIENTS; ii++)
     {
-        /* This means there are no doubly indirect pointers, so set the next to -1 and return */
-        blockArray[counter] = -1;
-        return;
+        if (schedClients[ii].id == id)
+            return ii;
+        if (schedClients[ii].queued)
+            continue;
+        if (slot < 0 || schedClients[ii].id == 0
+                || (schedClients[slot].id && schedClients[ii].lastUsed < schedClients[slot].lastUsed))
+            slot = ii;
     }
-    doubleIndirPointer = RAM_memory + DATA_BLOCKS_OFFSET + offset * RAM_BLOCK_SIZE;
-    for (ii = 0 ; ii < 64 ; ii++)
+    if (slot >= 0)
     {
-        /* Get the next offset for the next pointer block */
-        offset = (int) * ( (int *)(doubleIndirPointer + ii * 4) );
-        if (offset == -1)
-        {
-            /* This means there are no more doubly indirect pointers, so set the next to -1 and return */
-            blockArray[counter] = -1;
-            return;
-        }
-        blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + offset * RAM_BLOCK_SIZE;
-        for (jj = 0 ; jj < 64 ; jj++)
-        {
-            /* This is the innermost loop, where the values are not actually data blocks */
-            value = (int) * ( (int *)(blockPointer + jj * 4) );
-            blockArray[counter] = value;
-            if (value == -1)
-                return;
-            counter++;
-        }
+        memset(&schedClients[slot], 0, sizeof(schedClients[slot]));
+        schedClients[slot].id = id;
+        schedClients[slot].weight = SCHED_DEFAULT_WEIGHT;
     }
-    /* If it made it here, then this file has the total max amount of blocks possible! */
+    return slot;
 }
 
 /**
- * Returns the index node of a file stored in a directory
+ * Takes the next request to run by deficit round robin
  *
- * @return  int  the index node index for the desired file, returns -1 if not found or -2 if indexNode is not a directory
- * @param[in]  indexNode  the indexNode to search, must be a valid directory
- * @param[in]  filename  the filename to search for
+ * @return  struct RAM_schedRequest*  the request, NULL if nothing is queued
+ * @remark  Called with the scheduler lock held and the core free.  The client whose
+ *          round it is runs requests while its credit covers them, then the next
+ *          client with requests queued gets its quantum times its weight
  */
-int findFileIndexNodeInDir(int indexNode, char *filename)
+static struct RAM_schedRequest *schedPick(void)
 {
-    /* Some variables */
-    short fileCount;
-    char *directory;
-    char *blockPointer;
-    int counter, ii, jj;
-    int outputNode;
+    struct RAM_schedClient *client;
+    struct RAM_schedRequest *request;
+    int ii;
 
-    /* The index node we want */
-    directory = RAM_memory + INDEX_NODE_ARRAY_OFFSET + (INDEX_NODE_SIZE * indexNode);
-    if ( strcmp(directory + INODE_TYPE, "dir\0") )
+    for (ii = 0; ii < SCHED_CLIENTS && !schedClients[ii].queued; ii++)
+        ;
+    if (ii == SCHED_CLIENTS)
+        return NULL;
+
+    for (;;)
+    {
+        client = &schedClients[schedCursor];
+        request = client->head;
+        if (request && request->cost <= client->deficit)
+        {
+            client->deficit -= request->cost;
+            client->head = request->next;
+            if (!client->head)
+                client->tail = NULL;
+            client->queued--;
+            return request;
+        }
+        /* A client with nothing queued banks no credit */
+        if (!request)
+            client->deficit = 0;
+        schedCursor = (schedCursor + 1) % SCHED_CLIENTS;
+        client = &schedClients[schedCursor];
+        if (client->head)
+            client->deficit += SCHED_QUANTUM * client->weight;
+    }
+}
+
+/**
+ * Lets a request into the core and charges its wait to its client
+ *
+ * @remark  Called with the scheduler lock held
+ */
+static void schedGrant(struct RAM_schedRequest *request)
+{
+    struct RAM_schedClient *client;
+    unsigned long long now, wait;
+
+    now = budgetClock();
+    wait = now - request->queued;
+    client = &schedClients[request->client];
+    client->requests++;
+    client->bytes += request->bytes;
+    client->waitNs += wait;
+    if (wait > client->maxWaitNs)
+        client->maxWaitNs = wait;
+    client->lastUsed = now;
+    schedBusy = 1;
+    request->granted = 1;
+#ifdef DEBUG
+    pthread_cond_broadcast(&schedGranted);
+#else
+    complete(&request->grant);
+#endif
+}
+
+/**
+ * Queues a request, letting it straight in if the core is free
+ *
+ * @return  int  1 if it was let in, 0 if it waits for schedGrant
+ * @param[out]  request  the request, kept until schedLeave
+ * @param[in]  id  the process it comes from
+ * @param[in]  cmd  the command
+ * @param[in]  bytes  bytes it reads or writes
+ */
+static int schedQueue(struct RAM_schedRequest *request, int id, unsigned int cmd, long long bytes)
+{
+    struct RAM_schedClient *client;
+    int slot;
+
+    request->next = NULL;
+    request->cost = schedCost(cmd, bytes);
+    request->bytes = cmd == RAM_READ || cmd == RAM_WRITE ? bytes : 0;
+    request->queued = budgetClock();
+    request->granted = 0;
+#ifndef DEBUG
+    init_completion(&request->grant);
+#endif
+
+    SCHED_LOCK();
+    slot = schedClient(id);
+    if (slot < 0)
+        slot = (unsigned int)id % SCHED_CLIENTS; /* Shares a queue with whoever has it */
+    request->client = slot;
+    client = &schedClients[slot];
+    if (client->tail)
+        client->tail->next = request;
+    else
+        client->head = request;
+    client->tail = request;
+    client->queued++;
+    if (!schedBusy)
+        schedGrant(schedPick());
+    SCHED_UNLOCK();
+    return request->granted;
+}
+
+/**
+ * Waits for a request's turn at the core
+ *
+ * @param[out]  request  the request, passed to schedLeave once it is done
+ * @param[in]  cmd  the command
+ * @param[in]  bytes  bytes it reads or writes
+ */
+static void schedEnter(struct RAM_schedRequest *request, unsigned int cmd, long long bytes)
+{
+    if (schedQueue(request, schedCaller(), cmd, bytes))
+        return;
+#ifdef DEBUG
+    SCHED_LOCK();
+    while (!request->granted)
+        pthread_cond_wait(&schedGranted, &schedMutex);
+    SCHED_UNLOCK();
+#else
+    wait_for_completion(&request->grant);
+#endif
+}
+
+/**
+ * Hands the core to the next request once the current one is done
+ */
+static void schedLeave(void)
+{
+    struct RAM_schedRequest *request;
+
+    SCHED_LOCK();
+    schedBusy = 0;
+    request = schedPick();
+    if (request)
+        schedGrant(request);
+    SCHED_UNLOCK();
+}
+
+/************************ LATENCY HISTOGRAMS *****************************/
+
+/* One command's histograms on one CPU */
+struct RAM_latencyHistogram
+{
+    unsigned int wait[LAT_BUCKETS];     /* Time waiting for the core, its queue and the lock */
+    unsigned int service[LAT_BUCKETS];  /* Time in the core */
+    unsigned long long waitMax, serviceMax;
+};
+
+/* Every command's histograms on one CPU */
+struct RAM_latencyCpu
+{
+    struct RAM_latencyHistogram commands[LAT_COMMANDS];
+};
+
+// @var Histograms of each CPU, NULL until it is allocated */
+static struct RAM_latencyCpu *latencyCpus[LAT_CPUS];
+// @var Name of each command in the report, by _IOC_NR */
+static const char *latencyNames[LAT_COMMANDS] =
+{
+    [_IOC_NR(RAM_CREATE)] = "create",
+    [_IOC_NR(RAM_MKDIR)] = "mkdir",
+    [_IOC_NR(RAM_OPEN)] = "open",
+    [_IOC_NR(RAM_READ)] = "read",
+    [_IOC_NR(RAM_WRITE)] = "write",
+    [_IOC_NR(RAM_LSEEK)] = "lseek",
+    [_IOC_NR(RAM_UNLINK)] = "unlink",
+    [_IOC_NR(RAM_READDIR)] = "readdir",
+    [_IOC_NR(RAM_PUNCH_HOLE)] = "punch_hole",
+    [_IOC_NR(RAM_TRUNCATE)] = "truncate",
+    [_IOC_NR(RAM_FALLOCATE)] = "fallocate",
+    [_IOC_NR(RAM_RECLAIM)] = "reclaim",
+    [_IOC_NR(RAM_FSCK)] = "fsck",
+    [_IOC_NR(RAM_FRAG_SCORE)] = "frag_score",
+    [_IOC_NR(RAM_DEFRAG)] = "defrag",
+    [_IOC_NR(RAM_LOCK_BUDGET)] = "lock_budget",
+    [_IOC_NR(RAM_SCHED_WEIGHT)] = "sched_weight",
+    [_IOC_NR(RAM_SCHED_STATS)] = "sched_stats",
+    [_IOC_NR(RAM_LATENCY)] = "latency",
+};
+
+/**
+ * Returns the histogram bucket of a time
+ *
+ * @return  int  below LAT_SUB_BUCKETS one bucket per nanosecond, then LAT_SUB_BUCKETS
+ *               per power of 2, the last one taking everything past 2^LAT_MAX_SHIFT
+ * @param[in]  ns  the time in nanoseconds
+ */
+static int latencyBucket(unsigned long long ns)
+{
+    int shift;
+
+    if (ns < LAT_SUB_BUCKETS)
+        return (int)ns;
+    if (ns >> LAT_MAX_SHIFT)
+        return LAT_BUCKETS - 1;
+    /* The top LAT_SUB_BITS + 1 bits of the time pick the bucket */
+    shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB_BUCKETS + (int)(ns >> shift) - LAT_SUB_BUCKETS;
+}
+
+/**
+ * Returns the longest time that falls in a bucket, what a percentile landing in it reads
+ */
+static unsigned long long latencyBucketTop(int bucket)
+{
+    int shift;
+
+    if (bucket < LAT_SUB_BUCKETS)
+        return bucket;
+    shift = bucket / LAT_SUB_BUCKETS - 1;
+    return ((unsigned long long)(LAT_SUB_BUCKETS + bucket % LAT_SUB_BUCKETS) << shift)
+           + (1ULL << shift) - 1;
+}
+
+#ifdef DEBUG
+/**
+ * Returns the histograms of the CPU the caller is on, allocating them the first time
+ *
+ * @return  struct RAM_latencyCpu*  the histograms, NULL if out of memory
+ */
+static struct RAM_latencyCpu *latencyHere(void)
+{
+    struct RAM_latencyCpu *fresh;
+    int cpu;
+
+    cpu = sched_getcpu();
+    cpu = cpu < 0 ? 0 : cpu % LAT_CPUS;
+    if (!latencyCpus[cpu])
+    {
+        fresh = (struct RAM_latencyCpu *)calloc(1, sizeof(struct RAM_latencyCpu));
+        if (fresh && !__sync_bool_compare_and_swap(&latencyCpus[cpu], NULL, fresh))
+            free(fresh);
+    }
+    return latencyCpus[cpu];
+}
+
+static void latencyRaise(unsigned long long *max, unsigned long long ns)
+{
+    unsigned long long seen;
+
+    while ((seen = *max) < ns && !__sync_bool_compare_and_swap(max, seen, ns))
+        ;
+}
+#endif
+
+/**
+ * Adds one call of a command to the histograms of the CPU it finished on
+ *
+ * @param[in]  cmd  the command
+ * @param[in]  wait  nanoseconds from its arrival until it had the lock
+ * @param[in]  service  nanoseconds it then held the lock for
+ */
+static void latencyRecord(unsigned int cmd, unsigned long long wait, unsigned long long service)
+{
+    struct RAM_latencyHistogram *histogram;
+    struct RAM_latencyCpu *cpu;
+
+    if (_IOC_NR(cmd) >= LAT_COMMANDS)
+        return;
+#ifdef DEBUG
+    cpu = latencyHere();
+    if (!cpu)
+        return;
+    /* A thread preempted here can share the CPU's histograms with the next one */
+    histogram = &cpu->commands[_IOC_NR(cmd)];
+    __sync_fetch_and_add(&histogram->wait[latencyBucket(wait)], 1);
+    __sync_fetch_and_add(&histogram->service[latencyBucket(service)], 1);
+    latencyRaise(&histogram->waitMax, wait);
+    latencyRaise(&histogram->serviceMax, service);
+#else
+    cpu = latencyCpus[get_cpu()];
+    if (cpu)
+    {
+        histogram = &cpu->commands[_IOC_NR(cmd)];
+        histogram->wait[latencyBucket(wait)]++;
+        histogram->service[latencyBucket(service)]++;
+        if (wait > histogram->waitMax)
+            histogram->waitMax = wait;
+        if (service > histogram->serviceMax)
+            histogram->serviceMax = service;
+    }
+    put_cpu();
+#endif
+}
+
+/**
+ * Returns a percentile of a command's wait or service times, over every CPU
+ *
+ * @return  long long  the percentile in nanoseconds, at most max, 0 with nothing timed
+ * @param[in]  nr  _IOC_NR of the command
+ * @param[in]  service  1 for the time in the core, 0 for the wait
+ * @param[in]  count  calls timed
+ * @param[in]  tenThousandths  the percentile, 9990 for p99.9
+ * @param[in]  max  the longest of those times, which the top of its bucket may be past
+ */
+static long long latencyPercentile(int nr, int service, unsigned long long count, int tenThousandths,
+                                   unsigned long long max)
+{
+    unsigned long long rank, seen, top;
+    int bucket, cpu;
+
+    if (!count)
+        return 0;
+    rank = (count * tenThousandths + 9999) / 10000;
+    seen = 0;
+    for (bucket = 0; bucket < LAT_BUCKETS; bucket++)
+    {
+        for (cpu = 0; cpu < LAT_CPUS; cpu++)
+        {
+            if (latencyCpus[cpu])
+                seen += service ? latencyCpus[cpu]->commands[nr].service[bucket]
+                        : latencyCpus[cpu]->commands[nr].wait[bucket];
+        }
+        if (seen >= rank)
+            break;
+    }
+    top = latencyBucketTop(bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1);
+    return (long long)(top < max ? top : max);
+}
+
+/**
+ * Fills in the call count and percentiles of a command
+ *
+ * @param[in]  nr  _IOC_NR of the command, below LAT_COMMANDS
+ * @param[out]  latency  the count and percentiles
+ */
+static void latencyRead(int nr, struct RAM_latency *latency)
+{
+    struct RAM_latencyHistogram *histogram;
+    unsigned long long count, waitMax, serviceMax;
+    int bucket, cpu;
+
+    count = 0;
+    waitMax = 0;
+    serviceMax = 0;
+    for (cpu = 0; cpu < LAT_CPUS; cpu++)
+    {
+        if (!latencyCpus[cpu])
+            continue;
+        histogram = &latencyCpus[cpu]->commands[nr];
+        for (bucket = 0; bucket < LAT_BUCKETS; bucket++)
+            count += histogram->wait[bucket];
+        if (histogram->waitMax > waitMax)
+            waitMax = histogram->waitMax;
+        if (histogram->serviceMax > serviceMax)
+            serviceMax = histogram->serviceMax;
+    }
+    latency->count = (long long)count;
+    latency->waitMax = (long long)waitMax;
+    latency->serviceMax = (long long)serviceMax;
+    latency->waitP50 = latencyPercentile(nr, 0, count, 5000, waitMax);
+    latency->waitP99 = latencyPercentile(nr, 0, count, 9900, waitMax);
+    latency->waitP999 = latencyPercentile(nr, 0, count, 9990, waitMax);
+    latency->serviceP50 = latencyPercentile(nr, 1, count, 5000, serviceMax);
+    latency->serviceP99 = latencyPercentile(nr, 1, count, 9900, serviceMax);
+    latency->serviceP999 = latencyPercentile(nr, 1, count, 9990, serviceMax);
+}
+
+/**
+ * Empties every command's histograms
+ *
+ * @remark  Calls finishing meanwhile may be kept or lost
+ */
+static void latencyReset(void)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < LAT_CPUS; cpu++)
+    {
+        if (latencyCpus[cpu])
+            memset(latencyCpus[cpu], 0, sizeof(struct RAM_latencyCpu));
+    }
+}
+
+/**
+ * Writes a line of percentiles for every command timed since the last reset
+ *
+ * @return  int  bytes written, not counting the NUL
+ * @param[out]  buffer  the report, what /proc/ramdisk_stats reads
+ * @param[in]  size  bytes buffer holds
+ */
+static int latencyReport(char *buffer, int size)
+{
+    struct RAM_latency latency;
+    int nr, length;
+
+    if (size <= 0)
+        return 0;
+    length = snprintf(buffer, size, "%-12s %10s %10s %10s %10s %10s %10s %10s %10s %10s  (ns)\n",
+                      "command", "calls", "wait_p50", "wait_p99", "wait_p999", "wait_max",
+                      "serv_p50", "serv_p99", "serv_p999", "serv_max");
+    for (nr = 0; nr < LAT_COMMANDS && length < size; nr++)
+    {
+        if (!latencyNames[nr])
+            continue;
+        latencyRead(nr, &latency);
+        if (!latency.count)
+            continue;
+        length += snprintf(buffer + length, size - length,
+                           "%-12s %10lld %10lld %10lld %10lld %10lld %10lld %10lld %10lld %10lld\n",
+                           latencyNames[nr], latency.count, latency.waitP50, latency.waitP99,
+                           latency.waitP999, latency.waitMax, latency.serviceP50,
+                           latency.serviceP99, latency.serviceP999, latency.serviceMax);
+    }
+    return length < size ? length : size - 1;
+}
+
+/************************ INTERNAL HELPER FUNCTIONS **************************/
+
+/**
+ * Goes down one level of a pointer tree
+ *
+ * @return  int*  the slot at index in the pointer block named by slot, NULL if there is no
+ *                pointer block and allocate is 0, or if it could not be allocated
+ * @param[in-out]  slot  the slot naming the pointer block, filled in when one is allocated
+ * @param[in]  index  the slot wanted within the pointer block
+ * @param[in]  allocate  when set, a missing pointer block is allocated
+ */
+static inline int *descendPointerBlock(int *slot, unsigned long index, int allocate)
+{
+    if (*slot < 0)
+    {
+        if (!allocate)
+            return NULL;
+        *slot = newPointerBlock();
+        if (*slot < 0)
+            return NULL;
+    }
+    return (int *)blockAddress(*slot) + index;
+}
+
+/**
+ * Returns the slot holding the block pointer of a logical block of a pointer area laid
+ * out like an index node's, walking only the one path through the indirect blocks that
+ * leads to it
+ *
+ * @return  int*  the slot, NULL if a pointer block on the way is missing and allocate is 0,
+ *                or if it could not be allocated
+ * @param[in]  inodePointer  start of the index node, or of the pointer area mapping the index node table
+ * @param[in]  logicalBlock  the block index within the file
+ * @param[in]  allocate  when set, missing pointer blocks on the way are allocated
+ */
+static int *pointerAreaSlot(char *inodePointer, long logicalBlock, int allocate)
+{
+    unsigned long index;
+    int *slot;
+
+    if (logicalBlock < NUM_DIRECT)
+        return (int *)(inodePointer + DIRECT_1 + logicalBlock * 4);
+
+    /* Find which indirect tree holds the block and its index within that tree, then
+     * go down one level per case.  With a block size fixed at compile time every
+     * limit is a constant and the divisions are shifts */
+    if (logicalBlock < SINGLE_INDIR_LIMIT)
+    {
+        index = logicalBlock - NUM_DIRECT;
+        return descendPointerBlock((int *)(inodePointer + SINGLE_INDIR), index, allocate);
+    }
+    if (logicalBlock < DOUBLE_INDIR_LIMIT)
+    {
+        index = logicalBlock - SINGLE_INDIR_LIMIT;
+        slot = (int *)(inodePointer + DOUBLE_INDIR);
+    }
+    else
+    {
+        if (logicalBlock >= MAX_LOGICAL_BLOCKS)
+            return NULL; /* Past what the triple indirect block reaches */
+        index = logicalBlock - DOUBLE_INDIR_LIMIT;
+        slot = descendPointerBlock((int *)(inodePointer + TRIPLE_INDIR),
+                                   index / ((unsigned long)PTRS_PER_BLOCK * PTRS_PER_BLOCK), allocate);
+        if (slot == NULL)
+            return NULL;
+        index %= (unsigned long)PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    }
+    slot = descendPointerBlock(slot, index / PTRS_PER_BLOCK, allocate);
+    if (slot == NULL)
+        return NULL;
+    return descendPointerBlock(slot, index % PTRS_PER_BLOCK, allocate);
+}
+
+/**
+ * Returns the slot holding the block pointer of a logical block of a file
+ *
+ * @return  int*  the slot, NULL as for pointerAreaSlot
+ * @param[in]  indexNode  the index node of the file
+ * @param[in]  logicalBlock  the block index within the file
+ * @param[in]  allocate  when set, missing pointer blocks on the way are allocated
+ */
+static int *blockPointerSlot(int indexNode, long logicalBlock, int allocate)
+{
+    return pointerAreaSlot(indexNodeAddress(indexNode), logicalBlock, allocate);
+}
+
+/**
+ * Allocates a block of block pointers, all set to -1
+ *
+ * @return  int  the block number, -1 if the filesystem is full
+ */
+int newPointerBlock(void)
+{
+    int ii, block, negOne;
+    char *blockPointer;
+
+    negOne = -1;
+    block = getFreeBlock();
+    if (block < 0)
+        return -1;
+    blockPointer = blockAddress(block);
+    for (ii = 0 ; ii < PTRS_PER_BLOCK ; ii++)
+        memcpy(blockPointer + ii * 4, &negOne, sizeof(int));
+    return block;
+}
+
+/**
+ * Fills the input array with the block numbers of all the allocated blocks for a given index node, valid for both dir and fil
+ *
+ * @return  int  the number of allocated blocks, which is also the index of the -1 terminator
+ * @param[in-out]  blockArray  An int array which will hold the values of allocated blocks.
+ * @param[in]  inodeNum  the inode number to search through
+ * @require blockArray MUST be allocated with MAX_BLOCKS_ALLOCATABLE + 1 entries before being passed into this functino
+ * @remark  Only the entries up to the terminator are written, anything past it is stale.  Reads and
+ *          writes of regular files look up single blocks with blockPointerSlot instead
+ */
+int getAllocatedBlockNumbers(int *blockArray, int inodeNum)
+{
+    int counter, *slot;
+
+    /* Inline and fragment files have no pointers where the pointers would be */
+    if (fileFlags(inodeNum) & INODE_FLAG_SMALL)
+    {
+        blockArray[0] = -1;
+        return 0;
+    }
+
+    for (counter = 0 ; counter < MAX_BLOCKS_ALLOCATABLE ; counter++)
+    {
+        slot = blockPointerSlot(inodeNum, counter, 0);
+        if (slot == NULL || *slot < 0)
+            break;
+        blockArray[counter] = *slot;
+    }
+    /* We need to have at least one -1 as an end condition for the external check */
+    blockArray[counter] = -1;
+    return counter;
+}
+
+/**
+ * Returns the index node of a file stored in a directory
+ *
+ * @return  int  the index node index for the desired file, returns -1 if not found or -2 if indexNode is not a directory
+ * @param[in]  indexNode  the indexNode to search, must be a valid directory
+ * @param[in]  filename  the filename to search for
+ */
+int findFileIndexNodeInDir(int indexNode, char *filename)
+{
+    /* Some variables */
+    int fileCount;
+    char *directory;
+    char *blockPointer;
+    int counter, ii, jj;
+    int outputNode;
+
+    /* The index node we want */
+    directory = indexNodeAddress(indexNode);
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_DIR)
     {
         /* These are not equal, thus the inode is not a directory, fail here */
         return -2;
     }
 
     /* Now, get the file count of this directory for use in iterating through */
-    memcpy(&fileCount, directory + INODE_FILE_COUNT, sizeof(short) );
+    fileCount = directoryFileCount(indexNode);
 
     /* Finally, get the aray of all of the blocks allocated for this index node */
     getAllocatedBlockNumbers(allocatedBlocks, indexNode);
@@ -273,7 +1377,7 @@ int findFileIndexNodeInDir(int indexNode, char *filename)
 
             return -1;
         }
-        blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + allocatedBlocks[ii] * RAM_BLOCK_SIZE;
+        blockPointer = blockAddress(allocatedBlocks[ii]);
         /* Now, look through this block for the filename */
         for (jj = 0 ; jj < (RAM_BLOCK_SIZE / FILE_INFO_SIZE) ; jj++)
         {
@@ -282,7 +1386,7 @@ int findFileIndexNodeInDir(int indexNode, char *filename)
                 return -1; /* Exceeded the file count */
             }
 
-            outputNode = (int) * ( (short *) (blockPointer + INODE_NUM_OFFSET) );
+            outputNode = dirEntryIndexNode(blockPointer);
             if (outputNode == -2)
             {
                 /* This is a deleted file, ignore it and continue */
@@ -387,141 +1491,273 @@ int getIndexNodeNumberFromPathname(char *pathname, int dirFlag)
     return currentIndexNode;
 }
 
+/**
+ * Grows the index node table by one block taken from the data region
+ *
+ * @return  int  0 on success, -1 if the table can not grow or there is no free block
+ * @remark  The table never shrinks, freed index nodes in the grown part are reused
+ */
+static int growIndexNodeTable(void)
+{
+    int total, block, *slot;
+
+    total = superblock()->inodeTotal;
+    if ((long)total + INODES_PER_BLOCK > MAX_INDEX_NODES)
+        return -1;
+
+    slot = pointerAreaSlot(RAM_memory + SB_INODE_MAP_OFFSET, (total - INDEX_NODE_COUNT) / INODES_PER_BLOCK, 1);
+    if (slot == NULL)
+        return -1;
+    block = getFreeBlock(); /* Comes back zeroed, so every index node in it is free */
+    if (block < 0)
+        return -1;
+    *slot = block;
+
+    total += INODES_PER_BLOCK;
+    superblock()->inodeTotal = total;
+    changeIndexNodeCount(INODES_PER_BLOCK);
+    return 0;
+}
+
 /**
  * Get the next free IndexNodeNumber. Also clears up the block pointers.
  *
- * @return  int return index node number of a free index node
+ * @return  int return index node number of a free index node, -1 if the table is full and can not grow
+ * @remark  The scan starts at the free index node hint, and the table grows when every index node is in use
  */
 
 int getNewIndexNodeNumber(void)
 {
-    int ii;
-    char *indexNodeType;
+    int ii, total, hint;
 
-    for (ii = 0; ii < INDEX_NODE_COUNT; ii++)
+    total = superblock()->inodeTotal;
+    hint = superblock()->inodeHint;
+    for (ii = hint; ii < total; ii++)
     {
-
-        indexNodeType = RAM_memory + INDEX_NODE_ARRAY_OFFSET + ii * INDEX_NODE_SIZE + INODE_TYPE;
-        if (!(strlen(indexNodeType) > 1))
-        {
-            /* Clear up this index node before giving it back */
-            negateIndexNodePointers(ii);
-            /* Subtract 1 from the index node count */
-            changeIndexNodeCount(-1);
-            /* Return the index node number */
-            return ii;
-        }
+        if (indexNodeAt(ii)->type == RAM_TYPE_FREE)
+            break;
     }
+    if (ii == total && growIndexNodeTable() < 0)
+        return -1; /* No index node was found, so return this as an error */
+
+    /* Clear up this index node before giving it back */
+    negateIndexNodePointers(ii);
+    /* Subtract 1 from the index node count */
+    changeIndexNodeCount(-1);
+    hint = ii + 1;
+    superblock()->inodeHint = hint;
+    /* Return the index node number */
+    return ii;
+}
+
+/**
+ * Frees a block of block pointers along with everything below it
+ *
+ * @param[in]  block  the pointer block
+ * @param[in]  depth  1 if the pointers name data clusters, more for each level of indirection left
+ * @param[in]  clusterBlocks  blocks per data cluster of the file
+ */
+static void freePointerTree(int block, int depth, int clusterBlocks)
+{
+    int ii, child;
+    char *blockPointer;
 
-    return -1; /* No index node was found, so return this as an error */
+    blockPointer = blockAddress(block);
+    for (ii = 0; ii < PTRS_PER_BLOCK; ii++)
+    {
+        child = (int) * (int *)(blockPointer + ii * 4);
+        if (child < 0)
+            continue;
+        if (depth > 1)
+            freePointerTree(child, depth - 1, clusterBlocks);
+        else
+            freeCluster(child, clusterBlocks);
+    }
+    freeBlock(block);
 }
 
 /**
  * Helper method to clear an index node when a file/dir is removed
  *
  * @return  void
- * @param[indexNodeNumber]  int index node number to clear
+ * @param[in]  indexNodeNumber  int index node number to clear
  */
 void clearIndexNode(int IndexNodeNumber)
 {
 
-    int i, j, blocknumber, blocknumberInner;
+    int i, blocknumber, clusterBlocks, hint;
     char *indexNodeStart;
-    char *singleIndirectBlockStart;
-    char *doubleIndirectBlockStart;
 
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + IndexNodeNumber * INDEX_NODE_SIZE;
+    indexNodeStart = indexNodeAddress(IndexNodeNumber);
+    /* Data pointers of a regular file name whole clusters, pointer blocks stay single blocks */
+    clusterBlocks = 1 << fileSizeClass(IndexNodeNumber);
 
     /****** Free memory used by index node *****/
-    while (1)
+    if (fileFlags(IndexNodeNumber) & INODE_FLAG_SMALL)
+    {
+        releaseSmallData(IndexNodeNumber);
+    }
+    else
     {
-        // Direct memory freeing
         for (i = 0; i < NUM_DIRECT; i++)
         {
-            blocknumber = (int) * (indexNodeStart + DIRECT_1 + i * 4);
-
-            // If we received an unallocated block, we are done freeing memory
-            if (blocknumber <= 0)
-            {
-                break;
-            }
-
-            freeBlock(blocknumber);
+            blocknumber = (int) * (int *)(indexNodeStart + DIRECT_1 + i * 4);
+            if (blocknumber >= 0)
+                freeCluster(blocknumber, clusterBlocks);
         }
 
-        // Single indirect memory freeing
-        blocknumber = (int) * (int *)(indexNodeStart + SINGLE_INDIR);
-        if (blocknumber <= 0)
+        // Single, double and triple indirect trees
+        for (i = 0; i < 3; i++)
         {
-            /* Check if we are done now */
-            break;
+            blocknumber = (int) * (int *)(indexNodeStart + SINGLE_INDIR + i * 4);
+            if (blocknumber >= 0)
+                freePointerTree(blocknumber, i + 1, clusterBlocks);
         }
-        singleIndirectBlockStart =  RAM_memory + DATA_BLOCKS_OFFSET + (blocknumber * RAM_BLOCK_SIZE);
-        freeBlock(blocknumber);
+    }
+    /****** End of Free memory used by index node *****/
 
-        for (i = 0; i < 64; i++)
-        {
-            blocknumber = (int) * (int *)(singleIndirectBlockStart + i * 4);
+    // Clear index node bits
+    for (i = 0; i < INDEX_NODE_SIZE; i++)
+        indexNodeStart[i] = '\0';
 
-            // If we received an unallocated block, we are done freeing memory
-            if (blocknumber == -1)
-            {
-                break;
-            }
+    /* Update the superblock index node count */
+    changeIndexNodeCount(1);
+    hint = superblock()->inodeHint;
+    if (IndexNodeNumber < hint)
+        superblock()->inodeHint = IndexNodeNumber;
+}
 
-            freeBlock(blocknumber);
-        }
+/* Blocks freed by one call of reapDeadIndexNodes, which are merged into runs so
+ * a file laid out contiguously is freed a run at a time */
+struct RAM_reap
+{
+    long long budget;   /* Blocks to free before stopping, -1 for no limit */
+    long long freed;
+    int runStart;       /* Run waiting to be freed, -1 if none */
+    int runLength;
+};
 
-        // Double indirect memory freeing
-        blocknumber = (int) * (int *)(indexNodeStart + DOUBLE_INDIR);
-        if (blocknumber <= 0)
-        {
-            /* Check if we are done now */
-            break;
-        }
-        singleIndirectBlockStart =  RAM_memory + DATA_BLOCKS_OFFSET + (blocknumber * RAM_BLOCK_SIZE);
-        freeBlock(blocknumber);
-
-        for (i = 0; i < 64; i++)
-        {
-            blocknumber = (int) * (int *)(singleIndirectBlockStart + i * 4);
+static void reapBlocks(struct RAM_reap *reap, int first, int count)
+{
+    if (reap->runStart >= 0 && reap->runStart + reap->runLength == first)
+    {
+        reap->runLength += count;
+    }
+    else
+    {
+        if (reap->runStart >= 0)
+            freeRun(reap->runStart, reap->runLength);
+        reap->runStart = first;
+        reap->runLength = count;
+    }
+    reap->freed += count;
+}
 
-            // If we received an unallocated block, we are done freeing memory
-            if (blocknumber <= 0)
-            {
-                break;
-            }
+/**
+ * Frees what is below a block pointer of an unlinked file, as far as the budget allows
+ *
+ * @return  int  1 once everything below it is freed and the pointer cleared, 0 if the budget ran out
+ * @param[in-out]  reap  the blocks freed so far
+ * @param[in-out]  slot  the pointer, set to -1 once it is freed
+ * @param[in]  depth  0 if it names a data cluster, more for each level of indirection
+ * @param[in]  clusterBlocks  blocks per data cluster of the file
+ * @remark  Pointers are cleared as their blocks go, so the next call picks up where this one stopped
+ */
+static int reapPointer(struct RAM_reap *reap, int *slot, int depth, int clusterBlocks)
+{
+    int ii, *pointers;
 
-            doubleIndirectBlockStart = RAM_memory + DATA_BLOCKS_OFFSET + (blocknumber * RAM_BLOCK_SIZE);
+    if (*slot < 0)
+        return 1;
+    if (depth)
+    {
+        pointers = (int *)blockAddress(*slot);
+        for (ii = 0; ii < PTRS_PER_BLOCK; ii++)
+        {
+            if (!reapPointer(reap, pointers + ii, depth - 1, clusterBlocks))
+                return 0;
+        }
+    }
+    if (reap->budget >= 0 && reap->freed >= reap->budget)
+        return 0;
+    reapBlocks(reap, *slot, depth ? 1 : clusterBlocks);
+    *slot = -1;
+    return 1;
+}
 
-            for (j = 0; j < 64; j++)
-            {
-                blocknumberInner = (int) * (int *)(doubleIndirectBlockStart + j * 4);
+/**
+ * Frees the blocks of unlinked files on the dead list, and their index nodes once they are empty
+ *
+ * @return  long long  blocks freed
+ * @param[in]  budget  blocks to free before returning, -1 to empty the list
+ */
+long long reapDeadIndexNodes(long long budget)
+{
+    struct RAM_reap reap;
+    struct RAM_indexNode *node;
+    char *indexNodeStart;
+    int indexNode, clusterBlocks, done, ii;
 
-                if (blocknumberInner <= 0)
-                    break;
+    reap.budget = budget;
+    reap.freed = 0;
+    reap.runStart = -1;
+    reap.runLength = 0;
+    while ((indexNode = superblock()->deadList) != 0)
+    {
+        indexNodeStart = indexNodeAddress(indexNode);
+        node = (struct RAM_indexNode *)indexNodeStart;
+        clusterBlocks = 1 << node->sizeClass;
+        done = 1;
+        for (ii = 0; ii < NUM_DIRECT && done; ii++)
+            done = reapPointer(&reap, (int *)(indexNodeStart + DIRECT_1 + ii * 4), 0, clusterBlocks);
+        // Single, double and triple indirect trees
+        for (ii = 0; ii < 3 && done; ii++)
+            done = reapPointer(&reap, (int *)(indexNodeStart + SINGLE_INDIR + ii * 4), ii + 1, clusterBlocks);
+        if (!done)
+            break;
 
-                freeBlock(blocknumberInner);
-            }
-            freeBlock(blocknumber); 
-        }
-        /* Made it to the end, so we always break */
-        break;
+        superblock()->deadList = (int)node->size;
+        memset(indexNodeStart, 0, INDEX_NODE_SIZE);
+        changeIndexNodeCount(1);
+        if (indexNode < superblock()->inodeHint)
+            superblock()->inodeHint = indexNode;
     }
+    if (reap.runStart >= 0)
+        freeRun(reap.runStart, reap.runLength);
+    return reap.freed;
+}
 
-    /****** End of Free memory used by index node *****/
+/**
+ * Unlinks an index node in constant time, leaving its blocks for the worker to free
+ *
+ * @param[in]  indexNode  the index node, a directory or a file with blocks
+ */
+static void detachIndexNode(int indexNode)
+{
+    struct RAM_indexNode *node;
 
-    // Clear index node bits
-    for (i = 0; i < INDEX_NODE_SIZE; i++)
-        indexNodeStart[i] = '\0';
+    node = indexNodeAt(indexNode);
+    node->type = RAM_TYPE_DEAD;
+    node->size = superblock()->deadList;
+    superblock()->deadList = indexNode;
+}
 
-    /* Update the superblock index node count */
-    changeIndexNodeCount(1);
+/**
+ * Returns the number of free blocks, freeing those of unlinked files first when short
+ *
+ * @return  int  free blocks
+ * @param[in]  wanted  blocks the caller needs
+ */
+static int availableBlocks(long wanted)
+{
+    if (superblock()->freeBlocks < wanted && superblock()->deadList)
+        reapDeadIndexNodes(-1);
+    return superblock()->freeBlocks;
 }
 
 /**
  * Helper function for setting memory region to -1 for easier tracking
- * Set Direct 1-8, single indirect 9 and double indirect 10 byte to -1
+ * Set the direct, single, double and triple indirect pointers to -1
  *
  * @param[in-out]  indexNodeNumber - id of the index number
  */
@@ -530,8 +1766,8 @@ void negateIndexNodePointers(int indexNodeNumber)
     int ii, negate;
     char *indexNodeMemoryRegion;
     negate = -1;
-    indexNodeMemoryRegion = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNodeNumber * INDEX_NODE_SIZE + DIRECT_1;
-    for (ii = 0 ; ii < 10 ; ii++)
+    indexNodeMemoryRegion = indexNodeAddress(indexNodeNumber) + DIRECT_1;
+    for (ii = 0 ; ii < NUM_DIRECT + 3 ; ii++)
     {
         memcpy(indexNodeMemoryRegion + ii * 4, &negate, sizeof(int));
     }
@@ -575,11 +1811,10 @@ int stringContainsChar(char *string, char ourchar)
 int createIndexNode(char *type, char *pathname, int memorysize)
 {
     int indexNodeNumber;
-    int data, existance;
+    int existance;
     int directoryNodeNum, retVal;
     int numberOfBlocksRequired, numBlocksPlusPointers, numBlocksDoubleIndir;
     int blocksAvailable;
-    short shortData;
     char *indexNodeStart, *filename;
 
     // Calculate the actual number of blocks needed for the file
@@ -592,17 +1827,17 @@ int createIndexNode(char *type, char *pathname, int memorysize)
     {
         /* Add an extra block for the singly indirect block */
         numBlocksPlusPointers += 1;
-        if (numberOfBlocksRequired > 72)
+        if (numberOfBlocksRequired > SINGLE_INDIR_LIMIT)
         {
             /* Need extra blocks for the double indirect pointer blocks */
             numBlocksPlusPointers += 1; /* Add one for the pointer block */
-            numBlocksDoubleIndir = numberOfBlocksRequired - 72;
+            numBlocksDoubleIndir = numberOfBlocksRequired - SINGLE_INDIR_LIMIT;
             /* Add the number of blocks necessary for all the double indir necessary */
-            numBlocksPlusPointers += (numBlocksDoubleIndir / 64) + 1;
+            numBlocksPlusPointers += (numBlocksDoubleIndir / PTRS_PER_BLOCK) + 1;
         }
     }
 
-    memcpy(&blocksAvailable, RAM_memory, sizeof(int));
+    blocksAvailable = availableBlocks(numBlocksPlusPointers);
     if (numBlocksPlusPointers > blocksAvailable)
     {
         PRINT("Not enough blocks available!\n");
@@ -634,7 +1869,7 @@ int createIndexNode(char *type, char *pathname, int memorysize)
         return -1;
     }
     allocMemoryForIndexNode(indexNodeNumber, numberOfBlocksRequired);
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNodeNumber * INDEX_NODE_SIZE;
+    indexNodeStart = indexNodeAddress(indexNodeNumber);
 
     // Insert the file into the right directory node
     filename = getFileNameFromPath(pathname);
@@ -652,20 +1887,27 @@ int createIndexNode(char *type, char *pathname, int memorysize)
         {
             PRINT("Error in insert, clearing the index node\n");
             clearIndexNode(indexNodeNumber);
+            return -1;
         }
     }
 
     /* Set the index node values */
     // Set the type
-    strcpy(indexNodeStart + INODE_TYPE, type);
+    indexNodeStart[INODE_TYPE] = strcmp(type, "dir\0") == 0 ? RAM_TYPE_DIR : RAM_TYPE_REG;
     // Set indexNode size
-    data = memorysize;
-    memcpy(indexNodeStart + INODE_SIZE, &data, sizeof(int));
-    // Set the file count, default to 0
-    shortData = 0;
-    memcpy(indexNodeStart + INODE_FILE_COUNT, &shortData , sizeof(short));
+    setFileSize(indexNodeNumber, memorysize);
+    // Size class and flags start at 0
+    indexNodeStart[INODE_SIZE_CLASS] = 0;
+    indexNodeStart[INODE_FLAGS] = 0;
     strcpy(indexNodeStart + INODE_FILE_NAME, filename);
 
+    /* An empty file starts inline, it only takes blocks once it outgrows the index node */
+    if (strcmp(type, "reg\0") == 0 && memorysize == 0)
+    {
+        memset(indexNodeStart + INLINE_DATA_OFFSET, 0, INLINE_DATA_SIZE);
+        indexNodeStart[INODE_FLAGS] = INODE_FLAG_INLINE;
+    }
+
     PRINT("New index node: %d created\n", indexNodeNumber);
 
     return indexNodeNumber;
@@ -673,18 +1915,13 @@ int createIndexNode(char *type, char *pathname, int memorysize)
 
 char *getIndexNodeType(int indexNode)
 {
-    char *indexNodeStart;
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNode * INDEX_NODE_SIZE;
-    if (strcmp("dir\0", indexNodeStart + INODE_TYPE) == 0)
+    switch (indexNodeAt(indexNode)->type)
     {
+    case RAM_TYPE_DIR:
         return "dir\0";
-    }
-    else if (strcmp("reg\0", indexNodeStart + INODE_TYPE) == 0)
-    {
+    case RAM_TYPE_REG:
         return "reg\0";
-    }
-    else
-    {
+    default:
         return "error\0";
     }
 
@@ -697,6 +1934,7 @@ char *getFileNameFromPath(char *pathname)
     int delimPosition, index;
     delim =  '/';
     index = 0;
+    delimPosition = 0; /* Root has no delimiter followed by a name */
     temp = pathname[index];
     while (temp != '\0')
     {
@@ -724,16 +1962,16 @@ int numberOfFilesInMemoryBlock(int memoryBlock)
 {
     char *filename;
     char *memoryblockStart;
-    short inodeNum;
+    int inodeNum;
     int i, numberOfFiles;
     if (memoryBlock == -1)
         return 0;
     numberOfFiles = 0;
-    memoryblockStart = RAM_memory + DATA_BLOCKS_OFFSET + (memoryBlock * RAM_BLOCK_SIZE);
+    memoryblockStart = blockAddress(memoryBlock);
 
     for (i = 0; i < (RAM_BLOCK_SIZE / FILE_INFO_SIZE); i++)
     {
-        inodeNum = (short) * (short *)(memoryblockStart + i * FILE_INFO_SIZE + INODE_NUM_OFFSET);
+        inodeNum = dirEntryIndexNode(memoryblockStart + i * FILE_INFO_SIZE);
         if (inodeNum == -2)
             continue; /* Deleted file, skip it */
 
@@ -757,20 +1995,17 @@ int numberOfFilesInMemoryBlock(int memoryBlock)
 int insertFileIntoDirectoryNode(int directoryNodeNum, int fileNodeNum, char *filename)
 {
 
-    char *indexNodeStart, *dirlistingstart;
-    int i, blocknumber, freeblock, numOfFiles;
-    short inodeNum, fileCount, numFreeBlocks;
-    int dirSize;
+    char *dirlistingstart;
+    int i, freeblock, blockCount;
+    int inodeNum, fileCount;
+    int numFreeBlocks;
 
     freeblock = -1;
-    blocknumber = 0;
-    i = 0;
     PRINT("Inserting file into directory node\n");
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + directoryNodeNum * INDEX_NODE_SIZE;
 
-    // Increment file count
-    fileCount = (short) * (short *)(indexNodeStart + INODE_FILE_COUNT);
-    if (fileCount == 1023)
+    /* A directory is only limited by the blocks its pointers reach */
+    fileCount = directoryFileCount(directoryNodeNum);
+    if ((long)fileCount >= MAX_LOGICAL_BLOCKS * (RAM_BLOCK_SIZE / FILE_INFO_SIZE) || fileCount == 0x7FFFFFFF)
     {
         /* Max file count already reached, can't add in anymore files */
         return -1;
@@ -778,8 +2013,8 @@ int insertFileIntoDirectoryNode(int directoryNodeNum, int fileNodeNum, char *fil
 
     /* Also need to check if the next added file will then require a new block for more storage */
     /* Redundant checks for sanity, since this is checked higher up */
-    numFreeBlocks = (int) * ((int *) (RAM_memory + SUPERBLOCK_OFFSET)) ;
-    if (!(fileCount  % 16))
+    numFreeBlocks = availableBlocks(2);
+    if (!(fileCount  % (RAM_BLOCK_SIZE / FILE_INFO_SIZE)))
     {
         /* On this mod, it means the next addition requires a new block, so check if enough blocks are available */
         if (numFreeBlocks < 1)
@@ -788,8 +2023,8 @@ int insertFileIntoDirectoryNode(int directoryNodeNum, int fileNodeNum, char *fil
             return -1;
         }
 
-        /* Also check for the case at fileCount = 128, at which point a new block is required for both the indirect and data */
-        if (fileCount == 128)
+        /* Also check for the case where the direct blocks are full, at which point a new block is required for both the indirect and data */
+        if (fileCount == NUM_DIRECT * (RAM_BLOCK_SIZE / FILE_INFO_SIZE))
         {
             if (numFreeBlocks < 2)
             {
@@ -799,52 +2034,43 @@ int insertFileIntoDirectoryNode(int directoryNodeNum, int fileNodeNum, char *fil
         }
     }
 
-    /* Good, we can properly add this file */
-    fileCount++;
-    memcpy(indexNodeStart + INODE_FILE_COUNT, &fileCount , sizeof(short));
-    /* Also, increase the file size of the directory */
-    dirSize = (int) * ( (int *)(indexNodeStart + INODE_SIZE) );
-    dirSize += 16;
-    memcpy(indexNodeStart + INODE_SIZE, &dirSize, sizeof(int) );
-
     // Get allocated blocks for directory node
-    getAllocatedBlockNumbers(allocatedBlocks, directoryNodeNum);
+    blockCount = getAllocatedBlockNumbers(allocatedBlocks, directoryNodeNum);
 
-    // Find a block that isn't fully allocated of directories
-    do
+    // Find a block that isn't fully allocated of directories.  New entries go at the end,
+    // so the scan starts from the last block, the one most likely to have room
+    for (i = blockCount - 1; i >= 0; i--)
     {
-        blocknumber = allocatedBlocks[i];
-        if (blocknumber == -1)
+        if (numberOfFilesInMemoryBlock(allocatedBlocks[i]) < (RAM_BLOCK_SIZE / FILE_INFO_SIZE))
         {
-            blocknumber = allocBlockForNode(directoryNodeNum, i);
-            if (blocknumber == -1)
-            {
-                PRINT("Could not get allocatable block in insertFileIntoDirectoryNode\n");
-                return -1;
-            }
+            freeblock = allocatedBlocks[i];
+            break;
         }
-        numOfFiles = numberOfFilesInMemoryBlock(blocknumber);
-        if (numOfFiles < (RAM_BLOCK_SIZE / FILE_INFO_SIZE))
+    }
+    if (freeblock == -1)
+    {
+        freeblock = allocBlockForNode(directoryNodeNum, blockCount);
+        if (freeblock == -1)
         {
-            freeblock = blocknumber;
-            break;
+            PRINT("Could not get allocatable block in insertFileIntoDirectoryNode\n");
+            return -1;
         }
-        i++;
     }
-    while (blocknumber != -1);
 
-    dirlistingstart = RAM_memory + DATA_BLOCKS_OFFSET + (freeblock * RAM_BLOCK_SIZE);
+    dirlistingstart = blockAddress(freeblock);
 
     // Find the next unused directry file index
     for (i = 0; i < (RAM_BLOCK_SIZE / FILE_INFO_SIZE); i++)
     {
-        inodeNum = (short) * (short *) (dirlistingstart + i * FILE_INFO_SIZE + INODE_NUM_OFFSET);
+        inodeNum = dirEntryIndexNode(dirlistingstart + i * FILE_INFO_SIZE);
 
         // We have found a directory block with no blocknumber or a deleted indicator, so its unused
         if (inodeNum <= 0)
         {
             strcpy(dirlistingstart + i * FILE_INFO_SIZE, filename);
-            memcpy(dirlistingstart + i * FILE_INFO_SIZE + INODE_NUM_OFFSET, (short *)&fileNodeNum , sizeof(short));
+            setDirEntryIndexNode(dirlistingstart + i * FILE_INFO_SIZE, fileNodeNum);
+            /* Growing the directory by an entry is what counts the file */
+            setFileSize(directoryNodeNum, getFileSize(directoryNodeNum) + FILE_INFO_SIZE);
             return 0;
         }
     }
@@ -863,17 +2089,17 @@ int readFileName(int indexNodeNum, char *address, int index)
 
     char *indexNodeStart, *dirlistingstart, *filename;
     int i, j, memoryblock, dirIndex, k;
-    short inodeOfFile, numOfFiles;
+    int inodeOfFile, numOfFiles;
     dirIndex = 0;
 
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNodeNum * INDEX_NODE_SIZE;
-    numOfFiles = (short) * (short *)(indexNodeStart + INODE_FILE_COUNT);
+    indexNodeStart = indexNodeAddress(indexNodeNum);
+    numOfFiles = directoryFileCount(indexNodeNum);
 
     // Make sure the file index is not greater than the number of files
     if (index >= numOfFiles)
         index = 0;
 
-    if (strcmp("dir\0",  indexNodeStart + INODE_TYPE) == 0)
+    if (indexNodeAt(indexNodeNum)->type == RAM_TYPE_DIR)
     {
         getAllocatedBlockNumbers(allocatedBlocks, indexNodeNum);
         i = 0;
@@ -884,11 +2110,11 @@ int readFileName(int indexNodeNum, char *address, int index)
         {
 
             memoryblock = allocatedBlocks[i];
-            dirlistingstart = RAM_memory + DATA_BLOCKS_OFFSET + (memoryblock * RAM_BLOCK_SIZE);
+            dirlistingstart = blockAddress(memoryblock);
 
             for (j = 0; j < RAM_BLOCK_SIZE / FILE_INFO_SIZE; j++)
             {
-                indexNodeNum = (short) * (short *)(dirlistingstart + FILE_INFO_SIZE * j + INODE_NUM_OFFSET);
+                indexNodeNum = dirEntryIndexNode(dirlistingstart + FILE_INFO_SIZE * j);
 
                 // If this file is a gap, skip it
                 if (indexNodeNum == -2)
@@ -898,7 +2124,7 @@ int readFileName(int indexNodeNum, char *address, int index)
                 {
                     // Get file name
                     filename = (dirlistingstart + FILE_INFO_SIZE * j);
-                    inodeOfFile = (short)*(short*)(dirlistingstart + FILE_INFO_SIZE * j + INODE_NUM_OFFSET);
+                    inodeOfFile = indexNodeNum;
 
                     // Copy the filename into the specified address
                     if (dirIndex == index)
@@ -916,7 +2142,7 @@ int readFileName(int indexNodeNum, char *address, int index)
                         
                         // Copy inode number of specified address
                         // PRINT("INODE: %d\n", inodeOfFile);
-                        memcpy(&(address[14]), &(inodeOfFile), sizeof(short));
+                        memcpy(&(address[14]), &(inodeOfFile), sizeof(int));
                         return numOfFiles;
                     }
 
@@ -940,106 +2166,77 @@ int readFileName(int indexNodeNum, char *address, int index)
 }
 
 /**
- * Allocate memory for index Node given the number of blocks.  This should be done depending on allocation size
+ * Copies out the first entry of a directory at or after a cursor, looking through
+ * no more of the directory than the lock budget allows
  *
- * @param[in]  indexNodeNumber - reference to the index node
- * @param[in]  numberOfBlocks  - number of blocks to allocate for
+ * @return    int    number of files in the directory, -1 if it is not a directory
+ * @param[in]    indexNode    index node of the directory
+ * @param[out]    address    the entry: 14 bytes of name, then the index node number
+ * @param[in-out]    cursor    entry slot the scan starts at, moved past the entry copied
+ *                             out, or to where the scan stopped
+ * @param[out]    found    1 if an entry was copied, 0 past the last one, 2 if the budget
+ *                         ran out first and the scan goes on from the cursor
+ * @remark  Unlike readFileName, the entries before the cursor are not counted again,
+ *          so reading a whole directory is linear in its size
  */
-void allocMemoryForIndexNode(int indexNodeNumber, int numberOfBlocks)
+int readDirectoryFrom(int indexNode, char *address, long long *cursor, int *found)
 {
+    struct RAM_budget budget;
+    char *entries, *entry;
+    int perBlock, entryNode, *slot;
 
-    char *indexNodeStart;
-    char *singleIndirectBlockStart;
-    char *doubleIndirectBlockStart;
-    int i, j, blockNumber, singleIndirectMemBlock, doubleIndirectMemBlock, noallocationFlag;
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNodeNumber * INDEX_NODE_SIZE;
-    noallocationFlag = -1;
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_DIR || *cursor < 0)
+        return -1;
 
-    // Allocate memory for direct blocks first
-    for (i = 0; i < NUM_DIRECT; i++)
+    perBlock = RAM_BLOCK_SIZE / FILE_INFO_SIZE;
+    budgetStart(&budget);
+    for (;;)
     {
-        if (numberOfBlocks == 0)
+        slot = blockPointerSlot(indexNode, (long)(*cursor / perBlock), 0);
+        if (slot == NULL || *slot < 0)
         {
-            memcpy(indexNodeStart + DIRECT_1 + 4 * i, &noallocationFlag, sizeof(int));
+            *found = 0;
+            return directoryFileCount(indexNode);
         }
-        else
+        entries = blockAddress(*slot);
+        do
         {
-            blockNumber = getFreeBlock();
-            memcpy(indexNodeStart + DIRECT_1 + 4 * i, &blockNumber, sizeof(int));
-
-            numberOfBlocks--;
-        }
-    }
-
-    if (numberOfBlocks == 0)
-    {
-        memcpy(indexNodeStart + SINGLE_INDIR, &noallocationFlag, sizeof(int));
-        memcpy(indexNodeStart + DOUBLE_INDIR, &noallocationFlag, sizeof(int));
-        return;
-    }
-
-    // Allocate memory for single indirect block second
-    singleIndirectMemBlock = getFreeBlock();
-    memcpy(indexNodeStart + SINGLE_INDIR, &singleIndirectMemBlock, sizeof(int));
-    singleIndirectBlockStart =  RAM_memory + DATA_BLOCKS_OFFSET + (singleIndirectMemBlock * RAM_BLOCK_SIZE);
+            entry = entries + (*cursor % perBlock) * FILE_INFO_SIZE;
+            (*cursor)++;
+            entryNode = dirEntryIndexNode(entry);
+            // Never used slots and gaps left by deletes are skipped
+            if (entryNode > 0)
+            {
+                strcpy(address, entry);
+                memcpy(&(address[14]), &entryNode, sizeof(int));
+                *found = 1;
+                return directoryFileCount(indexNode);
+            }
+        } while (*cursor % perBlock);
 
-    // Each data block hold 64 pointers to further memory blocks
-    for (i = 0; i < 64; i++)
-    {
-        if (numberOfBlocks == 0)
+        if (budgetCharge(&budget, 1))
         {
-            memcpy(singleIndirectBlockStart + 4 * i, &noallocationFlag, sizeof(int));
+            *found = 2;
+            return directoryFileCount(indexNode);
         }
-        else
-        {
-            blockNumber = getFreeBlock();
-            memcpy(singleIndirectBlockStart + 4 * i, &blockNumber, sizeof(int));
-
-            numberOfBlocks--;
-        }
-
-    }
-
-    if (numberOfBlocks == 0)
-    {
-        return;
     }
+}
 
-    // Allocate memory for double indirect block third
-    doubleIndirectMemBlock = getFreeBlock();
-    memcpy(indexNodeStart + DOUBLE_INDIR, &doubleIndirectMemBlock, sizeof(int));
-    doubleIndirectBlockStart = RAM_memory + DATA_BLOCKS_OFFSET + (doubleIndirectMemBlock * RAM_BLOCK_SIZE);
+/**
+ * Allocate memory for index Node given the number of blocks.  This should be done depending on allocation size
+ *
+ * @param[in]  indexNodeNumber - reference to the index node
+ * @param[in]  numberOfBlocks  - number of blocks to allocate for
+ */
+void allocMemoryForIndexNode(int indexNodeNumber, int numberOfBlocks)
+{
+    int i;
 
-    // For each data block, we will allocate another data block of 64 pointers
-    for (i = 0; i < 64; i++)
+    negateIndexNodePointers(indexNodeNumber);
+    for (i = 0; i < numberOfBlocks; i++)
     {
-        if (numberOfBlocks == 0)
-        {
-            memcpy(doubleIndirectBlockStart + 4 * i, &noallocationFlag, sizeof(int));
-        }
-        else
-        {
-            singleIndirectMemBlock = getFreeBlock();
-            singleIndirectBlockStart =  RAM_memory + DATA_BLOCKS_OFFSET + (singleIndirectMemBlock * RAM_BLOCK_SIZE);
-            memcpy(doubleIndirectBlockStart + 4 * i, &singleIndirectMemBlock, sizeof(int));
-
-            // Each data block hold 64 pointers to further memory blocks
-            for (j = 0; j < 64; j++)
-            {
-                if (numberOfBlocks == 0)
-                {
-                    memcpy(singleIndirectBlockStart + 4 * j, &noallocationFlag, sizeof(int));
-                }
-                else
-                {
-                    blockNumber = getFreeBlock();
-                    memcpy(singleIndirectBlockStart + 4 * j, &blockNumber, sizeof(int));
-
-                    numberOfBlocks--;
-                }
-
-            }
-        }
+        if (allocBlockForNode(indexNodeNumber, i) < 0)
+            break;
     }
 }
 
@@ -1056,16 +2253,12 @@ int deleteFile(char *pathname)
     /* Declare all of the vars */
     int indexNode;
     int parentIndexNode;
-    short fileCount;
     int offset;
-    int ii, jj, fileDeleted, counter, inodeSize;
-    char *type;
+    int ii, jj, fileDeleted, counter;
     char *filePointer;
-    char *parentPointer;
     char *blockPointer;
     char *filename;
-    short neg2, deleteCheck;
-    neg2 = -2;
+    int deleteCheck, detached;
 
     if (strcmp(pathname, "/") == 0)
     {
@@ -1092,14 +2285,11 @@ int deleteFile(char *pathname)
     }
 
     /* Now, check if the file is a dir itself */
-    filePointer = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNode * INDEX_NODE_SIZE;
-    parentPointer = RAM_memory + INDEX_NODE_ARRAY_OFFSET + parentIndexNode * INDEX_NODE_SIZE;
+    filePointer = indexNodeAddress(indexNode);
 
-    type = filePointer + INODE_TYPE;
-    if (strcmp(type, "dir\0") == 0)
+    if (indexNodeAt(indexNode)->type == RAM_TYPE_DIR)
     {
-        fileCount = (short) * ( (short *) (filePointer + INODE_FILE_COUNT) );
-        if (fileCount)
+        if (directoryFileCount(indexNode))
         {
             /* Non zero number of files, can not delete */
             PRINT("Directory not empty\n");
@@ -1107,12 +2297,16 @@ int deleteFile(char *pathname)
         }
     }
 
-    /* At this point, we should be able to delete this file, no problem, so we can clear it */
-    clearIndexNode(indexNode);
+    /* At this point, we should be able to delete this file, no problem, so we can clear it.
+     * With a worker running, a file with blocks is only detached and freed later */
+    detached = deferredFreeing && !(fileFlags(indexNode) & INODE_FLAG_SMALL);
+    if (detached)
+        detachIndexNode(indexNode);
+    else
+        clearIndexNode(indexNode);
     
     /* Now we need to delete this file from the parent, not optimizing right now, so we just delete the file */
     getAllocatedBlockNumbers(allocatedBlocks, parentIndexNode);
-    fileCount = (short) * ( (short *) (parentPointer + INODE_FILE_COUNT) );
     filename = getFileNameFromPath(pathname);
     ii = 0;
     counter = 0;
@@ -1128,17 +2322,17 @@ int deleteFile(char *pathname)
             return -1;
         }
 
-        blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + offset * RAM_BLOCK_SIZE;
+        blockPointer = blockAddress(offset);
         for (jj = 0 ; jj < (RAM_BLOCK_SIZE / FILE_INFO_SIZE) ; jj++)
         {
             /* Only perform these checks if the current file is not deleted */
-            deleteCheck = (short) *( (short *) (blockPointer + FILE_INFO_SIZE *jj + INODE_NUM_OFFSET));
+            deleteCheck = dirEntryIndexNode(blockPointer + FILE_INFO_SIZE * jj);
             if (deleteCheck != -2)
             {
                 if (strcmp(filename, blockPointer + FILE_INFO_SIZE * jj) == 0)
                 {
                     /* Found the file, set the inode value to -2 to indicate that it has been deleted */
-                    memcpy(blockPointer + FILE_INFO_SIZE * jj + INODE_NUM_OFFSET, &neg2, sizeof(short) );
+                    setDirEntryIndexNode(blockPointer + FILE_INFO_SIZE * jj, -2);
                     fileDeleted = 1;
                 }
             }
@@ -1146,13 +2340,11 @@ int deleteFile(char *pathname)
         ii++;
     }
 
-    /* The file has been successfully deleted, decrement the fileCount of the parent */
-    fileCount--;
-    memcpy(parentPointer + INODE_FILE_COUNT, &fileCount, sizeof(short) );
-    /* Also decrement the size of the parent (it may have blocks allocated, but size is the file_info size) */
-    inodeSize = (int) *( (int *) (parentPointer + INODE_SIZE) );
-    inodeSize -= 16;
-    memcpy(parentPointer + INODE_SIZE, &inodeSize, sizeof(int));
+    /* The file has been successfully deleted, shrinking the parent by an entry uncounts it
+     * (it may have blocks allocated, but size is the file_info size) */
+    setFileSize(parentIndexNode, getFileSize(parentIndexNode) - FILE_INFO_SIZE);
+    if (detached)
+        wakeReaper();
     PRINT("Successful file deletion\n");
     return 0; /* successful deletion */
 }
@@ -1161,369 +2353,470 @@ int deleteFile(char *pathname)
 * Writes to designated file marked by index node.
 * Fails if file is a directory
 *
-* @return    int    actual number of bytes written
+* @return    long long    actual number of bytes written, -1 if the index node is not a regular file
 * @param[in]    indexNode    index node of the file to write to
 * @param[in]    data    a char * pointer to the userspace memory that needs to be written
 * @param[in]    size    the number of bytes to write into the indexNode
 * @param[in]    offset    the offset into the file to start writing at (offset of 0 is the beginning of the file)
+* @remark  Writing past the end of the file leaves a hole, the skipped blocks are not allocated
 */
-int writeToFile(int indexNode, char *data, int size, int offset)
-{   
+long long writeToFile(int indexNode, char *data, long long size, long long offset)
+{
     /* Declare all of the vars */
-    char *indexNodePointer, *blockPointer;
-    int ii, jj, dataCounter;
-    int currentSize, diff;
-    int currentBlock, nextSize;
-    int startingBlock, startingOffset;
-
-    /* Access the pointer for size information */
-    indexNodePointer = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNode * INDEX_NODE_SIZE;
-    currentSize = (int) * ( (int *)(indexNodePointer + INODE_SIZE) );
-    diff = currentSize - offset;
-
-    /* Get the allocated blocks currently available*/
-    getAllocatedBlockNumbers(allocatedBlocks, indexNode);
+    long long currentSize, written, position, nextSize, end;
+    long logicalBlock;
+    int clusterSize, clusterOffset, length;
+    int *slot;
 
-    /* Get the starting block and offset for writing */
-    startingBlock = offset / RAM_BLOCK_SIZE;
-    startingOffset = offset % RAM_BLOCK_SIZE;
+    /* A file another process unlinked keeps the dead list link in its size */
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_REG)
+    {
+        PRINT("Error, cannot write bytes to a directory or an unlinked file\n");
+        return -1;
+    }
+    currentSize = getFileSize(indexNode);
 
-    /* Now, loop through allocated blocks, adding blocks as necessary to expand the file, and always writing */
-    dataCounter = 0;
-    for (ii = startingBlock; ; ii++)
+    if (fileFlags(indexNode) & INODE_FLAG_SMALL)
     {
-        if (ii >= MAX_BLOCKS_ALLOCATABLE)
-        {
-            /* Trying to access a block past the max available, therefore, we break out now */
-            nextSize = (dataCounter - diff + currentSize) > currentSize ? (dataCounter - diff + currentSize) : currentSize;
-            memcpy(indexNodePointer + INODE_SIZE, &nextSize, sizeof(int));
-            return dataCounter;
-        }
-        currentBlock = allocatedBlocks[ii];
-        if (currentBlock == -1)
+        /* Tiny files live in the index node and small ones in a shared fragment,
+         * a fragment grows with some room to spare so appends do not move it every time */
+        end = offset + size;
+        if (end > smallFileCapacity(indexNode) && end <= FRAGMENT_MAX_SIZE)
+            moveToFragment(indexNode, (int)(end < 2 * currentSize && 2 * currentSize <= FRAGMENT_MAX_SIZE ? 2 * currentSize : end));
+        if (end <= smallFileCapacity(indexNode))
         {
-            /* Need to allocate a new block for this file */
-            currentBlock = allocBlockForNode(indexNode, ii);
-            if (currentBlock == -1)
-            {
-                /* could not allocate a new block, return the amount of data actually written */
-                nextSize = (dataCounter - diff + currentSize) > currentSize ? (dataCounter - diff + currentSize) : currentSize;
-                memcpy(indexNodePointer + INODE_SIZE, &nextSize, sizeof(int));
-                return dataCounter;
-            }
+            memcpy(smallFileData(indexNode) + offset, data, size);
+            if (end > currentSize)
+                setFileSize(indexNode, end);
+            return size;
         }
+        if (moveSmallDataToBlocks(indexNode) < 0)
+            return 0;
+    }
 
-        blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + currentBlock * RAM_BLOCK_SIZE;
-        if (ii == startingBlock)
-        {
-            /* Start writing from the offset */
-            for (jj = startingOffset ; jj < RAM_BLOCK_SIZE ; jj++)
-            {
-                if (dataCounter == size)
-                {
-                    /* Finished writing all the data, we are done */
-                    nextSize = (size - diff + currentSize) > currentSize ? (size - diff + currentSize) : currentSize;
-                    memcpy(indexNodePointer + INODE_SIZE, &nextSize, sizeof(int));
-                    return size;
-                }
-
-                // blockPointer[jj] = data[dataCounter];
-                memcpy(blockPointer + jj, &(data[dataCounter]), sizeof(char));
-                dataCounter++;
-            }
-        }
-        else
-        {
-            for (jj = 0 ; jj < RAM_BLOCK_SIZE ; jj++)
-            {
-                if (dataCounter == size)
-                {
-                    /* Finished writing all the data, we are done */
-                    nextSize = (size - diff + currentSize) > currentSize ? (size - diff + currentSize) : currentSize;
-                    memcpy(indexNodePointer + INODE_SIZE, &nextSize, sizeof(int));
-                    return size;
-                }
-                // blockPointer[jj] = data[dataCounter];
-                memcpy(blockPointer + jj, &(data[dataCounter]), sizeof(char));
+    /* A small file about to outgrow its direct blocks moves to large clusters
+     * while it still only has a few blocks to copy */
+    if (fileSizeClass(indexNode) == 0 && currentSize <= NUM_DIRECT * RAM_BLOCK_SIZE
+            && offset + size > NUM_DIRECT * RAM_BLOCK_SIZE)
+        setFileSizeClass(indexNode, largeSizeClass());
+    clusterSize = RAM_BLOCK_SIZE << fileSizeClass(indexNode);
 
-                dataCounter++;
-            }
-        }
+    /* Copy a cluster at a time, looking up only the clusters the write touches */
+    written = 0;
+    while (written < size)
+    {
+        position = offset + written;
+        logicalBlock = (long)(position / clusterSize);
+        if (logicalBlock >= MAX_LOGICAL_BLOCKS)
+            break; /* Trying to access a block past what the pointers reach */
 
-        if (dataCounter == size)
+        slot = blockPointerSlot(indexNode, logicalBlock, 0);
+        if (slot == NULL || *slot < 0)
         {
-            /* Finished writing all the data, we are done */
-            nextSize = (size - diff + currentSize) > currentSize ? (size - diff + currentSize) : currentSize;
-            memcpy(indexNodePointer + INODE_SIZE, &nextSize, sizeof(int));
-            return size;
+            /* Need to allocate a new block for this file */
+            if (allocBlockForNode(indexNode, logicalBlock) < 0)
+                break; /* could not allocate a new block, return the amount of data actually written */
+            slot = blockPointerSlot(indexNode, logicalBlock, 0);
         }
-    }
 
-    if (dataCounter > size)
-    {
-        PRINT("Error in loop, adding more data than intended\n");
+        clusterOffset = (int)(position % clusterSize);
+        length = clusterSize - clusterOffset;
+        if (length > size - written)
+            length = (int)(size - written);
+        memcpy(blockAddress(*slot) + clusterOffset, data + written, length);
+        written += length;
     }
-    return size;
+
+    nextSize = offset + written > currentSize ? offset + written : currentSize;
+    setFileSize(indexNode, nextSize);
+    return written;
 }
 
 /**
  * Read specify number of bytes to destinated location
  * Fails if file is a directory. Assumes that data has size+1 elements in order to place a null
  *
- * @return    int    1=success -1=fail
+ * @return    long long    number of bytes read, -1 on failure
  * @param[in]    indexNode    index node of the file to read from
  * @param[in]    data    a char * pointer to the userspace memory that needs to be read to
  * @param[in]    size    the number of bytes to read into the indexNode
  * @param[in]    offset    the offset into the file to start reading at
+ * @remark  Parts of the file that were never written read as zeros
  */
-int readFromFile(int indexNode, char *data, int size, int offset)
+long long readFromFile(int indexNode, char *data, long long size, long long offset)
 {
     /* Declare all of the vars */
-    char *indexNodePointer;
-    char null;
-    int i, currentBlock, currentPosition, bytesRead, fileSize, absolutePosition;
-
-    null = '\0';
+    long long fileSize, bytesRead, position;
+    int clusterSize, clusterOffset, length;
+    int *slot;
 
     // Make sure the indexNode is a file
-    if (strcmp("dir\0", getIndexNodeType(indexNode)) == 0 || strcmp("error\0", getIndexNodeType(indexNode)) == 0)
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_REG)
     {
         PRINT("Error, cannot read bytes from directory\n");
         return -1;
     }
-    currentBlock = offset / RAM_BLOCK_SIZE;
-    currentPosition = offset % RAM_BLOCK_SIZE;
-    absolutePosition = currentPosition;
-    bytesRead = 0;
+    fileSize = getFileSize(indexNode);
 
-    fileSize = (int)*(int*) (RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNode * INDEX_NODE_SIZE + INODE_SIZE);
-
-    // Get allocated blocks for directory node
-    getAllocatedBlockNumbers(allocatedBlocks, indexNode);
-    indexNodePointer = RAM_memory + DATA_BLOCKS_OFFSET + allocatedBlocks[currentBlock] * RAM_BLOCK_SIZE + currentPosition;
+    /* Reading at or past the end of the file returns nothing, so callers can rely on the count */
+    if (offset >= fileSize || size <= 0)
+    {
+        data[0] = '\0';
+        return 0;
+    }
+    // Make sure we dont read more bytes then the file size
+    if (size > fileSize - offset)
+        size = fileSize - offset;
 
-    PRINT("block[currentBlock] = %d\n", allocatedBlocks[currentBlock]);
+    if (fileFlags(indexNode) & INODE_FLAG_SMALL)
+    {
+        memcpy(data, smallFileData(indexNode) + offset, size);
+        data[size] = '\0';
+        return size;
+    }
 
-    // Copy 'size' bytes into data
-    for (i = 0; i < size; i++)
+    clusterSize = RAM_BLOCK_SIZE << fileSizeClass(indexNode);
+    for (bytesRead = 0; bytesRead < size; bytesRead += length)
     {
+        position = offset + bytesRead;
+        clusterOffset = (int)(position % clusterSize);
+        length = clusterSize - clusterOffset;
+        if (length > size - bytesRead)
+            length = (int)(size - bytesRead);
+
+        slot = blockPointerSlot(indexNode, (long)(position / clusterSize), 0);
+        if (slot == NULL || *slot < 0)
+            memset(data + bytesRead, 0, length);
+        else
+            memcpy(data + bytesRead, blockAddress(*slot) + clusterOffset, length);
+    }
 
-        memcpy(&(data[i]), &(indexNodePointer[0]), sizeof(char));
-        // memcpy(data, &a, sizeof(char));
+    // Place a null character in the proper position
+    data[bytesRead] = '\0';
+    return bytesRead;
+}
 
-        currentPosition++;
-        absolutePosition++;
-        bytesRead++;
 
-        // Make sure we dont read more bytes then the file size
-        if (absolutePosition>fileSize) {
-            /* Place a null character in the proper position */
-            memcpy(&(data[bytesRead]), &null, sizeof(char));
-            return bytesRead;
-        }
+/**
+ * Frees the data clusters of a range of logical blocks below one pointer slot, and the
+ * pointer blocks the range leaves empty
+ *
+ * @param[in-out]  slot  the pointer slot, set to -1 once nothing is left below it
+ * @param[in]  depth  0 if the slot names a data cluster, otherwise the levels of pointer blocks below it
+ * @param[in]  first  first logical block of the range, relative to the slot
+ * @param[in]  last  last logical block of the range, relative to the slot
+ * @param[in]  clusterBlocks  blocks per data cluster of the file
+ */
+static void punchPointerTree(int *slot, int depth, long first, long last, int clusterBlocks)
+{
+    long span, childFirst, childLast;
+    int ii, *pointers;
 
-        if (currentPosition == 256)
-        {
-            currentPosition = 0;
-            currentBlock++;
-        }
+    if (*slot < 0)
+        return;
+    if (depth == 0)
+    {
+        freeCluster(*slot, clusterBlocks);
+        *slot = -1;
+        return;
+    }
+
+    /* Logical blocks below each pointer of this block */
+    for (span = 1, ii = 1; ii < depth; ii++)
+        span *= PTRS_PER_BLOCK;
 
-        indexNodePointer = RAM_memory + DATA_BLOCKS_OFFSET + allocatedBlocks[currentBlock] * RAM_BLOCK_SIZE + currentPosition;
+    pointers = (int *)blockAddress(*slot);
+    for (ii = (int)(first / span); ii <= last / span; ii++)
+    {
+        childFirst = first > ii * span ? first - ii * span : 0;
+        childLast = last < (ii + 1) * span - 1 ? last - ii * span : span - 1;
+        punchPointerTree(&pointers[ii], depth - 1, childFirst, childLast, clusterBlocks);
     }
 
-    // If we have reached this point, we have read enough bytes, place null and return
-    memcpy(&(data[bytesRead]), &null, sizeof(char));
-    return bytesRead;
+    for (ii = 0; ii < PTRS_PER_BLOCK; ii++)
+    {
+        if (pointers[ii] >= 0)
+            return;
+    }
+    freeBlock(*slot);
+    *slot = -1;
 }
 
+/**
+ * Zeroes part of one cluster of a file, if the cluster is allocated
+ *
+ * @param[in]  indexNode  index node of the file
+ * @param[in]  from  first byte to zero
+ * @param[in]  to  byte past the last one to zero, in the same cluster as from
+ * @param[in]  clusterSize  bytes per cluster of the file
+ * @remark  A whole cluster is left alone, punchHole frees those
+ */
+static void zeroPartialCluster(int indexNode, long long from, long long to, int clusterSize)
+{
+    int *slot;
 
-int getFileSize(int indexNode) {
-    char *indexNodeStart;
-    int fileSize;
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNode * INDEX_NODE_SIZE;
-    fileSize = (int)*(int*)(indexNodeStart+INODE_SIZE);
-    return fileSize;
+    if (to <= from || to - from == clusterSize)
+        return;
+    slot = blockPointerSlot(indexNode, (long)(from / clusterSize), 0);
+    if (slot != NULL && *slot >= 0)
+        memset(blockAddress(*slot) + from % clusterSize, 0, to - from);
 }
 
-/************************ MEMORY MANAGEMENT *****************************/
-
 /**
- * Function that allocates a new data block for a given index node
+ * Punches a hole in a file, freeing the clusters that lie wholly inside the range and
+ * zeroing the parts of clusters at its ends.  The file keeps its size
  *
- * @return    int    -1 if there is no more room available in the filesystem, the new block number otherwise
- * @param[in]    indexNode    the indexNode to expand
- * @param[in]    current   the current number of index nodes allocated
+ * @return    int    0 on success, -1 if the index node is not a regular file
+ * @param[in]    indexNode    index node of the file
+ * @param[in]    offset    first byte of the hole
+ * @param[in]    length    bytes in the hole, the range may run past the end of the file
  */
-int allocBlockForNode(int indexNode, int currentSize)
+int punchHole(int indexNode, long long offset, long long length)
 {
-    int numAvailableBlocks;
-    int inodePointer, doubleOffset, singleOffset;
-    int newSingle, newDouble, newBlock;
-    int ii, negOne;
-    char *nodePointer;
-    char *blockPointer;
-    char *singleIndirPointer;
-    char *doubleIndirPointer;
+    static const int treeSlots[3] = { SINGLE_INDIR, DOUBLE_INDIR, TRIPLE_INDIR };
+    char *indexNodeStart;
+    long long end, headEnd;
+    long first, last, base, span;
+    int clusterSize, clusterBlocks, ii;
 
-    /* First, find out the next indexNode which needs to be allocated */
-    negOne = -1;
-    nodePointer = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNode * INDEX_NODE_SIZE;
-    numAvailableBlocks = (int) * ( (int *)(RAM_memory + SUPERBLOCK_OFFSET) );
-    if (numAvailableBlocks == 0)
-    {
-        PRINT("Out of memory, can not write\n");
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_REG || offset < 0 || length < 0)
         return -1;
-    }
+    end = offset + length;
 
-    /* Since currentSize is simply the number of blocks we can use this to figure out where the next free pointer is */
-    /* Essentially, loopless block allocation, much quicker than looping through to find the next open slot */
-    if (currentSize < 8)
+    if (fileFlags(indexNode) & INODE_FLAG_SMALL)
     {
-        /* Example: 0 allocated, the free inode pointer is DIRECT_1 at offset 0*/
-        PRINT("Allocating a new direct block for indexNode %d\n", indexNode);
-        if ( ((int) * ((int *)(nodePointer + DIRECT_1 + currentSize * 4))) != -1)
-        {
-            PRINT("Mem corruption, block pointers are inconsistent\n");
-            return -1;
-        }
-        newBlock = getFreeBlock();
-        /* Current is num allocated blocks, so the next allocatable block is at index currentSize */
-        memcpy(nodePointer + DIRECT_1 + currentSize * 4, &newBlock, sizeof(int));
-        return newBlock;
+        if (end > smallFileCapacity(indexNode))
+            end = smallFileCapacity(indexNode);
+        if (offset < end)
+            memset(smallFileData(indexNode) + offset, 0, end - offset);
+        return 0;
     }
-    else if (currentSize < 72)
+
+    /* Zero the parts of the clusters at either end that the range only partly covers */
+    clusterBlocks = 1 << fileSizeClass(indexNode);
+    clusterSize = RAM_BLOCK_SIZE * clusterBlocks;
+    headEnd = (offset / clusterSize + 1) * clusterSize;
+    zeroPartialCluster(indexNode, offset, end < headEnd ? end : headEnd, clusterSize);
+    if (end > headEnd)
+        zeroPartialCluster(indexNode, end - end % clusterSize, end, clusterSize);
+
+    /* Free the whole clusters, walking only the subtrees the range touches */
+    first = (long)((offset + clusterSize - 1) / clusterSize);
+    last = (long)(end / clusterSize) - 1;
+    if (last >= MAX_LOGICAL_BLOCKS)
+        last = MAX_LOGICAL_BLOCKS - 1;
+    if (first > last)
+        return 0;
+
+    indexNodeStart = indexNodeAddress(indexNode);
+    for (ii = (int)first; ii < NUM_DIRECT && ii <= last; ii++)
+        punchPointerTree((int *)(indexNodeStart + DIRECT_1 + ii * 4), 0, 0, 0, clusterBlocks);
+
+    base = NUM_DIRECT;
+    span = PTRS_PER_BLOCK;
+    for (ii = 0; ii < 3 && base <= last; ii++)
     {
-        /* This is in singly indirect territory */
-        if (currentSize == 8)
-        {
-            /** @todo Special Case where we have to allocated an indirect block as well (must num available blocks in order
-              *  to not leak a block by accident)
-              */
-            PRINT("Allocating a new single indirect block for indexNode %d\n", indexNode);
-            if (numAvailableBlocks < 2)
-            {
-                PRINT("Out of memory, no room to allocate both a single indirect and data block\n");
-                return -1; /* Not enough blocks available to allocate a new indirect and data block */
-            }
-            if ( ((int) * ((int *)(nodePointer + SINGLE_INDIR))) != -1)
-            {
-                PRINT("Mem corruption, block pointers are inconsistent\n");
-                return -1;
-            }
+        if (first < base + span)
+            punchPointerTree((int *)(indexNodeStart + treeSlots[ii]), ii + 1,
+                             first > base ? first - base : 0, last < base + span - 1 ? last - base : span - 1,
+                             clusterBlocks);
+        base += span;
+        span *= PTRS_PER_BLOCK;
+    }
+    return 0;
+}
+
+/**
+ * Sets the size of a file, freeing everything past a shorter size
+ *
+ * @return    int    0 on success, -1 if the index node is not a regular file or there is no room
+ * @param[in]    indexNode    index node of the file
+ * @param[in]    length    the new size in bytes
+ * @remark  Growing leaves a hole.  A file truncated to 0 goes back to keeping its data inline
+ */
+int truncateFile(int indexNode, long long length)
+{
+    char *indexNodeStart;
+    long long fileSize;
 
-            newSingle = getFreeBlock();
-            newBlock = getFreeBlock();
-            memcpy(nodePointer + SINGLE_INDIR, &newSingle, sizeof(int));
-            blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + newSingle * RAM_BLOCK_SIZE;
-            /* First clear this block to all -1, since these are all block pointers */
-            for (ii = 0 ; ii < 64 ; ii++)
-                memcpy( blockPointer + ii * 4, &negOne, sizeof(int) );
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_REG || length < 0)
+        return -1;
+    fileSize = getFileSize(indexNode);
 
-            /* The block is ready for pointing! */
-            memcpy(blockPointer, &newBlock, sizeof(int) );
-            return newBlock;
-        }
-        else
+    if (fileFlags(indexNode) & INODE_FLAG_SMALL)
+    {
+        /* Keep everything past the size zeroed, later growth reads it back */
+        if (length < fileSize)
+            memset(smallFileData(indexNode) + length, 0, fileSize - length);
+        else if (length > smallFileCapacity(indexNode))
         {
-            /* Find out which pointer in the indirect block to give it to */
-            inodePointer = currentSize - 8;
-            blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + ( (int) * ( (int *)(nodePointer + SINGLE_INDIR) ) ) * RAM_BLOCK_SIZE;
-            if ( ((int) * ((int *)(blockPointer + inodePointer * 4))) != -1)
-            {
-                PRINT("Mem corruption, block pointers are inconsistent\n");
+            if (length <= FRAGMENT_MAX_SIZE ? moveToFragment(indexNode, (int)length) : moveSmallDataToBlocks(indexNode))
                 return -1;
-            }
-            newSingle = getFreeBlock();
-            memcpy( blockPointer + inodePointer * 4, &newSingle, sizeof(int) );
-            return newSingle;
         }
+        setFileSize(indexNode, length);
+        return 0;
     }
-    else if (currentSize < 4168)
-    {
-        /* Doubly indirect situation, requires a special case on mod 64, to ensure a new block is allocated */
-        inodePointer = currentSize - 72;
-        if (currentSize == 72)
-        {
-            /* First special case, need to allocate the double pointer, and the first single indirect within it */
-            PRINT("Allocating the first doubly indirect block for indexNode %d\n", indexNode);
-            if (numAvailableBlocks < 3)
-            {
-                /* Not enough blocks available */
-                PRINT("Out of memory, no room to allocate the necessary single, double, and direct blocks\n");
-                return -1;
-            }
-            if ( ((int) * ((int *)(nodePointer + DOUBLE_INDIR))) != -1)
-            {
-                PRINT("Mem corruption, block pointers are inconsistent\n");
-                return -1;
-            }
-            newDouble = getFreeBlock();
-            doubleIndirPointer = RAM_memory + DATA_BLOCKS_OFFSET + newDouble * RAM_BLOCK_SIZE;
-            for (ii = 0 ; ii < 64 ; ii++)
-                memcpy(doubleIndirPointer + ii * 4, &negOne, sizeof(int) );
 
-            newSingle = getFreeBlock();
-            singleIndirPointer = RAM_memory + DATA_BLOCKS_OFFSET + newSingle * RAM_BLOCK_SIZE;
-            for (ii = 0 ; ii < 64 ; ii++)
-                memcpy(singleIndirPointer + ii * 4, &negOne, sizeof(int) );
+    /* Everything from the new end on goes, including blocks reserved past the old end */
+    punchHole(indexNode, length, (long long)MAX_LOGICAL_BLOCKS * (RAM_BLOCK_SIZE << fileSizeClass(indexNode)) - length);
+    setFileSize(indexNode, length);
 
-            memcpy(nodePointer + DOUBLE_INDIR, &newDouble, sizeof(int) );
-            memcpy(doubleIndirPointer, &newSingle, sizeof(int) );
+    if (length == 0)
+    {
+        indexNodeStart = indexNodeAddress(indexNode);
+        memset(indexNodeStart + INLINE_DATA_OFFSET, 0, INLINE_DATA_SIZE);
+        indexNodeStart[INODE_SIZE_CLASS] = 0;
+        indexNodeStart[INODE_FLAGS] = INODE_FLAG_INLINE;
+    }
+    return 0;
+}
 
-            newBlock = getFreeBlock();
-            memcpy(singleIndirPointer, &newBlock, sizeof(int) );
-            return newBlock;
-        }
-        else if ((inodePointer % 64) == 0)
+/**
+ * Reserves blocks for a range of a file so later writes there do not allocate, taking
+ * them as one contiguous run when the bitmap has one
+ *
+ * @return    int    0 on success, -1 if the index node is not a regular file or there is no room
+ * @param[in]    indexNode    index node of the file
+ * @param[in]    offset    first byte of the range
+ * @param[in]    length    bytes in the range
+ * @remark  The file grows to cover the range, like posix_fallocate.  Reserved blocks read as zeros
+ */
+int fallocateFile(int indexNode, long long offset, long long length)
+{
+    long long end;
+    long first, last, logical;
+    int clusterBlocks, clusterSize, missing, runClusters, run, ii, numAvailableBlocks;
+    int *slot;
+
+    end = offset + length;
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_REG || offset < 0 || length <= 0)
+        return -1;
+
+    if (fileFlags(indexNode) & INODE_FLAG_SMALL)
+    {
+        if (end > smallFileCapacity(indexNode))
         {
-            /* Must now add a new singly indirect pointer block, and allocate within there */
-            if (numAvailableBlocks < 2)
-            {
-                /* Not enough blocks available */
-                PRINT("Out of memory, no room to allocate the necessary single, and direct blocks\n");
-                return -1;
-            }
-            doubleOffset = inodePointer / 64;  /* This is now the offset into double indir, where a new block is needed */
-            doubleIndirPointer = RAM_memory + DATA_BLOCKS_OFFSET + ( (int) * ( (int *)(nodePointer + DOUBLE_INDIR) ) ) * RAM_BLOCK_SIZE;
-            if ( ((int) * ((int *)(doubleIndirPointer + (4 * doubleOffset) ))) != -1)
-            {
-                PRINT("Mem corruption, block pointers are inconsistent\n");
+            if (end <= FRAGMENT_MAX_SIZE ? moveToFragment(indexNode, (int)end) : moveSmallDataToBlocks(indexNode))
                 return -1;
-            }
-            /* Get the new single block to store in the double indirect block */
-            newSingle = getFreeBlock();
-            singleIndirPointer = RAM_memory + DATA_BLOCKS_OFFSET + newSingle * RAM_BLOCK_SIZE;
-            for (ii = 0 ; ii < 64 ; ii++)
-                memcpy(singleIndirPointer + ii * 4, &negOne, sizeof(int) );
+        }
+        if (fileFlags(indexNode) & INODE_FLAG_SMALL)
+        {
+            if (end > getFileSize(indexNode))
+                setFileSize(indexNode, end);
+            return 0;
+        }
+    }
+
+    /* Same size class choice as a write reaching this far */
+    if (fileSizeClass(indexNode) == 0 && end > NUM_DIRECT * RAM_BLOCK_SIZE)
+        setFileSizeClass(indexNode, largeSizeClass());
+    clusterBlocks = 1 << fileSizeClass(indexNode);
+    clusterSize = RAM_BLOCK_SIZE * clusterBlocks;
+    first = (long)(offset / clusterSize);
+    last = (long)((end - 1) / clusterSize);
+    if (last >= MAX_LOGICAL_BLOCKS)
+        return -1;
 
-            memcpy(doubleIndirPointer + (4 * doubleOffset), &newSingle, sizeof(int) );
+    missing = 0;
+    for (logical = first; logical <= last; logical++)
+    {
+        slot = blockPointerSlot(indexNode, logical, 0);
+        if (slot == NULL || *slot < 0)
+            missing++;
+    }
+    numAvailableBlocks = availableBlocks((long)missing * clusterBlocks);
+    if ((long)missing * clusterBlocks > numAvailableBlocks)
+    {
+        PRINT("Out of memory, can not reserve the range\n");
+        return -1;
+    }
 
-            /* Finally get the new data block for the file */
-            newBlock = getFreeBlock();
-            memcpy(singleIndirPointer, &newBlock, sizeof(int) );
-            return newBlock;
+    /* Take the largest run the bitmap has, halving until one is found, and hand it out in order */
+    logical = first;
+    runClusters = missing;
+    while (missing > 0)
+    {
+        if (runClusters > missing)
+            runClusters = missing;
+        run = getFreeRun(runClusters * clusterBlocks, clusterBlocks);
+        if (run < 0)
+        {
+            if (runClusters == 1)
+                return -1;
+            runClusters /= 2;
+            continue;
         }
-        else
+
+        for (ii = 0; ii < runClusters; logical++)
         {
-            /* The standard case, inodePointer points to a block pointed to by a block pointed to by the double */
-            doubleOffset = inodePointer / 64; /* Offset into double indirect block */
-            singleOffset = inodePointer % 64; /* Offset from the single block */
-            /* singleOffset can't equal 0 (would have been caught above), so we know that this is not an edge case and division is straightforward */
-            doubleIndirPointer = RAM_memory + DATA_BLOCKS_OFFSET + ( (int) * ( (int *)(nodePointer + DOUBLE_INDIR) ) ) * RAM_BLOCK_SIZE;
-            singleIndirPointer = RAM_memory + DATA_BLOCKS_OFFSET + ( (int) * ( (int *)(doubleIndirPointer + 4 * doubleOffset) ) ) * RAM_BLOCK_SIZE;
-            newBlock = (int) * ( (int *)(singleIndirPointer + 4 * singleOffset) );
-            if ( newBlock != -1)
+            slot = blockPointerSlot(indexNode, logical, 1);
+            if (slot == NULL)
             {
-                PRINT("Mem corruption, block pointers are inconsistent\n");
+                /* No room left for a pointer block, give back the rest of the run */
+                freeCluster(run + ii * clusterBlocks, (runClusters - ii) * clusterBlocks);
                 return -1;
             }
-            newBlock = getFreeBlock();
-            memcpy(singleIndirPointer + (4 * singleOffset), &newBlock, sizeof(int));
-            return newBlock;
+            if (*slot >= 0)
+                continue;
+            *slot = run + ii * clusterBlocks;
+            ii++;
         }
+        missing -= runClusters;
     }
-    /* 4168 is the max blocks available to a file (max size is 1067008), if it made it here, invalid write */
-    return -1;
+
+    if (end > getFileSize(indexNode))
+        setFileSize(indexNode, end);
+    return 0;
+}
+
+long long getFileSize(int indexNode) {
+    return indexNodeAt(indexNode)->size;
+}
+
+void setFileSize(int indexNode, long long fileSize) {
+    indexNodeAt(indexNode)->size = fileSize;
+}
+
+/************************ MEMORY MANAGEMENT *****************************/
+
+/**
+ * Function that allocates a new data block for a given index node
+ *
+ * @return    int    -1 if there is no more room available in the filesystem, the new block number otherwise
+ * @param[in]    indexNode    the indexNode to expand
+ * @param[in]    logicalBlock   the block index within the file to allocate
+ * @remark  Pointer blocks on the way are allocated as needed.  If the data block itself does not fit they
+ *          stay attached, empty, and are freed with the file
+ */
+int allocBlockForNode(int indexNode, long logicalBlock)
+{
+    int numAvailableBlocks, clusterBlocks, newBlock;
+    int *slot;
+
+    /* Data blocks come as clusters sized by the file's class, pointer blocks are always one block */
+    clusterBlocks = 1 << fileSizeClass(indexNode);
+    numAvailableBlocks = availableBlocks(clusterBlocks);
+    if (numAvailableBlocks < clusterBlocks || logicalBlock >= MAX_LOGICAL_BLOCKS)
+    {
+        PRINT("Out of memory, can not write\n");
+        return -1;
+    }
+
+    slot = blockPointerSlot(indexNode, logicalBlock, 1);
+    if (slot == NULL)
+    {
+        PRINT("Out of memory, no room for the pointer blocks\n");
+        return -1;
+    }
+    if (*slot != -1)
+    {
+        PRINT("Mem corruption, block pointers are inconsistent\n");
+        return -1;
+    }
+
+    newBlock = getFreeCluster(clusterBlocks);
+    *slot = newBlock;
+    return newBlock;
 }
 
 void zeroBlock(int blockNum)
@@ -1532,7 +2825,7 @@ void zeroBlock(int blockNum)
     char *blockPointer;
     char null;
     null = '\0';
-    blockPointer = RAM_memory + DATA_BLOCKS_OFFSET + blockNum * RAM_BLOCK_SIZE;
+    blockPointer = blockAddress(blockNum);
     for ( ii = 0 ; ii < RAM_BLOCK_SIZE ; ii++)
     {
         memcpy(blockPointer + ii, &null, sizeof(char));
@@ -1540,23 +2833,139 @@ void zeroBlock(int blockNum)
 
 }
 
+/**
+ * Makes sure the chunks holding a run of data blocks have memory before the run is handed out
+ *
+ * @return    int    0 on success, -1 if out of memory
+ * @param[in]    firstBlock    the first block of the run
+ * @param[in]    blockCount    the number of blocks in the run
+ */
+static int commitBlocks(int firstBlock, int blockCount)
+{
+    int chunk;
+#ifndef DEBUG
+    unsigned long start;
+#endif
+
+    for (chunk = firstBlock / CHUNK_BLOCKS; chunk <= (firstBlock + blockCount - 1) / CHUNK_BLOCKS; chunk++)
+    {
+        if (chunkCommitted[chunk])
+            continue;
+#ifndef DEBUG
+        /* Anonymous and shared memory in the DEBUG build is backed when first touched */
+        start = DATA_BLOCKS_OFFSET + (unsigned long)chunk * RAM_CHUNK_SIZE;
+        if (mapImagePages(start, min(start + RAM_CHUNK_SIZE, (unsigned long)FS_SIZE)) < 0)
+            return -1;
+#endif
+        chunkCommitted[chunk] = 1;
+    }
+    return 0;
+}
+
+/**
+ * Gives the memory of one chunk back to the system
+ *
+ * @return    long long    bytes given back
+ * @param[in]    chunk    the chunk, none of its blocks may be in use
+ */
+static long long releaseChunk(int chunk)
+{
+    int first, count;
+    unsigned long from, to;
+
+    first = chunk * CHUNK_BLOCKS;
+    count = TOT_AVAILABLE_BLOCKS - first < CHUNK_BLOCKS ? TOT_AVAILABLE_BLOCKS - first : CHUNK_BLOCKS;
+    from = DATA_BLOCKS_OFFSET + (unsigned long)first * RAM_BLOCK_SIZE;
+    to = from + (unsigned long)count * RAM_BLOCK_SIZE;
+    chunkCommitted[chunk] = 0;
+#ifdef DEBUG
+    /* Only whole pages, the ones at the ends may hold blocks of the neighbouring chunks.
+     * An image from allocImage has its chunks on huge pages, so nothing is cut off there */
+    from = ((unsigned long)RAM_memory + from + RAM_PAGE_SIZE - 1) & ~(RAM_PAGE_SIZE - 1);
+    to = ((unsigned long)RAM_memory + to) & ~(RAM_PAGE_SIZE - 1);
+    if (from >= to)
+        return 0;
+    madvise((char *)from, to - from, imageShared ? MADV_REMOVE : MADV_DONTNEED);
+#else
+    unmapImagePages(from, to);
+#endif
+    return (long long)(to - from);
+}
+
+/**
+ * Finds the chunks with no block in use and gives their memory back to the system
+ *
+ * @return    long long    bytes given back
+ * @remark  Runs by itself once reclaimWatermark bytes have been freed since the last
+ *          run, and from the module's shrinker or RAM_RECLAIM when memory is short.
+ *          A shared segment has chunks other processes committed, so there every free
+ *          chunk is given back rather than only the ones this process used
+ */
+long long reclaimChunks(void)
+{
+    int chunk, words, ii;
+    unsigned int *bits;
+    long long released;
+
+    released = 0;
+    freedSinceReclaim = 0;
+    words = CHUNK_BLOCKS / 32;
+    for (chunk = 0; chunk < DATA_CHUNK_COUNT; chunk++)
+    {
+        if (!chunkCommitted[chunk] && !imageShared)
+            continue;
+
+        /* Bits past the last block are never set, so the last chunk's words may run over
+         * them, but not past the end of the bitmap */
+        bits = (unsigned int *)(RAM_memory + BLOCK_BITMAP_OFFSET) + chunk * words;
+        if (chunk == DATA_CHUNK_COUNT - 1)
+            words = (TOT_AVAILABLE_BLOCKS - chunk * CHUNK_BLOCKS + 31) / 32;
+        for (ii = 0; ii < words; ii++)
+        {
+            if (bits[ii])
+                break;
+        }
+        if (ii == words)
+            released += releaseChunk(chunk);
+    }
+    return released;
+}
+
 int getFreeBlock(void)
 {
 
-    int i, j, index;
+    int i, j, index, hint;
 
-    for (i = 0; i < BLOCK_BITMAP_SIZE; i++)
+    /* The last free blocks may be held by unlinked files the worker has not got to */
+    if (superblock()->freeBlocks <= 0 && superblock()->deadList)
+        reapDeadIndexNodes(-1);
+
+    /* First fit, but every block below the hint is known to be in use, so the
+     * scan starts at the hint's byte instead of the beginning of the bitmap */
+    hint = superblock()->freeHint;
+    for (i = hint / 8; i < BLOCK_BITMAP_SIZE; i++)
     {
+        /* Skip over bytes with all blocks in use */
+        if ((unsigned char)RAM_memory[BLOCK_BITMAP_OFFSET + i] == 0xFF)
+            continue;
+
         for (j = 7; j >= 0; j--)
         {
             if (!checkBit(BLOCK_BITMAP_OFFSET + i, j))
             {
+                // Convert the loop indices into a block bitmap index
+                index = i * 8 + (7 - j);
+                if (index >= TOT_AVAILABLE_BLOCKS)
+                    return -1; /* The last bitmap byte can cover blocks past the end */
+                if (commitBlocks(index, 1) < 0)
+                    return -1;
+
                 // Return block number
                 setBit(BLOCK_BITMAP_OFFSET + i, j);
                 /* Decrement the block count in the superblock */
                 changeBlockCount(-1);
-                // Convert the loop indices into a block bitmap index
-                index = i * 8 + (7 - j);
+                hint = index + 1;
+                superblock()->freeHint = hint;
                 zeroBlock(index);
                 return index;
             }
@@ -1570,424 +2979,5061 @@ int getFreeBlock(void)
 
 void freeBlock(int blockindex)
 {
-    int major, minor;
+    int major, minor, hint;
     major = blockindex / 8;
     minor = blockindex % 8;
     minor = 7 - minor;
     clearBit(BLOCK_BITMAP_OFFSET + major, minor);
 
+    /* Keep the first fit hint at or below the lowest free block */
+    hint = superblock()->freeHint;
+    if (blockindex < hint)
+        superblock()->freeHint = blockindex;
+
     /* Increment block count in the superblock */
     changeBlockCount(1);
-}
 
-/************************ DEBUGGING FUNCTIONS *****************************/
+    /* Freed memory stays with the ramdisk, ready for reuse, until enough has piled up */
+    freedSinceReclaim += RAM_BLOCK_SIZE;
+    if (freedSinceReclaim >= reclaimWatermark)
+        reclaimChunks();
+}
 
 /**
- * Prints out the superblock
+ * Finds a run of free blocks without taking it
  *
+ * @return    int    the first block of the run, -1 if no such run is free
+ * @param[in]    blockCount    the number of blocks in the run
+ * @param[in]    align    the run starts on a multiple of this, a power of two
  */
-void printSuperblock(void)
+static int findFreeRun(int blockCount, int align)
 {
-    /* At the moment, there are only two values in the superblock.  INODE count, and BLOCK count */
-    PRINT("\n/-------------Printing Superblock---------------/\n");
-    PRINT("Number of free blocks ---> %d\n", (int) * ( (int *)(RAM_memory + SUPERBLOCK_OFFSET) ) );
-    PRINT("Number of free index nodes ---> %d\n", (int) * ( (int *)(RAM_memory + SUPERBLOCK_OFFSET + INODE_COUNT_OFFSET) ) );
-    PRINT("\n/-------------Done Printing Block---------------/\n");
+    int start, ii, hint, index;
+
+    /* No block below the hint is free, so no run can start below it either */
+    hint = superblock()->freeHint;
+    start = hint & ~(align - 1);
+    while (start + blockCount <= TOT_AVAILABLE_BLOCKS)
+    {
+        for (ii = 0; ii < blockCount; ii++)
+        {
+            index = start + ii;
+            if (checkBit(BLOCK_BITMAP_OFFSET + index / 8, 7 - index % 8))
+                break;
+        }
+        if (ii == blockCount)
+            return start;
+
+        /* No run can contain the block in use, resume after it */
+        start = (start + ii + align) & ~(align - 1);
+    }
+    // No free run
+    return -1;
 }
 
 /**
- * This debugging function prints the specified number of bitmap numberOfBits
+ * Marks a run of free blocks in use
  *
- * @return  void prints the bitmap bits in 25 bit chunks
- * @param[in]  numberOfBits specifies the number of bits to print
+ * @return    int    0 on success, -1 if out of memory
+ * @param[in]    start    the first block of the run, every block of it free
+ * @param[in]    blockCount    the number of blocks in the run
  */
-void printBitmap(int numberOfBits)
+static int claimRun(int start, int blockCount)
 {
-    int i, j, bitCount;
-    bitCount = 0;
-    for (i = 0; i < BLOCK_BITMAP_SIZE; i++)
+    int ii, index;
+
+    if (commitBlocks(start, blockCount) < 0)
+        return -1;
+    for (ii = 0; ii < blockCount; ii++)
     {
-        for (j = 7; j >= 0; j--)
-        {
-            // We have printed the right number of bits
-            if (bitCount >= numberOfBits)
-                return;
-            if (bitCount % 25 == 0)
-                PRINT("Printing %d - %d bitmaps\n", bitCount, bitCount + 24);
-            if (!checkBit(BLOCK_BITMAP_OFFSET + i, j))
-                PRINT("0 ");
-            else
-                PRINT("1 ");
-            bitCount++;
-            if (bitCount % 25 == 0)
-                PRINT("\n");
-        }
+        index = start + ii;
+        setBit(BLOCK_BITMAP_OFFSET + index / 8, 7 - index % 8);
+        zeroBlock(index);
     }
+    changeBlockCount(-blockCount);
+    return 0;
 }
 
-void printIndexNode(int nodeIndex)
+/**
+ * Finds a run of free blocks and marks it in use
+ *
+ * @return    int    the first block of the run, -1 if no such run is free
+ * @param[in]    blockCount    the number of blocks in the run
+ * @param[in]    align    the run starts on a multiple of this, a power of two
+ */
+int getFreeRun(int blockCount, int align)
 {
+    int start;
 
-    char *indexNodeStart;
-    char *singleIndirectStart;
-    char *doubleIndirectStart, *dirlistingstart, *filename;
-    int singleDirectBlock, doubleDirectBlock, memoryblock, memoryblockinner, i, j;
-    short indexNodeNum;
-
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + nodeIndex * INDEX_NODE_SIZE;
-    PRINT("-----Printing indexNode %d-----\n", nodeIndex);
-    PRINT("NODE TYPE:%.4s\n", indexNodeStart + INODE_TYPE);
-    PRINT("NODE SIZE:%d\n", (int) * ( (int *) (indexNodeStart + INODE_SIZE) ) );
-    PRINT("FILE COUNT:%hi\n", (short) * ( (short *)(indexNodeStart + INODE_FILE_COUNT) ) );
-    PRINT("FILE NAME: %s\n", indexNodeStart + INODE_FILE_NAME);
-
-    // Prints the Direct memory channels
-    PRINT("MEM DIRECT: ");
-    for (i = 0; i <= 7; i++)
+    start = findFreeRun(blockCount, align);
+    if (start < 0 && superblock()->deadList)
     {
-        PRINT("%d  ", (int) * ((int *)(indexNodeStart + DIRECT_1 + 4 * i)));
+        /* The run may be waiting on the blocks of unlinked files */
+        reapDeadIndexNodes(-1);
+        start = findFreeRun(blockCount, align);
     }
-    PRINT("\n");
+    if (start < 0 || claimRun(start, blockCount) < 0)
+        return -1;
+    return start;
+}
 
-    // Prints the Single indirect channels
-    singleDirectBlock = (int) * (indexNodeStart + SINGLE_INDIR) ;
-    singleIndirectStart = RAM_memory + DATA_BLOCKS_OFFSET + (singleDirectBlock * RAM_BLOCK_SIZE);
+/**
+ * Finds a run of free blocks aligned to its own length and marks it in use
+ *
+ * @return    int    the first block of the run, -1 if no such run is free
+ * @param[in]    blockCount    the number of blocks in the run, a power of two
+ */
+int getFreeCluster(int blockCount)
+{
+    if (blockCount == 1)
+        return getFreeBlock();
+    return getFreeRun(blockCount, blockCount);
+}
 
-    PRINT("MEM SINGLE INDIR: \n");
-    if (singleDirectBlock != -1)
-    {
-        for (i = 0; i < RAM_BLOCK_SIZE / 4; i++)
-        {
-            memoryblock = (int)(*(singleIndirectStart + 4 * i));
-            if (memoryblock != 0 || memoryblock != -1)
-                PRINT("%d  ", memoryblock);
-        }
-        PRINT("\n");
-    }
+/**
+ * Frees a run of blocks, clearing their bits a 32 bit word at a time where it can
+ *
+ * @param[in]    firstBlock    the first block of the run
+ * @param[in]    blockCount    the number of blocks in the run, all in use
+ */
+void freeRun(int firstBlock, int blockCount)
+{
+    unsigned char *bitmap;
+    int block, end, hint;
+
+    bitmap = (unsigned char *)RAM_memory + BLOCK_BITMAP_OFFSET;
+    block = firstBlock;
+    end = firstBlock + blockCount;
+    /* Single bits up to a byte, bytes up to a word, then words, then back down */
+    for (; block < end && block % 8; block++)
+        bitmap[block / 8] &= ~(0x80 >> (block % 8));
+    for (; block + 8 <= end && block % 32; block += 8)
+        bitmap[block / 8] = 0;
+    for (; block + 32 <= end; block += 32)
+        *(unsigned int *)(bitmap + block / 8) = 0;
+    for (; block + 8 <= end; block += 8)
+        bitmap[block / 8] = 0;
+    for (; block < end; block++)
+        bitmap[block / 8] &= ~(0x80 >> (block % 8));
+
+    hint = superblock()->freeHint;
+    if (firstBlock < hint)
+        superblock()->freeHint = firstBlock;
+    changeBlockCount(blockCount);
+
+    freedSinceReclaim += (unsigned long)blockCount * RAM_BLOCK_SIZE;
+    if (freedSinceReclaim >= reclaimWatermark)
+        reclaimChunks();
+}
 
+void freeCluster(int firstBlock, int blockCount)
+{
+    if (blockCount == 1)
+        freeBlock(firstBlock);
+    else
+        freeRun(firstBlock, blockCount);
+}
 
-    // Prints the Double indirect channels
-    doubleDirectBlock = (int) * (indexNodeStart + DOUBLE_INDIR) ;
-    doubleIndirectStart = RAM_memory + DATA_BLOCKS_OFFSET + (doubleDirectBlock * RAM_BLOCK_SIZE);
+/**
+ * Takes a fragment block off the chain of blocks with free units
+ *
+ * @param[in]    prev    the block before it on the chain, -1 if it is the head
+ * @param[in]    fragBlock    the block to take off
+ */
+static void unlinkFragmentBlock(int prev, int fragBlock)
+{
+    int next;
+    short listed;
+    char *header;
+
+    header = blockAddress(fragBlock);
+    memcpy(&next, header + FRAG_HEADER_NEXT, sizeof(int));
+    if (prev < 0)
+        superblock()->fragList = next;
+    else
+        memcpy(blockAddress(prev) + FRAG_HEADER_NEXT, &next, sizeof(int));
+    listed = 0;
+    memcpy(header + FRAG_HEADER_LISTED, &listed, sizeof(short));
+}
 
-    PRINT("MEM DOUBLE INDIR: \n");
-    if (doubleDirectBlock != -1 && strlen(indexNodeStart + INODE_TYPE) > 1)
+/**
+ * Reserves a run of units in a shared fragment block
+ *
+ * @return    int    the byte offset of the fragment in its block, -1 if the filesystem is full
+ * @param[in]    length    bytes needed, at most FRAGMENT_MAX_SIZE
+ * @param[out]    fragBlock    the block holding the fragment
+ */
+int allocFragment(int length, int *fragBlock)
+{
+    int units, headerUnits, block, prev, next, start;
+    short freeUnits, listed;
+    unsigned long long map, mask;
+    char *header;
+
+    units = (length + FRAG_UNIT_SIZE - 1) / FRAG_UNIT_SIZE;
+    mask = (1ULL << units) - 1;
+
+    /* First fit along the chain, dropping blocks that have filled up on the way */
+    prev = -1;
+    block = superblock()->fragList;
+    while (block >= 0)
     {
-        for (i = 0; i < RAM_BLOCK_SIZE / 4; i++)
+        header = blockAddress(block);
+        memcpy(&next, header + FRAG_HEADER_NEXT, sizeof(int));
+        memcpy(&freeUnits, header + FRAG_HEADER_FREE, sizeof(short));
+        if (freeUnits == 0)
         {
-            singleDirectBlock = (int) * ((int *)(doubleIndirectStart + 4 * i));
-            singleIndirectStart = RAM_memory + DATA_BLOCKS_OFFSET + (singleDirectBlock * RAM_BLOCK_SIZE);
-
-            if (singleDirectBlock > -1)
+            unlinkFragmentBlock(prev, block);
+            block = next;
+            continue;
+        }
+        if (freeUnits >= units)
+        {
+            memcpy(&map, header + FRAG_HEADER_MAP, sizeof(map));
+            for (start = 0; start + units <= FRAG_UNITS_PER_BLOCK; start++)
             {
-                PRINT("Sector %d  block %d:\n ", i, singleDirectBlock);
-                for (j = 0; j < RAM_BLOCK_SIZE / 4; j++)
-                {
-                    memoryblockinner =  (int) * ((int *)(singleIndirectStart + 4 * j));
-
-                    if (memoryblockinner > -1)
-                        PRINT("%d ", memoryblockinner);
-                }
-                PRINT("\n");
+                if (!(map & (mask << start)))
+                    goto claim;
             }
-
         }
+        prev = block;
+        block = next;
     }
 
-    // If directory, print all the files in the directory
+    /* Nothing fits, start a new fragment block at the head of the chain */
+    block = getFreeBlock();
+    if (block < 0)
+        return -1;
+    header = blockAddress(block);
+    headerUnits = (FRAG_HEADER_SIZE + FRAG_UNIT_SIZE - 1) / FRAG_UNIT_SIZE;
+    map = (1ULL << headerUnits) - 1;
+    freeUnits = FRAG_UNITS_PER_BLOCK - headerUnits;
+    listed = 1;
+    memcpy(header + FRAG_HEADER_NEXT, RAM_memory + SB_FRAG_LIST_OFFSET, sizeof(int));
+    memcpy(header + FRAG_HEADER_LISTED, &listed, sizeof(short));
+    superblock()->fragList = block;
+    start = headerUnits;
+
+claim:
+    map |= mask << start;
+    freeUnits -= units;
+    memcpy(header + FRAG_HEADER_MAP, &map, sizeof(map));
+    memcpy(header + FRAG_HEADER_FREE, &freeUnits, sizeof(short));
+    *fragBlock = block;
+    return start * FRAG_UNIT_SIZE;
+}
 
-    if (strcmp("dir\0",  indexNodeStart + INODE_TYPE) == 0)
+/**
+ * Gives back a fragment, and its block once no fragment in it is left
+ *
+ * @param[in]    fragBlock    the block holding the fragment
+ * @param[in]    fragOffset    byte offset of the fragment in the block
+ * @param[in]    length    bytes reserved for the fragment
+ */
+void freeFragment(int fragBlock, int fragOffset, int length)
+{
+    int units, headerUnits, prev, block;
+    short freeUnits, listed;
+    unsigned long long map;
+    char *header;
+
+    header = blockAddress(fragBlock);
+    units = (length + FRAG_UNIT_SIZE - 1) / FRAG_UNIT_SIZE;
+    headerUnits = (FRAG_HEADER_SIZE + FRAG_UNIT_SIZE - 1) / FRAG_UNIT_SIZE;
+    memcpy(&map, header + FRAG_HEADER_MAP, sizeof(map));
+    memcpy(&freeUnits, header + FRAG_HEADER_FREE, sizeof(short));
+    memcpy(&listed, header + FRAG_HEADER_LISTED, sizeof(short));
+
+    map &= ~(((1ULL << units) - 1) << (fragOffset / FRAG_UNIT_SIZE));
+    freeUnits += units;
+    memcpy(header + FRAG_HEADER_MAP, &map, sizeof(map));
+    memcpy(header + FRAG_HEADER_FREE, &freeUnits, sizeof(short));
+
+    if (freeUnits == FRAG_UNITS_PER_BLOCK - headerUnits)
     {
-        getAllocatedBlockNumbers(allocatedBlocks, nodeIndex);
-        i = 0;
-        memoryblock = allocatedBlocks[i];
-        PRINT("Directory Listing: \n");
-
-        // While we haven't reached the end of the memory block, keep printing
-        while (memoryblock != -1)
+        /* Empty, take it off the chain and give the block back */
+        if (listed)
         {
-
-            memoryblock = allocatedBlocks[i];
-            dirlistingstart = RAM_memory + DATA_BLOCKS_OFFSET + (memoryblock * RAM_BLOCK_SIZE);
-
-            for (j = 0; j < RAM_BLOCK_SIZE / FILE_INFO_SIZE; j++)
+            prev = -1;
+            block = superblock()->fragList;
+            while (block != fragBlock)
             {
-                indexNodeNum = (short) * (short *)(dirlistingstart + FILE_INFO_SIZE * j + INODE_NUM_OFFSET);
-                if (indexNodeNum > 0 && memoryblock > -1)
-                {
-                    // Print the file name and node type
-                    filename = (dirlistingstart + FILE_INFO_SIZE * j);
-                    if (stringContainsChar(filename, '/') == 1)
-                        PRINT("Directory: %s  Inode: %hd\n", filename, indexNodeNum);
-                    else
-                        PRINT("File: %s  Inode: %hd\n", filename, indexNodeNum);
-                }
+                prev = block;
+                memcpy(&block, blockAddress(block) + FRAG_HEADER_NEXT, sizeof(int));
             }
-            i++;
+            unlinkFragmentBlock(prev, fragBlock);
         }
-
+        freeBlock(fragBlock);
+    }
+    else if (!listed)
+    {
+        /* Has room again, put it back at the head of the chain */
+        memcpy(header + FRAG_HEADER_NEXT, RAM_memory + SB_FRAG_LIST_OFFSET, sizeof(int));
+        listed = 1;
+        memcpy(header + FRAG_HEADER_LISTED, &listed, sizeof(short));
+        superblock()->fragList = fragBlock;
     }
-
-    PRINT("-----End of Printing indexNode %d-----\n", nodeIndex);
 }
 
-/****************************Testing Routines*********************************/
-void testDirCreation(void)
-{
-    /* Creates 20 files that go into the root directory (starts adding files to new data blocks */
-    int ii, indexNodeNum;
-    char filename[80];
-    for (ii = 0 ; ii < 1024 ; ii++)
-    {
-        sprintf(filename, "/test%d.txt", ii);
-        indexNodeNum = createIndexNode("reg\0", filename, 0);
-        PRINT("Created index node %d for file %s\n", indexNodeNum, filename);
+/**
+ * Returns the size class of a file, the log2 of its blocks per cluster
+ *
+ * @return    int    the size class, always 0 for directories
+ * @param[in]    indexNode    the index node to check
+ */
+int fileSizeClass(int indexNode)
+{
+    struct RAM_indexNode *node;
+    node = indexNodeAt(indexNode);
+    return node->type == RAM_TYPE_REG ? node->sizeClass : 0;
+}
 
-        // printIndexNode(0);
-    }
+/**
+ * The smallest size class whose clusters are at least LARGE_CLUSTER_SIZE bytes
+ */
+int largeSizeClass(void)
+{
+    int sizeClass;
+    sizeClass = 0;
+    while ((RAM_BLOCK_SIZE << sizeClass) < LARGE_CLUSTER_SIZE)
+        sizeClass++;
+    return sizeClass;
+}
 
-    printIndexNode(0);
+/**
+ * Returns the flags of a regular file
+ *
+ * @return    int    the INODE_FLAG_ bits, always 0 for directories
+ * @param[in]    indexNode    the index node to check
+ */
+int fileFlags(int indexNode)
+{
+    struct RAM_indexNode *node;
+    node = indexNodeAt(indexNode);
+    return node->type == RAM_TYPE_REG ? node->flags : 0;
+}
 
-    /* Print out the root indexNode now */
-    printSuperblock();
+/**
+ * Checks whether a file keeps its data inside its index node
+ *
+ * @return    int    1 if the data is inline, 0 otherwise and for directories
+ * @param[in]    indexNode    the index node to check
+ */
+int fileIsInline(int indexNode)
+{
+    return (fileFlags(indexNode) & INODE_FLAG_INLINE) != 0;
 }
 
-void testFileCreation(void)
+/**
+ * Returns where the data of an inline or fragment file starts
+ */
+char *smallFileData(int indexNode)
 {
-    /* Add 2000000 bytes (~2 MB) to a file, this should limit the file size to the max allocatable size */
-    int indexNodeNum, dataSize, sizeWritten, ii;
-    char file[] = "/bigfile";
-    char *uselessData;
-    /* Initialize some useless data to 0 so we can verify 0 data is being written later */
-    dataSize = 20000;
-#ifdef DEBUG
-    uselessData = calloc(dataSize, sizeof(char));
-#else
-    uselessData = vmalloc(dataSize);
-    if (!uselessData)
-    {
-        PRINT("ALLOCATION FAILED\n");
-        return;
-    }
-#endif
-    for (ii = 0 ; ii < dataSize ; ii++)
-        uselessData[ii] = 'a';
+    char *indexNodeStart;
+    int fragBlock, fragOffset;
+
+    indexNodeStart = indexNodeAddress(indexNode);
+    if (fileIsInline(indexNode))
+        return indexNodeStart + INLINE_DATA_OFFSET;
+    memcpy(&fragBlock, indexNodeStart + FRAG_BLOCK, sizeof(int));
+    memcpy(&fragOffset, indexNodeStart + FRAG_OFFSET, sizeof(int));
+    return blockAddress(fragBlock) + fragOffset;
+}
 
-    indexNodeNum = createIndexNode("reg\0", file, 0);
-    printIndexNode(0); /* Veryify file was created */
-    sizeWritten = writeToFile(indexNodeNum, uselessData, dataSize, 0);
-    PRINT("Actual size written to index node %d is %d\n", indexNodeNum, sizeWritten);
-    printIndexNode(indexNodeNum); /* Verify size was written */
-#ifdef DEBUG
-    free(uselessData);
-#else
-    vfree(uselessData);
-#endif
+/**
+ * Returns how many bytes an inline or fragment file can hold where it is
+ */
+int smallFileCapacity(int indexNode)
+{
+    int length;
+    if (fileIsInline(indexNode))
+        return INLINE_DATA_SIZE;
+    memcpy(&length, indexNodeAddress(indexNode) + FRAG_LENGTH, sizeof(int));
+    return length;
+}
 
-    // Reading bytes from a high offset
-    // int bytes = 1000;
-    // char newdata[bytes];
-    // readFromFile(indexNodeNum, newdata, bytes, 19500);
-    // int j;
-    // for (j=0 ; j<bytes;j++) {
-    //     PRINT("%c", newdata[j]);
-    // }
-    // PRINT("\n");
+/**
+ * Gives back the fragment of a fragment file, inline data needs nothing
+ */
+void releaseSmallData(int indexNode)
+{
+    char *indexNodeStart;
+    int fragBlock, fragOffset, length;
 
+    if (!(fileFlags(indexNode) & INODE_FLAG_FRAGMENT))
+        return;
+    indexNodeStart = indexNodeAddress(indexNode);
+    memcpy(&fragBlock, indexNodeStart + FRAG_BLOCK, sizeof(int));
+    memcpy(&fragOffset, indexNodeStart + FRAG_OFFSET, sizeof(int));
+    memcpy(&length, indexNodeStart + FRAG_LENGTH, sizeof(int));
+    freeFragment(fragBlock, fragOffset, length);
 }
 
-void testReadFromFile(void)
+/**
+ * Moves the data of an inline or fragment file into a fragment of at least length bytes
+ *
+ * @return    int    0 on success, -1 if there is no room, the data then stays where it was
+ * @param[in]    indexNode    the index node of the file
+ * @param[in]    length    bytes the new fragment must hold, at most FRAGMENT_MAX_SIZE
+ */
+int moveToFragment(int indexNode, int length)
 {
-    int nodeNum, blockNum, ii;
-    char *nodeStart;
+    char *indexNodeStart, *fragment;
+    int fragBlock, fragOffset, size;
 
-    int byteNum = 12;
-    int sizeWritten, dataSize;
-    char *uselessData;
-    dataSize = 300;
-    char data[dataSize];
+    size = (int)getFileSize(indexNode);
+    fragOffset = allocFragment(length, &fragBlock);
+    if (fragOffset < 0)
+        return -1;
 
-#ifdef DEBUG
-    uselessData = calloc(dataSize, sizeof(char));
-#else
-    uselessData = kmalloc(dataSize * sizeof(char), GFP_ATOMIC);
-    if (!uselessData)
+    /* Whole units are reserved, and anything past the data must read back as zeros */
+    length = (length + FRAG_UNIT_SIZE - 1) / FRAG_UNIT_SIZE * FRAG_UNIT_SIZE;
+    fragment = blockAddress(fragBlock) + fragOffset;
+    memcpy(fragment, smallFileData(indexNode), size);
+    memset(fragment + size, 0, length - size);
+    releaseSmallData(indexNode);
+
+    indexNodeStart = indexNodeAddress(indexNode);
+    indexNodeStart[INODE_FLAGS] = (indexNodeStart[INODE_FLAGS] & ~INODE_FLAG_SMALL) | INODE_FLAG_FRAGMENT;
+    memcpy(indexNodeStart + FRAG_BLOCK, &fragBlock, sizeof(int));
+    memcpy(indexNodeStart + FRAG_OFFSET, &fragOffset, sizeof(int));
+    memcpy(indexNodeStart + FRAG_LENGTH, &length, sizeof(int));
+    return 0;
+}
+
+/**
+ * Moves the data of an inline or fragment file out to a data block of its own, leaving
+ * a normal pointer area behind
+ *
+ * @return    int    0 on success, -1 if there is no block for the data, which then stays put
+ * @param[in]    indexNode    the index node of the file
+ * @remark  Small data is never more than half a block, so one block always holds it
+ */
+int moveSmallDataToBlocks(int indexNode)
+{
+    char *indexNodeStart;
+    int size, block;
+
+    size = (int)getFileSize(indexNode);
+    block = -1;
+    if (size > 0)
     {
-        PRINT("ALLOCATION FAILED\n");
-        return;
+        block = getFreeBlock();
+        if (block < 0)
+        {
+            PRINT("Out of memory, file keeps its small data\n");
+            return -1;
+        }
+        memcpy(blockAddress(block), smallFileData(indexNode), size);
     }
-#endif
-
-    for (ii = 0 ; ii < dataSize ; ii++)
-        uselessData[ii] = 'z';
+    releaseSmallData(indexNode);
 
-    nodeNum = createIndexNode("reg\0", "/otherfile.txt\0",  0);
-    sizeWritten = writeToFile(nodeNum, uselessData, dataSize, 0);
+    indexNodeStart = indexNodeAddress(indexNode);
+    indexNodeStart[INODE_FLAGS] &= ~INODE_FLAG_SMALL;
+    negateIndexNodePointers(indexNode);
+    memcpy(indexNodeStart + DIRECT_1, &block, sizeof(int));
+    return 0;
+}
 
-    for (ii = 0 ; ii < dataSize ; ii++)
-        uselessData[ii] = 'X';
+/**
+ * Changes the size class of a regular file, moving its data into clusters of the new size
+ *
+ * @return    int    0 on success, -1 if the file can not be moved
+ * @param[in]    indexNode    the index node of the file
+ * @param[in]    sizeClass    the new size class
+ * @remark  Only files that still fit in their direct pointers can be moved, the
+ *          old blocks are released after the copy so both must fit at once
+ */
+int setFileSizeClass(int indexNode, int sizeClass)
+{
+    int oldBlocks[NUM_DIRECT], newBlocks[NUM_DIRECT];
+    int oldClass, oldClusterSize, newClusterSize, chunk;
+    int fileSize, newCount, position, length, ii, negOne;
+    char *indexNodeStart;
 
-    sizeWritten = writeToFile(nodeNum, uselessData, 50, 200);
+    indexNodeStart = indexNodeAddress(indexNode);
+    if (indexNodeAt(indexNode)->type != RAM_TYPE_REG || sizeClass < 0
+            || (RAM_BLOCK_SIZE << sizeClass) > MAX_BLOCK_SIZE)
+        return -1;
 
-    // int blocks [MAX_BLOCKS_ALLOCATABLE];
-    // getAllocatedBlockNumbers(blocks, nodeNum);
-    // blockNum = blocks[0];
-    // printf("Block num:%d\n", blockNum);
-    // nodeStart = RAM_memory + DATA_BLOCKS_OFFSET + blockNum * RAM_BLOCK_SIZE;
-    // strcpy(nodeStart, "hello world\0");
+    oldClass = fileSizeClass(indexNode);
+    if (sizeClass == oldClass)
+        return 0;
+    if ((fileFlags(indexNode) & INODE_FLAG_SMALL) || (int) * (int *)(indexNodeStart + SINGLE_INDIR) != -1)
+        return -1;
 
-    readFromFile(nodeNum, data, dataSize, 0);
+    oldClusterSize = RAM_BLOCK_SIZE << oldClass;
+    newClusterSize = RAM_BLOCK_SIZE << sizeClass;
+    /* Only reached with the file inside its direct blocks, so the size fits an int */
+    fileSize = (int)getFileSize(indexNode);
+    newCount = (fileSize + newClusterSize - 1) / newClusterSize;
+    if (newCount > NUM_DIRECT)
+        return -1;
 
-    PRINT("NODE: %d\n", nodeNum);
+    for (ii = 0; ii < NUM_DIRECT; ii++)
+        oldBlocks[ii] = (int) * (int *)(indexNodeStart + DIRECT_1 + ii * 4);
 
-    for (ii = 0; ii < dataSize + 5; ii++)
+    for (ii = 0; ii < newCount; ii++)
     {
-        PRINT("%d:%c ", ii, data[ii]);
+        newBlocks[ii] = getFreeCluster(1 << sizeClass);
+        if (newBlocks[ii] == -1)
+        {
+            PRINT("Out of memory, file keeps its size class\n");
+            while (ii--)
+                freeCluster(newBlocks[ii], 1 << sizeClass);
+            return -1;
+        }
     }
-    PRINT("\n");
-    // printf("Data: %s\n", data);
 
-    printIndexNode(0);
-    printIndexNode(nodeNum);
+    /* Both cluster sizes are powers of two, so a chunk of the smaller one never straddles the larger */
+    chunk = oldClusterSize < newClusterSize ? oldClusterSize : newClusterSize;
+    for (position = 0; position < fileSize; position += chunk)
+    {
+        length = fileSize - position < chunk ? fileSize - position : chunk;
+        /* Never written, the new cluster is already zeroed */
+        if (oldBlocks[position / oldClusterSize] < 0)
+            continue;
+        memcpy(blockAddress(newBlocks[position / newClusterSize]) + position % newClusterSize,
+               blockAddress(oldBlocks[position / oldClusterSize]) + position % oldClusterSize, length);
+    }
 
-    // nodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + nodeNum*INDEX_NODE_SIZE;
+    for (ii = 0; ii < NUM_DIRECT; ii++)
+    {
+        if (oldBlocks[ii] >= 0)
+            freeCluster(oldBlocks[ii], 1 << oldClass);
+    }
 
+    negOne = -1;
+    for (ii = 0; ii < NUM_DIRECT; ii++)
+        memcpy(indexNodeStart + DIRECT_1 + ii * 4, ii < newCount ? &newBlocks[ii] : &negOne, sizeof(int));
+    indexNodeStart[INODE_SIZE_CLASS] = (char)sizeClass;
+    return 0;
 }
 
-void testFileDeletion(void)
+/************************ DEFRAGMENTATION *****************************/
+
+/* A walk over the data clusters of a file in logical order, scoring them and
+ * optionally moving a range of them */
+struct RAM_fragWalk
 {
-    int indexNodeNum;
+    int clusterBlocks;
+    long long index;        /* Clusters visited so far */
+    int last;               /* Where the previous one starts, -1 before the first */
+    long long breaks;       /* Clusters not starting where the previous one ended */
+    long long first;        /* Clusters first to first + count - 1 are moved */
+    long long count;        /* 0 to only score */
+    int target;             /* Where the next cluster moved goes */
+};
 
-    indexNodeNum = createIndexNode("reg\0", "/myfile.txt\0",  0);
-    indexNodeNum = createIndexNode("reg\0", "/myfile2.txt\0",  0);
-    indexNodeNum = createIndexNode("dir\0", "/folder/\0",  0);
-    createIndexNode("reg\0", "/folder/newfile\0",  0);
+/**
+ * Walks the clusters below one block pointer
+ *
+ * @param[in-out]  walk  the walk so far
+ * @param[in-out]  slot  the pointer, rewritten when its cluster is moved
+ * @param[in]  depth  0 if it names a data cluster, more for each level of indirection
+ */
+static void fragWalkPointer(struct RAM_fragWalk *walk, int *slot, int depth)
+{
+    int ii, *pointers;
 
-    printIndexNode(indexNodeNum);
+    if (*slot < 0 || (walk->count && walk->index >= walk->first + walk->count))
+        return;
+    if (depth)
+    {
+        pointers = (int *)blockAddress(*slot);
+        for (ii = 0; ii < PTRS_PER_BLOCK; ii++)
+            fragWalkPointer(walk, pointers + ii, depth - 1);
+        return;
+    }
 
-    deleteFile("/folder/newfile\0");
-    printIndexNode(indexNodeNum);
+    if (walk->count && walk->index >= walk->first)
+    {
+        memcpy(blockAddress(walk->target), blockAddress(*slot), (long)walk->clusterBlocks * RAM_BLOCK_SIZE);
+        freeCluster(*slot, walk->clusterBlocks);
+        *slot = walk->target;
+        walk->target += walk->clusterBlocks;
+    }
+    if (walk->last >= 0 && *slot != walk->last + walk->clusterBlocks)
+        walk->breaks++;
+    walk->last = *slot;
+    walk->index++;
 }
 
-void testReadDir(void)
+/**
+ * Walks the clusters of a file or directory, inline and fragment files have none
+ *
+ * @param[in-out]  walk  clusterBlocks is filled in, first, count and target set when moving
+ * @param[in]  indexNode  the index node, in use
+ */
+static void fragWalkFile(struct RAM_fragWalk *walk, int indexNode)
 {
+    char *indexNodeStart;
+    int ii;
 
-    int indexNodeNum;
+    walk->clusterBlocks = 1 << fileSizeClass(indexNode);
+    walk->index = 0;
+    walk->last = -1;
+    walk->breaks = 0;
+    if (fileFlags(indexNode) & INODE_FLAG_SMALL)
+        return;
 
-    createIndexNode("reg\0", "/myfile.txt\0",  0);
-    createIndexNode("reg\0", "/myfile2.txt\0",  0);
-    indexNodeNum = createIndexNode("dir\0", "/folder/\0",  0);
+    indexNodeStart = indexNodeAddress(indexNode);
+    for (ii = 0; ii < NUM_DIRECT; ii++)
+        fragWalkPointer(walk, (int *)(indexNodeStart + DIRECT_1 + ii * 4), 0);
+    // Single, double and triple indirect trees
+    for (ii = 0; ii < 3; ii++)
+        fragWalkPointer(walk, (int *)(indexNodeStart + SINGLE_INDIR + ii * 4), ii + 1);
+}
 
-    printIndexNode(indexNodeNum);
+/**
+ * Scores how scattered the blocks of a file, or of every file, are
+ *
+ * @return  int  0 on success, -1 if the index node is not in use
+ * @param[in-out]  fragScore  indexNode is read, -1 for the whole filesystem, the score is filled in
+ * @remark  The score is the per mille of clusters, the first of each file aside, that
+ *          do not start where the one before them in the file ended.  A file in one
+ *          contiguous run scores 0, one whose every cluster is elsewhere 1000.  Holes
+ *          are skipped, so a sparse file can score 0 too
+ */
+int fragScore(struct RAM_fragScore *fragScore)
+{
+    struct RAM_fragWalk walk;
+    long long pairs;
+    int indexNode, first, last;
 
-    char blah[30];
+    first = fragScore->indexNode;
+    last = first + 1;
+    if (first < 0)
+    {
+        first = 0;
+        last = superblock()->inodeTotal;
+    }
+    else if (first >= superblock()->inodeTotal || indexNodeAt(first)->type == RAM_TYPE_FREE
+             || indexNodeAt(first)->type == RAM_TYPE_DEAD)
+    {
+        return -1;
+    }
 
-    short inode;
+    memset(&walk, 0, sizeof(walk));
+    fragScore->clusters = 0;
+    fragScore->breaks = 0;
+    pairs = 0;
+    for (indexNode = first; indexNode < last; indexNode++)
+    {
+        /* An unlinked file is on its way out, how it is laid out no longer matters */
+        if (indexNodeAt(indexNode)->type == RAM_TYPE_FREE || indexNodeAt(indexNode)->type == RAM_TYPE_DEAD)
+            continue;
+        fragWalkFile(&walk, indexNode);
+        fragScore->clusters += walk.index;
+        fragScore->breaks += walk.breaks;
+        if (walk.index > 1)
+            pairs += walk.index - 1;
+    }
+    fragScore->score = pairs ? (int)(fragScore->breaks * 1000 / pairs) : 0;
+    return 0;
+}
 
-    // inode = atoi(&blah[14]);
-    readFileName(0, blah, 0);
-    inode = (short)*(short*)(blah+14);    
-    PRINT("Result: %s inode: %d\n", blah, inode);
+/**
+ * Counts the free blocks at the start of a range
+ *
+ * @return  int  blocks from start up to the first one in use, at most blockCount
+ * @param[in]  start  the first block, -1 for none
+ * @param[in]  blockCount  the length of the range
+ */
+static int freeRunLength(int start, int blockCount)
+{
+    int index;
 
-    readFileName(0, blah, 1);
-    inode = (short)*(short*)(blah+14);    
-    PRINT("Result: %s inode: %d\n", blah, inode);
+    if (start < 0)
+        return 0;
+    for (index = start; index < start + blockCount && index < TOT_AVAILABLE_BLOCKS; index++)
+    {
+        if (checkBit(BLOCK_BITMAP_OFFSET + index / 8, 7 - index % 8))
+            break;
+    }
+    return index - start;
+}
 
-    readFileName(0, blah, 2);
-    inode = (short)*(short*)(blah+14);    
-    PRINT("Result: %s inode: %d\n", blah, inode);    
+/**
+ * Takes one bounded step of a defragmentation pass, moving the clusters of files
+ * that score above the threshold into contiguous free runs
+ *
+ * @return  int  0 on success, -1 if out of memory
+ * @param[in-out]  defrag  the pass so far, updated for the next step
+ * @remark  A step returns once it has moved or scored about budget blocks, so a
+ *          pass made of many steps never holds the lock for long, and a large file
+ *          is moved over several steps.  Everything is checked again at each step,
+ *          so files may change or go away between them.  A file is moved in logical
+ *          order to the largest free run that will take it, and once that run is
+ *          used up the rest follows in the next one.  Only data clusters move, the
+ *          pointers to them are rewritten where they are
+ */
+int defragStep(struct RAM_defrag *defrag)
+{
+    struct RAM_fragWalk walk;
+    long long work;
+    int total, clusterBlocks, score, clusters, run, moved, budget;
+
+    defrag->moved = 0;
+    defrag->files = 0;
+    budget = defrag->budget > 0 ? defrag->budget : 1;
+    total = superblock()->inodeTotal;
+    memset(&walk, 0, sizeof(walk));
+    work = 0;
+    while (work < budget)
+    {
+        if (defrag->indexNode < 0 || defrag->indexNode >= total)
+        {
+            defrag->done = 1;
+            return 0;
+        }
+        if (indexNodeAt(defrag->indexNode)->type == RAM_TYPE_FREE
+                || indexNodeAt(defrag->indexNode)->type == RAM_TYPE_DEAD
+                || (fileFlags(defrag->indexNode) & INODE_FLAG_SMALL))
+            goto nextFile;
+        clusterBlocks = 1 << fileSizeClass(defrag->indexNode);
+
+        if (defrag->cluster == 0)
+        {
+            /* Scored first, a file is only moved when it is scattered enough and
+             * there is a free run of more than one cluster for it */
+            walk.count = 0;
+            fragWalkFile(&walk, defrag->indexNode);
+            work += walk.index;
+            score = walk.index > 1 ? (int)(walk.breaks * 1000 / (walk.index - 1)) : 0;
+            if (score <= defrag->threshold)
+                goto nextFile;
+            for (clusters = (int)walk.index; clusters > 1; clusters /= 2)
+            {
+                run = findFreeRun(clusters * clusterBlocks, clusterBlocks);
+                if (run >= 0)
+                    break;
+            }
+            if (clusters <= 1)
+                goto nextFile;
+            defrag->target = run;
+        }
 
+        /* Carry on where the previous step stopped for as long as the run there lasts,
+         * it may have been used up or taken since */
+        clusters = (int)((budget - work + clusterBlocks - 1) / clusterBlocks);
+        if (clusters < 1)
+            clusters = 1;
+        run = freeRunLength(defrag->target, clusters * clusterBlocks) / clusterBlocks;
+        if (run > 0)
+        {
+            clusters = run;
+        }
+        else
+        {
+            for (; clusters > 0; clusters /= 2)
+            {
+                defrag->target = findFreeRun(clusters * clusterBlocks, clusterBlocks);
+                if (defrag->target >= 0)
+                    break;
+            }
+            if (clusters == 0)
+                goto nextFile; /* Full, the rest of the file stays where it is */
+        }
+        if (claimRun(defrag->target, clusters * clusterBlocks) < 0)
+            return -1;
 
+        walk.first = defrag->cluster;
+        walk.count = clusters;
+        walk.target = defrag->target;
+        fragWalkFile(&walk, defrag->indexNode);
+        moved = walk.target - defrag->target;
+        /* Past the end of the file, the rest of the run goes back */
+        if (moved < clusters * clusterBlocks)
+            freeCluster(walk.target, clusters * clusterBlocks - moved);
+        work += moved;
+        defrag->moved += moved;
+        defrag->cluster += moved / clusterBlocks;
+        defrag->target = walk.target;
+        if (moved < clusters * clusterBlocks)
+        {
+            defrag->files++;
+            goto nextFile;
+        }
+        continue;
 
+nextFile:
+        defrag->indexNode++;
+        defrag->cluster = 0;
+    }
+    return 0;
 }
 
-/************************INIT AND EXIT ROUTINES*****************************/
-#ifdef DEBUG
+/************************ CONSISTENCY CHECK *****************************/
 
-void kr_creat(struct RAM_path *input)
+/* What the threads of one check share.  Each thread owns a slice of the index node
+ * table, and only the shadow maps are written by more than one, atomically */
+struct RAM_fsckState
 {
-    int indexNodeNum;
-    indexNodeNum = createIndexNode("reg\0", input->name, 0);
-    input->ret = indexNodeNum;
-}
+    unsigned char *referenced;   /* Shadow of the block bitmap, built from the block maps */
+    unsigned char *fragments;    /* Blocks referenced as fragment blocks, which files share */
+    int *links;                  /* Directory entries naming each index node */
+    int total;                   /* Index nodes checked */
+    int repair;
+};
+
+/* One thread's slice of the index node table and what it found there */
+struct RAM_fsckSlice
+{
+    struct RAM_fsckState *state;
+    int first;
+    int last;
+    int worker;                  /* Set when a thread of its own checks it */
+    long long crossLinked;
+    long long badPointers;
+    long long badIndexNodes;
+    long long badCounts;
+    long long danglingEntries;
+    long long freeIndexNodes;
+    long long repaired;
+};
 
 /**
- * Kernel pair for making a new directory
+ * Returns whether the memory of a block can be read
  *
- * @param[in]   input   The RAM_path struct for creating the file
+ * @remark  In the module a block in a chunk nothing was handed out in has no page
+ *          behind it, in the DEBUG build every block reads, as zeros if never used
  */
-void kr_mkdir(struct RAM_path *input)
+static inline int fsckReadable(int block)
+{
+#ifdef DEBUG
+    (void)block;
+    return 1;
+#else
+    return chunkCommitted[block / CHUNK_BLOCKS];
+#endif
+}
+
+/**
+ * Marks a run of blocks referenced in the shadow bitmap
+ *
+ * @param[in-out]  slice  counts blocks that were already referenced as cross linked
+ * @param[in]  first  the first block, the run is known to be in range
+ * @param[in]  count  blocks in the run
+ */
+static void fsckReference(struct RAM_fsckSlice *slice, int first, int count)
+{
+    int block;
+    unsigned char bit, old;
+
+    for (block = first; block < first + count; block++)
+    {
+        bit = 0x80 >> (block % 8);
+        old = __sync_fetch_and_or(&slice->state->referenced[block / 8], bit);
+        if (old & bit)
+            slice->crossLinked++;
+    }
+}
+
+/**
+ * Checks the entries of one directory block, counting the index nodes they name
+ *
+ * @return  int  the live entries in the block
+ * @param[in-out]  slice  the thread's counts
+ * @param[in]  block  the directory block
+ */
+static int fsckDirectoryBlock(struct RAM_fsckSlice *slice, int block)
+{
+    int ii, entryNode, live;
+    char *entry;
+
+    live = 0;
+    entry = blockAddress(block);
+    for (ii = 0; ii < RAM_BLOCK_SIZE / FILE_INFO_SIZE; ii++, entry += FILE_INFO_SIZE)
+    {
+        entryNode = dirEntryIndexNode(entry);
+        if (entryNode <= 0)
+            continue;
+        if (entryNode >= slice->state->total || indexNodeAt(entryNode)->type == RAM_TYPE_FREE
+                || indexNodeAt(entryNode)->type == RAM_TYPE_DEAD)
+        {
+            slice->danglingEntries++;
+            if (slice->state->repair)
+            {
+                setDirEntryIndexNode(entry, -2);
+                slice->repaired++;
+            }
+            continue;
+        }
+        __sync_fetch_and_add(&slice->state->links[entryNode], 1);
+        live++;
+    }
+    return live;
+}
+
+/**
+ * Checks a block pointer and everything below it, marking what it reaches referenced
+ *
+ * @param[in-out]  slice  the thread's counts
+ * @param[in-out]  slot  the pointer, set to -1 when bad and repairing
+ * @param[in]  depth  0 if it names a data cluster, more for each level of indirection
+ * @param[in]  clusterBlocks  blocks per data cluster of the file
+ * @param[in-out]  entries  for a directory, the live entries found so far, NULL otherwise
+ */
+static void fsckPointer(struct RAM_fsckSlice *slice, int *slot, int depth, int clusterBlocks, int *entries)
+{
+    int block, blocks, ii;
+    int *pointers;
+
+    block = *slot;
+    if (block < 0)
+        return;
+    blocks = depth ? 1 : clusterBlocks;
+    if (block + (long)blocks > TOT_AVAILABLE_BLOCKS || block % blocks
+            || ((depth || entries) && !fsckReadable(block)))
+    {
+        slice->badPointers++;
+        if (slice->state->repair)
+        {
+            *slot = -1;
+            slice->repaired++;
+        }
+        return;
+    }
+
+    fsckReference(slice, block, blocks);
+    if (depth)
+    {
+        pointers = (int *)blockAddress(block);
+        for (ii = 0; ii < PTRS_PER_BLOCK; ii++)
+            fsckPointer(slice, pointers + ii, depth - 1, clusterBlocks, entries);
+    }
+    else if (entries)
+    {
+        *entries += fsckDirectoryBlock(slice, block);
+    }
+}
+
+/**
+ * Checks the pointers of a pointer area laid out like an index node's
+ *
+ * @param[in-out]  slice  the thread's counts
+ * @param[in]  pointerArea  start of the index node, or of the pointer area mapping the index node table
+ * @param[in]  clusterBlocks  blocks per data cluster
+ * @param[in-out]  entries  as for fsckPointer
+ */
+static void fsckPointerArea(struct RAM_fsckSlice *slice, char *pointerArea, int clusterBlocks, int *entries)
+{
+    int ii;
+
+    for (ii = 0; ii < NUM_DIRECT; ii++)
+        fsckPointer(slice, (int *)(pointerArea + DIRECT_1 + ii * 4), 0, clusterBlocks, entries);
+    // Single, double and triple indirect trees
+    for (ii = 0; ii < 3; ii++)
+        fsckPointer(slice, (int *)(pointerArea + SINGLE_INDIR + ii * 4), ii + 1, clusterBlocks, entries);
+}
+
+/**
+ * Checks one slice of the index node table
+ *
+ * @param[in-out]  slice  the range to check, its counts are filled in
+ */
+static void fsckSlice(struct RAM_fsckSlice *slice)
+{
+    struct RAM_indexNode *node;
+    char *indexNodeStart;
+    int indexNode, live, fragBlock, fragOffset, fragLength;
+    unsigned char bit, old;
+
+    for (indexNode = slice->first; indexNode < slice->last; indexNode++)
+    {
+        indexNodeStart = indexNodeAddress(indexNode);
+        node = (struct RAM_indexNode *)indexNodeStart;
+        if (node->type == RAM_TYPE_FREE)
+        {
+            slice->freeIndexNodes++;
+            continue;
+        }
+        if ((node->type != RAM_TYPE_REG && node->type != RAM_TYPE_DIR && node->type != RAM_TYPE_DEAD)
+                || (node->type != RAM_TYPE_DIR && (node->sizeClass > 8 || (RAM_BLOCK_SIZE << node->sizeClass) > MAX_BLOCK_SIZE)))
+        {
+            /* Nothing it points to can be trusted, so it is dropped and the bitmap
+             * rebuild gives back whatever it held */
+            slice->badIndexNodes++;
+            if (slice->state->repair && indexNode != ROOT_INDEX_NODE)
+            {
+                memset(indexNodeStart, 0, INDEX_NODE_SIZE);
+                slice->freeIndexNodes++;
+                slice->repaired++;
+            }
+            continue;
+        }
+
+        if (node->type == RAM_TYPE_DIR)
+        {
+            live = 0;
+            fsckPointerArea(slice, indexNodeStart, 1, &live);
+            if (directoryFileCount(indexNode) != live || getFileSize(indexNode) % FILE_INFO_SIZE)
+            {
+                slice->badCounts++;
+                if (slice->state->repair)
+                {
+                    setFileSize(indexNode, (long long)live * FILE_INFO_SIZE);
+                    slice->repaired++;
+                }
+            }
+        }
+        else if (node->flags & INODE_FLAG_FRAGMENT)
+        {
+            memcpy(&fragBlock, indexNodeStart + FRAG_BLOCK, sizeof(int));
+            memcpy(&fragOffset, indexNodeStart + FRAG_OFFSET, sizeof(int));
+            memcpy(&fragLength, indexNodeStart + FRAG_LENGTH, sizeof(int));
+            if (fragBlock < 0 || fragBlock >= TOT_AVAILABLE_BLOCKS || fragOffset < FRAG_HEADER_SIZE
+                    || fragLength <= 0 || fragOffset + fragLength > RAM_BLOCK_SIZE)
+            {
+                slice->badPointers++;
+                continue;
+            }
+            /* The first file found in a fragment block references it for all of them */
+            bit = 0x80 >> (fragBlock % 8);
+            old = __sync_fetch_and_or(&slice->state->fragments[fragBlock / 8], bit);
+            if (!(old & bit))
+                fsckReference(slice, fragBlock, 1);
+        }
+        else if (!(node->flags & INODE_FLAG_INLINE))
+        {
+            fsckPointerArea(slice, indexNodeStart, 1 << node->sizeClass, NULL);
+        }
+    }
+}
+
+#ifdef DEBUG
+static void *fsckSliceRun(void *arg)
+{
+    fsckSlice((struct RAM_fsckSlice *)arg);
+    return NULL;
+}
+#endif
+
+/**
+ * Counts the bits set in a byte
+ */
+static inline int fsckBitCount(unsigned char bits)
+{
+    int count;
+    for (count = 0; bits; count++)
+        bits &= bits - 1;
+    return count;
+}
+
+/**
+ * Puts every fragment block with free units back on the chain, and takes the rest off
+ *
+ * @param[in]  state  the check, whose fragment map names the fragment blocks
+ */
+static void fsckRebuildFragmentList(struct RAM_fsckState *state)
+{
+    int block;
+    short freeUnits, listed;
+    char *header;
+
+    superblock()->fragList = -1;
+    for (block = TOT_AVAILABLE_BLOCKS - 1; block >= 0; block--)
+    {
+        if (!(state->fragments[block / 8] & (0x80 >> (block % 8))))
+            continue;
+        header = blockAddress(block);
+        memcpy(&freeUnits, header + FRAG_HEADER_FREE, sizeof(short));
+        listed = freeUnits > 0;
+        memcpy(header + FRAG_HEADER_LISTED, &listed, sizeof(short));
+        if (listed)
+        {
+            memcpy(header + FRAG_HEADER_NEXT, RAM_memory + SB_FRAG_LIST_OFFSET, sizeof(int));
+            superblock()->fragList = block;
+        }
+    }
+}
+
+/**
+ * Cross checks the block bitmap against the block maps of every index node, the
+ * directory sizes against their live entries and the superblock's free counts
+ *
+ * @return  int  0 if the check ran, -1 if out of memory
+ * @param[in-out]  report  repair and threads are read, the counts filled in
+ * @remark  Nothing may change the filesystem while it runs.  The index node table is
+ *          split across threads in the DEBUG build, which build one shadow bitmap
+ *          with atomic ors.  A repair runs on one thread, since what it writes is
+ *          tracked for the next snapshot.  It rebuilds the bitmap and free counts from
+ *          what is referenced, drops bad pointers, bad index nodes and dangling
+ *          entries, and corrects directory sizes.  Cross linked blocks and index
+ *          nodes no directory names are only reported
+ */
+int fsckRun(struct RAM_fsck *report)
+{
+    struct RAM_fsckState state, mapState;
+    struct RAM_fsckSlice *slices, mapSlice;
+    unsigned char *savedMarking, *bitmap;
+    int repair, threads, ii, bytes, usedBlocks, block, steps, indexNode, deadIndexNodes;
+    long long freeIndexNodes;
+    short listed;
+#ifdef DEBUG
+    pthread_t *workers;
+#endif
+
+    memset(&state, 0, sizeof(state));
+    state.repair = report->repair;
+    state.total = superblock()->inodeTotal;
+    bytes = (TOT_AVAILABLE_BLOCKS + 7) / 8;
+    threads = report->threads;
+#ifdef DEBUG
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    threads = 1; /* The module checks on the calling thread */
+#endif
+    /* Writes made while repairing go to the dirty map, which is not thread safe */
+    if (threads < 1 || state.repair)
+        threads = 1;
+    if (threads > 64)
+        threads = 64;
+
+    state.referenced = (unsigned char *)RAM_ALLOC(bytes);
+    state.fragments = (unsigned char *)RAM_ALLOC(bytes);
+    state.links = (int *)RAM_ALLOC((long)state.total * sizeof(int));
+    slices = (struct RAM_fsckSlice *)RAM_ALLOC(threads * sizeof(struct RAM_fsckSlice));
+    if (!state.referenced || !state.fragments || !state.links || !slices)
+    {
+        RAM_FREE(state.referenced);
+        RAM_FREE(state.fragments);
+        RAM_FREE(state.links);
+        RAM_FREE(slices);
+        return -1;
+    }
+    memset(state.referenced, 0, bytes);
+    memset(state.fragments, 0, bytes);
+    memset(state.links, 0, (long)state.total * sizeof(int));
+    memset(slices, 0, threads * sizeof(struct RAM_fsckSlice));
+
+    /* The blocks the index node table grew into come first, walked like a file's
+     * without repair.  A bad one would make the index nodes in it unreachable, so
+     * then only the fixed array is checked */
+    memset(&mapSlice, 0, sizeof(mapSlice));
+    mapState = state;
+    mapState.repair = 0;
+    mapSlice.state = &mapState;
+    fsckPointerArea(&mapSlice, RAM_memory + SB_INODE_MAP_OFFSET, 1, NULL);
+    if (mapSlice.badPointers || mapSlice.crossLinked)
+        state.total = INDEX_NODE_COUNT;
+
+    savedMarking = dirtyMarking;
+    if (!state.repair)
+        dirtyMarking = NULL;
+    for (ii = 0; ii < threads; ii++)
+    {
+        slices[ii].state = &state;
+        slices[ii].first = (int)((long)state.total * ii / threads);
+        slices[ii].last = (int)((long)state.total * (ii + 1) / threads);
+    }
+#ifdef DEBUG
+    workers = (pthread_t *)RAM_ALLOC(threads * sizeof(pthread_t));
+    for (ii = 1; ii < threads; ii++)
+    {
+        /* A slice no thread could be started for is checked here */
+        slices[ii].worker = workers && !pthread_create(&workers[ii], NULL, fsckSliceRun, &slices[ii]);
+        if (!slices[ii].worker)
+            fsckSlice(&slices[ii]);
+    }
+    fsckSlice(&slices[0]);
+    for (ii = 1; ii < threads; ii++)
+    {
+        if (slices[ii].worker)
+            pthread_join(workers[ii], NULL);
+    }
+    RAM_FREE(workers);
+#else
+    fsckSlice(&slices[0]);
+#endif
+    dirtyMarking = savedMarking;
+
+    repair = report->repair;
+    memset(report, 0, sizeof(*report));
+    report->repair = repair;
+    report->crossLinked = mapSlice.crossLinked;
+    report->badPointers = mapSlice.badPointers;
+    freeIndexNodes = 0;
+    for (ii = 0; ii < threads; ii++)
+    {
+        report->crossLinked += slices[ii].crossLinked;
+        report->badPointers += slices[ii].badPointers;
+        report->badIndexNodes += slices[ii].badIndexNodes;
+        report->badCounts += slices[ii].badCounts;
+        report->danglingEntries += slices[ii].danglingEntries;
+        report->repaired += slices[ii].repaired;
+        freeIndexNodes += slices[ii].freeIndexNodes;
+    }
+    if (indexNodeAt(ROOT_INDEX_NODE)->type != RAM_TYPE_DIR)
+        report->badIndexNodes++;
+
+    /* Every index node in use but the root is named by exactly one directory entry,
+     * and an unlinked one waiting to be freed by none */
+    deadIndexNodes = 0;
+    for (ii = 0; ii < state.total; ii++)
+    {
+        if (indexNodeAt(ii)->type == RAM_TYPE_FREE)
+            continue;
+        if (indexNodeAt(ii)->type == RAM_TYPE_DEAD)
+        {
+            deadIndexNodes++;
+            if (state.links[ii])
+                report->orphans++;
+            continue;
+        }
+        if (state.links[ii] != (ii != ROOT_INDEX_NODE))
+            report->orphans++;
+    }
+
+    /* The dead list holds every unlinked index node once, its end is 0 */
+    steps = 0;
+    for (indexNode = superblock()->deadList; indexNode != 0; indexNode = (int)indexNodeAt(indexNode)->size)
+    {
+        if (steps++ >= deadIndexNodes || indexNode < 0 || indexNode >= state.total
+                || indexNodeAt(indexNode)->type != RAM_TYPE_DEAD)
+        {
+            report->badDeadList++;
+            break;
+        }
+    }
+    if (!report->badDeadList && steps != deadIndexNodes)
+        report->badDeadList++;
+    if (report->badDeadList && state.repair)
+    {
+        superblock()->deadList = 0;
+        for (ii = state.total - 1; ii > 0; ii--)
+        {
+            if (indexNodeAt(ii)->type != RAM_TYPE_DEAD)
+                continue;
+            indexNodeAt(ii)->size = superblock()->deadList;
+            superblock()->deadList = ii;
+        }
+        report->repaired++;
+    }
+
+    /* Every block on the fragment chain is a fragment block that says it is listed,
+     * and a loop is caught by never taking more steps than there are blocks */
+    steps = 0;
+    for (block = superblock()->fragList; block >= 0; steps++)
+    {
+        if (steps >= TOT_AVAILABLE_BLOCKS || block >= TOT_AVAILABLE_BLOCKS
+                || !(state.fragments[block / 8] & (0x80 >> (block % 8))))
+        {
+            report->badFragmentList++;
+            break;
+        }
+        memcpy(&listed, blockAddress(block) + FRAG_HEADER_LISTED, sizeof(short));
+        if (listed != 1)
+        {
+            report->badFragmentList++;
+            break;
+        }
+        memcpy(&block, blockAddress(block) + FRAG_HEADER_NEXT, sizeof(int));
+    }
+    if (report->badFragmentList && state.repair)
+    {
+        fsckRebuildFragmentList(&state);
+        report->repaired++;
+    }
+
+    /* The bitmap against its shadow, a byte at a time.  Bits past the last block
+     * are never referenced, so any set there count as leaked */
+    bitmap = (unsigned char *)RAM_memory + BLOCK_BITMAP_OFFSET;
+    usedBlocks = 0;
+    for (ii = 0; ii < bytes; ii++)
+    {
+        usedBlocks += fsckBitCount(bitmap[ii]);
+        if (bitmap[ii] == state.referenced[ii])
+            continue;
+        report->leakedBlocks += fsckBitCount(bitmap[ii] & ~state.referenced[ii]);
+        report->lostBlocks += fsckBitCount(state.referenced[ii] & ~bitmap[ii]);
+    }
+    if (superblock()->freeBlocks != TOT_AVAILABLE_BLOCKS - usedBlocks)
+        report->badFreeCounts++;
+    if (superblock()->freeIndexNodes != freeIndexNodes)
+        report->badFreeCounts++;
+
+    if (state.repair && (report->leakedBlocks || report->lostBlocks || report->badFreeCounts))
+    {
+        usedBlocks = 0;
+        for (ii = 0; ii < bytes; ii++)
+        {
+            /* A lost block is in use again, so its chunk must have memory */
+            if (state.referenced[ii] & ~bitmap[ii])
+                commitBlocks(ii * 8, 8 < TOT_AVAILABLE_BLOCKS - ii * 8 ? 8 : TOT_AVAILABLE_BLOCKS - ii * 8);
+            bitmap[ii] = state.referenced[ii];
+            usedBlocks += fsckBitCount(bitmap[ii]);
+        }
+        superblock()->freeBlocks = TOT_AVAILABLE_BLOCKS - usedBlocks;
+        superblock()->freeIndexNodes = (int)freeIndexNodes;
+        /* Both hints only promise nothing below them is free, 0 always keeps that */
+        superblock()->freeHint = 0;
+        superblock()->inodeHint = 0;
+        report->repaired += report->leakedBlocks + report->lostBlocks + report->badFreeCounts;
+    }
+
+    report->errors = report->leakedBlocks + report->lostBlocks + report->crossLinked + report->badPointers
+                     + report->badIndexNodes + report->badCounts + report->danglingEntries + report->orphans
+                     + report->badFreeCounts + report->badFragmentList + report->badDeadList;
+    report->indexNodes = state.total;
+    report->threads = threads;
+
+    RAM_FREE(state.referenced);
+    RAM_FREE(state.fragments);
+    RAM_FREE(state.links);
+    RAM_FREE(slices);
+    return 0;
+}
+
+/************************ DEBUGGING FUNCTIONS *****************************/
+
+/**
+ * Prints out the superblock
+ *
+ */
+void printSuperblock(void)
+{
+    /* At the moment, there are only two values in the superblock.  INODE count, and BLOCK count */
+    PRINT("\n/-------------Printing Superblock---------------/\n");
+    PRINT("Number of free blocks ---> %d\n", superblock()->freeBlocks);
+    PRINT("Number of free index nodes ---> %d\n", superblock()->freeIndexNodes);
+    PRINT("\n/-------------Done Printing Block---------------/\n");
+}
+
+/**
+ * This debugging function prints the specified number of bitmap numberOfBits
+ *
+ * @return  void prints the bitmap bits in 25 bit chunks
+ * @param[in]  numberOfBits specifies the number of bits to print
+ */
+void printBitmap(int numberOfBits)
+{
+    int i, j, bitCount;
+    bitCount = 0;
+    for (i = 0; i < BLOCK_BITMAP_SIZE; i++)
+    {
+        for (j = 7; j >= 0; j--)
+        {
+            // We have printed the right number of bits
+            if (bitCount >= numberOfBits)
+                return;
+            if (bitCount % 25 == 0)
+                PRINT("Printing %d - %d bitmaps\n", bitCount, bitCount + 24);
+            if (!checkBit(BLOCK_BITMAP_OFFSET + i, j))
+                PRINT("0 ");
+            else
+                PRINT("1 ");
+            bitCount++;
+            if (bitCount % 25 == 0)
+                PRINT("\n");
+        }
+    }
+}
+
+void printIndexNode(int nodeIndex)
 {
+
+    char *indexNodeStart;
+    char *singleIndirectStart;
+    char *doubleIndirectStart, *dirlistingstart, *filename;
+    int singleDirectBlock, doubleDirectBlock, memoryblock, memoryblockinner, i, j;
     int indexNodeNum;
-    indexNodeNum = createIndexNode("dir\0", input->name, 0);
-    input->ret = indexNodeNum;
+
+    indexNodeStart = indexNodeAddress(nodeIndex);
+    PRINT("-----Printing indexNode %d-----\n", nodeIndex);
+    PRINT("NODE TYPE:%s\n", getIndexNodeType(nodeIndex));
+    PRINT("NODE SIZE:%lld\n", getFileSize(nodeIndex));
+    PRINT("FILE COUNT:%d\n", directoryFileCount(nodeIndex));
+    PRINT("FILE NAME: %s\n", indexNodeStart + INODE_FILE_NAME);
+
+    // Prints the Direct memory channels
+    PRINT("MEM DIRECT: ");
+    for (i = 0; i < NUM_DIRECT; i++)
+    {
+        PRINT("%d  ", (int) * ((int *)(indexNodeStart + DIRECT_1 + 4 * i)));
+    }
+    PRINT("\n");
+
+    // Prints the Single indirect channels
+    singleDirectBlock = (int) * (indexNodeStart + SINGLE_INDIR) ;
+    singleIndirectStart = blockAddress(singleDirectBlock);
+
+    PRINT("MEM SINGLE INDIR: \n");
+    if (singleDirectBlock != -1)
+    {
+        for (i = 0; i < RAM_BLOCK_SIZE / 4; i++)
+        {
+            memoryblock = (int)(*(singleIndirectStart + 4 * i));
+            if (memoryblock != 0 || memoryblock != -1)
+                PRINT("%d  ", memoryblock);
+        }
+        PRINT("\n");
+    }
+
+
+    // Prints the Double indirect channels
+    doubleDirectBlock = (int) * (indexNodeStart + DOUBLE_INDIR) ;
+    doubleIndirectStart = blockAddress(doubleDirectBlock);
+
+    PRINT("MEM DOUBLE INDIR: \n");
+    if (doubleDirectBlock != -1 && indexNodeAt(nodeIndex)->type != RAM_TYPE_FREE)
+    {
+        for (i = 0; i < RAM_BLOCK_SIZE / 4; i++)
+        {
+            singleDirectBlock = (int) * ((int *)(doubleIndirectStart + 4 * i));
+            singleIndirectStart = blockAddress(singleDirectBlock);
+
+            if (singleDirectBlock > -1)
+            {
+                PRINT("Sector %d  block %d:\n ", i, singleDirectBlock);
+                for (j = 0; j < RAM_BLOCK_SIZE / 4; j++)
+                {
+                    memoryblockinner =  (int) * ((int *)(singleIndirectStart + 4 * j));
+
+                    if (memoryblockinner > -1)
+                        PRINT("%d ", memoryblockinner);
+                }
+                PRINT("\n");
+            }
+
+        }
+    }
+
+    // If directory, print all the files in the directory
+
+    if (indexNodeAt(nodeIndex)->type == RAM_TYPE_DIR)
+    {
+        getAllocatedBlockNumbers(allocatedBlocks, nodeIndex);
+        i = 0;
+        memoryblock = allocatedBlocks[i];
+        PRINT("Directory Listing: \n");
+
+        // While we haven't reached the end of the memory block, keep printing
+        while (memoryblock != -1)
+        {
+
+            memoryblock = allocatedBlocks[i];
+            dirlistingstart = blockAddress(memoryblock);
+
+            for (j = 0; j < RAM_BLOCK_SIZE / FILE_INFO_SIZE; j++)
+            {
+                indexNodeNum = dirEntryIndexNode(dirlistingstart + FILE_INFO_SIZE * j);
+                if (indexNodeNum > 0 && memoryblock > -1)
+                {
+                    // Print the file name and node type
+                    filename = (dirlistingstart + FILE_INFO_SIZE * j);
+                    if (stringContainsChar(filename, '/') == 1)
+                        PRINT("Directory: %s  Inode: %d\n", filename, indexNodeNum);
+                    else
+                        PRINT("File: %s  Inode: %d\n", filename, indexNodeNum);
+                }
+            }
+            i++;
+        }
+
+    }
+
+    PRINT("-----End of Printing indexNode %d-----\n", nodeIndex);
+}
+
+/****************************Testing Routines*********************************/
+void testDirCreation(void)
+{
+    /* Creates 20 files that go into the root directory (starts adding files to new data blocks */
+    int ii, indexNodeNum;
+    char filename[80];
+    for (ii = 0 ; ii < 1024 ; ii++)
+    {
+        sprintf(filename, "/test%d.txt", ii);
+        indexNodeNum = createIndexNode("reg\0", filename, 0);
+        PRINT("Created index node %d for file %s\n", indexNodeNum, filename);
+
+        // printIndexNode(0);
+    }
+
+    printIndexNode(0);
+
+    /* Print out the root indexNode now */
+    printSuperblock();
+}
+
+void testFileCreation(void)
+{
+    /* Add 2000000 bytes (~2 MB) to a file, this should limit the file size to the max allocatable size */
+    int indexNodeNum, dataSize, sizeWritten, ii;
+    char file[] = "/bigfile";
+    char *uselessData;
+    /* Initialize some useless data to 0 so we can verify 0 data is being written later */
+    dataSize = 20000;
+#ifdef DEBUG
+    uselessData = calloc(dataSize, sizeof(char));
+#else
+    uselessData = vmalloc(dataSize);
+    if (!uselessData)
+    {
+        PRINT("ALLOCATION FAILED\n");
+        return;
+    }
+#endif
+    for (ii = 0 ; ii < dataSize ; ii++)
+        uselessData[ii] = 'a';
+
+    indexNodeNum = createIndexNode("reg\0", file, 0);
+    printIndexNode(0); /* Veryify file was created */
+    sizeWritten = writeToFile(indexNodeNum, uselessData, dataSize, 0);
+    PRINT("Actual size written to index node %d is %d\n", indexNodeNum, sizeWritten);
+    printIndexNode(indexNodeNum); /* Verify size was written */
+#ifdef DEBUG
+    free(uselessData);
+#else
+    vfree(uselessData);
+#endif
+
+    // Reading bytes from a high offset
+    // int bytes = 1000;
+    // char newdata[bytes];
+    // readFromFile(indexNodeNum, newdata, bytes, 19500);
+    // int j;
+    // for (j=0 ; j<bytes;j++) {
+    //     PRINT("%c", newdata[j]);
+    // }
+    // PRINT("\n");
+
+}
+
+void testReadFromFile(void)
+{
+    int nodeNum, blockNum, ii;
+    char *nodeStart;
+
+    int byteNum = 12;
+    int sizeWritten, dataSize;
+    char *uselessData;
+    dataSize = 300;
+    char data[dataSize];
+
+#ifdef DEBUG
+    uselessData = calloc(dataSize, sizeof(char));
+#else
+    uselessData = kmalloc(dataSize * sizeof(char), GFP_ATOMIC);
+    if (!uselessData)
+    {
+        PRINT("ALLOCATION FAILED\n");
+        return;
+    }
+#endif
+
+    for (ii = 0 ; ii < dataSize ; ii++)
+        uselessData[ii] = 'z';
+
+    nodeNum = createIndexNode("reg\0", "/otherfile.txt\0",  0);
+    sizeWritten = writeToFile(nodeNum, uselessData, dataSize, 0);
+
+    for (ii = 0 ; ii < dataSize ; ii++)
+        uselessData[ii] = 'X';
+
+    sizeWritten = writeToFile(nodeNum, uselessData, 50, 200);
+
+    // int blocks [MAX_BLOCKS_ALLOCATABLE];
+    // getAllocatedBlockNumbers(blocks, nodeNum);
+    // blockNum = blocks[0];
+    // printf("Block num:%d\n", blockNum);
+    // nodeStart = blockAddress(blockNum);
+    // strcpy(nodeStart, "hello world\0");
+
+    readFromFile(nodeNum, data, dataSize, 0);
+
+    PRINT("NODE: %d\n", nodeNum);
+
+    for (ii = 0; ii < dataSize + 5; ii++)
+    {
+        PRINT("%d:%c ", ii, data[ii]);
+    }
+    PRINT("\n");
+    // printf("Data: %s\n", data);
+
+    printIndexNode(0);
+    printIndexNode(nodeNum);
+
+    // nodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + nodeNum*INDEX_NODE_SIZE;
+
+}
+
+void testFileDeletion(void)
+{
+    int indexNodeNum;
+
+    indexNodeNum = createIndexNode("reg\0", "/myfile.txt\0",  0);
+    indexNodeNum = createIndexNode("reg\0", "/myfile2.txt\0",  0);
+    indexNodeNum = createIndexNode("dir\0", "/folder/\0",  0);
+    createIndexNode("reg\0", "/folder/newfile\0",  0);
+
+    printIndexNode(indexNodeNum);
+
+    deleteFile("/folder/newfile\0");
+    printIndexNode(indexNodeNum);
+}
+
+void testReadDir(void)
+{
+
+    int indexNodeNum;
+
+    createIndexNode("reg\0", "/myfile.txt\0",  0);
+    createIndexNode("reg\0", "/myfile2.txt\0",  0);
+    indexNodeNum = createIndexNode("dir\0", "/folder/\0",  0);
+
+    printIndexNode(indexNodeNum);
+
+    char blah[30];
+
+    int inode;
+
+    // inode = atoi(&blah[14]);
+    readFileName(0, blah, 0);
+    memcpy(&inode, blah + 14, sizeof(int));    
+    PRINT("Result: %s inode: %d\n", blah, inode);
+
+    readFileName(0, blah, 1);
+    memcpy(&inode, blah + 14, sizeof(int));    
+    PRINT("Result: %s inode: %d\n", blah, inode);
+
+    readFileName(0, blah, 2);
+    memcpy(&inode, blah + 14, sizeof(int));    
+    PRINT("Result: %s inode: %d\n", blah, inode);    
+
+
+
+}
+
+#ifdef DEBUG
+/**
+ * Reformats as a 64 MB ramdisk with 4 KB blocks and round trips a 32 MB file through it
+ *
+ * @return  int  0 if the data and the free block count came back intact, -1 otherwise
+ */
+int testGeometry(void)
+{
+    int indexNodeNum, ii, chunk, freeBefore, freeAfter;
+    char *data, *readBack;
+
+    chunk = 1 << 20;
+    data = malloc(chunk);
+    readBack = malloc(chunk + 1);
+
+    freeImage(RAM_memory);
+    setGeometry(64UL << 20, 4096, 4096);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+    freeBefore = superblock()->freeBlocks;
+
+    indexNodeNum = createIndexNode("reg\0", "/big\0", 0);
+    for (ii = 0 ; ii < 32 ; ii++)
+    {
+        memset(data, 'a' + ii, chunk);
+        if (writeToFile(indexNodeNum, data, chunk, ii * chunk) != chunk)
+        {
+            PRINT("testGeometry: short write at chunk %d\n", ii);
+            return -1;
+        }
+    }
+    for (ii = 0 ; ii < 32 ; ii++)
+    {
+        memset(data, 'a' + ii, chunk);
+        if (readFromFile(indexNodeNum, readBack, chunk, ii * chunk) != chunk || memcmp(data, readBack, chunk))
+        {
+            PRINT("testGeometry: bad data at chunk %d\n", ii);
+            return -1;
+        }
+    }
+
+    deleteFile("/big\0");
+    freeAfter = superblock()->freeBlocks;
+    free(data);
+    free(readBack);
+
+    /* Root keeps the directory block it picked up for /big */
+    if (freeAfter != freeBefore - 1)
+    {
+        PRINT("testGeometry: leaked %d blocks\n", freeBefore - 1 - freeAfter);
+        return -1;
+    }
+    PRINT("testGeometry: passed\n");
+    return 0;
+}
+/**
+ * Grows a small file past its direct blocks and checks it moved to large
+ * clusters with its data intact, then that deleting it frees every block
+ *
+ * @return  int  0 on success, -1 on failure
+ */
+int testSizeClasses(void)
+{
+    int indexNodeNum, ii, size, freeBefore, freeAfter, blockCount;
+    char *data, *readBack;
+
+    size = 200 * 1024;
+    data = malloc(size);
+    readBack = malloc(size + 1);
+    for (ii = 0 ; ii < size ; ii++)
+        data[ii] = 'a' + ii % 23;
+
+    freeImage(RAM_memory);
+    setGeometry(DEFAULT_FS_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+    freeBefore = superblock()->freeBlocks;
+
+    /* Small writes stay in single blocks */
+    indexNodeNum = createIndexNode("reg\0", "/grow\0", 0);
+    writeToFile(indexNodeNum, data, 1000, 0);
+    if (fileSizeClass(indexNodeNum) != 0)
+    {
+        PRINT("testSizeClasses: small file left its block size\n");
+        return -1;
+    }
+
+    /* Growing past the direct blocks moves the file to LARGE_CLUSTER_SIZE clusters */
+    if (writeToFile(indexNodeNum, data + 1000, size - 1000, 1000) != size - 1000)
+    {
+        PRINT("testSizeClasses: short write\n");
+        return -1;
+    }
+    blockCount = getAllocatedBlockNumbers(allocatedBlocks, indexNodeNum);
+    if (fileSizeClass(indexNodeNum) != largeSizeClass()
+            || blockCount != (size + LARGE_CLUSTER_SIZE - 1) / LARGE_CLUSTER_SIZE)
+    {
+        PRINT("testSizeClasses: class %d with %d clusters\n", fileSizeClass(indexNodeNum), blockCount);
+        return -1;
+    }
+    if (readFromFile(indexNodeNum, readBack, size, 0) != size || memcmp(data, readBack, size))
+    {
+        PRINT("testSizeClasses: bad data after the move\n");
+        return -1;
+    }
+
+    deleteFile("/grow\0");
+    freeAfter = superblock()->freeBlocks;
+    free(data);
+    free(readBack);
+
+    /* Root keeps the directory block it picked up for /grow */
+    if (freeAfter != freeBefore - 1)
+    {
+        PRINT("testSizeClasses: leaked %d blocks\n", freeBefore - 1 - freeAfter);
+        return -1;
+    }
+    PRINT("testSizeClasses: passed\n");
+    return 0;
+}
+/**
+ * Writes a file past the double indirect reach of 256 byte pointer blocks and
+ * checks it reads back through the triple indirect block
+ *
+ * @return  int  0 on success, -1 on failure
+ */
+int testTripleIndirect(void)
+{
+    int indexNodeNum, ii, chunk, chunks, freeBefore, freeAfter;
+    char *data, *readBack;
+
+    chunk = 1 << 20;
+    chunks = 24;
+    data = malloc(chunk);
+    readBack = malloc(chunk + 1);
+
+    /* 4 KB clusters reached through 64 pointer blocks cover about 16 MB before the triple */
+    freeImage(RAM_memory);
+    setGeometry(64UL << 20, 256, 1024);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+    freeBefore = superblock()->freeBlocks;
+
+    indexNodeNum = createIndexNode("reg\0", "/huge\0", 0);
+    for (ii = 0 ; ii < chunks ; ii++)
+    {
+        memset(data, 'A' + ii, chunk);
+        if (writeToFile(indexNodeNum, data, chunk, (long long)ii * chunk) != chunk)
+        {
+            PRINT("testTripleIndirect: short write at chunk %d\n", ii);
+            return -1;
+        }
+    }
+    if ((int) * (int *)(indexNodeAddress(indexNodeNum) + TRIPLE_INDIR) < 0
+            || getFileSize(indexNodeNum) != (long long)chunks * chunk)
+    {
+        PRINT("testTripleIndirect: file did not reach the triple indirect block\n");
+        return -1;
+    }
+    for (ii = chunks - 1 ; ii >= 0 ; ii--)
+    {
+        memset(data, 'A' + ii, chunk);
+        if (readFromFile(indexNodeNum, readBack, chunk, (long long)ii * chunk) != chunk || memcmp(data, readBack, chunk))
+        {
+            PRINT("testTripleIndirect: bad data at chunk %d\n", ii);
+            return -1;
+        }
+    }
+
+    deleteFile("/huge\0");
+    freeAfter = superblock()->freeBlocks;
+    free(data);
+    free(readBack);
+
+    /* Root keeps the directory block it picked up for /huge */
+    if (freeAfter != freeBefore - 1)
+    {
+        PRINT("testTripleIndirect: leaked %d blocks\n", freeBefore - 1 - freeAfter);
+        return -1;
+    }
+    PRINT("testTripleIndirect: passed\n");
+    return 0;
+}
+/**
+ * Checks a tiny file lives in its index node without taking a block, and that
+ * its data moves to a block intact once it grows
+ *
+ * @return  int  0 on success, -1 on failure
+ */
+int testInlineFiles(void)
+{
+    int indexNodeNum, freeBefore, freeAfter;
+    char data[128], readBack[129];
+
+    memset(data, 'x', sizeof(data));
+    memcpy(data, "lock held by 1234\n", 18);
+
+    freeImage(RAM_memory);
+    setGeometry(DEFAULT_FS_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    indexNodeNum = createIndexNode("reg\0", "/marker\0", 0);
+    freeBefore = superblock()->freeBlocks;
+    writeToFile(indexNodeNum, data, 18, 0);
+    freeAfter = superblock()->freeBlocks;
+    if (!fileIsInline(indexNodeNum) || freeAfter != freeBefore)
+    {
+        PRINT("testInlineFiles: tiny file took a block\n");
+        return -1;
+    }
+    if (readFromFile(indexNodeNum, readBack, 100, 0) != 18 || memcmp(data, readBack, 18))
+    {
+        PRINT("testInlineFiles: bad inline data\n");
+        return -1;
+    }
+
+    /* Growing past the index node moves the data out */
+    writeToFile(indexNodeNum, data + 18, sizeof(data) - 18, 18);
+    freeAfter = superblock()->freeBlocks;
+    if (fileIsInline(indexNodeNum) || freeAfter != freeBefore - 1)
+    {
+        PRINT("testInlineFiles: grown file still inline\n");
+        return -1;
+    }
+    if (readFromFile(indexNodeNum, readBack, sizeof(data), 0) != sizeof(data) || memcmp(data, readBack, sizeof(data)))
+    {
+        PRINT("testInlineFiles: bad data after moving out\n");
+        return -1;
+    }
+
+    deleteFile("/marker\0");
+    freeAfter = superblock()->freeBlocks;
+    if (freeAfter != freeBefore)
+    {
+        PRINT("testInlineFiles: leaked %d blocks\n", freeBefore - freeAfter);
+        return -1;
+    }
+    PRINT("testInlineFiles: passed\n");
+    return 0;
+}
+/**
+ * Packs many small files into shared fragment blocks and checks they read back,
+ * that one can grow out into blocks, and that deleting them frees every block
+ *
+ * @return  int  0 on success, -1 on failure
+ */
+int testFragments(void)
+{
+    int indexNodes[60], ii, count, size, freeCreated, freeWritten, freeAfter;
+    char name[16], data[1000], readBack[1001];
+
+    count = 60;
+    size = 60;
+    freeImage(RAM_memory);
+    setGeometry(DEFAULT_FS_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        sprintf(name, "/frag%d", ii);
+        indexNodes[ii] = createIndexNode("reg\0", name, 0);
+    }
+    freeCreated = superblock()->freeBlocks;
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        memset(data, 'a' + ii % 26, size);
+        writeToFile(indexNodes[ii], data, size, 0);
+    }
+    freeWritten = superblock()->freeBlocks;
+
+    /* Four 60 byte files share each 256 byte block, one block apiece without packing */
+    if (freeCreated - freeWritten > count / 4)
+    {
+        PRINT("testFragments: %d files took %d blocks\n", count, freeCreated - freeWritten);
+        return -1;
+    }
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        memset(data, 'a' + ii % 26, size);
+        if (!(fileFlags(indexNodes[ii]) & INODE_FLAG_FRAGMENT)
+                || readFromFile(indexNodes[ii], readBack, size, 0) != size || memcmp(data, readBack, size))
+        {
+            PRINT("testFragments: bad data in file %d\n", ii);
+            return -1;
+        }
+    }
+
+    /* Growing past half a block moves a file out to blocks of its own */
+    memset(data, 'a', sizeof(data));
+    writeToFile(indexNodes[0], data + size, sizeof(data) - size, size);
+    if ((fileFlags(indexNodes[0]) & INODE_FLAG_SMALL)
+            || readFromFile(indexNodes[0], readBack, sizeof(data), 0) != sizeof(data) || memcmp(data, readBack, sizeof(data)))
+    {
+        PRINT("testFragments: bad data after growing out of the fragment\n");
+        return -1;
+    }
+
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        sprintf(name, "/frag%d", ii);
+        deleteFile(name);
+    }
+    freeAfter = superblock()->freeBlocks;
+    if (freeAfter != freeCreated)
+    {
+        PRINT("testFragments: leaked %d blocks\n", freeCreated - freeAfter);
+        return -1;
+    }
+    PRINT("testFragments: passed\n");
+    return 0;
+}
+/**
+ * Writes a few bytes far past the end of a file and punches a hole in the middle
+ * of written data, checking that holes read as zeros and take no blocks
+ *
+ * @return  int  0 on success, -1 on failure
+ */
+int testSparseFiles(void)
+{
+    int indexNodeNum, ii, size, freeBefore, freeWritten, freePunched, freeAfter;
+    long long farOffset;
+    char *data, *readBack;
+
+    size = 256 * 1024;
+    data = malloc(size);
+    readBack = malloc(size + 1);
+    for (ii = 0 ; ii < size ; ii++)
+        data[ii] = 'a' + ii % 23;
+
+    freeImage(RAM_memory);
+    setGeometry(64UL << 20, 4096, 4096);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    indexNodeNum = createIndexNode("reg\0", "/sparse\0", 0);
+    freeBefore = superblock()->freeBlocks;
+
+    /* 5 GB into a 64 MB filesystem, only the last block and its pointer blocks are allocated */
+    farOffset = 5LL << 30;
+    if (writeToFile(indexNodeNum, data, 100, farOffset) != 100 || getFileSize(indexNodeNum) != farOffset + 100)
+    {
+        PRINT("testSparseFiles: write past the end failed\n");
+        return -1;
+    }
+    freeWritten = superblock()->freeBlocks;
+    if (freeBefore - freeWritten > 4)
+    {
+        PRINT("testSparseFiles: hole took %d blocks\n", freeBefore - freeWritten);
+        return -1;
+    }
+    if (readFromFile(indexNodeNum, readBack, 4096, farOffset - 4000) != 4096
+            || readBack[0] != 0 || readBack[3999] != 0 || memcmp(readBack + 4000, data, 96))
+    {
+        PRINT("testSparseFiles: bad data around the hole\n");
+        return -1;
+    }
+
+    /* Punch out the middle of real data, from part way into one block to part way into another */
+    writeToFile(indexNodeNum, data, size, 0);
+    freeWritten = superblock()->freeBlocks;
+    punchHole(indexNodeNum, 1000, 100000);
+    freePunched = superblock()->freeBlocks;
+    if (freePunched - freeWritten != 101000 / 4096 - 1)
+    {
+        PRINT("testSparseFiles: punch freed %d blocks\n", freePunched - freeWritten);
+        return -1;
+    }
+    readFromFile(indexNodeNum, readBack, size, 0);
+    for (ii = 0 ; ii < size ; ii++)
+    {
+        if (readBack[ii] != (ii >= 1000 && ii < 101000 ? 0 : data[ii]))
+        {
+            PRINT("testSparseFiles: bad byte %d after the punch\n", ii);
+            return -1;
+        }
+    }
+
+    deleteFile("/sparse\0");
+    freeAfter = superblock()->freeBlocks;
+    free(data);
+    free(readBack);
+    if (freeAfter != freeBefore)
+    {
+        PRINT("testSparseFiles: leaked %d blocks\n", freeBefore - freeAfter);
+        return -1;
+    }
+    PRINT("testSparseFiles: passed\n");
+    return 0;
+}
+/**
+ * Reserves a range, checks it came as one run, then truncates it back down
+ *
+ * @return    int    0 on success, -1 on failure
+ */
+int testTruncateFallocate(void)
+{
+    int indexNodeNum, ii, size, freeBefore, freeReserved, freeTruncated, freeAfter, first;
+    int *slot;
+    char *data, *readBack;
+
+    size = 1 << 20;
+    data = malloc(size);
+    readBack = malloc(size + 1);
+    for (ii = 0 ; ii < size ; ii++)
+        data[ii] = 'a' + ii % 19;
+
+    freeImage(RAM_memory);
+    setGeometry(64UL << 20, 4096, 4096);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    indexNodeNum = createIndexNode("reg\0", "/reserved\0", 0);
+    freeBefore = superblock()->freeBlocks;
+
+    /* 256 data blocks and the single indirect block, the data blocks in one run */
+    if (fallocateFile(indexNodeNum, 0, size) != 0 || getFileSize(indexNodeNum) != size)
+    {
+        PRINT("testTruncateFallocate: fallocate failed\n");
+        return -1;
+    }
+    freeReserved = superblock()->freeBlocks;
+    if (freeBefore - freeReserved != size / 4096 + 1)
+    {
+        PRINT("testTruncateFallocate: fallocate took %d blocks\n", freeBefore - freeReserved);
+        return -1;
+    }
+    first = *blockPointerSlot(indexNodeNum, 0, 0);
+    for (ii = 1 ; ii < size / 4096 ; ii++)
+    {
+        slot = blockPointerSlot(indexNodeNum, ii, 0);
+        if (slot == NULL || *slot != first + ii)
+        {
+            PRINT("testTruncateFallocate: block %d is not contiguous\n", ii);
+            return -1;
+        }
+    }
+    if (readFromFile(indexNodeNum, readBack, size, 0) != size || readBack[0] != 0 || readBack[size - 1] != 0)
+    {
+        PRINT("testTruncateFallocate: reserved range does not read as zeros\n");
+        return -1;
+    }
+
+    /* Writing into the reserved range takes no more blocks */
+    writeToFile(indexNodeNum, data, size, 0);
+    freeTruncated = superblock()->freeBlocks;
+    if (freeTruncated != freeReserved)
+    {
+        PRINT("testTruncateFallocate: write allocated %d blocks\n", freeReserved - freeTruncated);
+        return -1;
+    }
+
+    /* Down to 5000 bytes keeps two blocks, growing again reads zeros past the cut */
+    truncateFile(indexNodeNum, 5000);
+    freeTruncated = superblock()->freeBlocks;
+    if (freeBefore - freeTruncated != 2 || getFileSize(indexNodeNum) != 5000)
+    {
+        PRINT("testTruncateFallocate: truncate left %d blocks\n", freeBefore - freeTruncated);
+        return -1;
+    }
+    truncateFile(indexNodeNum, 10000);
+    readFromFile(indexNodeNum, readBack, 10000, 0);
+    for (ii = 0 ; ii < 10000 ; ii++)
+    {
+        if (readBack[ii] != (ii < 5000 ? data[ii] : 0))
+        {
+            PRINT("testTruncateFallocate: bad byte %d after the truncate\n", ii);
+            return -1;
+        }
+    }
+
+    /* Down to nothing gives every block back and keeps data inline again */
+    truncateFile(indexNodeNum, 0);
+    freeAfter = superblock()->freeBlocks;
+    if (freeAfter != freeBefore || !fileIsInline(indexNodeNum))
+    {
+        PRINT("testTruncateFallocate: truncate to 0 leaked %d blocks\n", freeBefore - freeAfter);
+        return -1;
+    }
+
+    /* A range a small file can hold stays in the index node */
+    if (fallocateFile(indexNodeNum, 0, 20) != 0 || !fileIsInline(indexNodeNum) || getFileSize(indexNodeNum) != 20)
+    {
+        PRINT("testTruncateFallocate: small fallocate left the index node\n");
+        return -1;
+    }
+
+    deleteFile("/reserved\0");
+    free(data);
+    free(readBack);
+    PRINT("testTruncateFallocate: passed\n");
+    return 0;
+}
+/**
+ * Fills one directory past what a short index node number and the fixed index
+ * node array could hold, then empties it again
+ *
+ * @return    int    0 on success, -1 on failure
+ */
+int testLargeDirectory(void)
+{
+    int ii, count, indexNodeNum, lastIndexNode, freeBefore, freeAfter, total;
+    char path[32], entry[32];
+
+    count = 33000;
+
+    freeImage(RAM_memory);
+    setGeometry(64UL << 20, 4096, 64);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    createIndexNode("dir\0", "/big/\0", 0);
+    freeBefore = superblock()->freeIndexNodes;
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        sprintf(path, "/big/f%d", ii);
+        lastIndexNode = createIndexNode("reg\0", path, 0);
+        if (lastIndexNode < 0)
+        {
+            PRINT("testLargeDirectory: create %d failed\n", ii);
+            return -1;
+        }
+    }
+    total = superblock()->inodeTotal;
+    indexNodeNum = getIndexNodeNumberFromPathname("/big/\0", 0);
+    if (lastIndexNode <= 32767 || total < count + 2 || directoryFileCount(indexNodeNum) != count)
+    {
+        PRINT("testLargeDirectory: %d files, last index node %d, table of %d\n",
+              directoryFileCount(indexNodeNum), lastIndexNode, total);
+        return -1;
+    }
+
+    /* The last entry reads back with its full index node number */
+    if (getIndexNodeNumberFromPathname("/big/f32999\0", 0) != lastIndexNode
+            || readFileName(indexNodeNum, entry, count - 1) != count
+            || strcmp(entry, "f32999") || memcmp(entry + 14, &lastIndexNode, sizeof(int)))
+    {
+        PRINT("testLargeDirectory: lookup of the last file failed\n");
+        return -1;
+    }
+
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        sprintf(path, "/big/f%d", ii);
+        deleteFile(path);
+    }
+    freeAfter = superblock()->freeIndexNodes;
+    if (directoryFileCount(indexNodeNum) != 0 || freeAfter - freeBefore != total - 64)
+    {
+        PRINT("testLargeDirectory: %d index nodes not freed\n", total - 64 - (freeAfter - freeBefore));
+        return -1;
+    }
+    PRINT("testLargeDirectory: passed\n");
+    return 0;
+}
+/**
+ * Writes an index node back in the version 3 layout, the reverse of upgradeIndexNodeRecord
+ *
+ * @param[in-out]  record  the 64 bytes of the index node
+ */
+static void downgradeIndexNodeRecord(char *record)
+{
+    struct RAM_indexNode node;
+    short fileCount;
+
+    memcpy(&node, record, INDEX_NODE_SIZE);
+    memset(record, 0, INDEX_NODE_SIZE);
+    if (node.type == RAM_TYPE_REG)
+    {
+        strcpy(record, "reg");
+        record[V3_INODE_SIZE_CLASS] = node.sizeClass;
+        record[V3_INODE_FLAGS] = node.flags;
+    }
+    else if (node.type == RAM_TYPE_DIR)
+    {
+        strcpy(record, "dir");
+        fileCount = (short)(node.size / FILE_INFO_SIZE);
+        memcpy(record + V3_INODE_SIZE_CLASS, &fileCount, sizeof(short));
+    }
+    memcpy(record + V3_DIRECT_1, node.direct, V3_POINTERS_SIZE);
+    memcpy(record + V3_INODE_SIZE, &node.size, sizeof(long long));
+    memcpy(record + V3_INODE_FILE_NAME, node.name, INDEX_NODE_SIZE - V3_INODE_FILE_NAME);
+}
+
+/**
+ * Turns a formatted image into a version 3 one and checks that loading it upgrades
+ * it with every file intact
+ *
+ * @return    int    0 on success, -1 on failure
+ */
+int testFormatUpgrade(void)
+{
+    int ii, dirNode, regNode, tinyNode, sizeClass;
+    char *data, readBack[4001];
+
+    data = malloc(4000);
+    for (ii = 0 ; ii < 4000 ; ii++)
+        data[ii] = 'a' + ii % 17;
+
+    freeImage(RAM_memory);
+    setGeometry(DEFAULT_FS_SIZE, DEFAULT_BLOCK_SIZE, 8);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    /* A directory, a file in blocks, an inline file, and enough files to grow the table */
+    dirNode = createIndexNode("dir\0", "/old/\0", 0);
+    regNode = createIndexNode("reg\0", "/old/data\0", 0);
+    writeToFile(regNode, data, 4000, 0);
+    sizeClass = fileSizeClass(regNode);
+    tinyNode = createIndexNode("reg\0", "/old/tiny\0", 0);
+    writeToFile(tinyNode, "hello", 5, 0);
+    for (ii = 0 ; ii < 20 ; ii++)
+    {
+        sprintf(readBack, "/f%d", ii);
+        createIndexNode("reg\0", readBack, 0);
+    }
+
+    for (ii = superblock()->inodeTotal - 1 ; ii >= 0 ; ii--)
+    {
+        if (indexNodeAt(ii)->type != RAM_TYPE_FREE)
+            downgradeIndexNodeRecord(indexNodeAddress(ii));
+    }
+    downgradeIndexNodeRecord(RAM_memory + SB_INODE_MAP_OFFSET);
+    superblock()->version = 3;
+
+    if (loadGeometry() < 0 || superblock()->version != RAMDISK_VERSION)
+    {
+        PRINT("testFormatUpgrade: version 3 image not loaded\n");
+        return -1;
+    }
+    if (getIndexNodeNumberFromPathname("/old/data\0", 0) != regNode || directoryFileCount(dirNode) != 2
+            || getIndexNodeNumberFromPathname("/f19\0", 0) < INDEX_NODE_COUNT
+            || fileSizeClass(regNode) != sizeClass || !fileIsInline(tinyNode))
+    {
+        PRINT("testFormatUpgrade: index nodes not upgraded\n");
+        return -1;
+    }
+    if (readFromFile(regNode, readBack, 4000, 0) != 4000 || memcmp(readBack, data, 4000)
+            || readFromFile(tinyNode, readBack, 100, 0) != 5 || strcmp(readBack, "hello"))
+    {
+        PRINT("testFormatUpgrade: data lost in the upgrade\n");
+        return -1;
+    }
+    free(data);
+    PRINT("testFormatUpgrade: passed\n");
+    return 0;
+}
+
+/**
+ * Counts the pages of part of the image that have memory behind them
+ *
+ * @return    long    resident pages, -1 if mincore fails
+ * @param[in]    start    start of the part, page aligned
+ * @param[in]    length    bytes of the part
+ */
+static long residentPages(char *start, unsigned long length)
+{
+    unsigned char *vector;
+    unsigned long pages, ii;
+    long resident;
+
+    pages = (length + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE;
+    vector = malloc(pages);
+    if (mincore(start, length, vector) < 0)
+    {
+        free(vector);
+        return -1;
+    }
+    resident = 0;
+    for (ii = 0; ii < pages; ii++)
+        resident += vector[ii] & 1;
+    free(vector);
+    return resident;
+}
+
+/**
+ * Checks that the data region only has memory where blocks are in use: none after
+ * formatting, the chunks of a file while it exists, and none again once it is deleted
+ * and the free chunks are reclaimed
+ *
+ * @return    int    0 on success, -1 on failure
+ */
+int testChunkedMemory(void)
+{
+    int node, ii;
+    char *data, *dataStart;
+    unsigned long dataLength;
+    long resident;
+
+    freeImage(RAM_memory);
+    setGeometry(64UL << 20, 4096, 1024);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    /* Whole chunks past the one holding the root directory */
+    dataStart = blockAddress(CHUNK_BLOCKS);
+    dataLength = (unsigned long)(TOT_AVAILABLE_BLOCKS - CHUNK_BLOCKS) / CHUNK_BLOCKS * RAM_CHUNK_SIZE;
+    if (residentPages(dataStart, dataLength) != 0)
+    {
+        PRINT("testChunkedMemory: formatting touched the data region\n");
+        return -1;
+    }
+
+    data = malloc(1 << 20);
+    memset(data, 'c', 1 << 20);
+    node = createIndexNode("reg\0", "/chunked\0", 0);
+    for (ii = 0; ii < 16; ii++)
+    {
+        if (writeToFile(node, data, 1 << 20, (long long)ii << 20) != 1 << 20)
+        {
+            PRINT("testChunkedMemory: write failed\n");
+            return -1;
+        }
+    }
+    resident = residentPages(dataStart, dataLength);
+    if (resident < (long)(12UL << 20) / (long)RAM_PAGE_SIZE)
+    {
+        PRINT("testChunkedMemory: only %ld pages resident for a 16 MB file\n", resident);
+        return -1;
+    }
+
+    /* Below the watermark the memory is kept for reuse until a reclaim */
+    if (deleteFile("/chunked\0") < 0)
+        return -1;
+    if (residentPages(dataStart, dataLength) == 0 || reclaimChunks() < (12LL << 20))
+    {
+        PRINT("testChunkedMemory: free chunks not kept until the reclaim\n");
+        return -1;
+    }
+    resident = residentPages(dataStart, dataLength);
+    if (resident != 0)
+    {
+        PRINT("testChunkedMemory: %ld pages still resident after the reclaim\n", resident);
+        return -1;
+    }
+
+    /* A watermark of one block gives every chunk back as soon as it empties */
+    reclaimWatermark = RAM_BLOCK_SIZE;
+    node = createIndexNode("reg\0", "/chunked\0", 0);
+    for (ii = 0; ii < 16; ii++)
+        writeToFile(node, data, 1 << 20, (long long)ii << 20);
+    if (deleteFile("/chunked\0") < 0)
+        return -1;
+    reclaimWatermark = DEFAULT_RECLAIM_WATERMARK;
+    resident = residentPages(dataStart, dataLength);
+    if (resident != 0)
+    {
+        PRINT("testChunkedMemory: %ld pages still resident past the watermark\n", resident);
+        return -1;
+    }
+    free(data);
+    PRINT("testChunkedMemory: passed\n");
+    return 0;
+}
+
+/**
+ * Times formatting a fresh image at capacities from 2 MB to 16 GB, which should
+ * cost the same at every size since only what the root directory uses is touched
+ *
+ * @return    int    0 on success, -1 on failure
+ */
+int testStartupTime(void)
+{
+    static const unsigned long capacities[] = { 2UL << 20, 256UL << 20, 4UL << 30, 16UL << 30 };
+    struct timespec start, end;
+    long micros;
+    int ii;
+
+    for (ii = 0; ii < (int)(sizeof(capacities) / sizeof(capacities[0])); ii++)
+    {
+        freeImage(RAM_memory);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (setGeometry(capacities[ii], DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT) < 0 || allocScratch() < 0)
+            return -1;
+        RAM_memory = allocImage(FS_SIZE);
+        if (RAM_memory == NULL)
+            return -1;
+        init_ramdisk();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        micros = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+        PRINT("testStartupTime: %lu MB formatted in %ld us\n", capacities[ii] >> 20, micros);
+        /* Clearing the region byte by byte took seconds at these sizes */
+        if (micros > 50000 || getIndexNodeNumberFromPathname("/\0", 1) != ROOT_INDEX_NODE)
+        {
+            PRINT("testStartupTime: startup depends on capacity\n");
+            return -1;
+        }
+    }
+    PRINT("testStartupTime: passed\n");
+    return 0;
+}
+
+/**
+ * Times random reads across a 384 MB file, with the image on 4 KB pages and then on
+ * transparent huge pages, and checks every read returns what was written there
+ *
+ * @return    int    0 on success, -1 on failure
+ * @remark  Only correctness is checked, the system may have no huge pages to give,
+ *          the time per read of each pass is printed to compare them
+ */
+int testHugePageReads(void)
+{
+    const long long fileSize = 384LL << 20;
+    const int reads = 1 << 21;
+    static const char *pages[] = { "4 KB pages", "huge pages" };
+    struct timespec start, end;
+    long long offset, *pattern, value;
+    char readBack[sizeof(long long) + 1]; /* Room for the terminator readFromFile adds */
+    unsigned long long seed;
+    long nanos;
+    int node, pass, ii;
+
+    /* Each 8 byte word of the file holds its own offset */
+    pattern = malloc(1 << 20);
+    if (pattern == NULL)
+        return -1;
+    for (pass = 0; pass < 2; pass++)
+    {
+        freeImage(RAM_memory);
+        imageHugePages = pass;
+        setGeometry(512UL << 20, 4096, 1024);
+        allocScratch();
+        RAM_memory = allocImage(FS_SIZE);
+        init_ramdisk();
+
+        node = createIndexNode("reg\0", "/random\0", 0);
+        for (offset = 0; offset < fileSize; offset += 1 << 20)
+        {
+            for (ii = 0; ii < (1 << 20) / (int)sizeof(long long); ii++)
+                pattern[ii] = offset + ii * (long long)sizeof(long long);
+            if (writeToFile(node, (char *)pattern, 1 << 20, offset) != 1 << 20)
+            {
+                PRINT("testHugePageReads: write failed\n");
+                free(pattern);
+                return -1;
+            }
+        }
+
+        seed = 12345;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (ii = 0; ii < reads; ii++)
+        {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            offset = (long long)((seed >> 20) % (fileSize / sizeof(long long))) * (long long)sizeof(long long);
+            value = -1;
+            if (readFromFile(node, readBack, sizeof(value), offset) == sizeof(value))
+                memcpy(&value, readBack, sizeof(value));
+            if (value != offset)
+            {
+                PRINT("testHugePageReads: read at %lld returned the wrong data\n", offset);
+                free(pattern);
+                return -1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        nanos = ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / reads;
+        PRINT("testHugePageReads: %ld ns per random read on %s\n", nanos, pages[pass]);
+    }
+    free(pattern);
+    imageHugePages = 1;
+    PRINT("testHugePageReads: passed\n");
+    return 0;
+}
+
+/**
+ * Checks a filesystem holding every kind of file, damages it in known ways, checks
+ * that each problem is counted, then repairs it
+ *
+ * @return  int  0 on success, -1 on failure
+ */
+int testConsistencyCheck(void)
+{
+    struct RAM_fsck report;
+    struct RAM_indexNode *fileA, *fileC, *fileE;
+    int ii, jj, indexNode, dirD1, fileB, freeBlock, fragBlock;
+    short listed;
+    char path[32], data[20000];
+    struct timespec start, end;
+
+    freeImage(RAM_memory);
+    /* A small fixed table, so the files grow it into data blocks */
+    setGeometry(16UL << 20, 256, 256);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    memset(data, 'x', sizeof(data));
+    for (ii = 0 ; ii < 4 ; ii++)
+    {
+        sprintf(path, "/d%d/", ii);
+        createIndexNode("dir\0", path, 0);
+        for (jj = 0 ; jj < 100 ; jj++)
+        {
+            sprintf(path, "/d%d/f%d", ii, jj);
+            indexNode = createIndexNode("reg\0", path, 0);
+            /* Inline, fragment, direct block, clustered and sparse files */
+            switch (jj % 5)
+            {
+            case 0: writeToFile(indexNode, data, 10, 0); break;
+            case 1: writeToFile(indexNode, data, 60, 0); break;
+            case 2: writeToFile(indexNode, data, 1000, 0); break;
+            case 3: writeToFile(indexNode, data, sizeof(data), 0); break;
+            case 4: writeToFile(indexNode, data, 100, 1LL << 22); break;
+            }
+        }
+    }
+
+    memset(&report, 0, sizeof(report));
+    report.threads = 4;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fsckRun(&report);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (report.errors != 0 || report.indexNodes != superblock()->inodeTotal || report.indexNodes <= INDEX_NODE_COUNT)
+    {
+        PRINT("testConsistencyCheck: %lld errors in a clean filesystem of %lld index nodes\n",
+              report.errors, report.indexNodes);
+        return -1;
+    }
+    PRINT("testConsistencyCheck: %lld index nodes checked on %d threads in %.1f ms\n", report.indexNodes,
+          report.threads, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    fileA = indexNodeAt(getIndexNodeNumberFromPathname("/d0/f2\0", 0));
+    fileC = indexNodeAt(getIndexNodeNumberFromPathname("/d0/f7\0", 0));
+    fileE = indexNodeAt(getIndexNodeNumberFromPathname("/d0/f12\0", 0));
+    fileB = getIndexNodeNumberFromPathname("/d2/f3\0", 0);
+    dirD1 = getIndexNodeNumberFromPathname("/d1/\0", 0);
+    if (fileA->sizeClass || fileC->sizeClass || fileE->sizeClass)
+    {
+        PRINT("testConsistencyCheck: 1000 byte files are not in single blocks\n");
+        return -1;
+    }
+
+    /* A block of A marked free: lost */
+    freeBlock = fileA->direct[1];
+    clearBit(BLOCK_BITMAP_OFFSET + freeBlock / 8, 7 - freeBlock % 8);
+    /* The last block marked in use: leaked, with the count off as well */
+    freeBlock = TOT_AVAILABLE_BLOCKS - 1;
+    setBit(BLOCK_BITMAP_OFFSET + freeBlock / 8, 7 - freeBlock % 8);
+    superblock()->freeBlocks -= 3;
+    /* C shares a block of A, and its own is leaked */
+    fileC->direct[0] = fileA->direct[0];
+    /* E points past the end, and its own block is leaked */
+    fileE->direct[2] = TOT_AVAILABLE_BLOCKS + 100;
+    /* D1 counts a file it does not have */
+    setFileSize(dirD1, getFileSize(dirD1) + FILE_INFO_SIZE);
+    /* B is freed behind its directory's back, leaving a dangling entry in a directory one too big */
+    clearIndexNode(fileB);
+    /* The head of the fragment chain no longer says it is listed */
+    fragBlock = superblock()->fragList;
+    listed = 0;
+    memcpy(blockAddress(fragBlock) + FRAG_HEADER_LISTED, &listed, sizeof(short));
+
+    memset(&report, 0, sizeof(report));
+    report.threads = 4;
+    fsckRun(&report);
+    if (report.leakedBlocks != 3 || report.lostBlocks != 1 || report.crossLinked != 1 || report.badPointers != 1
+            || report.badCounts != 2 || report.danglingEntries != 1 || report.orphans != 0
+            || report.badFreeCounts != 1 || report.badIndexNodes != 0 || report.badFragmentList != 1
+            || report.errors != 11 || report.repaired != 0)
+    {
+        PRINT("testConsistencyCheck: found %lld leaked %lld lost %lld cross linked %lld bad pointers "
+              "%lld bad counts %lld dangling %lld orphans %lld bad free counts %lld bad fragment chain\n",
+              report.leakedBlocks, report.lostBlocks, report.crossLinked, report.badPointers, report.badCounts,
+              report.danglingEntries, report.orphans, report.badFreeCounts, report.badFragmentList);
+        return -1;
+    }
+
+    /* Everything but the cross link is repaired */
+    memset(&report, 0, sizeof(report));
+    report.repair = 1;
+    fsckRun(&report);
+    memset(&report, 0, sizeof(report));
+    fsckRun(&report);
+    if (report.errors != 1 || report.crossLinked != 1 || fileE->direct[2] != -1)
+    {
+        PRINT("testConsistencyCheck: %lld errors left after repair\n", report.errors);
+        return -1;
+    }
+    fileC->direct[0] = -1;
+    memset(&report, 0, sizeof(report));
+    fsckRun(&report);
+    if (report.errors != 0)
+    {
+        PRINT("testConsistencyCheck: %lld errors left once the cross link is undone\n", report.errors);
+        return -1;
+    }
+
+    /* The repaired filesystem keeps working and stays consistent */
+    for (ii = 0 ; ii < 50 ; ii++)
+    {
+        sprintf(path, "/d1/g%d", ii);
+        indexNode = createIndexNode("reg\0", path, 0);
+        if (indexNode < 0 || writeToFile(indexNode, data, 60 + ii * 100, 0) != 60 + ii * 100)
+        {
+            PRINT("testConsistencyCheck: write after repair failed\n");
+            return -1;
+        }
+    }
+    deleteFile("/d0/f3\0");
+    memset(&report, 0, sizeof(report));
+    fsckRun(&report);
+    if (report.errors != 0)
+    {
+        PRINT("testConsistencyCheck: %lld errors after using the repaired filesystem\n", report.errors);
+        return -1;
+    }
+    PRINT("testConsistencyCheck: passed\n");
+    return 0;
+}
+
+/**
+ * Interleaves the writes of many files so their blocks are scattered, then
+ * defragments in small steps and checks the files come out contiguous and intact
+ *
+ * @return  int  0 on success, -1 on failure
+ */
+int testDefragmentation(void)
+{
+    struct RAM_fragScore score;
+    struct RAM_defrag defrag;
+    int indexNodes[30], deleted[30], ii, round, rounds, count, steps, freeBefore, before, movedDeleted;
+    char path[32], block[256], readBack[257];
+    struct RAM_fsck report;
+
+    freeImage(RAM_memory);
+    setGeometry(16UL << 20, 256, 256);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    /* 20 large files in 4 KB clusters and 10 that stay in single direct blocks,
+     * written a block at a time in turn */
+    count = 30;
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        sprintf(path, "/s%d", ii);
+        indexNodes[ii] = createIndexNode("reg\0", path, 0);
+        deleted[ii] = 0;
+    }
+    rounds = 200;
+    for (round = 0 ; round < rounds ; round++)
+    {
+        for (ii = 0 ; ii < count ; ii++)
+        {
+            if (ii >= 20 && round >= NUM_DIRECT)
+                continue;
+            memset(block, ii * 7 + round, sizeof(block));
+            writeToFile(indexNodes[ii], block, sizeof(block), (long long)round * sizeof(block));
+        }
+    }
+    /* Churn leaves holes between what is left */
+    for (ii = 0 ; ii < 20 ; ii += 4)
+    {
+        sprintf(path, "/s%d", ii);
+        deleteFile(path);
+        deleted[ii] = 1;
+    }
+
+    score.indexNode = -1;
+    fragScore(&score);
+    before = score.score;
+    score.indexNode = indexNodes[1];
+    fragScore(&score);
+    if (before < 500 || score.score < 500)
+    {
+        PRINT("testDefragmentation: interleaved files only score %d, filesystem %d\n", score.score, before);
+        return -1;
+    }
+
+    freeBefore = superblock()->freeBlocks;
+    movedDeleted = 0;
+    memset(&defrag, 0, sizeof(defrag));
+    defrag.threshold = 0;
+    defrag.budget = 64;
+    for (steps = 0 ; !defrag.done ; steps++)
+    {
+        if (defragStep(&defrag) < 0 || defrag.moved > defrag.budget + 15)
+        {
+            PRINT("testDefragmentation: step %d moved %lld blocks\n", steps, defrag.moved);
+            return -1;
+        }
+        /* A file deleted in the middle of being moved */
+        for (ii = 0 ; steps == 10 && ii < count ; ii++)
+        {
+            if (indexNodes[ii] == defrag.indexNode && defrag.cluster > 0 && !deleted[ii])
+            {
+                sprintf(path, "/s%d", ii);
+                deleteFile(path);
+                deleted[ii] = 1;
+                movedDeleted = 1;
+            }
+        }
+    }
+
+    score.indexNode = -1;
+    fragScore(&score);
+    if (score.score != 0 || steps < 20)
+    {
+        PRINT("testDefragmentation: filesystem scores %d after %d steps, %d before\n", score.score, steps, before);
+        return -1;
+    }
+    for (ii = 0 ; ii < count ; ii++)
+    {
+        if (deleted[ii])
+            continue;
+        for (round = 0 ; round < (ii >= 20 ? NUM_DIRECT : rounds) ; round++)
+        {
+            memset(block, ii * 7 + round, sizeof(block));
+            if (readFromFile(indexNodes[ii], readBack, sizeof(block), (long long)round * sizeof(block)) != sizeof(block)
+                    || memcmp(block, readBack, sizeof(block)))
+            {
+                PRINT("testDefragmentation: file %d has the wrong data in block %d\n", ii, round);
+                return -1;
+            }
+        }
+    }
+
+    memset(&report, 0, sizeof(report));
+    fsckRun(&report);
+    if (report.errors != 0 || !movedDeleted || superblock()->freeBlocks <= freeBefore)
+    {
+        PRINT("testDefragmentation: %lld errors, %d free blocks, %d before a file was deleted\n", report.errors,
+              superblock()->freeBlocks, freeBefore);
+        return -1;
+    }
+    PRINT("testDefragmentation: score %d to 0 in %d steps\n", before, steps);
+    PRINT("testDefragmentation: passed\n");
+    return 0;
+}
+
+/**
+ * Unlinks large files with the worker's deferred freeing on, and checks that the
+ * unlink leaves their blocks held, that they come back in bounded batches, and
+ * that an allocation short of space frees them itself
+ */
+int testDeferredFreeing(void)
+{
+    static char data[64 * 1024];
+    struct RAM_fsck report;
+    long long freed, batchMax;
+    int indexNode, other, freeBlocks, freeIndexNodes, held, batches, clusterBlocks, ii;
+
+    freeImage(RAM_memory);
+    setGeometry(32UL << 20, 256, 256);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+    deferredFreeing = 1; /* With no engine running, wakeReaper leaves the freeing to the test */
+
+    freeIndexNodes = superblock()->freeIndexNodes;
+    memset(data, 'd', sizeof(data));
+    indexNode = createIndexNode("reg\0", "/big\0", 0);
+    other = createIndexNode("reg\0", "/other\0", 0);
+    freeBlocks = superblock()->freeBlocks; /* The root directory has its block by now */
+    for (ii = 0 ; ii < 64 ; ii++)
+    {
+        writeToFile(indexNode, data, sizeof(data), (long long)ii * sizeof(data));
+        writeToFile(other, data, 1024, (long long)ii * 1024);
+    }
+    held = freeBlocks - superblock()->freeBlocks;
+
+    /* The unlink only puts the file on the dead list */
+    deleteFile("/big\0");
+    deleteFile("/other\0");
+    if (superblock()->freeBlocks != freeBlocks - held || superblock()->deadList != other
+            || indexNodeAt(indexNode)->type != RAM_TYPE_DEAD || indexNodeAt(other)->size != indexNode)
+    {
+        PRINT("testDeferredFreeing: unlink freed blocks or left the dead list at %d\n", superblock()->deadList);
+        return -1;
+    }
+
+    /* A descriptor left open on an unlinked file cannot touch the dead list link */
+    if (writeToFile(other, data, 1024, 1 << 20) != -1 || readFromFile(other, data, 10, 0) != -1
+            || truncateFile(other, 0) != -1 || punchHole(other, 0, 1024) != -1
+            || fallocateFile(other, 0, 1 << 20) != -1 || indexNodeAt(other)->size != indexNode)
+    {
+        PRINT("testDeferredFreeing: the data paths changed an unlinked file\n");
+        return -1;
+    }
+    memset(&report, 0, sizeof(report));
+    fsckRun(&report);
+    if (report.errors != 0)
+    {
+        PRINT("testDeferredFreeing: %lld errors with files waiting to be freed\n", report.errors);
+        return -1;
+    }
+
+    /* A batch frees its budget, give or take the cluster it stopped in */
+    clusterBlocks = 1 << indexNodeAt(indexNode)->sizeClass;
+    batches = 0;
+    batchMax = 0;
+    while (superblock()->deadList)
+    {
+        freed = reapDeadIndexNodes(DEFAULT_LOCK_BUDGET_BLOCKS);
+        if (freed > batchMax)
+            batchMax = freed;
+        batches++;
+    }
+    if (batchMax >= DEFAULT_LOCK_BUDGET_BLOCKS + clusterBlocks || batches < held / DEFAULT_LOCK_BUDGET_BLOCKS
+            || superblock()->freeBlocks != freeBlocks || superblock()->freeIndexNodes != freeIndexNodes)
+    {
+        PRINT("testDeferredFreeing: %d batches of up to %lld blocks left %d free blocks of %d\n",
+              batches, batchMax, superblock()->freeBlocks, freeBlocks);
+        return -1;
+    }
+
+    /* A file as large as the free space only fits once the unlinked one is freed */
+    indexNode = createIndexNode("reg\0", "/big\0", 0);
+    for (ii = 0 ; ii < 300 ; ii++)
+        writeToFile(indexNode, data, sizeof(data), (long long)ii * sizeof(data));
+    deleteFile("/big\0");
+    indexNode = createIndexNode("reg\0", "/big\0", 0);
+    for (ii = 0 ; ii < 300 ; ii++)
+    {
+        if (writeToFile(indexNode, data, sizeof(data), (long long)ii * sizeof(data)) != sizeof(data))
+        {
+            PRINT("testDeferredFreeing: write %d failed with blocks held by an unlinked file\n", ii);
+            return -1;
+        }
+    }
+    memset(&report, 0, sizeof(report));
+    fsckRun(&report);
+    deferredFreeing = 0;
+    if (report.errors != 0 || superblock()->deadList != 0)
+    {
+        PRINT("testDeferredFreeing: %lld errors after freeing on demand\n", report.errors);
+        return -1;
+    }
+    PRINT("testDeferredFreeing: %d blocks freed in %d batches\n", held, batches);
+    PRINT("testDeferredFreeing: passed\n");
+    return 0;
+}
+
+/**
+ * Runs long commands through the kr_* calls with a small lock budget, and checks that
+ * each call stops within it and that carrying on from where it stopped gives the
+ * same result as one unbounded call
+ */
+int testLockBudgets(void)
+{
+    static char data[1024 * 1024], readBack[1024 * 1024 + 1];
+    struct RAM_accessFile access;
+    struct RAM_lockBudget budget;
+    struct RAM_fsck report;
+    char path[32], entry[18];
+    int indexNode, directory, calls, listed, freeBlocks, perBlock, blocks, ii;
+    long long done, end;
+
+    freeImage(RAM_memory);
+    setGeometry(16UL << 20, 256, 1024);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+    budget.blocks = 64;
+    budget.us = 0;
+    kr_lockBudget(&budget);
+
+    for (ii = 0 ; ii < (int)sizeof(data) ; ii++)
+        data[ii] = (char)(ii * 13 + ii / 4096);
+    indexNode = createIndexNode("reg\0", "/big\0", 0);
+    freeBlocks = superblock()->freeBlocks; /* The root directory has its block now */
+
+    /* A 1 MB write and read each take a call per 64 blocks */
+    for (done = 0, calls = 0 ; done < (long long)sizeof(data) ; done += access.ret, calls++)
+    {
+        access.indexNode = indexNode;
+        access.address = data + done;
+        access.numBytes = sizeof(data) - done;
+        access.offset = done;
+        kr_write(&access);
+        if (access.ret <= 0 || access.ret > 64 * 256)
+        {
+            PRINT("testLockBudgets: write call %d wrote %lld bytes\n", calls, access.ret);
+            return -1;
+        }
+    }
+    if (calls != (int)(sizeof(data) / (64 * 256)))
+    {
+        PRINT("testLockBudgets: the write took %d calls\n", calls);
+        return -1;
+    }
+    access.offset = 0;
+    for (done = 0, calls = 0 ; done < (long long)sizeof(data) ; done += access.ret, calls++)
+    {
+        access.indexNode = indexNode;
+        access.address = readBack + done;
+        access.numBytes = sizeof(data) - done;
+        kr_read(&access);
+        if (access.ret <= 0 || access.ret > 64 * 256 || access.offset != done + access.ret)
+        {
+            PRINT("testLockBudgets: read call %d read %lld bytes\n", calls, access.ret);
+            return -1;
+        }
+    }
+    if (memcmp(data, readBack, sizeof(data)))
+    {
+        PRINT("testLockBudgets: the file reads back wrong after %d calls\n", calls);
+        return -1;
+    }
+
+    /* A time budget stops a write that the block budget would let through */
+    budget.blocks = 0;
+    budget.us = 1;
+    kr_lockBudget(&budget);
+    access.address = data;
+    access.numBytes = sizeof(data);
+    access.offset = 0;
+    kr_write(&access);
+    if (access.ret <= 0 || access.ret >= (long long)sizeof(data))
+    {
+        PRINT("testLockBudgets: a 1 us budget let a write do %lld bytes\n", access.ret);
+        return -1;
+    }
+    budget.blocks = 64;
+    budget.us = 0;
+    kr_lockBudget(&budget);
+
+    /* A hole is punched from its end, and a truncate shrinks the file a step at a time */
+    calls = 0;
+    end = 4096 + 512 * 1024;
+    do
+    {
+        access.offset = 4096;
+        access.numBytes = end - 4096;
+        kr_punchHole(&access);
+        end = access.offset;
+        calls++;
+    } while (access.ret == 1);
+    readFromFile(indexNode, readBack, sizeof(data), 0);
+    for (ii = 4096 ; ii < 4096 + 512 * 1024 && readBack[ii] == 0 ; ii++)
+        ;
+    if (access.ret != 0 || calls < 512 * 1024 / (64 * 256) || ii != 4096 + 512 * 1024
+            || memcmp(data, readBack, 4096) || memcmp(data + ii, readBack + ii, sizeof(data) - ii))
+    {
+        PRINT("testLockBudgets: hole punched in %d calls reads back wrong at %d\n", calls, ii);
+        return -1;
+    }
+    calls = 0;
+    do
+    {
+        access.offset = 0;
+        kr_truncate(&access);
+        calls++;
+    } while (access.ret == 1);
+    if (access.ret != 0 || getFileSize(indexNode) != 0 || calls < 2 || superblock()->freeBlocks != freeBlocks)
+    {
+        PRINT("testLockBudgets: truncate took %d calls and left %d free blocks of %d\n", calls,
+              superblock()->freeBlocks, freeBlocks);
+        return -1;
+    }
+
+    /* A directory with long runs of deleted entries is listed once, in bounded scans */
+    directory = createIndexNode("dir\0", "/d/\0", 0);
+    for (ii = 0 ; ii < 900 ; ii++)
+    {
+        sprintf(path, "/d/f%d", ii);
+        createIndexNode("reg\0", path, 0);
+    }
+    for (ii = 0 ; ii < 900 ; ii++)
+    {
+        sprintf(path, "/d/f%d", ii);
+        if (ii % 300 != 7)
+            deleteFile(path);
+    }
+    listed = 0;
+    calls = 0;
+    access.indexNode = directory;
+    access.address = entry;
+    access.dirIndex = 0;
+    access.offset = 0;
+    for (;;)
+    {
+        kr_readdir(&access);
+        calls++;
+        if (access.ret == 2)
+            continue;
+        if (access.ret != 1)
+            break;
+        sprintf(path, "f%d", 7 + 300 * listed);
+        if (strcmp(entry, path) || access.numOfFiles != 3)
+        {
+            PRINT("testLockBudgets: readdir gave %s of %d files\n", entry, access.numOfFiles);
+            return -1;
+        }
+        listed++;
+        access.dirIndex++;
+    }
+    /* From f607 on the directory is only deleted entries, a call per 8 of its blocks */
+    perBlock = RAM_BLOCK_SIZE / FILE_INFO_SIZE;
+    blocks = (900 + perBlock - 1) / perBlock - 608 / perBlock;
+    budget.blocks = 8;
+    budget.us = -1;
+    kr_lockBudget(&budget);
+    access.offset = 608;
+    ii = 0;
+    do
+    {
+        kr_readdir(&access);
+        ii++;
+    } while (access.ret == 2);
+    if (access.ret != 0 || listed != 3 || calls != 4 || ii != blocks / 8 + 1 || budget.blocks != 8 || budget.us != 0)
+    {
+        PRINT("testLockBudgets: listed %d files in %d calls, %d calls over %d blocks at 8 blocks\n", listed, calls, ii, blocks);
+        return -1;
+    }
+
+    memset(&report, 0, sizeof(report));
+    fsckRun(&report);
+    budget.blocks = DEFAULT_LOCK_BUDGET_BLOCKS;
+    budget.us = DEFAULT_LOCK_BUDGET_US;
+    kr_lockBudget(&budget);
+    if (report.errors != 0)
+    {
+        PRINT("testLockBudgets: %lld errors\n", report.errors);
+        return -1;
+    }
+    PRINT("testLockBudgets: passed\n");
+    return 0;
+}
+
+/**
+ * Queues requests from a streaming writer and a process doing small operations behind
+ * a busy core, and checks the order deficit round robin lets them in
+ */
+int testFairScheduling(void)
+{
+    static struct RAM_schedRequest writes[16], others[16], hold;
+    struct RAM_schedWeight weight;
+    struct RAM_schedStats stats;
+    int granted[32], count, ii, opensFirst, writesFirst, found;
+
+    memset(schedClients, 0, sizeof(schedClients));
+    schedCursor = 0;
+    schedBusy = 0;
+    if (!schedQueue(&hold, 100, RAM_OPEN, 0))
+    {
+        PRINT("testFairScheduling: a request to a free core had to wait\n");
+        return -1;
+    }
+
+    /* 16 writes of 256 KB get in line before 16 opens.  An open costs a 65th of a
+     * write, so every open should get in before the writer has saved up for one write */
+    for (ii = 0; ii < 16; ii++)
+        schedQueue(&writes[ii], 101, RAM_WRITE, 256 * 1024);
+    for (ii = 0; ii < 16; ii++)
+        schedQueue(&others[ii], 102, RAM_OPEN, 0);
+    memset(granted, 0, sizeof(granted));
+    opensFirst = 0;
+    writesFirst = 0;
+    for (count = 0; count < 32; count++)
+    {
+        schedLeave();
+        for (ii = 0; ii < 32; ii++)
+        {
+            if (!granted[ii] && (ii < 16 ? writes[ii].granted : others[ii - 16].granted))
+                break;
+        }
+        if (ii == 32)
+        {
+            PRINT("testFairScheduling: nothing was let in after %d requests\n", count);
+            return -1;
+        }
+        granted[ii] = 1;
+        if (ii < 16)
+            writesFirst++;
+        else if (writesFirst < 2)
+            opensFirst++;
+    }
+    if (opensFirst != 16)
+    {
+        PRINT("testFairScheduling: only %d opens got in before the second write\n", opensFirst);
+        return -1;
+    }
+
+    /* At weight 4 a writer gets 4 turns for every one of an equal writer at weight 1 */
+    weight.pid = 101;
+    weight.weight = 4;
+    kr_schedWeight(&weight);
+    for (ii = 0; ii < 16; ii++)
+    {
+        schedQueue(&writes[ii], 101, RAM_WRITE, 60 * 1024);
+        schedQueue(&others[ii], 102, RAM_WRITE, 60 * 1024);
+    }
+    memset(granted, 0, sizeof(granted));
+    writesFirst = 0;
+    for (count = 0; count < 10; count++)
+    {
+        schedLeave();
+        for (ii = 0; ii < 16; ii++)
+        {
+            if (!granted[ii] && writes[ii].granted)
+            {
+                granted[ii] = 1;
+                writesFirst++;
+            }
+        }
+    }
+    while (schedBusy)
+        schedLeave();
+    if (weight.weight != 4 || writesFirst < 7 || writesFirst > 9)
+    {
+        PRINT("testFairScheduling: the writer at weight 4 got %d of the first 10 turns\n", writesFirst);
+        return -1;
+    }
+
+    /* Both processes show up in the statistics with every request they made */
+    found = 0;
+    stats.index = 0;
+    for (;;)
+    {
+        kr_schedStats(&stats);
+        if (stats.index < 0)
+            break;
+        if ((stats.pid == 101 || stats.pid == 102) && stats.requests == 32 && stats.queued == 0)
+            found++;
+        stats.index++;
+    }
+    weight.weight = SCHED_MAX_WEIGHT + 1;
+    kr_schedWeight(&weight);
+    memset(schedClients, 0, sizeof(schedClients));
+    if (found != 2 || weight.weight != -1)
+    {
+        PRINT("testFairScheduling: statistics for %d of 2 processes\n", found);
+        return -1;
+    }
+
+    PRINT("testFairScheduling: passed\n");
+    return 0;
+}
+
+/**
+ * Times made up calls into the histograms, and checks the buckets and the percentiles
+ * read back stay within a bucket of the real ones
+ */
+int testLatencyHistograms(void)
+{
+    struct RAM_latency latency;
+    unsigned long long ns;
+    char report[4096];
+    int ii, bucket;
+
+    /* Every time lands in a bucket whose top is at most an eighth past it */
+    for (ns = 0, bucket = -1; ns < (1ULL << LAT_MAX_SHIFT); ns = ns < 64 ? ns + 1 : ns * 9 / 8)
+    {
+        if (latencyBucket(ns) < bucket || latencyBucketTop(latencyBucket(ns)) < ns
+                || latencyBucketTop(latencyBucket(ns)) > ns + ns / LAT_SUB_BUCKETS)
+        {
+            PRINT("testLatencyHistograms: %llu ns went to bucket %d\n", ns, latencyBucket(ns));
+            return -1;
+        }
+        bucket = latencyBucket(ns);
+    }
+
+    /* Reads waiting 1 to 1000 us and taking a tenth of that */
+    latencyReset();
+    for (ii = 1; ii <= 1000; ii++)
+        latencyRecord(RAM_READ, ii * 1000ULL, ii * 100ULL);
+    latencyRecord(RAM_OPEN, 5000, 2000);
+    latency.command = RAM_READ;
+    latency.reset = 0;
+    kr_latency(&latency);
+    if (latency.count != 1000 || latency.waitMax != 1000000 || latency.serviceMax != 100000
+            || latency.waitP50 < 500000 || latency.waitP50 > 500000 + 500000 / LAT_SUB_BUCKETS
+            || latency.waitP99 < 990000 || latency.waitP999 < 999000 || latency.waitP999 > 1000000
+            || latency.serviceP50 < 50000 || latency.serviceP50 > 50000 + 50000 / LAT_SUB_BUCKETS)
+    {
+        PRINT("testLatencyHistograms: %lld reads, p50 %lld p99 %lld p99.9 %lld max %lld\n",
+              latency.count, latency.waitP50, latency.waitP99, latency.waitP999, latency.waitMax);
+        return -1;
+    }
+
+    /* The report has a line for each command timed, and a reset empties them all */
+    latencyReport(report, sizeof(report));
+    if (!strstr(report, "\nread ") || !strstr(report, "\nopen ") || strstr(report, "\nwrite "))
+    {
+        PRINT("testLatencyHistograms: report\n%s", report);
+        return -1;
+    }
+    latency.command = RAM_OPEN;
+    latency.reset = 1;
+    kr_latency(&latency);
+    latency.reset = 0;
+    kr_latency(&latency);
+    if (latency.count != 0 || latencyReport(report, sizeof(report)) != (int)strlen(report)
+            || strchr(report, '\n') != report + strlen(report) - 1)
+    {
+        PRINT("testLatencyHistograms: %lld opens left after a reset\n", latency.count);
+        return -1;
+    }
+
+    PRINT("testLatencyHistograms: passed\n");
+    return 0;
+}
+#endif
+
+/************************ Kernel Implementations *****************************/
+/* Shared by the module ioctl entry point and the in-process engine */
+
+/**
+ * Notes a change to a file's data or size, so buffering readers can tell
+ *
+ * @return  unsigned int  the file's new write generation
+ * @param[in]  indexNode  the file
+ */
+static unsigned int bumpGeneration(int indexNode)
+{
+    return ++writeGenerations[(unsigned int)indexNode % WRITE_GENERATIONS];
+}
+
+static unsigned int fileGeneration(int indexNode)
+{
+    return writeGenerations[(unsigned int)indexNode % WRITE_GENERATIONS];
+}
+
+/**
+ * Kernel pair for the create function
+ *
+ * @param[in]   input   The RAM_path struct for creating the file
+ */
+void kr_creat(struct RAM_path *input)
+{
+    int indexNodeNum;
+    indexNodeNum = createIndexNode("reg\0", input->name, 0);
+    /* A file known to outgrow a fragment goes straight to blocks, and a large one
+     * starts in large clusters instead of moving there later */
+    if (indexNodeNum >= 0 && input->sizeHint > FRAGMENT_MAX_SIZE)
+        moveSmallDataToBlocks(indexNodeNum);
+    if (indexNodeNum >= 0 && input->sizeHint > NUM_DIRECT * RAM_BLOCK_SIZE)
+        setFileSizeClass(indexNodeNum, largeSizeClass());
+    input->ret = indexNodeNum;
+}
+
+/**
+ * Kernel pair for making a new directory
+ *
+ * @param[in]   input   The RAM_path struct for creating the file
+ */
+void kr_mkdir(struct RAM_path *input)
+{
+    int indexNodeNum;
+    indexNodeNum = createIndexNode("dir\0", input->name, 0);
+    PRINT("New Dir made with INODE: %d\n",indexNodeNum);
+    input->ret = indexNodeNum;
+}
+
+/**
+ * Kernel pair for opening a file
+ *
+ * @param[in]   input   The RAM_path struct for opening the file
+ */
+void kr_open(struct RAM_file *input)
+{
+    int indexNodeNum;
+
+    PRINT("Opening pathname: %s\n",input->name);
+    indexNodeNum = getIndexNodeNumberFromPathname(input->name, 0);
+
+    PRINT("INDEX NODE: %d\n", indexNodeNum);
+    input->indexNode = indexNodeNum;
+    input->fileSize = indexNodeNum < 0 ? 0 : getFileSize(indexNodeNum);
+}
+
+void kr_read(struct RAM_accessFile *input)
+{
+    struct RAM_budget budget;
+    long long ret, piece, limit;
+
+    /* A read past the budget stops short, the library calls again for the rest */
+    limit = input->numBytes;
+    if (lockBudgetBlocks && limit > (long long)lockBudgetBlocks * RAM_BLOCK_SIZE)
+        limit = (long long)lockBudgetBlocks * RAM_BLOCK_SIZE;
+    budgetStart(&budget);
+    ret = 0;
+    do
+    {
+        piece = (long long)BUDGET_CHECK_BLOCKS * RAM_BLOCK_SIZE;
+        if (piece > limit - ret)
+            piece = limit - ret;
+        piece = readFromFile(input->indexNode, input->address + ret, piece, input->offset + ret);
+        if (piece < 0)
+        {
+            ret = ret ? ret : -1;
+            break;
+        }
+        ret += piece;
+        if (piece < (long long)BUDGET_CHECK_BLOCKS * RAM_BLOCK_SIZE || ret >= limit)
+            break; /* The end of the file or of the request */
+    } while (!budgetCharge(&budget, (long)(piece / RAM_BLOCK_SIZE)));
+    input->ret = ret;
+    input->offset = input->offset + (ret > 0 ? ret : 0);
+    /* Hand back the current size and generation so the library can notice writes from other processes */
+    input->fileSize = getFileSize(input->indexNode);
+    input->generation = fileGeneration(input->indexNode);
+}
+void kr_write(struct RAM_accessFile *input)
+{
+    struct RAM_budget budget;
+    long long ret, piece, written, limit;
+
+    /* A write past the budget stops short, the library calls again for the rest */
+    limit = input->numBytes;
+    if (lockBudgetBlocks && limit > (long long)lockBudgetBlocks * RAM_BLOCK_SIZE)
+        limit = (long long)lockBudgetBlocks * RAM_BLOCK_SIZE;
+    budgetStart(&budget);
+    ret = 0;
+    do
+    {
+        piece = (long long)BUDGET_CHECK_BLOCKS * RAM_BLOCK_SIZE;
+        if (piece > limit - ret)
+            piece = limit - ret;
+        written = writeToFile(input->indexNode, input->address + ret, piece, input->offset + ret);
+        if (written < 0)
+        {
+            if (ret > 0)
+                bumpGeneration(input->indexNode);
+            input->ret = -1;
+            return;
+        }
+        ret += written;
+        if (written < piece || ret >= limit)
+            break; /* Out of space, or done */
+    } while (!budgetCharge(&budget, (long)(written / RAM_BLOCK_SIZE)));
+    input->ret = ret;
+    input->fileSize = getFileSize(input->indexNode);
+    input->generation = ret > 0 ? bumpGeneration(input->indexNode) : fileGeneration(input->indexNode);
+    PRINT("Bytes written: %lld\n", ret);
+}
+void kr_lseek(struct RAM_file *input)
+{}
+
+void kr_unlink(struct RAM_path *input)
+{
+    int ret;
+    ret = deleteFile(input->name);
+    input->ret = ret;
+}
+
+void kr_readdir(struct RAM_accessFile *input)
+{
+    int ret, found;
+    PRINT("Reading the dir %d\n", input->indexNode);
+    if (input->dirIndex > 0 && input->offset <= 0)
+    {
+        /* A caller without a cursor, the entry is counted from the start */
+        ret = readFileName(input->indexNode, input->address, input->dirIndex);
+        input->ret = ret > -1 ? 1 : -1;
+    }
+    else
+    {
+        ret = readDirectoryFrom(input->indexNode, input->address, &input->offset, &found);
+        input->ret = ret > -1 ? found : -1;
+    }
+    input->numOfFiles = ret;
+    PRINT("num of files: %d\n", ret);
+}
+
+void kr_punchHole(struct RAM_accessFile *input)
+{
+    long long start, end;
+
+    /* Only the tail the budget covers goes now, ret 1 asks for a call for the rest */
+    end = input->offset + input->numBytes;
+    start = budgetRangeStart(input->indexNode, input->offset, end);
+    input->ret = punchHole(input->indexNode, start, end - start);
+    if (input->ret == 0 && start > input->offset)
+        input->ret = 1;
+    input->offset = start;
+    input->numBytes = end - start;
+    input->fileSize = getFileSize(input->indexNode);
+    input->generation = input->ret >= 0 ? bumpGeneration(input->indexNode) : fileGeneration(input->indexNode);
+}
+
+void kr_truncate(struct RAM_accessFile *input)
+{
+    long long length;
+
+    /* A file shrinks by at most the budget, ret 1 asks for a call for the rest */
+    length = budgetRangeStart(input->indexNode, input->offset, getFileSize(input->indexNode));
+    input->ret = truncateFile(input->indexNode, length);
+    if (input->ret == 0 && length > input->offset)
+        input->ret = 1;
+    input->offset = length;
+    input->fileSize = getFileSize(input->indexNode);
+    input->generation = input->ret >= 0 ? bumpGeneration(input->indexNode) : fileGeneration(input->indexNode);
+}
+
+void kr_fallocate(struct RAM_accessFile *input)
+{
+    input->ret = fallocateFile(input->indexNode, input->offset, input->numBytes);
+    input->fileSize = getFileSize(input->indexNode);
+    input->generation = input->ret >= 0 ? bumpGeneration(input->indexNode) : fileGeneration(input->indexNode);
+}
+
+void kr_reclaim(struct RAM_reclaim *input)
+{
+    if (input->watermark >= 0)
+        reclaimWatermark = (unsigned long)input->watermark;
+    input->released = reclaimChunks();
+}
+
+void kr_fragScore(struct RAM_fragScore *input)
+{
+    if (fragScore(input) < 0)
+        input->score = -1;
+}
+
+void kr_defrag(struct RAM_defrag *input)
+{
+    if (defragStep(input) < 0)
+        input->done = -1;
+}
+
+void kr_fsck(struct RAM_fsck *input)
+{
+    if (fsckRun(input) < 0)
+        input->errors = -1;
+}
+
+void kr_lockBudget(struct RAM_lockBudget *input)
+{
+    if (input->blocks >= 0)
+        lockBudgetBlocks = input->blocks;
+    if (input->us >= 0)
+        lockBudgetUs = (long)input->us;
+    input->blocks = lockBudgetBlocks;
+    input->us = lockBudgetUs;
+}
+
+void kr_schedWeight(struct RAM_schedWeight *input)
+{
+    int slot;
+
+    SCHED_LOCK();
+    slot = schedClient(input->pid ? input->pid : schedCaller());
+    if (slot < 0 || input->weight > SCHED_MAX_WEIGHT || input->weight == 0 || input->weight < -1)
+    {
+        input->weight = -1;
+    }
+    else
+    {
+        if (input->weight > 0)
+            schedClients[slot].weight = input->weight;
+        input->weight = schedClients[slot].weight;
+    }
+    SCHED_UNLOCK();
+}
+
+void kr_schedStats(struct RAM_schedStats *input)
+{
+    struct RAM_schedClient *client;
+    int ii;
+
+    SCHED_LOCK();
+    for (ii = input->index < 0 ? 0 : input->index; ii < SCHED_CLIENTS && !schedClients[ii].id; ii++)
+        ;
+    if (ii < SCHED_CLIENTS)
+    {
+        client = &schedClients[ii];
+        input->index = ii;
+        input->pid = client->id;
+        input->weight = client->weight;
+        input->queued = client->queued;
+        input->requests = (long long)client->requests;
+        input->bytes = (long long)client->bytes;
+        input->waitUs = (long long)(client->waitNs / 1000);
+        input->maxWaitUs = (long long)(client->maxWaitNs / 1000);
+    }
+    else
+    {
+        input->index = -1;
+        input->pid = 0;
+    }
+    SCHED_UNLOCK();
+}
+
+void kr_latency(struct RAM_latency *input)
+{
+    if (_IOC_NR(input->command) < LAT_COMMANDS)
+    {
+        latencyRead(_IOC_NR(input->command), input);
+    }
+    else
+    {
+        input->count = 0;
+        input->waitP50 = input->waitP99 = input->waitP999 = input->waitMax = 0;
+        input->serviceP50 = input->serviceP99 = input->serviceP999 = input->serviceMax = 0;
+    }
+    if (input->reset)
+        latencyReset();
+}
+
+/************************ End of Kernel Implementations *****************************/
+
+/************************INIT AND EXIT ROUTINES*****************************/
+#ifdef DEBUG
+
+/* Serializes engine calls the same way FS_mutex serializes ioctls in the module */
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t *engineLock = &engine_mutex;
+/* Held by a snapshot from start to end, so a second one waits rather than writing the same file */
+static pthread_mutex_t snapshotMutex = PTHREAD_MUTEX_INITIALIZER;
+static int engineInitialized;
+
+/* Format parameters for the next init, the DEBUG counterpart of the module parameters */
+static unsigned long engineFsSize = DEFAULT_FS_SIZE;
+static int engineBlockSize = DEFAULT_BLOCK_SIZE;
+static int engineInodeCount = DEFAULT_INODE_COUNT;
+
+/* Magic placed in a shared segment once the creator has finished formatting it */
+#define SHARED_SEGMENT_MAGIC 0x52414D44 /* "RAMD" */
+#define SHARED_HEADER_SIZE 4096 /* Keeps the filesystem image page aligned */
+
+/**
+ * Header at the start of a shared segment, the filesystem image follows it.
+ * The mutex is robust and process shared, so a process dying inside the core
+ * does not wedge everyone else.
+ */
+struct RAM_sharedHeader
+{
+    volatile int magic;
+    pthread_mutex_t mutex;
+    unsigned int generations[WRITE_GENERATIONS];
+};
+RAM_STATIC_ASSERT(sizeof(struct RAM_sharedHeader) <= SHARED_HEADER_SIZE, shared_header_size);
+
+/**
+ * Takes the engine lock, recovering it if the previous owner died holding it
+ */
+static void lockEngine(void)
+{
+    if (pthread_mutex_lock(engineLock) == EOWNERDEAD)
+    {
+        /* Metadata may be half updated, but the lock is usable again */
+        fprintf(stderr, "ramdisk: engine lock owner died, recovering\n");
+        pthread_mutex_consistent(engineLock);
+    }
+}
+
+static void unlockEngine(void)
+{
+    pthread_mutex_unlock(engineLock);
+}
+
+/* The worker that frees the blocks of unlinked files.  It is started by the first
+ * unlink in each process, a child forked from a process running one starts its own */
+static pthread_mutex_t reaperMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaperWake = PTHREAD_COND_INITIALIZER;
+static pid_t reaperOwner;
+static int reaperPending;
+
+/**
+ * Frees the blocks of unlinked files a batch per hold of the engine lock, so
+ * other calls never wait behind more than one batch
+ */
+static void *reaperRun(void *arg)
+{
+    int more;
+
+    (void)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&reaperMutex);
+        while (!reaperPending)
+            pthread_cond_wait(&reaperWake, &reaperMutex);
+        reaperPending = 0;
+        pthread_mutex_unlock(&reaperMutex);
+
+        do
+        {
+            lockEngine();
+            /* Pointers are cleared as blocks go, the next incremental snapshot needs them */
+            dirtyMarking = dirtyMap;
+            reapDeadIndexNodes(lockBudgetBlocks ? lockBudgetBlocks : -1);
+            dirtyMarking = NULL;
+            more = superblock()->deadList != 0;
+            unlockEngine();
+            sched_yield();
+        } while (more);
+    }
+    return NULL;
+}
+
+/**
+ * Tells the worker there are blocks to free, starting it if this process has none
+ *
+ * @remark  Called with the engine lock held
+ */
+static void wakeReaper(void)
+{
+    pthread_t thread;
+
+    /* Without an engine the caller reaps for itself */
+    if (!deferredFreeing || !engineInitialized)
+        return;
+    if (reaperOwner != getpid())
+    {
+        /* A forked child inherits neither the thread nor a usable mutex */
+        pthread_mutex_init(&reaperMutex, NULL);
+        pthread_cond_init(&reaperWake, NULL);
+        reaperPending = 0;
+        if (pthread_create(&thread, NULL, reaperRun, NULL))
+        {
+            reapDeadIndexNodes(-1); /* No worker, free them now */
+            return;
+        }
+        pthread_detach(thread);
+        reaperOwner = getpid();
+    }
+    pthread_mutex_lock(&reaperMutex);
+    reaperPending = 1;
+    pthread_cond_signal(&reaperWake);
+    pthread_mutex_unlock(&reaperMutex);
+}
+
+/**
+ * Brings up an in-process ramdisk, the userspace equivalent of loading the module
+ *
+ * @return  int  0 on success, -1 if the memory could not be allocated
+ * @remark  Calling this more than once keeps the existing filesystem
+ */
+int ramdisk_engine_init(void)
+{
+    lockEngine();
+    if (!engineInitialized)
+    {
+        if (setGeometry(engineFsSize, engineBlockSize, engineInodeCount) < 0 || allocScratch() < 0)
+        {
+            unlockEngine();
+            return -1;
+        }
+        RAM_memory = allocImage(FS_SIZE);
+        if (RAM_memory == NULL)
+        {
+            unlockEngine();
+            return -1;
+        }
+        init_ramdisk();
+        engineInitialized = 1;
+        deferredFreeing = 1;
+    }
+    unlockEngine();
+    return 0;
+}
+
+/**
+ * Sets the geometry used when the engine formats its ramdisk
+ *
+ * @return  int  0 on success, -1 if the geometry is invalid or the engine is already running
+ * @param[in]  fsSize  total bytes of ramdisk memory
+ * @param[in]  blockSize  bytes per block, a power of 2 from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
+ * @param[in]  inodeCount  number of index nodes
+ */
+int ramdisk_engine_configure(unsigned long fsSize, int blockSize, int inodeCount)
+{
+    if (engineInitialized)
+        return -1;
+
+    /* Validate now rather than failing later at init */
+    if (setGeometry(fsSize, blockSize, inodeCount) < 0)
+        return -1;
+
+    engineFsSize = fsSize;
+    engineBlockSize = blockSize;
+    engineInodeCount = inodeCount;
+    return 0;
+}
+
+/**
+ * Brings up a ramdisk in shared memory that several processes run the core on directly
+ *
+ * @return  int  0 on success, -1 on failure
+ * @param[in]  name  shm_open name to create or attach to, or NULL for an anonymous
+ *                   memfd segment that is shared with children forked afterwards
+ * @remark  The first process to create a named segment formats it, later ones attach
+ */
+int ramdisk_engine_init_shared(const char *name)
+{
+    int fd, creator;
+    size_t segmentSize;
+    char *segment;
+    struct RAM_sharedHeader *header;
+    pthread_mutexattr_t attr;
+
+    if (engineInitialized)
+        return 0;
+
+    if (setGeometry(engineFsSize, engineBlockSize, engineInodeCount) < 0 || allocScratch() < 0)
+        return -1;
+
+    segmentSize = SHARED_HEADER_SIZE + FS_SIZE;
+    creator = 1;
+    if (name == NULL)
+    {
+        fd = memfd_create("ramdisk", 0);
+    }
+    else
+    {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST)
+        {
+            creator = 0;
+            fd = shm_open(name, O_RDWR, 0600);
+        }
+    }
+    if (fd < 0)
+        return -1;
+
+    if (creator && ftruncate(fd, segmentSize) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* An attacher may get here before the creator has sized the segment, and
+     * the size it picked is the one that counts, not our own parameters */
+    if (!creator)
+    {
+        struct stat st;
+        do
+        {
+            if (fstat(fd, &st) < 0)
+            {
+                close(fd);
+                return -1;
+            }
+            if (st.st_size <= SHARED_HEADER_SIZE)
+                sched_yield();
+        }
+        while (st.st_size <= SHARED_HEADER_SIZE);
+        segmentSize = st.st_size;
+    }
+
+    segment = (char *)mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); /* The mapping keeps the segment alive */
+    if (segment == MAP_FAILED)
+        return -1;
+
+    /* Only takes effect where shmem huge pages are set to advise */
+    madvise(segment, segmentSize, MADV_HUGEPAGE);
+
+    header = (struct RAM_sharedHeader *)segment;
+    RAM_memory = segment + SHARED_HEADER_SIZE;
+    imageShared = 1;
+    imageZeroed = creator; /* A new segment reads as zeros */
+
+    if (creator)
+    {
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        init_ramdisk();
+        __sync_synchronize();
+        header->magic = SHARED_SEGMENT_MAGIC;
+    }
+    else
+    {
+        /* Wait for the creator to finish formatting */
+        while (header->magic != SHARED_SEGMENT_MAGIC)
+            sched_yield();
+        __sync_synchronize();
+
+        /* Take the layout from the segment's superblock */
+        if (loadGeometry() < 0 || allocScratch() < 0)
+        {
+            munmap(segment, segmentSize);
+            return -1;
+        }
+    }
+
+    engineLock = &header->mutex;
+    writeGenerations = header->generations;
+    engineInitialized = 1;
+    deferredFreeing = 1;
+    return 0;
+}
+
+/**
+ * Writes all of a buffer at an offset of a file
+ *
+ * @return  int  0 on success, -1 on a write error
+ */
+static int writeAll(int fd, const char *data, unsigned long length, unsigned long offset)
+{
+    ssize_t done;
+
+    while (length > 0)
+    {
+        done = pwrite(fd, data, length, (off_t)offset);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += done;
+        length -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+/* Metadata journal record types */
+#define JOURNAL_CREATE 1    /* path, a is the size hint */
+#define JOURNAL_MKDIR 2     /* path */
+#define JOURNAL_UNLINK 3    /* path */
+#define JOURNAL_SIZE 4      /* indexNode, a is the new size */
+#define JOURNAL_FALLOCATE 5 /* indexNode, a and b give the range */
+#define JOURNAL_PUNCH 6     /* indexNode, a and b give the range */
+
+/**
+ * A journal record, followed in the file by pathLength bytes of path.  Records name
+ * index nodes by number, which replay reproduces since it runs the same operations
+ * in the same order over the same snapshot
+ */
+struct RAM_journalRecord
+{
+    unsigned int checksum;     /* FNV-1a of the rest of the record and the path, a torn tail fails it */
+    unsigned short type;
+    unsigned short pathLength;
+    int indexNode;
+    int reserved;
+    long long a;
+    long long b;
+};
+
+/**
+ * Write-ahead journal of metadata operations.  Records are appended under the engine
+ * lock, so they are in the order the operations were applied, and made durable after
+ * it is released by group commit: one caller writes and fsyncs everything appended so
+ * far while the others wait for it, so a busy engine pays one fsync per batch.  A batch
+ * that fails to write stays at the front of the buffer and the next commit retries it
+ */
+struct RAM_journal
+{
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t committed;
+    char *buffer;              /* Records appended and not yet handed to a commit */
+    char *spare;               /* The other buffer, written out by the commit in progress */
+    size_t used, capacity, spareCapacity;
+    unsigned long end;         /* Bytes in the file */
+    unsigned long long appended;  /* Sequence number of the last record appended */
+    unsigned long long durable;   /* Sequence number of the last record on disk */
+    int committing;
+    int lost;                  /* A record could not be kept, commits fail until a snapshot */
+    unsigned long long records, commits;
+};
+
+// @var The journal, NULL while journaling is off */
+static struct RAM_journal *journal;
+
+static unsigned int journalChecksum(const struct RAM_journalRecord *record, const char *path)
+{
+    const unsigned char *bytes;
+    unsigned int hash;
+    size_t ii;
+
+    hash = 2166136261u;
+    bytes = (const unsigned char *)record + sizeof(record->checksum);
+    for (ii = 0; ii < sizeof(*record) - sizeof(record->checksum); ii++)
+        hash = (hash ^ bytes[ii]) * 16777619u;
+    for (ii = 0; ii < record->pathLength; ii++)
+        hash = (hash ^ (unsigned char)path[ii]) * 16777619u;
+    return hash;
+}
+
+/**
+ * Appends a record to the journal buffer
+ *
+ * @return  unsigned long long  the record's sequence number.  Out of memory the record is
+ *          lost and the journal marked so, committing the number then fails
+ * @require  the engine lock is held, so records go in the order operations were applied
+ */
+static unsigned long long journalAppend(int type, int indexNode, long long a, long long b, const char *path)
+{
+    struct RAM_journalRecord record;
+    unsigned long long sequence;
+    size_t needed;
+    char *grown;
+
+    memset(&record, 0, sizeof(record));
+    record.type = (unsigned short)type;
+    record.pathLength = path ? (unsigned short)strlen(path) : 0;
+    record.indexNode = indexNode;
+    record.a = a;
+    record.b = b;
+    record.checksum = journalChecksum(&record, path);
+
+    pthread_mutex_lock(&journal->mutex);
+    needed = journal->used + sizeof(record) + record.pathLength;
+    if (needed > journal->capacity)
+    {
+        grown = (char *)realloc(journal->buffer, needed * 2);
+        if (grown == NULL)
+        {
+            /* Later records would replay without this one, so none of them are kept */
+            journal->lost = 1;
+            sequence = ++journal->appended;
+            pthread_mutex_unlock(&journal->mutex);
+            return sequence;
+        }
+        journal->buffer = grown;
+        journal->capacity = needed * 2;
+    }
+    memcpy(journal->buffer + journal->used, &record, sizeof(record));
+    if (path)
+        memcpy(journal->buffer + journal->used + sizeof(record), path, record.pathLength);
+    journal->used = needed;
+    journal->records++;
+    sequence = ++journal->appended;
+    pthread_mutex_unlock(&journal->mutex);
+    return sequence;
+}
+
+/**
+ * Waits until a record is on disk, writing it and everything before it if no one else is
+ *
+ * @return  int  0 once durable, -1 if the journal could not be written or lost a record
+ * @param[in]  sequence  the record's sequence number
+ * @remark  Called without the engine lock, so operations keep running during the fsync
+ *          and their records make up the next batch
+ */
+static int journalCommit(unsigned long long sequence)
+{
+    unsigned long long target;
+    size_t length, capacity, needed;
+    char *data, *grown;
+    int ret;
+
+    ret = 0;
+    pthread_mutex_lock(&journal->mutex);
+    while (journal->durable < sequence && ret == 0)
+    {
+        if (journal->lost)
+        {
+            ret = -1;
+            break;
+        }
+        if (journal->committing)
+        {
+            pthread_cond_wait(&journal->committed, &journal->mutex);
+            continue;
+        }
+
+        /* Lead this batch: take the buffer and let appends go on in the spare */
+        journal->committing = 1;
+        target = journal->appended;
+        data = journal->buffer;
+        length = journal->used;
+        capacity = journal->capacity;
+        journal->buffer = journal->spare;
+        journal->capacity = journal->spareCapacity;
+        journal->used = 0;
+        pthread_mutex_unlock(&journal->mutex);
+
+        if (writeAll(journal->fd, data, length, journal->end) < 0 || fdatasync(journal->fd) < 0)
+            ret = -1;
+
+        pthread_mutex_lock(&journal->mutex);
+        if (ret == 0)
+        {
+            journal->end += length;
+            journal->durable = target;
+        }
+        else
+        {
+            /* Put the batch back ahead of what was appended meanwhile, the next commit
+             * writes it again at the same offset */
+            needed = length + journal->used;
+            grown = needed > capacity ? (char *)realloc(data, needed) : data;
+            if (grown != NULL)
+            {
+                memcpy(grown + length, journal->buffer, journal->used);
+                data = journal->buffer;
+                journal->buffer = grown;
+                journal->used = needed;
+                needed = needed > capacity ? needed : capacity;
+                capacity = journal->capacity;
+                journal->capacity = needed;
+            }
+            else
+                journal->lost = 1;
+        }
+        journal->spare = data;
+        journal->spareCapacity = capacity;
+        journal->commits++;
+        journal->committing = 0;
+        pthread_cond_broadcast(&journal->committed);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return ret;
+}
+
+/**
+ * Empties the journal once a snapshot holds everything in it
+ *
+ * @require  the engine lock is held and the snapshot is on disk
+ */
+static void journalCheckpoint(void)
+{
+    pthread_mutex_lock(&journal->mutex);
+    while (journal->committing)
+        pthread_cond_wait(&journal->committed, &journal->mutex);
+    if (ftruncate(journal->fd, 0) == 0 && fdatasync(journal->fd) == 0)
+    {
+        /* Operations waiting on their records are durable through the snapshot */
+        journal->used = 0;
+        journal->end = 0;
+        journal->lost = 0;
+        journal->durable = journal->appended;
+        pthread_cond_broadcast(&journal->committed);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+/**
+ * Records a metadata operation that just succeeded
+ *
+ * @return  unsigned long long  sequence number to commit, 0 if nothing was recorded
+ * @param[in]  cmd  the RAM_* command
+ * @param[in]  arg  its struct, holding the results
+ * @param[in]  sizeBefore  for RAM_WRITE, the file size before the write
+ * @require  the engine lock is held
+ */
+static unsigned long long journalOperation(unsigned int cmd, void *arg, long long sizeBefore)
+{
+    struct RAM_path *path;
+    struct RAM_accessFile *access;
+
+    path = (struct RAM_path *)arg;
+    access = (struct RAM_accessFile *)arg;
+    switch (cmd)
+    {
+    case RAM_CREATE:
+        return path->ret < 0 ? 0 : journalAppend(JOURNAL_CREATE, path->ret, path->sizeHint, 0, path->name);
+    case RAM_MKDIR:
+        return path->ret < 0 ? 0 : journalAppend(JOURNAL_MKDIR, path->ret, 0, 0, path->name);
+    case RAM_UNLINK:
+        return path->ret < 0 ? 0 : journalAppend(JOURNAL_UNLINK, -1, 0, 0, path->name);
+    case RAM_WRITE:
+        /* Data is not journaled, only the size it leaves the file with */
+        if (access->ret <= 0 || access->fileSize == sizeBefore)
+            return 0;
+        return journalAppend(JOURNAL_SIZE, access->indexNode, access->fileSize, 0, NULL);
+    case RAM_TRUNCATE:
+        return access->ret < 0 ? 0 : journalAppend(JOURNAL_SIZE, access->indexNode, access->offset, 0, NULL);
+    case RAM_FALLOCATE:
+        return access->ret < 0 ? 0 : journalAppend(JOURNAL_FALLOCATE, access->indexNode, access->offset,
+                                                   access->numBytes, NULL);
+    case RAM_PUNCH_HOLE:
+        return access->ret < 0 ? 0 : journalAppend(JOURNAL_PUNCH, access->indexNode, access->offset,
+                                                   access->numBytes, NULL);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Fails a journaled operation whose record did not reach the disk
+ *
+ * @param[in]  cmd  a command journalOperation recorded
+ * @param[in-out]  arg  its struct, ret is set to -1
+ */
+static void journalFailOperation(unsigned int cmd, void *arg)
+{
+    if (cmd == RAM_CREATE || cmd == RAM_MKDIR || cmd == RAM_UNLINK)
+        ((struct RAM_path *)arg)->ret = -1;
+    else
+        ((struct RAM_accessFile *)arg)->ret = -1;
+}
+
+/**
+ * Applies one journal record to the ramdisk
+ *
+ * @return  int  0 on success, -1 if the record does not fit the ramdisk it is replayed on
+ */
+static int replayRecord(const struct RAM_journalRecord *record, char *path)
+{
+    struct RAM_path create;
+
+    switch (record->type)
+    {
+    case JOURNAL_CREATE:
+        create.name = path;
+        create.sizeHint = (int)record->a;
+        kr_creat(&create);
+        return create.ret == record->indexNode ? 0 : -1;
+    case JOURNAL_MKDIR:
+        return createIndexNode("dir\0", path, 0) == record->indexNode ? 0 : -1;
+    case JOURNAL_UNLINK:
+        if (deleteFile(path) < 0)
+            return -1;
+        reapDeadIndexNodes(-1);
+        return 0;
+    }
+
+    if (record->indexNode < 0 || record->indexNode >= superblock()->inodeTotal
+            || indexNodeAt(record->indexNode)->type != RAM_TYPE_REG)
+        return -1;
+    switch (record->type)
+    {
+    case JOURNAL_SIZE:
+        return truncateFile(record->indexNode, record->a);
+    case JOURNAL_FALLOCATE:
+        return fallocateFile(record->indexNode, record->a, record->b);
+    case JOURNAL_PUNCH:
+        return punchHole(record->indexNode, record->a, record->b);
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Replays a journal over the running ramdisk, then journals every metadata operation to it
+ *
+ * @return  long  records replayed, -1 on failure or if a record does not fit the ramdisk
+ * @param[in]  path  the journal file, created if missing
+ * @remark  Bring the engine up from the snapshot the journal follows first.  Replay stops
+ *          at the first torn record and cuts the file there.  A whole record that does not
+ *          apply means the snapshot is not the one the journal follows, the file is then
+ *          left as it is.  Creates, mkdirs, unlinks and size changes are journaled, file
+ *          data is not, it is kept by snapshots.  Each operation returns once its record is
+ *          on disk.  If it cannot be written the operation fails with -EIO and the next
+ *          commit writes the record again, a record lost for lack of memory fails every
+ *          operation until a snapshot.  While journaling, unlinked files are freed at once
+ *          rather than by the worker, so replay hands out the same index nodes
+ */
+long ramdisk_engine_journal(const char *path)
+{
+    struct RAM_journalRecord record;
+    char name[65536];
+    off_t offset;
+    long replayed;
+    int fd;
+
+    if (!engineInitialized || journal != NULL || imageShared)
+        return -1;
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return -1;
+
+    lockEngine();
+    dirtyMarking = dirtyMap;
+    /* Files the snapshot holds unlinked are freed first, here and in the run replayed */
+    if (superblock()->deadList)
+        reapDeadIndexNodes(-1);
+    offset = 0;
+    replayed = 0;
+    while (pread(fd, &record, sizeof(record), offset) == sizeof(record)
+            && pread(fd, name, record.pathLength, offset + sizeof(record)) == record.pathLength)
+    {
+        name[record.pathLength] = '\0';
+        if (record.checksum != journalChecksum(&record, name))
+            break;
+        if (replayRecord(&record, name) < 0)
+        {
+            /* Committed operations follow, cutting them off would lose them for good */
+            PRINT("Journal record %ld does not apply\n", replayed);
+            replayed = -1;
+            break;
+        }
+        offset += sizeof(record) + record.pathLength;
+        replayed++;
+    }
+    dirtyMarking = NULL;
+
+    if (replayed < 0)
+    {
+        unlockEngine();
+        close(fd);
+        return -1;
+    }
+    journal = (struct RAM_journal *)calloc(1, sizeof(*journal));
+    if (journal == NULL || ftruncate(fd, offset) < 0)
+    {
+        free(journal);
+        journal = NULL;
+        unlockEngine();
+        close(fd);
+        return -1;
+    }
+    journal->fd = fd;
+    journal->end = (unsigned long)offset;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->committed, NULL);
+    unlockEngine();
+    return replayed;
+}
+
+/**
+ * Reports how well group commit is batching
+ *
+ * @param[out]  records  records journaled
+ * @param[out]  commits  write and fsync rounds that made them durable
+ */
+void ramdisk_engine_journal_stats(unsigned long long *records, unsigned long long *commits)
+{
+    *records = journal ? journal->records : 0;
+    *commits = journal ? journal->commits : 0;
+}
+
+/**
+ * Reads a file's write generation without the engine lock, so buffered reads can check it
+ *
+ * @return  unsigned int  the generation kr_read would hand back now
+ * @param[in]  indexNode  the file
+ */
+unsigned int ramdisk_engine_generation(int indexNode)
+{
+    return fileGeneration(indexNode);
+}
+
+/**
+ * Writes the latency percentiles of every command run in this process so far
+ *
+ * @return  int  bytes written, not counting the NUL
+ * @param[out]  buffer  the report, laid out as /proc/ramdisk_stats
+ * @param[in]  size  bytes buffer holds
+ */
+int ramdisk_engine_stats(char *buffer, int size)
+{
+    return latencyReport(buffer, size);
+}
+
+/**
+ * In-process counterpart of ramdisk_ioctl, takes the same commands and structs
+ *
+ * @return  int  0 on success, -EINVAL on an unknown command, -EIO if the operation was
+ *          applied but its journal record is not on disk, its ret is then -1 as well
+ * @param[in]  cmd  one of the RAM_* ioctl commands
+ * @param[in-out]  arg  pointer to the struct matching cmd
+ */
+int ramdisk_engine_ioctl(unsigned int cmd, void *arg)
+{
+    struct RAM_schedRequest request;
+    unsigned long long sequence, queued, started, finished;
+    long long sizeBefore;
+    int ret;
+    ret = 0;
+    sequence = 0;
+    sizeBefore = 0;
+
+    /* Threads take turns by deficit round robin, the lock then only guards against other processes */
+    queued = budgetClock();
+    schedEnter(&request, cmd, cmd == RAM_READ || cmd == RAM_WRITE ? ((struct RAM_accessFile *)arg)->numBytes : 0);
+    lockEngine();
+    started = budgetClock();
+    /* Blocks touched by anything but the read path go in the next incremental snapshot */
+    if (cmd != RAM_READ && cmd != RAM_READDIR)
+        dirtyMarking = dirtyMap;
+    if (journal && cmd == RAM_WRITE)
+        sizeBefore = getFileSize(((struct RAM_accessFile *)arg)->indexNode);
+    switch (cmd)
+    {
+    case RAM_CREATE:
+        kr_creat((struct RAM_path *)arg);
+        break;
+    case RAM_MKDIR:
+        kr_mkdir((struct RAM_path *)arg);
+        break;
+    case RAM_OPEN:
+        kr_open((struct RAM_file *)arg);
+        break;
+    case RAM_READ:
+        kr_read((struct RAM_accessFile *)arg);
+        break;
+    case RAM_WRITE:
+        kr_write((struct RAM_accessFile *)arg);
+        break;
+    case RAM_LSEEK:
+        kr_lseek((struct RAM_file *)arg);
+        break;
+    case RAM_UNLINK:
+        kr_unlink((struct RAM_path *)arg);
+        /* Replay has no worker and frees the blocks at once, the run it replays has to
+         * as well or later creates get different index nodes */
+        if (journal && superblock()->deadList)
+            reapDeadIndexNodes(-1);
+        break;
+    case RAM_READDIR:
+        kr_readdir((struct RAM_accessFile *)arg);
+        break;
+    case RAM_PUNCH_HOLE:
+        kr_punchHole((struct RAM_accessFile *)arg);
+        break;
+    case RAM_TRUNCATE:
+        kr_truncate((struct RAM_accessFile *)arg);
+        break;
+    case RAM_FALLOCATE:
+        kr_fallocate((struct RAM_accessFile *)arg);
+        break;
+    case RAM_RECLAIM:
+        kr_reclaim((struct RAM_reclaim *)arg);
+        break;
+    case RAM_FSCK:
+        kr_fsck((struct RAM_fsck *)arg);
+        break;
+    case RAM_FRAG_SCORE:
+        kr_fragScore((struct RAM_fragScore *)arg);
+        break;
+    case RAM_DEFRAG:
+        kr_defrag((struct RAM_defrag *)arg);
+        break;
+    case RAM_LOCK_BUDGET:
+        kr_lockBudget((struct RAM_lockBudget *)arg);
+        break;
+    case RAM_SCHED_WEIGHT:
+        kr_schedWeight((struct RAM_schedWeight *)arg);
+        break;
+    case RAM_SCHED_STATS:
+        kr_schedStats((struct RAM_schedStats *)arg);
+        break;
+    case RAM_LATENCY:
+        kr_latency((struct RAM_latency *)arg);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+    dirtyMarking = NULL;
+    if (journal && ret == 0)
+        sequence = journalOperation(cmd, arg, sizeBefore);
+    finished = budgetClock();
+    unlockEngine();
+    schedLeave();
+    latencyRecord(cmd, started - queued, finished - started);
+
+    /* Off the lock, so the next operations can run while this batch is written */
+    if (sequence && journalCommit(sequence) < 0)
+    {
+        /* Applied in memory, but a crash now would lose it */
+        journalFailOperation(cmd, arg);
+        ret = -EIO;
+    }
+    return ret;
+}
+
+/**
+ * Stops tracking dirty units, the next snapshot is a full one
+ */
+static void stopDirtyTracking(void)
+{
+    free(dirtyMap);
+    free(snapshotPath);
+    dirtyMap = NULL;
+    snapshotPath = NULL;
+}
+
+/**
+ * Starts tracking dirty units against a snapshot file that matches memory
+ *
+ * @return  int  0 on success, -1 if out of memory
+ * @param[in]  path  the snapshot file
+ */
+static int startDirtyTracking(const char *path)
+{
+    long mapBytes;
+
+    dirtyUnitShift = largeSizeClass();
+    mapBytes = (((long)TOT_AVAILABLE_BLOCKS >> dirtyUnitShift) + 8) / 8;
+    free(dirtyMap);
+    free(snapshotPath);
+    dirtyMap = (unsigned char *)calloc(mapBytes, 1);
+    snapshotPath = strdup(path);
+    if (dirtyMap && snapshotPath)
+        return 0;
+    stopDirtyTracking();
+    return -1;
+}
+
+/**
+ * Tells whether any block of a dirty unit is in use
+ *
+ * @return  int  1 if a block is in use, 0 if all are free
+ * @param[in]  unit  the dirty unit
+ */
+static int unitInUse(long unit)
+{
+    long block, last;
+
+    block = unit << dirtyUnitShift;
+    last = (unit + 1) << dirtyUnitShift;
+    if (last > TOT_AVAILABLE_BLOCKS)
+        last = TOT_AVAILABLE_BLOCKS;
+    for (; block < last; block++)
+    {
+        if (checkBit(BLOCK_BITMAP_OFFSET + block / 8, 7 - block % 8))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the image to a file laid out exactly like RAM_memory
+ *
+ * @return  long long  bytes written, -1 on failure
+ * @param[in]  fd  the file, FS_SIZE bytes long
+ * @param[in]  incremental  when set only dirty units are written, and dirty units left
+ *                          with no block in use are punched out of the file
+ * @remark  The metadata is always written whole.  Free space is never written, so the
+ *          file is sparse and a dump costs what is in use, not the capacity
+ */
+static long long writeSnapshotImage(int fd, int incremental)
+{
+    long unit, units, runStart, dataEnd, from, to;
+    long long written;
+    int write;
+
+    if (writeAll(fd, RAM_memory, DATA_BLOCKS_OFFSET, 0) < 0)
+        return -1;
+    written = DATA_BLOCKS_OFFSET;
+
+    /* Units to write are gathered into runs, each written with one pwrite */
+    dataEnd = DATA_BLOCKS_OFFSET + (long)TOT_AVAILABLE_BLOCKS * RAM_BLOCK_SIZE;
+    units = ((long)TOT_AVAILABLE_BLOCKS + (1L << dirtyUnitShift) - 1) >> dirtyUnitShift;
+    runStart = -1;
+    for (unit = 0; unit <= units; unit++)
+    {
+        write = 0;
+        if (unit < units && (!incremental || (dirtyMap[unit >> 3] & (1 << (unit & 7)))))
+        {
+            write = unitInUse(unit);
+            if (!write && incremental)
+            {
+                /* Freed since the last snapshot, its old contents are not needed */
+                from = DATA_BLOCKS_OFFSET + (unit << dirtyUnitShift) * (long)RAM_BLOCK_SIZE;
+                to = from + (1L << dirtyUnitShift) * RAM_BLOCK_SIZE;
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, (to < dataEnd ? to : dataEnd) - from);
+            }
+        }
+        if (write && runStart < 0)
+            runStart = unit;
+        if (!write && runStart >= 0)
+        {
+            from = DATA_BLOCKS_OFFSET + (runStart << dirtyUnitShift) * (long)RAM_BLOCK_SIZE;
+            to = DATA_BLOCKS_OFFSET + (unit << dirtyUnitShift) * (long)RAM_BLOCK_SIZE;
+            if (to > dataEnd)
+                to = dataEnd;
+            if (writeAll(fd, RAM_memory + from, to - from, from) < 0)
+                return -1;
+            written += to - from;
+            runStart = -1;
+        }
+    }
+    return written;
+}
+
+/**
+ * Dumps the ramdisk to a sparse image file that ramdisk_engine_init_snapshot can map
+ *
+ * @return  long long  bytes written, -1 on failure
+ * @param[in]  path  the image file
+ * @param[in]  incremental  when set, and path holds the last snapshot of this ramdisk,
+ *                          only what changed since then is written
+ * @remark  A full dump goes to a temporary file renamed over path, so a crash leaves the
+ *          previous snapshot.  An incremental one updates path in place.  A shared
+ *          segment is written by other processes too, so it always gets a full dump.
+ *          Commands wait while the image is written, not while it is synced to disk,
+ *          unless a journal is open: emptying it needs nothing to have run since
+ */
+long long ramdisk_engine_snapshot(const char *path, int incremental)
+{
+    char tempPath[4096];
+    long long written;
+    int fd, locked;
+
+    pthread_mutex_lock(&snapshotMutex);
+    lockEngine();
+    if (dirtyMap == NULL || snapshotPath == NULL || imageShared || strcmp(path, snapshotPath) != 0)
+        incremental = 0;
+
+    if (incremental)
+    {
+        fd = open(path, O_RDWR);
+    }
+    else
+    {
+        snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+        fd = open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    }
+    if (fd < 0)
+    {
+        unlockEngine();
+        pthread_mutex_unlock(&snapshotMutex);
+        return -1;
+    }
+
+    written = -1;
+    if (incremental || ftruncate(fd, FS_SIZE) == 0)
+        written = writeSnapshotImage(fd, incremental);
+    /* The file now matches memory, changes from here on go in the next incremental one */
+    if (written >= 0 && startDirtyTracking(path) < 0)
+        written = -1;
+    locked = 1;
+    if (written >= 0 && !journal)
+    {
+        unlockEngine();
+        locked = 0;
+    }
+
+    if (written >= 0 && fsync(fd) < 0)
+        written = -1;
+    close(fd);
+    if (written >= 0 && !incremental && rename(tempPath, path) < 0)
+        written = -1;
+
+    if (written < 0)
+    {
+        /* What is on disk is unknown, the next snapshot starts over */
+        if (!locked)
+            lockEngine();
+        locked = 1;
+        stopDirtyTracking();
+        if (!incremental)
+            unlink(tempPath);
+    }
+    else if (journal)
+    {
+        journalCheckpoint();
+    }
+    if (locked)
+        unlockEngine();
+    pthread_mutex_unlock(&snapshotMutex);
+    return written;
+}
+
+/**
+ * Maps a snapshot file as the ramdisk image, copy on write so the file is left as it was
+ *
+ * @return  char*  the image, NULL on failure
+ * @param[in]  fd  the snapshot file
+ * @require  setGeometry has been called with the snapshot's superblock
+ * @remark  Nothing is read here, each page comes in from the file when first touched.
+ *          The image sits in a reservation shaped like one from allocImage, so
+ *          freeImage takes it back
+ */
+static char *mapSnapshotImage(int fd)
+{
+    char *mapping, *image;
+    unsigned long length, dataStart;
+    struct RAM_imageHeader *header;
+
+    length = FS_SIZE + 2 * RAM_HUGE_PAGE_SIZE;
+    mapping = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    /* Data on a huge page boundary where a page aligned image allows it */
+    dataStart = ((unsigned long)mapping + RAM_PAGE_SIZE + DATA_BLOCKS_OFFSET + RAM_HUGE_PAGE_SIZE - 1)
+                & ~(RAM_HUGE_PAGE_SIZE - 1);
+    image = (char *)((dataStart - DATA_BLOCKS_OFFSET) & ~(RAM_PAGE_SIZE - 1));
+    if (mmap(image, FS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(mapping, length);
+        return NULL;
+    }
+    header = (struct RAM_imageHeader *)image - 1;
+    header->mapping = mapping;
+    header->length = length;
+    imageShared = 0;
+    imageZeroed = 0;
+    return image;
+}
+
+/**
+ * Brings up an in-process ramdisk from a snapshot, usable at once with its blocks read lazily
+ *
+ * @return  int  0 on success, -1 if the file is not a snapshot or can not be mapped
+ * @param[in]  path  a file written by ramdisk_engine_snapshot
+ * @remark  Changes stay in memory until the next snapshot, the file is not written
+ */
+int ramdisk_engine_init_snapshot(const char *path)
+{
+    struct RAM_superblock sb;
+    struct stat st;
+    int fd;
+
+    if (engineInitialized)
+        return -1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    /* The layout comes from the superblock, the rest is only mapped */
+    if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) || fstat(fd, &st) < 0
+            || sb.magic != RAMDISK_MAGIC || st.st_size != sb.fsSize
+            || setGeometry((unsigned long)sb.fsSize, sb.blockSize, sb.inodeTableBlocks * (sb.blockSize / INDEX_NODE_SIZE)) < 0
+            || allocScratch() < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    RAM_memory = mapSnapshotImage(fd);
+    close(fd); /* The mapping keeps the file open */
+    if (RAM_memory == NULL || loadGeometry() < 0)
+        return -1;
+
+    /* The file holds exactly this image, so an incremental snapshot can follow */
+    if (startDirtyTracking(path) < 0)
+        return -1;
+    engineInitialized = 1;
+    deferredFreeing = 1;
+    /* Files unlinked before the snapshot may still hold blocks */
+    if (superblock()->deadList)
+    {
+        lockEngine();
+        wakeReaper();
+        unlockEngine();
+    }
+    return 0;
+}
+
+#ifndef RAMDISK_ENGINE
+/**
+ * Writes a file through the engine, the way RAMFileLib does
+ *
+ * @return    long long    bytes written
+ */
+static long long engineWrite(int indexNode, char *data, long long size, long long offset)
+{
+    struct RAM_accessFile access;
+
+    memset(&access, 0, sizeof(access));
+    access.indexNode = indexNode;
+    access.address = data;
+    access.numBytes = size;
+    access.offset = offset;
+    ramdisk_engine_ioctl(RAM_WRITE, &access);
+    return access.ret;
+}
+
+/**
+ * Takes a full and an incremental snapshot, checks both are sparse and the incremental
+ * one only holds the changes, then restores from the file and checks every file
+ *
+ * @return    int    0 on success, -1 on failure
+ * @remark  Leaves the engine running on the restored image, so it runs last
+ */
+int testSnapshot(void)
+{
+    char path[] = "/tmp/ramdisk_snapshot_XXXXXX";
+    char *data, *readBack;
+    struct RAM_path create;
+    struct stat st;
+    long long full, incremental;
+    int fd, bigNode, newNode;
+
+    fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    close(fd);
+
+    freeImage(RAM_memory);
+    setGeometry(64UL << 20, 4096, 1024);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
+    init_ramdisk();
+
+    data = malloc(8 << 20);
+    readBack = malloc((8 << 20) + 1);
+    memset(data, 's', 8 << 20);
+    createIndexNode("dir\0", "/snap/\0", 0);
+    bigNode = createIndexNode("reg\0", "/snap/big\0", 0);
+    writeToFile(bigNode, data, 8 << 20, 0);
+    createIndexNode("reg\0", "/small\0", 0);
+
+    full = ramdisk_engine_snapshot(path, 1); /* No earlier snapshot, so a full one */
+    if (full < (8LL << 20) || stat(path, &st) < 0 || st.st_size != (off_t)FS_SIZE
+            || st.st_blocks * 512LL > full + (1LL << 20))
+    {
+        PRINT("testSnapshot: full snapshot of %lld bytes is not sparse\n", full);
+        return -1;
+    }
+
+    /* Change a page of the big file, add a file, and remove one */
+    memset(data + (1 << 20), 'X', 4096);
+    engineWrite(bigNode, data + (1 << 20), 4096, 1 << 20);
+    create.name = "/fresh\0";
+    create.sizeHint = 0;
+    ramdisk_engine_ioctl(RAM_CREATE, &create);
+    newNode = getIndexNodeNumberFromPathname("/fresh\0", 0);
+    engineWrite(newNode, "restored", 8, 0);
+    create.name = "/small\0";
+    ramdisk_engine_ioctl(RAM_UNLINK, &create);
+
+    incremental = ramdisk_engine_snapshot(path, 1);
+    if (incremental < 0 || incremental > (long long)DATA_BLOCKS_OFFSET + (64LL << 10))
+    {
+        PRINT("testSnapshot: incremental snapshot wrote %lld bytes\n", incremental);
+        return -1;
+    }
+
+    freeImage(RAM_memory);
+    RAM_memory = NULL;
+    if (ramdisk_engine_init_snapshot(path) < 0)
+    {
+        PRINT("testSnapshot: restore failed\n");
+        return -1;
+    }
+    if (getIndexNodeNumberFromPathname("/snap/big\0", 0) != bigNode
+            || readFromFile(bigNode, readBack, 8 << 20, 0) != 8 << 20 || memcmp(readBack, data, 8 << 20)
+            || readFromFile(newNode, readBack, 100, 0) != 8 || strcmp(readBack, "restored")
+            || getIndexNodeNumberFromPathname("/small\0", 0) >= 0)
+    {
+        PRINT("testSnapshot: restored files differ\n");
+        return -1;
+    }
+    if (createIndexNode("reg\0", "/after\0", 0) < 0 || writeToFile(bigNode, data, 4096, 8 << 20) != 4096)
+    {
+        PRINT("testSnapshot: restored ramdisk is not writable\n");
+        return -1;
+    }
+    unlink(path);
+    free(data);
+    free(readBack);
+    PRINT("testSnapshot: passed, %lld bytes full, %lld incremental\n", full, incremental);
+    return 0;
+}
+
+/* Work for one thread of testJournal */
+struct journalWorker
+{
+    int id;
+    int failed;
+};
+
+/**
+ * Creates, grows and deletes files through the engine from one of several threads
+ */
+static void *journalWorkerRun(void *arg)
+{
+    struct journalWorker *worker;
+    struct RAM_path create;
+    char name[32];
+    int ii, node;
+
+    worker = (struct journalWorker *)arg;
+    for (ii = 0; ii < 40; ii++)
+    {
+        sprintf(name, "/j%d_%d", worker->id, ii);
+        create.name = name;
+        create.sizeHint = 0;
+        ramdisk_engine_ioctl(RAM_CREATE, &create);
+        node = create.ret;
+        if (node < 0 || engineWrite(node, name, 1 + ii % 7, 100) != 1 + ii % 7)
+            worker->failed = 1;
+        /* Every fourth file is removed again */
+        if (ii % 4 == 3)
+        {
+            ramdisk_engine_ioctl(RAM_UNLINK, &create);
+            if (create.ret < 0)
+                worker->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Throws away the engine and its journal as a crash would, leaving only their files
+ */
+static void crashEngine(void)
+{
+    close(journal->fd);
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal);
+    journal = NULL;
+    freeImage(RAM_memory);
+    engineInitialized = 0;
+}
+
+/**
+ * Journals creates, size changes and unlinks from several threads, checks group commit
+ * batched them, then restarts from the snapshot and the journal, torn tail included,
+ * and checks every change came back
+ *
+ * @return    int    0 on success, -1 on failure
+ * @require  testSnapshot has run, the engine is up
+ */
+int testJournal(void)
+{
+    char snapshot[] = "/tmp/ramdisk_snapshot_XXXXXX";
+    char journalPath[] = "/tmp/ramdisk_journal_XXXXXX";
+    struct journalWorker workers[8];
+    pthread_t threads[8];
+    unsigned long long records, commits;
+    struct stat st;
+    char name[32];
+    int fd, ii, jj, node;
+    long replayed;
+
+    close(mkstemp(snapshot));
+    fd = mkstemp(journalPath);
+    if (ramdisk_engine_snapshot(snapshot, 0) < 0 || ramdisk_engine_journal(journalPath) != 0)
+    {
+        PRINT("testJournal: could not start journaling\n");
+        return -1;
+    }
+
+    for (ii = 0; ii < 8; ii++)
+    {
+        workers[ii].id = ii;
+        workers[ii].failed = 0;
+        pthread_create(&threads[ii], NULL, journalWorkerRun, &workers[ii]);
+    }
+    for (ii = 0; ii < 8; ii++)
+    {
+        pthread_join(threads[ii], NULL);
+        if (workers[ii].failed)
+        {
+            PRINT("testJournal: operations failed\n");
+            return -1;
+        }
+    }
+    ramdisk_engine_journal_stats(&records, &commits);
+    PRINT("testJournal: %llu records in %llu commits\n", records, commits);
+    if (records != 8 * (40 + 40 + 10) || commits >= records)
+    {
+        PRINT("testJournal: records were not batched\n");
+        return -1;
+    }
+
+    /* A crash while a record was half written */
+    lseek(fd, 0, SEEK_END);
+    write(fd, "torn", 4);
+    close(fd);
+
+    /* Restart: the in-memory ramdisk is gone, only the two files are left */
+    crashEngine();
+    replayed = -1;
+    if (ramdisk_engine_init_snapshot(snapshot) < 0 || (replayed = ramdisk_engine_journal(journalPath)) != (long)records)
+    {
+        PRINT("testJournal: replayed %ld of %llu records\n", replayed, records);
+        return -1;
+    }
+    for (ii = 0; ii < 8; ii++)
+    {
+        for (jj = 0; jj < 40; jj++)
+        {
+            sprintf(name, "/j%d_%d", ii, jj);
+            node = getIndexNodeNumberFromPathname(name, 0);
+            if ((jj % 4 == 3) != (node < 0) || (node >= 0 && getFileSize(node) != 100 + 1 + jj % 7))
+            {
+                PRINT("testJournal: %s not rebuilt\n", name);
+                return -1;
+            }
+        }
+    }
+
+    /* A snapshot holds everything, so the journal starts over */
+    if (ramdisk_engine_snapshot(snapshot, 1) < 0 || stat(journalPath, &st) < 0 || st.st_size != 0)
+    {
+        PRINT("testJournal: snapshot did not empty the journal\n");
+        return -1;
+    }
+    unlink(snapshot);
+    unlink(journalPath);
+    PRINT("testJournal: passed\n");
+    return 0;
 }
 
 /**
- * Kernel pair for opening a file
+ * Unlinks a file with blocks between creates, waits for the worker, and checks replay
+ * rebuilds the same files and that a journal which does not fit is left whole
  *
- * @param[in]   input   The RAM_path struct for opening the file
+ * @return    int    0 on success, -1 on failure
+ * @require  testJournal has run, the engine is up and journaling
  */
-void kr_open(struct RAM_file *input)
+int testJournalReplayAfterUnlink(void)
 {
-    char *indexNodeStart;
-    int indexNodeNum, fileSize;
-    indexNodeNum = getIndexNodeNumberFromPathname(input->name, 0);
-    indexNodeStart = RAM_memory + INDEX_NODE_ARRAY_OFFSET + indexNodeNum * INDEX_NODE_SIZE;
-    fileSize = (int) * (int *) (indexNodeStart + INODE_SIZE);
+    char snapshot[] = "/tmp/ramdisk_snapshot_XXXXXX";
+    char journalPath[] = "/tmp/ramdisk_journal_XXXXXX";
+    static char data[8192];
+    struct RAM_path create;
+    struct stat before, after;
+    int ii, nodeB, nodeC;
+    long replayed;
+
+    crashEngine();
+    close(mkstemp(snapshot));
+    close(mkstemp(journalPath));
+    if (ramdisk_engine_init() < 0 || ramdisk_engine_snapshot(snapshot, 0) < 0 || ramdisk_engine_journal(journalPath) != 0)
+    {
+        PRINT("testJournalReplayAfterUnlink: could not start journaling\n");
+        return -1;
+    }
 
-    input->indexNode = indexNodeNum;
-    input->fileSize = fileSize;
-}
+    memset(data, 'u', sizeof(data));
+    create.sizeHint = 0;
+    create.name = "/ua\0";
+    ramdisk_engine_ioctl(RAM_CREATE, &create);
+    engineWrite(create.ret, data, sizeof(data), 0);
+    ramdisk_engine_ioctl(RAM_UNLINK, &create);
+    /* However long the worker takes, the next create has to be repeatable */
+    for (ii = 0; ii < 1000 && superblock()->deadList; ii++)
+        usleep(1000);
+    create.name = "/ub\0";
+    ramdisk_engine_ioctl(RAM_CREATE, &create);
+    nodeB = create.ret;
+    engineWrite(nodeB, data, sizeof(data), 0);
+    create.name = "/uc\0";
+    ramdisk_engine_ioctl(RAM_CREATE, &create);
+    nodeC = create.ret;
+
+    crashEngine();
+    replayed = -1;
+    if (ramdisk_engine_init_snapshot(snapshot) < 0 || (replayed = ramdisk_engine_journal(journalPath)) != 6
+            || getIndexNodeNumberFromPathname("/ub\0", 0) != nodeB || getFileSize(nodeB) != sizeof(data)
+            || getIndexNodeNumberFromPathname("/uc\0", 0) != nodeC)
+    {
+        PRINT("testJournalReplayAfterUnlink: replayed %ld of 6 records\n", replayed);
+        return -1;
+    }
 
-void kr_read(struct RAM_accessFile *input)
-{
-    int ret;
-    ret = readFromFile(input->indexNode, input->address, input->numBytes, input->offset);
-    input->ret = ret;
+    /* Replayed over a ramdisk it does not follow, the journal fails to open and keeps its records */
+    crashEngine();
+    stat(journalPath, &before);
+    ramdisk_engine_init_snapshot(snapshot);
+    createIndexNode("reg\0", "/stray\0", 0);
+    if (ramdisk_engine_journal(journalPath) != -1 || journal != NULL
+            || stat(journalPath, &after) < 0 || after.st_size != before.st_size)
+    {
+        PRINT("testJournalReplayAfterUnlink: a journal that does not apply was cut\n");
+        return -1;
+    }
+    unlink(snapshot);
+    unlink(journalPath);
+    PRINT("testJournalReplayAfterUnlink: passed\n");
+    return 0;
 }
 
 /**
- * Kernel pair for the write function
+ * Makes the journal unwritable, checks operations fail with -EIO while still applying,
+ * then checks the next commit writes their records and replay rebuilds them
  *
- * @param[in]   input   The accessfile struct.  Input for writing is in this struct
+ * @return    int    0 on success, -1 on failure
+ * @require  testJournalReplayAfterUnlink has run, the engine is up and not journaling
  */
-void kr_write(struct RAM_accessFile *input)
+int testJournalWriteFailure(void)
 {
-    int ret;
-    ret = writeToFile(input->indexNode, input->address, input->numBytes, input->offset);
-    PRINT("Bytes written: %d\n", ret);
-    input->ret = ret;
-}
-
-// This function is in user level
-void kr_lseek(struct RAM_file *input)
-{}
+    char snapshot[] = "/tmp/ramdisk_snapshot_XXXXXX";
+    char journalPath[] = "/tmp/ramdisk_journal_XXXXXX";
+    static char data[300];
+    struct RAM_path create;
+    int fd, ret, nodeA, nodeB, nodeC;
+    long replayed;
+
+    close(mkstemp(snapshot));
+    close(mkstemp(journalPath));
+    if (ramdisk_engine_snapshot(snapshot, 0) < 0 || ramdisk_engine_journal(journalPath) != 0)
+    {
+        PRINT("testJournalWriteFailure: could not start journaling\n");
+        return -1;
+    }
 
-void kr_unlink(struct RAM_path *input)
-{
-    int ret;
-    ret = deleteFile(input->name);
-    input->ret = ret;
-}
+    memset(data, 'w', sizeof(data));
+    create.sizeHint = 0;
+    create.name = "/wa\0";
+    ramdisk_engine_ioctl(RAM_CREATE, &create);
+    nodeA = create.ret;
+
+    /* A descriptor that cannot be written stands in for a full or failing disk */
+    fd = journal->fd;
+    journal->fd = open(journalPath, O_RDONLY);
+    create.name = "/wb\0";
+    ret = ramdisk_engine_ioctl(RAM_CREATE, &create);
+    nodeB = getIndexNodeNumberFromPathname("/wb\0", 0);
+    if (ret != -EIO || create.ret != -1 || nodeB < 0 || engineWrite(nodeB, data, sizeof(data), 0) != -1
+            || getFileSize(nodeB) != sizeof(data))
+    {
+        PRINT("testJournalWriteFailure: an operation that was not journaled did not fail\n");
+        return -1;
+    }
+    close(journal->fd);
+    journal->fd = fd;
+
+    /* The next commit carries the two records that failed */
+    create.name = "/wc\0";
+    ret = ramdisk_engine_ioctl(RAM_CREATE, &create);
+    nodeC = create.ret;
+    if (ret != 0 || nodeC < 0)
+    {
+        PRINT("testJournalWriteFailure: the journal did not recover\n");
+        return -1;
+    }
 
-void kr_readdir(struct RAM_accessFile *input)
-{
-    int ret;
-    ret = readFileName(input->indexNode, input->address, input->dirIndex);
-    if (ret > -1)
-        input->ret = 1;
-    else
-        input->ret = -1;
-    input->numOfFiles = ret;
+    crashEngine();
+    replayed = -1;
+    if (ramdisk_engine_init_snapshot(snapshot) < 0 || (replayed = ramdisk_engine_journal(journalPath)) != 4
+            || getIndexNodeNumberFromPathname("/wa\0", 0) != nodeA
+            || getIndexNodeNumberFromPathname("/wb\0", 0) != nodeB || getFileSize(nodeB) != sizeof(data)
+            || getIndexNodeNumberFromPathname("/wc\0", 0) != nodeC)
+    {
+        PRINT("testJournalWriteFailure: replayed %ld of 4 records\n", replayed);
+        return -1;
+    }
+    unlink(snapshot);
+    unlink(journalPath);
+    PRINT("testJournalWriteFailure: passed\n");
+    return 0;
 }
 
-
 int main()
 {
     int indexNodeNum;
 
-    RAM_memory = (char *)malloc(FS_SIZE * sizeof(char));
+    setGeometry(DEFAULT_FS_SIZE, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_COUNT);
+    allocScratch();
+    RAM_memory = allocImage(FS_SIZE);
     init_ramdisk();
     /* Uncomment to test maximum files in folder */
     // testDirCreation();
@@ -2004,6 +8050,52 @@ int main()
     // testFileDeletion();
      testReadDir();
 
+    /* Reformats with a larger geometry, run last */
+    if (testGeometry() < 0)
+        return 1;
+    if (testSizeClasses() < 0)
+        return 1;
+    if (testTripleIndirect() < 0)
+        return 1;
+    if (testInlineFiles() < 0)
+        return 1;
+    if (testFragments() < 0)
+        return 1;
+    if (testSparseFiles() < 0)
+        return 1;
+    if (testTruncateFallocate() < 0)
+        return 1;
+    if (testLargeDirectory() < 0)
+        return 1;
+    if (testFormatUpgrade() < 0)
+        return 1;
+    if (testChunkedMemory() < 0)
+        return 1;
+    if (testStartupTime() < 0)
+        return 1;
+    if (testHugePageReads() < 0)
+        return 1;
+    if (testConsistencyCheck() < 0)
+        return 1;
+    if (testDefragmentation() < 0)
+        return 1;
+    if (testDeferredFreeing() < 0)
+        return 1;
+    if (testLockBudgets() < 0)
+        return 1;
+    if (testFairScheduling() < 0)
+        return 1;
+    if (testLatencyHistograms() < 0)
+        return 1;
+    if (testSnapshot() < 0)
+        return 1;
+    if (testJournal() < 0)
+        return 1;
+    if (testJournalReplayAfterUnlink() < 0)
+        return 1;
+    if (testJournalWriteFailure() < 0)
+        return 1;
+
     // printIndexNode(indexNodeNum);
     // deleteFile("/folder\0");
     // printIndexNode(indexNodeNum);
@@ -2021,16 +8113,90 @@ int main()
     // printIndexNode(indexNodeNum);
     return 0;
 }
+#endif /* RAMDISK_ENGINE */
 
 
 
 #else
+/**
+* Memory pressure hook, gives back the memory of free chunks when the kernel asks
+*
+* @return  int  pages that could still be given back, an estimate
+* @param[in]  nr_to_scan  0 to only ask for the estimate
+*/
+static int ramdisk_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+    /* Never wait for an ioctl, reclaim may run from inside an allocation it made */
+    if (nr_to_scan && down_trylock(&FS_mutex) == 0)
+    {
+        reclaimChunks();
+        up(&FS_mutex);
+    }
+    return (int)(freedSinceReclaim >> PAGE_SHIFT);
+}
+
+static struct shrinker ramdiskShrinker =
+{
+    .shrink = ramdisk_shrink,
+    .seeks = DEFAULT_SEEKS,
+};
+
+static void reapWork(struct work_struct *work);
+static DECLARE_WORK(reaperWork, reapWork);
+
+/**
+* Frees the blocks of unlinked files a batch per hold of FS_mutex, requeueing
+* itself so other ioctls get in between batches
+*/
+static void reapWork(struct work_struct *work)
+{
+    int more;
+
+    down(&FS_mutex);
+    dirtyMarking = dirtyMap;
+    reapDeadIndexNodes(lockBudgetBlocks ? lockBudgetBlocks : -1);
+    dirtyMarking = NULL;
+    more = superblock()->deadList != 0;
+    up(&FS_mutex);
+    if (more)
+        schedule_work(&reaperWork);
+}
+
+/**
+* Tells the worker there are blocks to free
+*/
+static void wakeReaper(void)
+{
+    if (deferredFreeing)
+        schedule_work(&reaperWork);
+}
+
+/**
+* Reading /proc/ramdisk_stats gives the latency percentiles of every command
+*/
+static int readStats(char *page, char **start, off_t offset, int count, int *eof, void *data)
+{
+    *eof = 1;
+    if (offset > 0)
+        return 0;
+    return latencyReport(page, count);
+}
+
+/**
+* Writing anything to /proc/ramdisk_stats empties the histograms
+*/
+static int writeStats(struct file *file, const char __user *buffer, unsigned long count, void *data)
+{
+    latencyReset();
+    return count;
+}
+
 /**
 * The main init routine for the kernel module.  Initializes proc entry
 */
 static int __init initialization_routine(void)
 {
-    int indexNodeNum;
+    int indexNodeNum, cpu;
     rootCreated = 0;
 
     PRINT("<1> Loading RAMDISK filesystem\n");
@@ -2049,10 +8215,49 @@ static int __init initialization_routine(void)
     proc_entry->proc_fops = &pseudo_dev_proc_operations;
 
     // Initialize the ramdisk here now
-    RAM_memory = (char *)vmalloc(FS_SIZE);
+    if (setGeometry(fs_size, block_size, inode_count) < 0 || allocScratch() < 0)
+    {
+        PRINT("<1> Invalid ramdisk geometry\n");
+        remove_proc_entry("ramdisk", NULL);
+        return -EINVAL;
+    }
+    RAM_memory = allocImage(FS_SIZE);
+    if (!RAM_memory)
+    {
+        PRINT("<1> Could not allocate %lu bytes for the ramdisk\n", FS_SIZE);
+        remove_proc_entry("ramdisk", NULL);
+        return -ENOMEM;
+    }
+    /* The metadata is always backed, data chunks only once blocks in them are used */
+    if (mapImagePages(0, DATA_BLOCKS_OFFSET) < 0)
+    {
+        PRINT("<1> Could not allocate the ramdisk metadata\n");
+        freeImage(RAM_memory);
+        remove_proc_entry("ramdisk", NULL);
+        return -ENOMEM;
+    }
 
     // Initialize the superblock and all other memory segments
     init_ramdisk();
+    reclaimWatermark = reclaim_watermark;
+    lockBudgetBlocks = lock_budget_blocks;
+    lockBudgetUs = lock_budget_us;
+    register_shrinker(&ramdiskShrinker);
+    deferredFreeing = 1;
+
+    /* Latency histograms, a CPU whose allocation fails just goes untimed */
+    for_each_possible_cpu(cpu)
+    {
+        latencyCpus[cpu] = vmalloc(sizeof(struct RAM_latencyCpu));
+        if (latencyCpus[cpu])
+            memset(latencyCpus[cpu], 0, sizeof(struct RAM_latencyCpu));
+    }
+    stats_entry = create_proc_entry("ramdisk_stats", 0644, NULL);
+    if (stats_entry)
+    {
+        stats_entry->read_proc = readStats;
+        stats_entry->write_proc = writeStats;
+    }
 
     // PRINT("MEM BEFORE\n");
     // printBitmap(400);
@@ -2075,8 +8280,21 @@ static int __init initialization_routine(void)
 */
 static void __exit cleanup_routine(void)
 {
+    int cpu;
+
     PRINT("<1> Dumping RAMDISK module\n");
     remove_proc_entry("ramdisk", NULL);
+    if (stats_entry)
+        remove_proc_entry("ramdisk_stats", NULL);
+    unregister_shrinker(&ramdiskShrinker);
+    /* No ioctl can queue it any more, let a running batch finish */
+    deferredFreeing = 0;
+    cancel_work_sync(&reaperWork);
+    freeImage(RAM_memory);
+    RAM_FREE(allocatedBlocks);
+    RAM_FREE(chunkCommitted);
+    for_each_possible_cpu(cpu)
+        vfree(latencyCpus[cpu]);
 
     return;
 }
@@ -2089,8 +8307,30 @@ static int ramdisk_ioctl(struct inode *inode, struct file *file,
     struct RAM_path path;
     struct RAM_file ramFile;
     struct RAM_accessFile access;
+    struct RAM_reclaim reclaim;
+    struct RAM_fsck fsck;
+    struct RAM_fragScore score;
+    struct RAM_defrag defrag;
+    struct RAM_lockBudget lockBudget;
+    struct RAM_schedWeight weight;
+    struct RAM_schedStats stats;
+    struct RAM_latency latency;
+    struct RAM_schedRequest request;
+    unsigned long long queued, started, finished;
+    long long bytes;
+    int ret;
 
+    /* Processes take turns by deficit round robin, reads and writes are charged
+     * for their bytes so their size is needed before the turn comes */
+    ret = 0;
+    bytes = 0;
+    queued = budgetClock();
+    if ((cmd == RAM_READ || cmd == RAM_WRITE)
+            && copy_from_user(&access, (struct RAM_accessFile *)arg, sizeof(struct RAM_accessFile)) == 0)
+        bytes = access.numBytes;
+    schedEnter(&request, cmd, bytes);
     while (down_interruptible(&FS_mutex));
+    started = budgetClock();
     // PRINT("PAST MUTEX");
 
     switch (cmd)
@@ -2175,114 +8415,131 @@ static int ramdisk_ioctl(struct inode *inode, struct file *file,
 
         break;
 
-    default:
-        PRINT("--DEFAULT!\n");
-        return -EINVAL;
+    case RAM_PUNCH_HOLE:
+        PRINT("Punching a hole...\n");
+
+        copy_from_user(&access, (struct RAM_accessFile *)arg,
+                       sizeof(struct RAM_accessFile));
+        kr_punchHole(&access);
+        copy_to_user((struct RAM_accessFile *)arg, &access, sizeof(struct RAM_accessFile));
+
         break;
-    }
 
-    /* Release the mutex */
-    up(&FS_mutex);
+    case RAM_TRUNCATE:
+        PRINT("Truncating file...\n");
 
-    return 0;
-}
+        copy_from_user(&access, (struct RAM_accessFile *)arg,
+                       sizeof(struct RAM_accessFile));
+        kr_truncate(&access);
+        copy_to_user((struct RAM_accessFile *)arg, &access, sizeof(struct RAM_accessFile));
 
-/************************ Kernel Implementations *****************************/
+        break;
 
-/**
- * Kernel pair for the create function
- *
- * @param[in]   input   The RAM_path struct for creating the file
- */
-void kr_creat(struct RAM_path *input)
-{
-    int indexNodeNum;
-    indexNodeNum = createIndexNode("reg\0", input->name, 0);
-    input->ret = indexNodeNum;
-}
+    case RAM_FALLOCATE:
+        PRINT("Reserving file blocks...\n");
 
-/**
- * Kernel pair for making a new directory
- *
- * @param[in]   input   The RAM_path struct for creating the file
- */
-void kr_mkdir(struct RAM_path *input)
-{
-    int indexNodeNum;
-    indexNodeNum = createIndexNode("dir\0", input->name, 0);
-    PRINT("New Dir made with INODE: %d\n",indexNodeNum);
-    input->ret = indexNodeNum;
-}
+        copy_from_user(&access, (struct RAM_accessFile *)arg,
+                       sizeof(struct RAM_accessFile));
+        kr_fallocate(&access);
+        copy_to_user((struct RAM_accessFile *)arg, &access, sizeof(struct RAM_accessFile));
 
-/**
- * Kernel pair for opening a file
- *
- * @param[in]   input   The RAM_path struct for opening the file
- */
-void kr_open(struct RAM_file *input)
-{
-    char *indexNodeStart;
-    int indexNodeNum;
+        break;
 
-    PRINT("Opening pathname: %s\n",input->name);
-    indexNodeNum = getIndexNodeNumberFromPathname(input->name, 0);
+    case RAM_RECLAIM:
+        PRINT("Reclaiming free memory...\n");
 
-    PRINT("INDEX NODE: %d\n", indexNodeNum);
-    input->indexNode = indexNodeNum;
-    input->fileSize = getFileSize(indexNodeNum);
-    // PRINT("FILE SIZE: %d\n", getFileSize(indexNodeNum));
-}
+        copy_from_user(&reclaim, (struct RAM_reclaim *)arg,
+                       sizeof(struct RAM_reclaim));
+        kr_reclaim(&reclaim);
+        copy_to_user((struct RAM_reclaim *)arg, &reclaim, sizeof(struct RAM_reclaim));
 
-void kr_read(struct RAM_accessFile *input)
-{
-    int ret;
-    printk("%d, %ld, %d, %d\n", input->indexNode, input->address, input->numBytes, input->offset);
-    ret = readFromFile(input->indexNode, input->address, input->numBytes, input->offset);
-    input->ret = ret;
-    input->offset = input->offset + ret;
-}
+        break;
 
-/**
- * Kernel pair for the write function
- *
- * @param[in]   input   The accessfile struct.  Input for writing is in this struct
- */
-void kr_write(struct RAM_accessFile *input)
-{
-    int ret;
-    // printIndexNode(input->indexNode);
-    ret = writeToFile(input->indexNode, input->address, input->numBytes, input->offset);
-    input->ret = ret;
-    input->fileSize = getFileSize(input->indexNode);
-    PRINT("Bytes written: %d\n", ret);
-}
+    case RAM_FSCK:
+        PRINT("Checking the filesystem...\n");
 
-// This function is in user level
-void kr_lseek(struct RAM_file *input)
-{}
+        copy_from_user(&fsck, (struct RAM_fsck *)arg,
+                       sizeof(struct RAM_fsck));
+        kr_fsck(&fsck);
+        copy_to_user((struct RAM_fsck *)arg, &fsck, sizeof(struct RAM_fsck));
 
-void kr_unlink(struct RAM_path *input)
-{
-    int ret;
-    ret = deleteFile(input->name);
-    input->ret = ret;
-}
+        break;
 
-void kr_readdir(struct RAM_accessFile *input)
-{
-    int ret;
-    printk("Reading the dir %d\n", input->indexNode);
-    ret = readFileName(input->indexNode, input->address, input->dirIndex);
-    if (ret > -1)
-        input->ret = 1;
-    else
-        input->ret = -1;
-    input->numOfFiles = ret;
-    PRINT("num of files: %d\n", ret);
-}
+    case RAM_FRAG_SCORE:
+        PRINT("Scoring fragmentation...\n");
 
+        copy_from_user(&score, (struct RAM_fragScore *)arg,
+                       sizeof(struct RAM_fragScore));
+        kr_fragScore(&score);
+        copy_to_user((struct RAM_fragScore *)arg, &score, sizeof(struct RAM_fragScore));
+
+        break;
+
+    case RAM_DEFRAG:
+        PRINT("Defragmenting...\n");
+
+        copy_from_user(&defrag, (struct RAM_defrag *)arg,
+                       sizeof(struct RAM_defrag));
+        kr_defrag(&defrag);
+        copy_to_user((struct RAM_defrag *)arg, &defrag, sizeof(struct RAM_defrag));
+
+        break;
+
+    case RAM_LOCK_BUDGET:
+        PRINT("Setting the lock budget...\n");
+
+        copy_from_user(&lockBudget, (struct RAM_lockBudget *)arg,
+                       sizeof(struct RAM_lockBudget));
+        kr_lockBudget(&lockBudget);
+        copy_to_user((struct RAM_lockBudget *)arg, &lockBudget, sizeof(struct RAM_lockBudget));
+
+        break;
+
+    case RAM_SCHED_WEIGHT:
+        PRINT("Setting a scheduling weight...\n");
+
+        copy_from_user(&weight, (struct RAM_schedWeight *)arg,
+                       sizeof(struct RAM_schedWeight));
+        kr_schedWeight(&weight);
+        copy_to_user((struct RAM_schedWeight *)arg, &weight, sizeof(struct RAM_schedWeight));
+
+        break;
+
+    case RAM_SCHED_STATS:
+        PRINT("Reading the scheduling statistics...\n");
+
+        copy_from_user(&stats, (struct RAM_schedStats *)arg,
+                       sizeof(struct RAM_schedStats));
+        kr_schedStats(&stats);
+        copy_to_user((struct RAM_schedStats *)arg, &stats, sizeof(struct RAM_schedStats));
+
+        break;
+
+    case RAM_LATENCY:
+        PRINT("Reading the latency histograms...\n");
+
+        copy_from_user(&latency, (struct RAM_latency *)arg,
+                       sizeof(struct RAM_latency));
+        kr_latency(&latency);
+        copy_to_user((struct RAM_latency *)arg, &latency, sizeof(struct RAM_latency));
+
+        break;
+
+    default:
+        PRINT("--DEFAULT!\n");
+        ret = -EINVAL;
+        break;
+    }
+
+    /* Release the mutex, then let the next request in */
+    finished = budgetClock();
+    up(&FS_mutex);
+    schedLeave();
+    latencyRecord(cmd, started - queued, finished - started);
+
+    return ret;
+}
 
-/************************ End of Kernel Implementations *****************************/
 
 // Init and Exit declaration
 module_init(initialization_routine);
@@ -0,0 +1,87 @@
+/**
+*  rdfsck -- checks the consistency of a ramdisk
+*
+*  Checks the running module, a shared memory ramdisk or a snapshot image:
+*  the block bitmap against every index node's block map, directory sizes
+*  against their live entries and the superblock's free counts.
+*
+*	rdfsck [-r] [-j threads] [-s name | image]
+*
+*  -r repairs what can be repaired, a repaired image is written back in place.
+*  Exits 0 if the ramdisk is clean, 1 if problems were found, 2 on failure.
+*/
+
+#include "RAMFileLib.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: rdfsck [-r] [-j threads] [-s name | image]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct RAM_fsck report;
+    const char *shared, *image;
+    int opt;
+
+    memset(&report, 0, sizeof(report));
+    shared = NULL;
+    image = NULL;
+    while ((opt = getopt(argc, argv, "rj:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            report.repair = 1;
+            break;
+        case 'j':
+            report.threads = atoi(optarg);
+            break;
+        case 's':
+            shared = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc)
+        image = argv[optind++];
+    if (optind < argc || (shared && image))
+        usage();
+
+    if ((image && rd_use_snapshot_engine(image) < 0)
+            || (shared && rd_use_shared_engine(shared) < 0)
+            || (!image && !shared && rd_use_module() < 0))
+    {
+        fprintf(stderr, "rdfsck: could not open %s\n", image ? image : shared ? shared : "/proc/ramdisk");
+        return 2;
+    }
+    if (rd_fsck(&report) < 0)
+    {
+        fprintf(stderr, "rdfsck: check failed\n");
+        return 2;
+    }
+
+    printf("%lld index nodes checked on %d threads\n", report.indexNodes, report.threads);
+    printf("  leaked blocks       %lld\n", report.leakedBlocks);
+    printf("  lost blocks         %lld\n", report.lostBlocks);
+    printf("  cross linked blocks %lld\n", report.crossLinked);
+    printf("  bad block pointers  %lld\n", report.badPointers);
+    printf("  bad index nodes     %lld\n", report.badIndexNodes);
+    printf("  bad directory sizes %lld\n", report.badCounts);
+    printf("  dangling entries    %lld\n", report.danglingEntries);
+    printf("  orphans             %lld\n", report.orphans);
+    printf("  bad free counts     %lld\n", report.badFreeCounts);
+    printf("  bad fragment chain  %lld\n", report.badFragmentList);
+    printf("  bad unlinked chain  %lld\n", report.badDeadList);
+    printf("%lld problems, %lld repaired\n", report.errors, report.repaired);
+
+    /* The snapshot is mapped copy on write, the repairs only reach it through a new dump */
+    if (image && report.repaired && ramdisk_engine_snapshot(image, 0) < 0)
+    {
+        fprintf(stderr, "rdfsck: could not write the repaired image\n");
+        return 2;
+    }
+    return report.errors ? 1 : 0;
+}
@@ -11,6 +11,17 @@
 #define RAM_LSEEK _IOWR(1, 12, struct RAM_file) // works
 #define RAM_UNLINK _IOWR(1, 13, struct RAM_path) // works
 #define RAM_READDIR _IOWR(1, 14, struct RAM_accessFile) // doesnt work
+#define RAM_PUNCH_HOLE _IOWR(1, 15, struct RAM_accessFile) // offset and numBytes give the range
+#define RAM_TRUNCATE _IOWR(1, 16, struct RAM_accessFile) // offset is the new size
+#define RAM_FALLOCATE _IOWR(1, 17, struct RAM_accessFile) // offset and numBytes give the range
+#define RAM_RECLAIM _IOWR(1, 18, struct RAM_reclaim) // gives the memory of free chunks back
+#define RAM_FSCK _IOWR(1, 19, struct RAM_fsck) // checks, and optionally repairs, the metadata
+#define RAM_FRAG_SCORE _IOWR(1, 20, struct RAM_fragScore) // how scattered the blocks of a file are
+#define RAM_DEFRAG _IOWR(1, 21, struct RAM_defrag) // one bounded step of a defragmentation pass
+#define RAM_LOCK_BUDGET _IOWR(1, 22, struct RAM_lockBudget) // how long a long command keeps the lock
+#define RAM_SCHED_WEIGHT _IOWR(1, 23, struct RAM_schedWeight) // a process's share of the ramdisk
+#define RAM_SCHED_STATS _IOWR(1, 24, struct RAM_schedStats) // how long a process's requests waited
+#define RAM_LATENCY _IOWR(1, 25, struct RAM_latency) // percentiles of how long a command takes
 
 /*****************************IOCTL STRUCTURES*******************************/
 
@@ -18,40 +29,134 @@ struct RAM_path
 {
     char *name;  /** Pathname for the file */
     int ret;          /** Return value, will be used for a variety of reasons */
+    int sizeHint;     /** Expected file size on create, 0 if unknown */
 };
 
 struct RAM_file
 {
     char *name;
     int indexNode;       /** Index Node */
-    int offset;  /** Only used for seek, not for close.  Offset into data requested */
+    long long offset;  /** Only used for seek, not for close.  Offset into data requested */
     int ret;      /** Return value */
-    int fileSize;
+    long long fileSize;
 };
 
 struct RAM_accessFile
 {
     int fd;               /** File descriptor */
-    int numBytes;    /** Number of bytes to transfer into userspace (Used if regular file) */
-    int ret;              /** Return value */
+    long long numBytes;    /** Number of bytes to transfer into userspace (Used if regular file) */
+    long long ret;         /** Return value */
     int indexNode;
-    int offset;
+    long long offset;
     int dirIndex;
     int numOfFiles;
-    int fileSize;
+    long long fileSize;
     char *address;  /** User space address to which to send data */
+    unsigned int generation; /** Write generation of the file after the call, changes with its data or size */
 };
 
 
+struct RAM_reclaim
+{
+    long long watermark;  /** Bytes freed between automatic reclaims from now on, -1 keeps the current one */
+    long long released;   /** Bytes of memory given back to the system */
+};
+
+struct RAM_fsck
+{
+    int repair;                 /** Set to fix what can be fixed */
+    int threads;                /** Threads to split the index node table across, 0 for one per CPU.  Set to those used */
+    long long errors;           /** Problems found, the sum of the counts below */
+    long long repaired;         /** Problems fixed */
+    long long leakedBlocks;     /** Blocks marked in use that nothing references */
+    long long lostBlocks;       /** Blocks referenced but marked free */
+    long long crossLinked;      /** Blocks referenced more than once */
+    long long badPointers;      /** Block pointers past the last block or off their cluster size */
+    long long badIndexNodes;    /** Index nodes of no known type, or a root that is not a directory */
+    long long badCounts;        /** Directories whose size disagrees with their live entries */
+    long long danglingEntries;  /** Directory entries naming a free or missing index node */
+    long long orphans;          /** Index nodes in use named by no directory entry, or by several */
+    long long badFreeCounts;    /** Superblock free block and index node counts that are off */
+    long long badFragmentList;  /** The chain of fragment blocks with free units is broken */
+    long long badDeadList;      /** The chain of unlinked files waiting to be freed is broken */
+    long long indexNodes;       /** Index nodes checked */
+};
+
+struct RAM_fragScore
+{
+    int indexNode;       /** The file to score, -1 for the whole filesystem */
+    int score;           /** Per mille of clusters not following the one before them, -1 on failure */
+    long long clusters;  /** Data clusters scored */
+    long long breaks;    /** Clusters not following the one before them */
+};
+
+struct RAM_defrag
+{
+    int threshold;       /** Files scoring above this, per mille, are moved */
+    int budget;          /** Blocks to move or score before the call returns */
+    int indexNode;       /** Where the pass is, 0 to start one.  Updated for the next call */
+    int cluster;         /** Clusters of that file already moved */
+    int target;          /** Block the next of them goes to */
+    int done;            /** Set once the pass is through every index node, -1 on failure */
+    long long moved;     /** Blocks moved by this call */
+    int files;           /** Files this call finished moving */
+};
+
+struct RAM_lockBudget
+{
+    int blocks;          /** Blocks a long command works through per call, 0 for no limit, -1 keeps the current one.  Set to the one in force */
+    long long us;        /** Microseconds a long command holds the lock for, the same way */
+};
+
+struct RAM_schedWeight
+{
+    int pid;             /** The process, 0 for the caller */
+    int weight;          /** Its share relative to the others, 1 to SCHED_MAX_WEIGHT, -1 keeps it.  Set to the one in force, -1 on failure */
+};
+
+struct RAM_schedStats
+{
+    int index;           /** Slot to look from.  Set to the slot of the process found, -1 if none */
+    int pid;             /** The process */
+    int weight;
+    int queued;          /** Requests it has waiting */
+    long long requests;  /** Requests it has run */
+    long long bytes;     /** Bytes they read or wrote */
+    long long waitUs;    /** Time they spent queued, in microseconds */
+    long long maxWaitUs; /** Longest any of them was queued */
+};
+
+struct RAM_latency
+{
+    int command;          /** The command, RAM_READ and so on */
+    int reset;            /** Set to empty every command's histograms once this one is read */
+    long long count;      /** Calls timed since the last reset */
+    long long waitP50;    /** Time waiting for the core, its queue and the lock, in nanoseconds */
+    long long waitP99;
+    long long waitP999;
+    long long waitMax;
+    long long serviceP50; /** Time in the core, in nanoseconds */
+    long long serviceP99;
+    long long serviceP999;
+    long long serviceMax;
+};
+
 struct FD_entry
 {
     int fd;             /* File descriptor */
     int indexNode;      /* IndexNode ID */
-    int offset;         /* Offset in the file */
-    int fileSize;       /* Size of file */
+    long long offset;   /* Offset in the file */
+    long long fileSize; /* Size of file */
     int dirIndex;
     int numOfFiles;
+    long long dirCursor;/* Entry slot the next readdir scan starts at */
     char *pathname;
+    char *readBuffer;   /* Read-ahead buffer, only allocated once sequential reads are seen */
+    long long bufferOffset; /* File offset of the first byte held in readBuffer */
+    int bufferLength;   /* Number of valid bytes in readBuffer, 0 when invalid */
+    long long lastReadEnd;  /* Offset just past the previous read, used to detect sequential access */
+    int sequentialReads;/* Number of back to back sequential reads */
+    unsigned int generation; /* Write generation the buffer and fileSize were read at */
 };
 
 /***************************KERNEL FS FUNCTION PROTOTYPES********************/
@@ -81,14 +186,16 @@ void kr_open(struct RAM_file *input);
 /**
  * Kernel pair for reading a file
  *
- * @param[in]   input   The accessfile struct.  Output read is placed into this struct
+ * @param[in]   input   The accessfile struct.  Output read is placed into this struct.
+ *                      Stops short after the lock budget, the caller reads on from there
  */
 void kr_read(struct RAM_accessFile *input);
 
 /**
  * Kernel pair for the write function
  *
- * @param[in]   input   The accessfile struct.  Input for writing is in this struct
+ * @param[in]   input   The accessfile struct.  Input for writing is in this struct.
+ *                      Stops short after the lock budget, the caller writes on from there
  */
 void kr_write(struct RAM_accessFile *input);
 
@@ -109,10 +216,90 @@ void kr_unlink(struct RAM_path *input);
 /**
  * Kernel pair for the readdir function
  *
- * @param[in]   input   Accessfile struct.  Used to read the relevant directory
+ * @param[in]   input   Accessfile struct.  Used to read the relevant directory.  offset is
+ *                      the cursor the scan starts at, ret is 2 if it should be called again
  */
 void kr_readdir(struct RAM_accessFile *input);
 
+/**
+ * Kernel pair for punching a hole in a file
+ *
+ * @param[in]   input   Accessfile struct.  The hole starts at offset and is numBytes long.
+ *                      Set to the part punched, ret is 1 if what is in front of it is left
+ */
+void kr_punchHole(struct RAM_accessFile *input);
+
+/**
+ * Kernel pair for truncating a file
+ *
+ * @param[in]   input   Accessfile struct.  offset is the new size of the file.  Set to the
+ *                      size reached, ret is 1 if the file is still longer than asked
+ */
+void kr_truncate(struct RAM_accessFile *input);
+
+/**
+ * Kernel pair for reserving the blocks of a range of a file
+ *
+ * @param[in]   input   Accessfile struct.  The range starts at offset and is numBytes long
+ */
+void kr_fallocate(struct RAM_accessFile *input);
+
+/**
+ * Kernel pair for giving the memory of free chunks back to the system
+ *
+ * @param[in]   input   Reclaim struct.  Sets the watermark if one is given, released is filled in
+ */
+void kr_reclaim(struct RAM_reclaim *input);
+
+/**
+ * Kernel pair for checking the filesystem's consistency
+ *
+ * @param[in]   input   Fsck struct.  repair and threads are read, the report is filled in
+ */
+void kr_fsck(struct RAM_fsck *input);
+
+/**
+ * Kernel pair for scoring the fragmentation of a file or the filesystem
+ *
+ * @param[in]   input   FragScore struct.  indexNode is read, the score is filled in
+ */
+void kr_fragScore(struct RAM_fragScore *input);
+
+/**
+ * Kernel pair for one step of a defragmentation pass
+ *
+ * @param[in]   input   Defrag struct.  Holds where the pass is, updated for the next step
+ */
+void kr_defrag(struct RAM_defrag *input);
+
+/**
+ * Kernel pair for reading and setting the lock budget of long commands
+ *
+ * @param[in]   input   Lock budget struct.  Set to the budget in force
+ */
+void kr_lockBudget(struct RAM_lockBudget *input);
+
+/**
+ * Kernel pair for reading and setting the scheduling weight of a process
+ *
+ * @param[in]   input   Weight struct.  Set to the weight in force
+ */
+void kr_schedWeight(struct RAM_schedWeight *input);
+
+/**
+ * Kernel pair for reading the queueing statistics of the processes using the ramdisk
+ *
+ * @param[in]   input   Stats struct.  Filled in for the first process at or after index
+ */
+void kr_schedStats(struct RAM_schedStats *input);
+
+/**
+ * Kernel pair for reading the latency percentiles of a command
+ *
+ * @param[in]   input   Latency struct.  command and reset are read, the percentiles are filled in
+ */
+void kr_latency(struct RAM_latency *input);
+
 
 /********** Helper Function Declarations **********/
 int checkIfIndexNodeAlreadyExists(int inode);
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include <vector>
 #include "RAMFileLib.h"
 
@@ -30,6 +31,10 @@
 #define TEST3
 #define TEST4
 #define TEST5
+#define TEST6
+#define TEST7
+#define TEST8
+#define TEST9
 
 // #define's to control whether single indirect or
 // double indirect block pointers are tested
@@ -38,9 +43,9 @@
 #define TEST_DOUBLE_INDIRECT
 
 
-#define MAX_FILES 1023
+#define MAX_FILES 1023 /* Files the fixed index node array holds, past it the table grows */
 #define BLK_SZ 256    /* Block size */
-#define DIRECT 8    /* Direct pointers in location attribute */
+#define DIRECT 6    /* Direct pointers in location attribute */
 #define PTR_SZ 4    /* 32-bit [relative] addressing */
 #define PTRS_PB  (BLK_SZ / PTR_SZ) /* Pointers per index block */
 
@@ -55,17 +60,147 @@ extern int proc;
 extern int currentFdNum;
 extern std::vector<FD_entry> fd_Table;
 
+#ifdef TEST6
+/* Reads a file 10 bytes at a time through the read-ahead buffer, then checks
+   that a write, a truncate and a hole punched through the fd each drop it */
+static void testReadBuffer (void) {
+  int fd, i, retval;
+  FD_entry *entry;
+
+  retval = rd_creat ((char *)"/seqfile");
+
+  if (retval < 0) {
+    fprintf (stderr, "rd_creat: Sequential file creation error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  fd = rd_open ((char *)"/seqfile");
+
+  for (i = 0; i < (int)sizeof(data1); i++)
+    data1[i] = 'a' + (i % 26);
+
+  retval = rd_write (fd, data1, sizeof(data1));
+
+  if (retval != sizeof(data1)) {
+    fprintf (stderr, "rd_write: Sequential file write error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  /* Read the file back 10 bytes at a time, most of these come from the buffer */
+  rd_lseek (fd, 0);
+  for (i = 0; i < (int)sizeof(data1); i += retval) {
+    retval = rd_read (fd, addr, 10);
+
+    if (retval <= 0 || memcmp (addr, data1 + i, retval)) {
+      fprintf (stderr, "rd_read: Sequential read mismatch at %d! status: %d\n",
+         i, retval);
+
+      exit (1);
+    }
+  }
+
+  /* Three reads in, the rest of the file is buffered */
+  entry = getEntryFromFd (fd);
+  rd_lseek (fd, 0);
+  for (i = 0; i < 3; i++)
+    rd_read (fd, addr, 10);
+
+  if (entry->readBuffer == NULL || entry->bufferLength != sizeof(data1)) {
+    fprintf (stderr, "rd_read: Sequential reads were not buffered!\n");
+
+    exit (1);
+  }
+
+  /* A write through the same fd must not leave stale buffered data behind */
+  rd_lseek (fd, 20);
+  rd_write (fd, (char *)"ZZZZ", 4);
+  rd_lseek (fd, 20);
+  retval = rd_read (fd, addr, 4);
+
+  if (retval != 4 || memcmp (addr, "ZZZZ", 4)) {
+    fprintf (stderr, "rd_read: Stale read-ahead data after write!\n");
+
+    exit (1);
+  }
+
+  /* Nor may a truncate, the buffer still holds the old end of the file */
+  rd_lseek (fd, 0);
+  for (i = 0; i < 3; i++)
+    rd_read (fd, addr, 10);
+  rd_ftruncate (fd, 100);
+  rd_lseek (fd, 90);
+  retval = rd_read (fd, addr, 20);
+
+  if (retval != 10) {
+    fprintf (stderr, "rd_read: Read past a truncate through the buffer! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  /* Nor a hole, which reads back as zeros */
+  rd_lseek (fd, 0);
+  for (i = 0; i < 3; i++)
+    rd_read (fd, addr, 10);
+  rd_punch_hole (fd, 40, 20);
+  rd_lseek (fd, 40);
+  retval = rd_read (fd, addr, 20);
+
+  for (i = 0; i < retval && addr[i] == 0; i++)
+    ;
+
+  if (retval != 20 || i != 20) {
+    fprintf (stderr, "rd_read: Stale read-ahead data after a hole was punched!\n");
+
+    exit (1);
+  }
+
+  rd_close (fd);
+  rd_unlink ((char *)"/seqfile");
+}
+#endif // TEST6
+
 int main () {
     
   int retval, i;
   int fd; 
-  short index_node_number;
+  int index_node_number;
 
   /* Some arbitrary data for our files */
   memset (data1, '1', sizeof (data1));
   memset (data2, '2', sizeof (data2));
   memset (data3, '3', sizeof (data3));
-  proc = open ("/proc/ramdisk", O_RDONLY);
+
+#ifdef TEST6
+  /* Test 6 also runs on a private engine, in a child started before any
+     backend is chosen so the one picked below is left alone */
+  if ((retval = fork()) == 0) {
+    if (rd_use_engine () < 0)
+      exit (1);
+    testReadBuffer ();
+    exit (0);
+  }
+
+  int engineStatus;
+  waitpid (retval, &engineStatus, 0);
+  if (!WIFEXITED(engineStatus) || WEXITSTATUS(engineStatus) != 0) {
+    fprintf (stderr, "Test 6 failed on the private engine\n");
+
+    exit (1);
+  }
+#endif // TEST6
+
+  /* Use the kernel module when it is loaded, otherwise run the core in
+     shared memory so the forked processes of test 5 see one filesystem */
+  if (rd_use_module () < 0 && rd_use_shared_engine (NULL) < 0) {
+    fprintf (stderr, "No ramdisk backend available!\n");
+
+    exit (1);
+  }
 
 
 #ifdef TEST1
@@ -75,8 +210,8 @@ int main () {
   /* Assumes the pre-existence of a root directory file "/"
      that is neither created nor deleted in this test sequence */
 
-  /* Generate MAXIMUM regular files */
-  for (i = 0; i < MAX_FILES + 1; i++) { // go beyond the limit
+  /* Fill the index node array, then go beyond it so the table has to grow */
+  for (i = 0; i < MAX_FILES + 1; i++) {
     sprintf (pathname, "/file%d", i);
     
     retval = rd_creat (pathname);
@@ -85,15 +220,14 @@ int main () {
       fprintf (stderr, "rd_create: File creation error! status: %d\n", 
          retval);
       
-      if (i != MAX_FILES)
-  exit (1);
+      exit (1);
     }
     
     memset (pathname, 0, 80);
   }   
 
   /* Delete all the files created */
-  for (i = 0; i < MAX_FILES; i++) { 
+  for (i = 0; i < MAX_FILES + 1; i++) { 
     sprintf (pathname, "/file%d", i);
     
     retval = rd_unlink (pathname);
@@ -310,17 +444,196 @@ int main () {
       exit (1);
     }
 
-    index_node_number = (short)*(short*)(addr+14);
+    memcpy (&index_node_number, addr+14, sizeof(int));
     //index_node_number = atoi(&addr[14]);
     printf ("Contents at addr: [%s,%d]\n", addr, index_node_number);
   }
 
 #endif // TEST4
 
+#ifdef TEST6
+
+  /* ****TEST 6: Small sequential reads through the read-ahead buffer**** */
+  printf("Starting test 6\n");
+  testReadBuffer ();
+
+  /* On the shared engine a hit checks the file's write generation, so an
+     overwrite by another process is seen even inside the buffered range.
+     The module only sees it at the next fill */
+  if (proc < 0) {
+    rd_creat ((char *)"/seqshared");
+    fd = rd_open ((char *)"/seqshared");
+    rd_write (fd, data1, sizeof(data1));
+    rd_lseek (fd, 0);
+    for (i = 0; i < 3; i++)
+      rd_read (fd, addr, 10);
+
+    if ((retval = fork()) == 0) {
+      rd_lseek (fd, 30);
+      retval = rd_write (fd, (char *)"YYYY", 4);
+      rd_close (fd);
+      exit (retval == 4 ? 0 : 1);
+    }
+
+    int writerStatus;
+    waitpid (retval, &writerStatus, 0);
+    rd_lseek (fd, 30);
+    retval = rd_read (fd, addr, 4);
+
+    if (!WIFEXITED(writerStatus) || WEXITSTATUS(writerStatus) != 0
+        || retval != 4 || memcmp (addr, "YYYY", 4)) {
+      fprintf (stderr, "rd_read: Stale read-ahead data after another process wrote!\n");
+
+      exit (1);
+    }
+
+    rd_close (fd);
+    rd_unlink ((char *)"/seqshared");
+  }
+
+#endif // TEST6
+
+#ifdef TEST7
+
+  /* ****TEST 7: A file created with a size hint starts in large clusters**** */
+  printf("Starting test 7\n");
+  retval = rd_creat_sized ("/sizedfile", sizeof(data2));
+
+  if (retval < 0) {
+    fprintf (stderr, "rd_creat_sized: Sized file creation error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  fd = rd_open ("/sizedfile");
+  retval = rd_write (fd, data2, sizeof(data2));
+
+  if (retval != sizeof(data2)) {
+    fprintf (stderr, "rd_write: Sized file write error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  rd_lseek (fd, 0);
+  retval = rd_read (fd, addr, sizeof(data2));
+
+  if (retval != sizeof(data2) || memcmp (addr, data2, sizeof(data2))) {
+    fprintf (stderr, "rd_read: Sized file read mismatch! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  rd_close (fd);
+  rd_unlink ("/sizedfile");
+
+#endif // TEST7
+
+#ifdef TEST8
+
+  /* ****TEST 8: Sparse file, written past the end and then punched**** */
+  printf("Starting test 8\n");
+  retval = rd_creat ("/sparsefile");
+
+  if (retval < 0) {
+    fprintf (stderr, "rd_creat: Sparse file creation error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  fd = rd_open ("/sparsefile");
+  rd_lseek (fd, sizeof(data2));
+  retval = rd_write (fd, data1, sizeof(data1));
+
+  if (retval != sizeof(data1)) {
+    fprintf (stderr, "rd_write: Write past the end error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  rd_lseek (fd, 0);
+  retval = rd_read (fd, addr, sizeof(data2) + sizeof(data1));
+
+  if (retval != sizeof(data2) + sizeof(data1) || addr[0] != 0 || addr[sizeof(data2) - 1] != 0
+      || memcmp (addr + sizeof(data2), data1, sizeof(data1))) {
+    fprintf (stderr, "rd_read: Hole did not read as zeros! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  retval = rd_punch_hole (fd, sizeof(data2), sizeof(data1));
+  rd_lseek (fd, sizeof(data2));
+  rd_read (fd, addr, sizeof(data1));
+
+  if (retval < 0 || addr[0] != 0 || addr[sizeof(data1) - 1] != 0) {
+    fprintf (stderr, "rd_punch_hole: Punched range still has data! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  rd_close (fd);
+  rd_unlink ("/sparsefile");
+
+#endif // TEST8
+
+#ifdef TEST9
+
+  /* ****TEST 9: Reserve blocks up front, then truncate**** */
+  printf("Starting test 9\n");
+  retval = rd_creat ("/reserved");
+
+  if (retval < 0) {
+    fprintf (stderr, "rd_creat: Reserved file creation error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  fd = rd_open ("/reserved");
+  retval = rd_fallocate (fd, 0, sizeof(data2));
+
+  if (retval < 0) {
+    fprintf (stderr, "rd_fallocate: Reserve error! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  retval = rd_write (fd, data2, sizeof(data2));
+  rd_ftruncate (fd, sizeof(data1));
+  rd_lseek (fd, 0);
+  retval = rd_read (fd, addr, sizeof(data2));
+
+  if (retval != sizeof(data1) || memcmp (addr, data2, sizeof(data1))) {
+    fprintf (stderr, "rd_ftruncate: Truncated file reads wrong! status: %d\n",
+       retval);
+
+    exit (1);
+  }
+
+  rd_close (fd);
+  rd_unlink ("/reserved");
+
+#endif // TEST9
+
 #ifdef TEST5
 
   /* ****TEST 5: 2 process test**** */
   printf("Starting test 5\n");
+
+  /* Count what is already in root so the combined result can be checked */
+  int rootEntries, rootFd, status;
+  rootFd = rd_open ((char *)"/");
+  rootEntries = 0;
+  while (rd_readdir (rootFd, addr) > 0)
+    rootEntries++;
+
   if((retval = fork())) {
 
     if(retval == -1) {
@@ -344,6 +657,25 @@ int main () {
     
       memset (pathname, 0, 80);
     }  
+
+    /* Both processes' files must be visible once the child is done */
+    wait (&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf (stderr, "(Parent) Child process failed\n");
+
+      exit(1);
+    }
+
+    i = 0;
+    while ((retval = rd_readdir (rootFd, addr)) > 0)
+      i++;
+
+    if (i != rootEntries + 600) {
+      fprintf (stderr, "(Parent) Expected %d entries in root, found %d\n",
+         rootEntries + 600, i);
+
+      exit(1);
+    }
     
   }
   else {
@@ -362,6 +694,8 @@ int main () {
     
       memset (pathname, 0, 80);
     }
+
+    exit(0);
   }
 
 #endif // TEST5